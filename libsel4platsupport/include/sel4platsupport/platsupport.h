@@ -31,6 +31,12 @@ platsupport_serial_setup_io_ops(ps_io_ops_t* io_ops);
 void
 register_console(ps_chardevice_t* user_console);
 
+/* Returns the character device behind __plat_put/get_char, for callers that
+ * want to drive its input with interrupts. The device may not support reading
+ * until one of the setup functions above has succeeded. */
+ps_chardevice_t *
+platsupport_serial_get_console(void);
+
 void
 platsupport_undo_serial_setup(void);
 
@@ -21,9 +21,17 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* Number of hash buckets used to index the mappings */
+#define IO_MAPPER_BUCKETS 64
+
 typedef struct io_mapping {
     /* address we returned to the user */
     void *returned_addr;
+    /* physical address and attributes the user asked for */
+    uintptr_t paddr;
+    bool cached;
+    /* number of times this mapping was returned and not yet unmapped */
+    size_t refs;
     /* base address of the mapping with respect to the vspace */
     void *mapped_addr;
     size_t num_pages;
@@ -33,13 +41,16 @@ typedef struct io_mapping {
     seL4_CPtr *caps;
     /* allocation cookie for allocation(s) */
     seL4_Word *alloc_cookies;
-    struct io_mapping *next, *prev;
+    /* hash chains indexed by returned_addr and by paddr */
+    struct io_mapping *vaddr_next;
+    struct io_mapping *paddr_next;
 } io_mapping_t;
 
 typedef struct sel4platsupport_io_mapper_cookie {
     vspace_t *vspace;
     vka_t *vka;
-    io_mapping_t *head;
+    io_mapping_t *by_vaddr[IO_MAPPER_BUCKETS];
+    io_mapping_t *by_paddr[IO_MAPPER_BUCKETS];
 } sel4platsupport_io_mapper_cookie_t;
 
 static void free_node(io_mapping_t *node)
@@ -93,20 +104,27 @@ static void destroy_node(vka_t *vka, io_mapping_t *mapping)
     free_node(mapping);
 }
 
+static inline size_t hash_addr(uintptr_t addr)
+{
+    /* Mappings are at least page aligned, so hash on the page number */
+    return (addr >> seL4_PageBits) % IO_MAPPER_BUCKETS;
+}
+
 static void insert_node(sel4platsupport_io_mapper_cookie_t *io_mapper, io_mapping_t *node)
 {
-    node->prev = NULL;
-    node->next = io_mapper->head;
-    if (io_mapper->head) {
-        io_mapper->head->prev = node;
-    }
-    io_mapper->head = node;
+    io_mapping_t **vaddr_bucket = &io_mapper->by_vaddr[hash_addr((uintptr_t) node->returned_addr)];
+    node->vaddr_next = *vaddr_bucket;
+    *vaddr_bucket = node;
+
+    io_mapping_t **paddr_bucket = &io_mapper->by_paddr[hash_addr(node->paddr)];
+    node->paddr_next = *paddr_bucket;
+    *paddr_bucket = node;
 }
 
 static io_mapping_t *find_node(sel4platsupport_io_mapper_cookie_t *io_mapper, void *returned_addr)
 {
     io_mapping_t *current;
-    for (current = io_mapper->head; current; current = current->next) {
+    for (current = io_mapper->by_vaddr[hash_addr((uintptr_t) returned_addr)]; current; current = current->vaddr_next) {
         if (current->returned_addr == returned_addr) {
             return current;
         }
@@ -114,16 +132,36 @@ static io_mapping_t *find_node(sel4platsupport_io_mapper_cookie_t *io_mapper, vo
     return NULL;
 }
 
+/* Find an existing mapping of paddr that can be returned for a request of size bytes */
+static io_mapping_t *find_node_by_paddr(sel4platsupport_io_mapper_cookie_t *io_mapper, uintptr_t paddr,
+                                        size_t size, bool cached)
+{
+    io_mapping_t *current;
+    for (current = io_mapper->by_paddr[hash_addr(paddr)]; current; current = current->paddr_next) {
+        uintptr_t mapped_end = (uintptr_t) current->mapped_addr + current->num_pages * BIT(current->page_size_bits);
+        if (current->paddr == paddr && current->cached == cached &&
+            mapped_end - (uintptr_t) current->returned_addr >= size) {
+            return current;
+        }
+    }
+    return NULL;
+}
+
 static void remove_node(sel4platsupport_io_mapper_cookie_t *io_mapper, io_mapping_t *node)
 {
-    if (node->prev) {
-        node->prev->next = node->next;
-    } else {
-        assert(io_mapper->head == node);
-        io_mapper->head = node->next;
+    io_mapping_t **current;
+    for (current = &io_mapper->by_vaddr[hash_addr((uintptr_t) node->returned_addr)]; *current;
+         current = &(*current)->vaddr_next) {
+        if (*current == node) {
+            *current = node->vaddr_next;
+            break;
+        }
     }
-    if (node->next) {
-        node->next->prev = node->prev;
+    for (current = &io_mapper->by_paddr[hash_addr(node->paddr)]; *current; current = &(*current)->paddr_next) {
+        if (*current == node) {
+            *current = node->paddr_next;
+            break;
+        }
     }
 }
 
@@ -184,6 +222,9 @@ static void *sel4platsupport_map_paddr_with_page_size(sel4platsupport_io_mapper_
     if (mapping->mapped_addr != NULL) {
         /* fill out and insert node */
         mapping->returned_addr = mapping->mapped_addr + offset;
+        mapping->paddr = paddr;
+        mapping->cached = cached;
+        mapping->refs = 1;
         insert_node(io_mapper, mapping);
         return mapping->returned_addr;
     }
@@ -201,10 +242,23 @@ static void *sel4platsupport_map_paddr(void *cookie, uintptr_t paddr, size_t siz
     }
 
     sel4platsupport_io_mapper_cookie_t *io_mapper = (sel4platsupport_io_mapper_cookie_t *)cookie;
+
+    /* Device registers and buffers are often mapped repeatedly, hand out the existing
+     * mapping rather than retyping the device untyped again */
+    io_mapping_t *existing = find_node_by_paddr(io_mapper, paddr, size, cached);
+    if (existing) {
+        existing->refs++;
+        return existing->returned_addr;
+    }
+
     int frame_size_index = 0;
-    /* find the largest reasonable frame size */
+    /* find the largest frame size that the region fills and that paddr is aligned to,
+     * so that large regions do not take a frame, slot and mapping per 4K page */
+    uintptr_t start = ROUND_DOWN(paddr, BIT(sel4_page_sizes[0]));
+    size_t span = paddr + size - start;
     while (frame_size_index + 1 < SEL4_NUM_PAGE_SIZES) {
-        if (size >> sel4_page_sizes[frame_size_index + 1] == 0) {
+        size_t next_bits = sel4_page_sizes[frame_size_index + 1];
+        if (span >> next_bits == 0 || !IS_ALIGNED(start, next_bits)) {
             break;
         }
         frame_size_index++;
@@ -240,6 +294,13 @@ static void sel4platsupport_unmap_vaddr(void *cookie, void *vaddr, UNUSED size_t
         return;
     }
 
+    assert(mapping->refs > 0);
+    mapping->refs--;
+    if (mapping->refs > 0) {
+        /* still in use by another caller that mapped the same paddr */
+        return;
+    }
+
     /* unmap the pages */
     vspace_unmap_pages(vspace, mapping->mapped_addr, mapping->num_pages, mapping->page_size_bits,
                        VSPACE_PRESERVE);
@@ -29,6 +29,14 @@ typedef enum irq_iface_type {
     MINI_IFACE
 } irq_iface_type_t;
 
+struct irq_cookie;
+
+/* Passed to the callback as the cookie for the acknowledge function */
+typedef struct {
+    struct irq_cookie *irq_cookie;
+    irq_id_t irq_id;
+} ack_data_t;
+
 typedef struct {
     /* These are always non-empty if this particular IRQ ID is in use */
     bool allocated;
@@ -45,6 +53,12 @@ typedef struct {
     cspacepath_t ntfn_path;
     ntfn_id_t paired_ntfn;
     int8_t allocated_badge_index;
+
+    /* The kernel does not deliver the IRQ again until it is acknowledged, so
+     * there is at most one outstanding acknowledgement and its data can live
+     * here instead of being allocated on every delivery */
+    ack_data_t ack_data;
+    bool ack_pending;
 } irq_entry_t;
 
 typedef struct {
@@ -61,7 +75,7 @@ typedef struct {
     irq_id_t bound_irqs[MAX_INTERRUPTS_TO_NOTIFICATIONS];
 } ntfn_entry_t;
 
-typedef struct {
+typedef struct irq_cookie {
     irq_iface_type_t iface_type;
     size_t num_registered_irqs;
     size_t num_allocated_ntfns;
@@ -81,11 +95,6 @@ typedef struct {
     ps_malloc_ops_t *malloc_ops;
 } irq_cookie_t;
 
-typedef struct {
-    irq_cookie_t *irq_cookie;
-    irq_id_t irq_id;
-} ack_data_t;
-
 static inline bool check_irq_id_is_valid(irq_cookie_t *irq_cookie, irq_id_t id)
 {
     if (unlikely(id < 0 || id >= irq_cookie->max_irq_ids)) {
@@ -318,6 +327,10 @@ static irq_id_t irq_register_common(irq_cookie_t *irq_cookie, ps_irq_t irq, irq_
     irq_entry->handler_path = irq_handler_path;
     irq_entry->irq_callback_fn = callback;
     irq_entry->callback_data = callback_data;
+    irq_entry->ack_data = (ack_data_t) {
+        .irq_cookie = irq_cookie, .irq_id = free_id
+    };
+    irq_entry->ack_pending = false;
 
     irq_cookie->num_registered_irqs++;
     fill_bit_in_bitfield(irq_cookie->allocated_irq_bitfields, free_id);
@@ -514,34 +527,37 @@ static int sel4platsupport_irq_acknowledge(void *ack_data)
         return -EINVAL;
     }
 
-    int ret = 0;
-
     ack_data_t *data = ack_data;
     irq_cookie_t *irq_cookie = data->irq_cookie;
     irq_id_t irq_id = data->irq_id;
 
+    /* The entry, and with it the acknowledge data, is zeroed when the IRQ is unregistered */
+    if (!irq_cookie) {
+        return -EINVAL;
+    }
+
     if (!check_irq_id_is_valid(irq_cookie, irq_id)) {
-        ret = -EINVAL;
-        goto exit;
+        return -EINVAL;
     }
 
     if (!check_irq_id_is_allocated(irq_cookie, irq_id)) {
-        ret = -EINVAL;
-        goto exit;
+        return -EINVAL;
     }
 
     irq_entry_t *irq_entry = &(irq_cookie->irq_table[irq_id]);
+    if (!irq_entry->ack_pending) {
+        ZF_LOGE("IRQ %d has already been acknowledged", irq_id);
+        return -EINVAL;
+    }
+    irq_entry->ack_pending = false;
+
     int error = seL4_IRQHandler_Ack(irq_entry->handler_path.capPtr);
     if (error) {
         ZF_LOGE("Failed to acknowledge IRQ");
-        ret = -EFAULT;
-        goto exit;
+        return -EFAULT;
     }
 
-exit:
-    ps_free(irq_cookie->malloc_ops, sizeof(ack_data_t), data);
-
-    return ret;
+    return 0;
 }
 
 int sel4platsupport_new_irq_ops(ps_irq_ops_t *irq_ops, vka_t *vka, simple_t *simple,
@@ -799,14 +815,9 @@ static bool perform_callback(irq_cookie_t *irq_cookie, irq_id_t irq_id, unsigned
 
     /* Check if callback was registered, if so, then run it */
     if (callback) {
-        ack_data_t *ack_data = NULL;
-        int error = ps_calloc(irq_cookie->malloc_ops, 1, sizeof(ack_data_t), (void **) &ack_data);
-        ZF_LOGF_IF(error, "Failed to allocate memory for a cookie for the acknowledge function");
-        *ack_data = (ack_data_t) {
-            .irq_cookie = irq_cookie, .irq_id = irq_id
-        };
+        irq_entry->ack_pending = true;
         callback(irq_entry->callback_data,
-                 sel4platsupport_irq_acknowledge, ack_data);
+                 sel4platsupport_irq_acknowledge, &irq_entry->ack_data);
         return true;
     }
     return false;
@@ -830,6 +841,8 @@ int sel4platsupport_irq_handle(ps_irq_ops_t *irq_ops, ntfn_id_t ntfn_id, seL4_Wo
     /* Just in case, but probably should throw an error at the user for passing in bits that
      * we dont' handle */
     unsigned long unchecked_bits = handle_mask & ntfn_entry->usable_mask;
+    /* An IRQ may have been unpaired after it was delivered, drop its bit */
+    unchecked_bits &= ntfn_entry->status_bitfield;
 
     while (unchecked_bits) {
         unsigned long bit_index = CTZL(unchecked_bits);
@@ -37,6 +37,11 @@ void register_console(struct ps_chardevice *user_console)
     console = user_console;
 }
 
+ps_chardevice_t *platsupport_serial_get_console(void)
+{
+    return console;
+}
+
 int __plat_serial_init(ps_io_ops_t *io_ops)
 {
     struct ps_chardevice temp_device;
@@ -7,6 +7,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <sel4/sel4.h>
 
@@ -59,6 +60,14 @@ typedef struct _serial_client_context {
     cspacepath_t badged_server_ep_cspath;
     volatile char *shmem;
     size_t shmem_size;
+    vka_t *vka;
+    vspace_t *vspace;
+    /* Only used by connections made with serial_server_client_connect_ring(). */
+    struct serial_server_ring *ring;
+    size_t ring_size;
+    cspacepath_t ring_ntfn_cspath;
+    /* Allocated by the first blocking serial_server_read(). */
+    vka_object_t rx_ntfn;
 } serial_client_context_t;
 
 /** Establishes a connection to the server thread and returns a connection
@@ -88,7 +97,84 @@ int serial_server_client_connect(seL4_CPtr server_ep_cap,
                                  vspace_t *client_vspace,
                                  serial_client_context_t *conn);
 
+/** Establishes a connection to the server thread in ring mode.
+ *
+ * In ring mode the shared memory window is used as a ring buffer. Writes and
+ * printfs append to the ring without making any system call, and return as
+ * soon as the data is in the ring; the server drains the rings of all its
+ * clients in batches. The server is only signalled when the client appends to
+ * a ring that the server had already emptied, and the client only blocks on
+ * the server when the ring is full.
+ *
+ * The connection must only be written to by one thread at a time. The other
+ * client functions work on a ring connection as they do on any other, except
+ * for serial_server_flush(), which does not apply.
+ *
+ * In addition to the requirements of serial_server_client_connect(), the
+ * client_vka must be able to allocate a CSpace slot, which receives a cap to
+ * the notification that the server waits on.
+ *
+ * @param server_ep_cap CPtr to an endpoint between the client and the SERVER
+ *                      thread.
+ * @param client_vka Initialized vka_t for the client thread.
+ * @param client_vspace Initialized vspace_t for the client thread.
+ * @param conn [out] Connection token returned by the library.
+ * @return Error value: 0 on success, non-zero on failure.
+ */
+int serial_server_client_connect_ring(seL4_CPtr server_ep_cap,
+                                      vka_t *client_vka,
+                                      vspace_t *client_vspace,
+                                      serial_client_context_t *conn);
+
+/** Establishes a connection to the server thread with a shared memory window
+ * of a given size, which may span several pages.
+ *
+ * If the server's max window size is smaller than shmem_size, the connection
+ * is made with a window of the server's max size instead. The size that was
+ * settled on is in conn->shmem_size.
+ *
+ * @param server_ep_cap CPtr to an endpoint between the client and the SERVER
+ *                      thread.
+ * @param client_vka Initialized vka_t for the client thread.
+ * @param client_vspace Initialized vspace_t for the client thread.
+ * @param shmem_size Size of the shared memory window in bytes.
+ * @param ring If true, connect in ring mode as serial_server_client_connect_ring().
+ * @param conn [out] Connection token returned by the library.
+ * @return Error value: 0 on success, non-zero on failure.
+ */
+int serial_server_client_connect_sized(seL4_CPtr server_ep_cap,
+                                       vka_t *client_vka,
+                                       vspace_t *client_vspace,
+                                       size_t shmem_size, bool ring,
+                                       serial_client_context_t *conn);
+
+/** Replaces the shared memory window of a connection with a larger one.
+ *
+ * The server writes out everything in the old window before switching over.
+ * As with connecting, if the server's max window size is smaller than
+ * shmem_size, the window is grown to the server's max size instead.
+ *
+ * @param ctxt Valid connection token.
+ * @param shmem_size New size of the shared memory window in bytes. Nothing is
+ *                   done if this is not larger than the current size.
+ * @return 0 on success, non-zero on failure, in which case the connection
+ *         keeps its old window.
+ */
+int serial_server_client_grow(serial_client_context_t *ctxt, size_t shmem_size);
+
+/** Waits until the server has written out everything that was appended to
+ * the ring of a ring connection.
+ *
+ * @param ctxt Valid connection token returned by
+ *             serial_server_client_connect_ring().
+ * @return 0 on success, or a negative integer for error condition.
+ */
+int serial_server_sync(serial_client_context_t *ctxt);
+
 /** Sends a request to the server to print a message to the serial.
+ *
+ * Messages that don't fit in the shared memory window are sent in pieces, as
+ * with serial_server_write_stream().
  *
  * @param ctxt Valid connection token returned by serial_server_client_connect().
  * @param fmt Valid printf format specifier string.
@@ -111,6 +197,9 @@ ssize_t serial_server_printf(serial_client_context_t *ctxt, const char *fmt, ...
 ssize_t serial_server_flush(serial_client_context_t *ctxt, ssize_t len);
 
 /** Sends a request to the server to write a fixed-length buffer to the serial.
+ *
+ * The server may ack the request once the data is in its write-back queue,
+ * before it has been written out to the device.
  *
  * @param ctxt Valid connection token returned by serial_server_client_connect().
  * @param in_buff Input buffer of data.
@@ -120,6 +209,53 @@ ssize_t serial_server_flush(serial_client_context_t *ctxt, ssize_t len);
  */
 ssize_t serial_server_write(serial_client_context_t *ctxt, const char *in_buff, ssize_t len);
 
+/** Writes a buffer of any length to the serial, by passing it through the
+ * shared memory window in pieces.
+ *
+ * The server acks each piece once it has been queued, so it writes out one
+ * piece while the client sends the next.
+ *
+ * @param ctxt Valid connection token returned by serial_server_client_connect().
+ * @param in_buff Input buffer of data.
+ * @param len the size of the buffer data.
+ * @return The number of bytes written (positive integer), or a negative integer
+ *         for error condition if nothing could be written.
+ */
+ssize_t serial_server_write_stream(serial_client_context_t *ctxt,
+                                   const char *in_buff, size_t len);
+
+/** Reads input from the serial device.
+ *
+ * The server buffers input as it arrives and hands it to one client at a
+ * time: the client with the input focus. The first client to read takes the
+ * focus if no client has it, and it can be taken at any time with
+ * serial_server_set_focus(). A client without the focus reads nothing.
+ *
+ * A blocking read waits until there is some input for the client, and then
+ * returns what is available, which may be less than len. The first blocking
+ * read allocates a notification from the connection's vka, which the server
+ * signals when input arrives.
+ *
+ * @param ctxt Valid connection token.
+ * @param out_buff Buffer for the input.
+ * @param len Size of out_buff. At most one IPC message worth of input is
+ *            read at once.
+ * @param block If false, return 0 straight away if there is no input.
+ * @return The number of bytes read, or a negative integer for error condition.
+ *         Blocking fails if the serial device can't be read.
+ */
+ssize_t serial_server_read(serial_client_context_t *ctxt, char *out_buff,
+                           size_t len, bool block);
+
+/** Takes the input focus, so that input from the serial device goes to the
+ * calling client from now on. Input that the previous client has not read yet
+ * goes to the caller as well.
+ *
+ * @param ctxt Valid connection token.
+ * @return 0 on success, or a negative integer for error condition.
+ */
+int serial_server_set_focus(serial_client_context_t *ctxt);
+
 /** Sends a request to the server to disconnect the calling client.
  *
  * Causes the server to release the connection metadata it holds about the
@@ -134,6 +270,8 @@ void serial_server_disconnect(serial_client_context_t *ctxt);
  *
  * In practice, right now that means that the server exits its message loop and
  * stops listening for IPC from clients, and then seL4_TCB_Suspend()s itself.
+ * The kill is acked once the server has disconnected all of its clients, after
+ * which the instance can be spawned again.
  * @param conn Connection handle to the server, returned by
  *             serial_server_client_connect().
  * @return Integer value: 0 on successfull "kill", non-zero if the server was
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <sel4/sel4.h>
 
@@ -13,6 +14,7 @@
 #include <vka/vka.h>
 #include <vspace/vspace.h>
 #include <sel4utils/process.h>
+#include <platsupport/chardev.h>
 
 /** @file API for allowing a thread to act as the parent to a serial server
  * thread.
@@ -20,8 +22,31 @@
  * Provides the APIs for spawning the server thread, allocating new badge
  * values to client threads, and minting the Server's Endpoint to Client
  * threads.
+ *
+ * Several Server instances can run side by side, for instance one per serial
+ * device or one per core. Each instance has its own thread, Endpoint and badge
+ * space. The functions without an instance argument work on
+ * SERIAL_SERVER_DEFAULT_INSTANCE.
  */
 
+/* Instance used by the functions that don't take an instance argument. */
+#define SERIAL_SERVER_DEFAULT_INSTANCE 0
+
+/* How a Server instance is spawned by serial_server_parent_spawn_instance(). */
+typedef struct serial_server_instance_config {
+    /* Server thread's priority. */
+    uint8_t priority;
+    /* Core that the Server thread runs on. */
+    seL4_Word core;
+    /* Character device that the instance drives, already initialised by the
+     * caller. NULL for the platform console, which the instance sets up with
+     * platsupport_serial_setup_simple(). Only one instance reads input from a
+     * device: the first spawned on it, or once that one is killed, the next
+     * one spawned on it.
+     */
+    ps_chardevice_t *device;
+} serial_server_instance_config_t;
+
 /** Spawns the server thread. Server thread is spawned within the VSpace and
  *  CSpace of the thread that spawned it.
  *
@@ -43,15 +68,46 @@ seL4_Error serial_server_parent_spawn_thread(simple_t *parent_simple,
                                              vspace_t *parent_vspace,
                                              uint8_t priority);
 
+/** Spawns the thread of a Server instance, as
+ * serial_server_parent_spawn_thread() does for the default instance.
+ *
+ * @param instance Instance to spawn, below CONFIG_SERIAL_SERVER_MAX_INSTANCES.
+ * @param parent_simple Initialized simple_t for the parent process.
+ * @param parent_vka Initialized vka_t for the parent process.
+ * @param parent_vspace Initialized vspace_t for the parent process.
+ * @param config Priority, core and device of the instance.
+ * @return seL4_Error value. seL4_IllegalOperation if the instance is running,
+ *         or has been sent a kill that has not been acked yet.
+ */
+seL4_Error serial_server_parent_spawn_instance(int instance,
+                                               simple_t *parent_simple,
+                                               vka_t *parent_vka,
+                                               vspace_t *parent_vspace,
+                                               const serial_server_instance_config_t *config);
+
+/** Picks the instance that a new client should be assigned to: the spawned
+ * instance on the client's core with the fewest clients, or if there is none
+ * on that core, the spawned instance with the fewest clients.
+ *
+ * @param core Core that the client runs on.
+ * @return The instance, or -1 if no instance has been spawned.
+ */
+int serial_server_parent_pick_instance(seL4_Word core);
+
 /** Mints a new, badged copy of the Server's Endpoint cap into the caller's
  * already-provided slot, dest_slot.
  *
  * @param dest_slot The caller-allocated slot into which the caller expects the
  *                  new badged Endpoint cap to be placed.
- * @return 0 if successful, non-zero on error.
+ * @return 0 if successful, non-zero on error, including when all
+ *         CONFIG_SERIAL_SERVER_MAX_CLIENTS badges of the instance are in use.
  */
 int serial_server_allocate_client_badged_ep(cspacepath_t dest_slot);
 
+/** As serial_server_allocate_client_badged_ep(), for a given instance. */
+int serial_server_allocate_client_badged_ep_instance(int instance,
+                                                     cspacepath_t dest_slot);
+
 /** Mints a new, badged copy of the Server's Endpoint cap and returns it.
  *
  * @param client_vka Initialized vka_t instance.
@@ -62,6 +118,14 @@ int serial_server_allocate_client_badged_ep(cspacepath_t dest_slot);
 int serial_server_parent_vka_mint_endpoint(vka_t *client_vka,
                                            cspacepath_t *badged_server_ep_cspath);
 
+/** As serial_server_parent_vka_mint_endpoint(), for a given instance. This
+ * is how a client is assigned to an instance: it talks to the instance whose
+ * Endpoint it has.
+ */
+int serial_server_parent_vka_mint_endpoint_instance(int instance,
+                                                    vka_t *client_vka,
+                                                    cspacepath_t *badged_server_ep_cspath);
+
 /** Mints a new, badged copy of the Server's Endpoint cap into the specified
  * destination process' CSpace, and returns the slot it was minto into, as its
  * return value.
@@ -71,3 +135,64 @@ int serial_server_parent_vka_mint_endpoint(vka_t *client_vka,
  * @return The cap-ptr to the slot that the cap was minted into.
  */
 seL4_CPtr serial_server_parent_mint_endpoint_to_process(sel4utils_process_t *p);
+
+/** As serial_server_parent_mint_endpoint_to_process(), for a given instance. */
+seL4_CPtr serial_server_parent_mint_endpoint_to_process_instance(int instance,
+                                                                 sel4utils_process_t *p);
+
+/* Counters kept by the Server. They can be read at any time with
+ * serial_server_parent_get_stats().
+ */
+typedef struct serial_server_stats {
+    /* Bytes written out to the serial device, for all clients. */
+    uint64_t bytes_written;
+    /* Bytes acked to clients before they were written out. */
+    uint64_t bytes_queued;
+    /* Number of times a client's write did not fit in what was left of its
+     * quota, so the Server had to write out queued data before acking it.
+     */
+    uint64_t quota_stalls;
+    /* Bytes currently queued, and the most that have ever been queued at once,
+     * summed over all clients.
+     */
+    size_t queue_depth;
+    size_t max_queue_depth;
+    /* Bytes of input read from the serial device, and bytes of input that
+     * were dropped because no client read them before the Server's input
+     * buffer filled up.
+     */
+    uint64_t rx_bytes;
+    uint64_t rx_dropped;
+} serial_server_stats_t;
+
+/** Sets the size of the write-back queue that the Server gives each client
+ * that connects from now on.
+ *
+ * The Server acks a client's writes as soon as they are in its queue, and
+ * writes queued data out while it has no requests to handle, taking the
+ * clients in turn. A client that writes more than its quota ahead of the
+ * device has to wait. With a quota of 0, writes are written out before they
+ * are acked. The default is CONFIG_SERIAL_SERVER_CLIENT_QUOTA.
+ *
+ * Call this after serial_server_parent_spawn_thread(), before the clients it
+ * should apply to connect.
+ *
+ * @param quota Bytes of data each client may have queued.
+ */
+void serial_server_parent_set_client_quota(size_t quota);
+
+/** As serial_server_parent_set_client_quota(), for a given instance. */
+void serial_server_parent_set_client_quota_instance(int instance, size_t quota);
+
+/** Reads the Server's counters.
+ *
+ * The counters are updated by the Server thread without synchronization, so
+ * they may be slightly out of date.
+ *
+ * @param stats [out] The counters.
+ */
+void serial_server_parent_get_stats(serial_server_stats_t *stats);
+
+/** As serial_server_parent_get_stats(), for a given instance. */
+void serial_server_parent_get_stats_instance(int instance,
+                                             serial_server_stats_t *stats);
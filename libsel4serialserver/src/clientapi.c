@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stdbool.h>
 
 #include <sel4/sel4.h>
 
@@ -30,105 +32,466 @@
  * communicate directly with the server thread from then on.
  */
 
-int
-serial_server_client_connect(seL4_CPtr badged_server_ep_cap,
-                             vka_t *client_vka, vspace_t *client_vspace,
-                             serial_client_context_t *conn)
+/** Allocates a shmem window and hands its Frames over to the server.
+ *
+ * The kernel only transfers one cap per message into the server's CSpace, so
+ * every Frame but the last is sent in a FUNC_SHMEM_FRAME_REQ message of its
+ * own. The last Frame is sent with the request that tells the server what to
+ * do with the window (connect, or resize).
+ *
+ * @param conn Connection, for the server endpoint, vka and vspace.
+ * @param shmem_size Size of the window in bytes.
+ * @param func Request to send with the last Frame.
+ * @param ack_func Reply that the server is expected to send to func.
+ * @param shmem [out] The new window. Unmapped again on failure.
+ * @param max_size [out] If the server refused the window as too large, the
+ *                 largest window it accepts.
+ * @param reply_tag [out] The server's reply to func.
+ * @return 0 on success, or the error the server returned.
+ */
+static int
+serial_server_client_send_shmem(serial_client_context_t *conn,
+                                size_t shmem_size,
+                                enum serial_server_funcs func,
+                                enum serial_server_funcs ack_func,
+                                volatile char **shmem, size_t *max_size,
+                                seL4_MessageInfo_t *reply_tag)
 {
-    seL4_Error error;
-    int shmem_n_pages;
+    int error = 0;
+    size_t shmem_n_pages;
     uintptr_t shmem_tmp_vaddr;
     seL4_MessageInfo_t tag;
     cspacepath_t frame_cspath;
-
-    if (badged_server_ep_cap == 0 || client_vka == NULL || client_vspace == NULL
-            || conn == NULL) {
-        return seL4_InvalidArgument;
-    }
-
-    memset(conn, 0, sizeof(serial_client_context_t));
-
-    shmem_n_pages = BYTES_TO_4K_PAGES(SERIAL_SERVER_SHMEM_MAX_SIZE);
-    if (shmem_n_pages > seL4_MsgMaxExtraCaps) {
-        ZF_LOGE(SERSERVC"connect: Currently unsupported shared memory size: "
-                "IPC cap transfer capability is inadequate.");
-        return seL4_RangeError;
-    }
-    conn->shmem = vspace_new_pages(client_vspace,
-                                   seL4_AllRights,
-                                   shmem_n_pages,
-                                   seL4_PageBits);
-    if (conn->shmem == NULL) {
-        ZF_LOGE(SERSERVC"connect: Failed to alloc shmem.");
+    bool last;
+
+    *max_size = 0;
+    shmem_n_pages = BYTES_TO_4K_PAGES(shmem_size);
+    *shmem = vspace_new_pages(conn->vspace, seL4_AllRights, shmem_n_pages,
+                              seL4_PageBits);
+    if (*shmem == NULL) {
+        ZF_LOGE(SERSERVC"connect: Failed to alloc %zd pages of shmem.",
+                shmem_n_pages);
         return seL4_NotEnoughMemory;
     }
-    assert(IS_ALIGNED((uintptr_t)conn->shmem, seL4_PageBits));
+    assert(IS_ALIGNED((uintptr_t)*shmem, seL4_PageBits));
 
     /* Look up the Frame cap behind each page in the shmem range, and marshal
-     * all of those Frame caps to the parent. The parent will then map those
-     * Frames into its VSpace and establish a shmem link.
+     * the Frame caps to the server, which maps those Frames into its VSpace
+     * and establishes a shmem link.
      */
-    shmem_tmp_vaddr = (uintptr_t)conn->shmem;
-    for (int i = 0; i < shmem_n_pages; i++) {
-        vka_cspace_make_path(client_vka,
-                             vspace_get_cap(client_vspace,
+    shmem_tmp_vaddr = (uintptr_t)*shmem;
+    for (size_t i = 0; i < shmem_n_pages; i++) {
+        last = (i == shmem_n_pages - 1);
+        vka_cspace_make_path(conn->vka,
+                             vspace_get_cap(conn->vspace,
                                             (void *)shmem_tmp_vaddr),
                              &frame_cspath);
-
-        seL4_SetCap(i, frame_cspath.capPtr);
         shmem_tmp_vaddr += BIT(seL4_PageBits);
+
+        seL4_SetCap(0, frame_cspath.capPtr);
+        if (last) {
+            seL4_SetMR(SSMSGREG_FUNC, func);
+            seL4_SetMR(SSMSGREG_CONNECT_REQ_SHMEM_SIZE, shmem_size);
+            tag = seL4_MessageInfo_new(0, 0, 1, SSMSGREG_CONNECT_REQ_END);
+        } else {
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_SHMEM_FRAME_REQ);
+            seL4_SetMR(SSMSGREG_SHMEM_FRAME_REQ_SHMEM_SIZE, shmem_size);
+            seL4_SetMR(SSMSGREG_SHMEM_FRAME_REQ_INDEX, i);
+            tag = seL4_MessageInfo_new(0, 0, 1, SSMSGREG_SHMEM_FRAME_REQ_END);
+        }
+
+        tag = seL4_Call(conn->badged_server_ep_cspath.capPtr, tag);
+
+        /* It makes sense to verify that the message we're getting back is an
+         * ACK response to our request message.
+         */
+        if (seL4_GetMR(SSMSGREG_FUNC) != (last ? ack_func : FUNC_SHMEM_FRAME_ACK)) {
+            ZF_LOGE(SERSERVC"connect: Reply message was not an ACK as "
+                    "expected.");
+            error = seL4_IllegalOperation;
+            break;
+        }
+        /* The ACKs all carry the max shmem size in the same msg-reg. */
+        error = seL4_MessageInfo_get_label(tag);
+        if (error == (int)SERIAL_SERVER_ERROR_SHMEM_TOO_LARGE) {
+            *max_size = seL4_GetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE);
+        }
+        if (error != 0 || last) {
+            break;
+        }
+    }
+
+    *reply_tag = tag;
+    if (error != 0) {
+        vspace_unmap_pages(conn->vspace, (void *)*shmem, shmem_n_pages,
+                           seL4_PageBits, VSPACE_FREE);
+        *shmem = NULL;
+    }
+    return error;
+}
+
+/** Sends a shmem window of up to shmem_size bytes to the server, settling for
+ * the server's max shmem size if shmem_size is larger.
+ */
+static int
+serial_server_client_negotiate_shmem(serial_client_context_t *conn,
+                                     size_t shmem_size,
+                                     enum serial_server_funcs func,
+                                     enum serial_server_funcs ack_func,
+                                     volatile char **shmem, size_t *final_size,
+                                     seL4_MessageInfo_t *reply_tag)
+{
+    int error;
+    size_t max_size;
+
+    error = serial_server_client_send_shmem(conn, shmem_size, func, ack_func,
+                                            shmem, &max_size, reply_tag);
+    if (error == (int)SERIAL_SERVER_ERROR_SHMEM_TOO_LARGE
+        && max_size != 0 && max_size < shmem_size) {
+        ZF_LOGD(SERSERVC"connect: Server's max shmem size is %zdB, retrying.",
+                max_size);
+        shmem_size = max_size;
+        error = serial_server_client_send_shmem(conn, shmem_size, func, ack_func,
+                                                shmem, &max_size, reply_tag);
+    }
+    if (error != 0) {
+        ZF_LOGE(SERSERVC"connect ERR %d: Failed to establish shmem with the "
+                "server.", error);
+        return error;
+    }
+
+    *final_size = shmem_size;
+    return 0;
+}
+
+static int
+serial_server_client_connect_common(seL4_CPtr badged_server_ep_cap,
+                                    vka_t *client_vka, vspace_t *client_vspace,
+                                    size_t shmem_size, bool ring,
+                                    serial_client_context_t *conn)
+{
+    int error;
+    seL4_MessageInfo_t tag;
+
+    if (badged_server_ep_cap == 0 || client_vka == NULL || client_vspace == NULL
+            || conn == NULL || shmem_size == 0) {
+        return seL4_InvalidArgument;
+    }
+
+    memset(conn, 0, sizeof(serial_client_context_t));
+    conn->vka = client_vka;
+    conn->vspace = client_vspace;
+    vka_cspace_make_path(client_vka, badged_server_ep_cap,
+                         &conn->badged_server_ep_cspath);
+
+    if (ring) {
+        /* The server will send us a cap to the notification it waits on for
+         * ring clients.
+         */
+        error = vka_cspace_alloc_path(client_vka, &conn->ring_ntfn_cspath);
+        if (error != 0) {
+            ZF_LOGE(SERSERVC"connect: Failed to alloc slot for ring "
+                    "notification.");
+            return error;
+        }
+        seL4_SetCapReceivePath(conn->ring_ntfn_cspath.root,
+                               conn->ring_ntfn_cspath.capPtr,
+                               conn->ring_ntfn_cspath.capDepth);
     }
 
     /* Call the server asking it to establish the shmem mapping with us, and
      * get us connected up.
      */
-    seL4_SetMR(SSMSGREG_FUNC, FUNC_CONNECT_REQ);
-    seL4_SetMR(SSMSGREG_CONNECT_REQ_SHMEM_SIZE,
-               SERIAL_SERVER_SHMEM_MAX_SIZE);
-    /* extraCaps doubles up as the number of shmem pages. */
-    tag = seL4_MessageInfo_new(0, 0,
-                               shmem_n_pages,
-                               SSMSGREG_CONNECT_REQ_END);
-
-    tag = seL4_Call(badged_server_ep_cap, tag);
-
-    /* It makes sense to verify that the message we're getting back is an
-     * ACK response to our request message.
-     */
-    if (seL4_GetMR(SSMSGREG_FUNC) != FUNC_CONNECT_ACK) {
-        error = seL4_IllegalOperation;
-        ZF_LOGE(SERSERVC"connect: Reply message was not a CONNECT_ACK as "
-                "expected.");
+    error = serial_server_client_negotiate_shmem(conn, shmem_size,
+                                                 ring ? FUNC_CONNECT_RING_REQ : FUNC_CONNECT_REQ,
+                                                 ring ? FUNC_CONNECT_RING_ACK : FUNC_CONNECT_ACK,
+                                                 &conn->shmem, &conn->shmem_size,
+                                                 &tag);
+    if (error != 0) {
         goto out;
     }
-    /* When the parent replies, we check to see if it was successful, etc. */
-    error = seL4_MessageInfo_get_label(tag);
-    if (error != (int)SERIAL_SERVER_NOERROR) {
-        ZF_LOGE(SERSERVC"connect ERR %d: Failed to connect to the server.",
-                error);
 
-        if (error == (int)SERIAL_SERVER_ERROR_SHMEM_TOO_LARGE) {
-            ZF_LOGE(SERSERVC"connect: Your requested shmem mapping size is too "
-                    "large.\n\tServer's max shmem size is %luB.",
-                    (long)seL4_GetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE));
-        }
+    if (ring && seL4_MessageInfo_get_extraCaps(tag) != 1) {
+        /* The server has mapped our shmem but we have no way to tell it about
+         * new data. Let it tear the connection down again.
+         */
+        ZF_LOGE(SERSERVC"connect: Server did not send a ring notification.");
+        serial_server_disconnect(conn);
+        vspace_unmap_pages(client_vspace, (void *)conn->shmem,
+                           BYTES_TO_4K_PAGES(conn->shmem_size), seL4_PageBits,
+                           VSPACE_FREE);
+        conn->shmem = NULL;
+        error = seL4_InvalidCapability;
         goto out;
     }
 
-    conn->shmem_size = SERIAL_SERVER_SHMEM_MAX_SIZE;
-    vka_cspace_make_path(client_vka, badged_server_ep_cap,
-                         &conn->badged_server_ep_cspath);
+    if (ring) {
+        conn->ring = (serial_server_ring_t *)conn->shmem;
+        conn->ring_size = conn->shmem_size - sizeof(serial_server_ring_t);
+    }
 
     return seL4_NoError;
 
 out:
-    if (conn->shmem != NULL) {
-        vspace_unmap_pages(client_vspace, (void *)conn->shmem, shmem_n_pages,
-                           seL4_PageBits, VSPACE_FREE);
+    if (conn->ring_ntfn_cspath.capPtr != 0) {
+        vka_cspace_free_path(client_vka, conn->ring_ntfn_cspath);
     }
     return error;
 }
 
+int
+serial_server_client_connect(seL4_CPtr badged_server_ep_cap,
+                             vka_t *client_vka, vspace_t *client_vspace,
+                             serial_client_context_t *conn)
+{
+    return serial_server_client_connect_common(badged_server_ep_cap,
+                                               client_vka, client_vspace,
+                                               SERIAL_SERVER_SHMEM_DEFAULT_SIZE,
+                                               false, conn);
+}
+
+int
+serial_server_client_connect_ring(seL4_CPtr badged_server_ep_cap,
+                                  vka_t *client_vka, vspace_t *client_vspace,
+                                  serial_client_context_t *conn)
+{
+    return serial_server_client_connect_common(badged_server_ep_cap,
+                                               client_vka, client_vspace,
+                                               SERIAL_SERVER_SHMEM_DEFAULT_SIZE,
+                                               true, conn);
+}
+
+int
+serial_server_client_connect_sized(seL4_CPtr badged_server_ep_cap,
+                                   vka_t *client_vka, vspace_t *client_vspace,
+                                   size_t shmem_size, bool ring,
+                                   serial_client_context_t *conn)
+{
+    return serial_server_client_connect_common(badged_server_ep_cap,
+                                               client_vka, client_vspace,
+                                               shmem_size, ring, conn);
+}
+
+int
+serial_server_client_grow(serial_client_context_t *conn, size_t shmem_size)
+{
+    int error;
+    seL4_MessageInfo_t tag;
+    volatile char *new_shmem;
+    size_t new_size;
+
+    if (conn == NULL || conn->shmem == NULL) {
+        return seL4_InvalidArgument;
+    }
+    if (shmem_size <= conn->shmem_size) {
+        return 0;
+    }
+
+    /* The server writes out everything in the old window, ring or not, before
+     * it switches over to the new one, so there is nothing to copy.
+     */
+    error = serial_server_client_negotiate_shmem(conn, shmem_size,
+                                                 FUNC_SHMEM_RESIZE_REQ,
+                                                 FUNC_SHMEM_RESIZE_ACK,
+                                                 &new_shmem, &new_size, &tag);
+    if (error != 0) {
+        return error;
+    }
+    if (new_size <= conn->shmem_size) {
+        /* The server's max was no bigger than what we already had. It still
+         * switched over, so there is no going back.
+         */
+        ZF_LOGW(SERSERVC"grow: Server's max shmem size is %zdB.", new_size);
+    }
+
+    /* The server has dropped its mapping of the old window. */
+    vspace_unmap_pages(conn->vspace, (void *)conn->shmem,
+                       BYTES_TO_4K_PAGES(conn->shmem_size), seL4_PageBits,
+                       VSPACE_FREE);
+    conn->shmem = new_shmem;
+    conn->shmem_size = new_size;
+    if (conn->ring != NULL) {
+        conn->ring = (serial_server_ring_t *)conn->shmem;
+        conn->ring_size = conn->shmem_size - sizeof(serial_server_ring_t);
+    }
+    return 0;
+}
+
+int
+serial_server_sync(serial_client_context_t *conn)
+{
+    seL4_MessageInfo_t tag;
+
+    if (conn == NULL || conn->ring == NULL) {
+        return -seL4_InvalidArgument;
+    }
+
+    seL4_SetMR(SSMSGREG_FUNC, FUNC_RING_SYNC_REQ);
+    tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_RING_SYNC_REQ_END);
+
+    tag = seL4_Call(conn->badged_server_ep_cspath.capPtr, tag);
+
+    if (seL4_GetMR(SSMSGREG_FUNC) != FUNC_RING_SYNC_ACK) {
+        ZF_LOGE(SERSERVC"sync: Reply message was not a RING_SYNC_ACK as "
+                "expected.");
+        return -seL4_IllegalOperation;
+    }
+    return -seL4_MessageInfo_get_label(tag);
+}
+
+/** Returns the number of bytes that can be appended to a ring without
+ * overwriting data the server has not read yet.
+ */
+static inline size_t
+serial_server_ring_space(serial_client_context_t *conn, uint32_t tail)
+{
+    uint32_t head = __atomic_load_n(&conn->ring->head, __ATOMIC_ACQUIRE);
+
+    if (head > tail) {
+        return head - tail - 1;
+    }
+    return conn->ring_size - (tail - head) - 1;
+}
+
+/** Reserves len bytes in the ring, waiting for the server to drain the ring
+ * if there is not enough space.
+ *
+ * @param conn Ring connection.
+ * @param len Number of bytes to reserve.
+ * @param tail [out] Offset of the reserved bytes in the ring.
+ * @return 0 on success, or a negative integer for error condition.
+ */
+static int
+serial_server_ring_reserve(serial_client_context_t *conn, size_t len,
+                           uint32_t *tail)
+{
+    int error;
+
+    /* One byte is always left unused. */
+    if (len >= conn->ring_size) {
+        ZF_LOGE(SERSERVC"write: Length %zd exceeds the ring's capacity of "
+                "%zd bytes.", len, conn->ring_size - 1);
+        return -seL4_RangeError;
+    }
+
+    /* We are the only writer of tail. */
+    *tail = __atomic_load_n(&conn->ring->tail, __ATOMIC_RELAXED);
+    while (serial_server_ring_space(conn, *tail) < len) {
+        error = serial_server_sync(conn);
+        if (error != 0) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+/** Makes the bytes up to new_tail visible to the server, and signals the
+ * server if it had already drained everything before them.
+ */
+static void
+serial_server_ring_publish(serial_client_context_t *conn, uint32_t tail,
+                           uint32_t new_tail)
+{
+    __atomic_store_n(&conn->ring->tail, new_tail, __ATOMIC_RELEASE);
+    /* Order the store of tail before the load of head. Pairs with the fence
+     * in serial_server_ring_drain: either we see that the server has caught
+     * up and signal it, or the server sees the new tail before it goes to
+     * sleep.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&conn->ring->head, __ATOMIC_RELAXED) == tail) {
+        seL4_Signal(conn->ring_ntfn_cspath.capPtr);
+    }
+}
+
+static ssize_t
+serial_server_ring_write(serial_client_context_t *conn, const char *in_buff,
+                         size_t len)
+{
+    uint32_t tail;
+    size_t first;
+    int error;
+
+    error = serial_server_ring_reserve(conn, len, &tail);
+    if (error != 0) {
+        return error;
+    }
+
+    first = MIN(len, conn->ring_size - tail);
+    memcpy(&conn->ring->data[tail], in_buff, first);
+    memcpy(&conn->ring->data[0], in_buff + first, len - first);
+
+    serial_server_ring_publish(conn, tail, (tail + len) % conn->ring_size);
+    return len;
+}
+
+/** Formats a message that is too long to be sent in one piece into a
+ * temporary buffer, and streams it to the server.
+ */
+static ssize_t
+serial_server_vprintf_stream(serial_client_context_t *conn, const char *fmt,
+                             va_list args, size_t len)
+{
+    char *tmp;
+    ssize_t ret;
+
+    tmp = malloc(len + 1);
+    if (tmp == NULL) {
+        return -seL4_NotEnoughMemory;
+    }
+    vsnprintf(tmp, len + 1, fmt, args);
+    ret = serial_server_write_stream(conn, tmp, len);
+    free(tmp);
+    return ret;
+}
+
+static ssize_t
+serial_server_ring_vprintf(serial_client_context_t *conn, const char *fmt,
+                           va_list args)
+{
+    uint32_t tail;
+    ssize_t len;
+    va_list args_copy;
+    char *tmp;
+    int error;
+
+    va_copy(args_copy, args);
+    len = vsnprintf(NULL, 0, fmt, args_copy);
+    va_end(args_copy);
+    if (len <= 0) {
+        return len;
+    }
+
+    if ((size_t)len >= conn->ring_size) {
+        /* Too long to go into the ring in one piece. */
+        return serial_server_vprintf_stream(conn, fmt, args, len);
+    }
+
+    error = serial_server_ring_reserve(conn, len, &tail);
+    if (error != 0) {
+        return error;
+    }
+
+    if (conn->ring_size - tail > (size_t)len) {
+        /* Fits before the end of the ring, with room to spare for the NUL
+         * terminator, which lands in the unused part of the ring.
+         */
+        vsnprintf(&conn->ring->data[tail], len + 1, fmt, args);
+        serial_server_ring_publish(conn, tail, tail + len);
+        return len;
+    }
+
+    /* The message wraps around the end of the ring. */
+    tmp = malloc(len + 1);
+    if (tmp == NULL) {
+        return -seL4_NotEnoughMemory;
+    }
+    vsnprintf(tmp, len + 1, fmt, args);
+    len = serial_server_ring_write(conn, tmp, len);
+    free(tmp);
+    return len;
+}
+
 /** Performs the IPC register setup for a write() call to the server.
  *
  * The Server's ABI for the write() request has changed a little: the server
@@ -180,6 +543,13 @@ serial_server_printf(serial_client_context_t *conn, const char *fmt, ...)
         return -seL4_InvalidArgument;
     }
 
+    if (conn->ring != NULL) {
+        va_start(args, fmt);
+        expanded_fmt_length = serial_server_ring_vprintf(conn, fmt, args);
+        va_end(args);
+        return expanded_fmt_length;
+    }
+
     va_start(args, fmt);
     expanded_fmt_length = vsnprintf((char *)conn->shmem, conn->shmem_size,
                                     fmt, args);
@@ -189,12 +559,12 @@ serial_server_printf(serial_client_context_t *conn, const char *fmt, ...)
     }
 
     if ((size_t)expanded_fmt_length >= conn->shmem_size) {
-        ZF_LOGE(SERSERVC"printf: This printf call's total expanded length (%zd) "
-                "exceeds your %zd bytes shmem buffer.\n\tMessage not sent to "
-                "server.",
-                expanded_fmt_length,
-                conn->shmem_size);
-        return -seL4_RangeError;
+        /* Didn't fit in the shmem: send it over in several pieces. */
+        va_start(args, fmt);
+        expanded_fmt_length = serial_server_vprintf_stream(conn, fmt, args,
+                                                           expanded_fmt_length);
+        va_end(args);
+        return expanded_fmt_length;
     }
 
     /* Else, send it off to the server. */
@@ -203,6 +573,10 @@ serial_server_printf(serial_client_context_t *conn, const char *fmt, ...)
 
 ssize_t serial_server_flush(serial_client_context_t *conn, ssize_t len)
 {
+    if (conn->ring != NULL) {
+        /* The shmem of a ring connection can't be used directly. */
+        return -seL4_IllegalOperation;
+    }
     if (len > conn->shmem_size) {
         return -seL4_RangeError;
     }
@@ -222,18 +596,141 @@ serial_server_write(serial_client_context_t *conn, const char *in_buff, ssize_t
                 "\tIs connection handle valid?");
         return -seL4_InvalidArgument;
     }
+    if (len == 0) {
+        return 0;
+    }
+
+    if (conn->ring != NULL) {
+        return serial_server_ring_write(conn, in_buff, len);
+    }
+
     if (len > conn->shmem_size) {
         return -seL4_RangeError;
     }
 
+    memcpy((void *)conn->shmem, in_buff, len);
+
+    /* Else, send it off to the server. */
+    return serial_server_write_ipc_invoke(conn, len);
+}
+
+ssize_t
+serial_server_write_stream(serial_client_context_t *conn, const char *in_buff,
+                           size_t len)
+{
+    size_t chunk, done = 0;
+    ssize_t ret;
+
+    if (in_buff == NULL || conn == NULL || conn->shmem == NULL) {
+        ZF_LOGE(SERSERVC"write_stream: NULL passed for required arguments.\n"
+                "\tIs connection handle valid?");
+        return -seL4_InvalidArgument;
+    }
+
+    /* Each piece is acked as soon as the server has queued it, so the server
+     * writes out one piece while we send the next. Rings are filled half at a
+     * time for the same reason.
+     */
+    chunk = (conn->ring != NULL) ? conn->ring_size / 2 : conn->shmem_size;
+    while (done < len) {
+        ret = serial_server_write(conn, in_buff + done, MIN(chunk, len - done));
+        if (ret <= 0) {
+            return (done != 0) ? (ssize_t)done : ret;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+ssize_t
+serial_server_read(serial_client_context_t *conn, char *out_buff, size_t len,
+                   bool block)
+{
+    seL4_MessageInfo_t tag;
+    bool send_ntfn = false;
+    size_t n;
+    int error;
+
+    if (out_buff == NULL || conn == NULL || conn->shmem == NULL) {
+        ZF_LOGE(SERSERVC"read: NULL passed for required arguments.\n"
+                "\tIs connection handle valid?");
+        return -seL4_InvalidArgument;
+    }
     if (len == 0) {
         return 0;
     }
 
-    memcpy((void *)conn->shmem, in_buff, len);
+    if (block && conn->rx_ntfn.cptr == 0) {
+        /* The server needs something to signal when it has input for us. */
+        error = vka_alloc_notification(conn->vka, &conn->rx_ntfn);
+        if (error != 0) {
+            ZF_LOGE(SERSERVC"read: Failed to alloc notification.");
+            return -seL4_NotEnoughMemory;
+        }
+        send_ntfn = true;
+    }
 
-    /* Else, send it off to the server. */
-    return serial_server_write_ipc_invoke(conn, len);
+    while (true) {
+        seL4_SetMR(SSMSGREG_FUNC, FUNC_READ_REQ);
+        seL4_SetMR(SSMSGREG_READ_REQ_MAX_LEN, MIN(len, SERIAL_SERVER_READ_MAX_LEN));
+        seL4_SetMR(SSMSGREG_READ_REQ_BLOCK, block);
+        if (send_ntfn) {
+            seL4_SetCap(0, conn->rx_ntfn.cptr);
+        }
+        tag = seL4_MessageInfo_new(0, 0, send_ntfn ? 1 : 0, SSMSGREG_READ_REQ_END);
+
+        tag = seL4_Call(conn->badged_server_ep_cspath.capPtr, tag);
+
+        if (seL4_GetMR(SSMSGREG_FUNC) != FUNC_READ_ACK) {
+            ZF_LOGE(SERSERVC"read: Reply message was not a READ_ACK as "
+                    "expected.");
+            return -seL4_IllegalOperation;
+        }
+        if (seL4_MessageInfo_get_label(tag) != 0) {
+            if (send_ntfn) {
+                vka_free_object(conn->vka, &conn->rx_ntfn);
+                memset(&conn->rx_ntfn, 0, sizeof(conn->rx_ntfn));
+            }
+            return -seL4_MessageInfo_get_label(tag);
+        }
+        send_ntfn = false;
+
+        n = MIN(seL4_GetMR(SSMSGREG_READ_ACK_N_BYTES_READ),
+                MIN(len, SERIAL_SERVER_READ_MAX_LEN));
+        if (n != 0 || !block) {
+            memcpy(out_buff, &seL4_GetIPCBuffer()->msg[SSMSGREG_READ_ACK_DATA], n);
+            return n;
+        }
+
+        if (seL4_GetMR(SSMSGREG_READ_ACK_WAIT)) {
+            seL4_Wait(conn->rx_ntfn.cptr, NULL);
+        } else {
+            /* The server can only poll the device, so we have to ask again. */
+            seL4_Yield();
+        }
+    }
+}
+
+int
+serial_server_set_focus(serial_client_context_t *conn)
+{
+    seL4_MessageInfo_t tag;
+
+    if (conn == NULL || conn->shmem == NULL) {
+        return -seL4_InvalidArgument;
+    }
+
+    seL4_SetMR(SSMSGREG_FUNC, FUNC_FOCUS_REQ);
+    tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_FOCUS_REQ_END);
+
+    tag = seL4_Call(conn->badged_server_ep_cspath.capPtr, tag);
+
+    if (seL4_GetMR(SSMSGREG_FUNC) != FUNC_FOCUS_ACK) {
+        ZF_LOGE(SERSERVC"set_focus: Reply message was not a FOCUS_ACK as "
+                "expected.");
+        return -seL4_IllegalOperation;
+    }
+    return -seL4_MessageInfo_get_label(tag);
 }
 
 void
@@ -254,6 +751,18 @@ serial_server_disconnect(serial_client_context_t *conn)
         ZF_LOGE(SERSERVC"disconnect: reply message was not a DISCONNECT_ACK "
                 "as expected.");
     }
+
+    if (conn->ring != NULL) {
+        vka_cnode_delete(&conn->ring_ntfn_cspath);
+        vka_cspace_free_path(conn->vka, conn->ring_ntfn_cspath);
+        memset(&conn->ring_ntfn_cspath, 0, sizeof(conn->ring_ntfn_cspath));
+        conn->ring = NULL;
+    }
+    /* The server has deleted its copy of the cap. */
+    if (conn->rx_ntfn.cptr != 0) {
+        vka_free_object(conn->vka, &conn->rx_ntfn);
+        memset(&conn->rx_ntfn, 0, sizeof(conn->rx_ntfn));
+    }
 }
 
 int
@@ -3,6 +3,9 @@
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
+#include <autoconf.h>
+#include <sel4serialserver/gen_config.h>
+
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
@@ -14,38 +17,66 @@
 #include <vka/vka.h>
 #include <vka/object.h>
 #include <vka/object_capops.h>
+#include <vka/capops.h>
 
 #include "serial_server.h"
 #include <serial_server/parent.h>
 
 seL4_Error
-serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
-                                  vspace_t *parent_vspace,
-                                  uint8_t priority)
+serial_server_parent_spawn_instance(int instance, simple_t *parent_simple,
+                                    vka_t *parent_vka, vspace_t *parent_vspace,
+                                    const serial_server_instance_config_t *instance_config)
 {
     const size_t shmem_max_size = SERIAL_SERVER_SHMEM_MAX_SIZE;
+    serial_server_context_t *server = serial_server_get_instance(instance);
     seL4_Error error;
     size_t shmem_max_n_pages;
     cspacepath_t parent_cspace_cspath;
     seL4_MessageInfo_t tag;
 
-    if (parent_simple == NULL || parent_vka == NULL || parent_vspace == NULL) {
+    if (server == NULL || parent_simple == NULL || parent_vka == NULL
+        || parent_vspace == NULL || instance_config == NULL
+        || instance_config->core >= CONFIG_MAX_NUM_NODES) {
         return seL4_InvalidArgument;
     }
+    /* The thread of a live or dying instance still uses the context. */
+    if (__atomic_load_n(&server->spawned, __ATOMIC_ACQUIRE)) {
+        ZF_LOGE(SERSERVP"spawn_thread: Instance %d is already running.", instance);
+        return seL4_IllegalOperation;
+    }
+
+    memset(server, 0, sizeof(serial_server_context_t));
+    server->instance = instance;
+    server->core = instance_config->core;
+    server->device = instance_config->device;
+    server->client_quota = CONFIG_SERIAL_SERVER_CLIENT_QUOTA;
 
-    memset(get_serial_server(), 0, sizeof(serial_server_context_t));
+    /* Two instances reading the same device would steal each other's input. */
+    server->reads_device = true;
+    for (int i = 0; i < SERIAL_SERVER_MAX_INSTANCES; i++) {
+        serial_server_context_t *other = serial_server_get_instance(i);
+
+        /* Killed instances clear both flags once they have been torn down,
+         * so a new instance on their device takes over its input.
+         */
+        if (i != instance && __atomic_load_n(&other->spawned, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&other->reads_device, __ATOMIC_ACQUIRE)
+            && other->device == server->device) {
+            server->reads_device = false;
+        }
+    }
 
     /* Get a CPtr to the parent's root cnode. */
     shmem_max_n_pages = BYTES_TO_4K_PAGES(shmem_max_size);
     vka_cspace_make_path(parent_vka, 0, &parent_cspace_cspath);
 
-    get_serial_server()->server_vka = parent_vka;
-    get_serial_server()->server_vspace = parent_vspace;
-    get_serial_server()->server_cspace = parent_cspace_cspath.root;
-    get_serial_server()->server_simple = parent_simple;
+    server->server_vka = parent_vka;
+    server->server_vspace = parent_vspace;
+    server->server_cspace = parent_cspace_cspath.root;
+    server->server_simple = parent_simple;
 
     /* Allocate the Endpoint that the server will be listening on. */
-    error = vka_alloc_endpoint(parent_vka, &get_serial_server()->server_ep_obj);
+    error = vka_alloc_endpoint(parent_vka, &server->server_ep_obj);
     if (error != 0) {
         ZF_LOGE(SERSERVP"spawn_thread: failed to alloc endpoint, err=%d.",
                 error);
@@ -62,16 +93,23 @@ serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
      * Server later on.
      */
 
-    get_serial_server()->parent_badge_value = serial_server_badge_value_alloc();
-    if (get_serial_server()->parent_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+    server->registry = calloc(SERIAL_SERVER_MAX_CLIENTS, sizeof(*server->registry));
+    if (server->registry == NULL) {
+        error = seL4_NotEnoughMemory;
+        goto out;
+    }
+    server->registry_n_entries = SERIAL_SERVER_MAX_CLIENTS;
+
+    server->parent_badge_value = serial_server_badge_value_alloc(server);
+    if (server->parent_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
         error = seL4_NotEnoughMemory;
         goto out;
     }
 
-    error = vka_mint_object(parent_vka, &get_serial_server()->server_ep_obj,
-                            &get_serial_server()->_badged_server_ep_cspath,
+    error = vka_mint_object(parent_vka, &server->server_ep_obj,
+                            &server->_badged_server_ep_cspath,
                             seL4_AllRights,
-                            get_serial_server()->parent_badge_value);
+                            server->parent_badge_value);
     if (error != 0) {
         ZF_LOGE(SERSERVP"spawn_thread: Failed to mint badged Endpoint cap to "
                 "server.\n"
@@ -79,47 +117,87 @@ serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
         goto out;
     }
 
-    /* Allocate enough Cnode slots in our CSpace to enable us to receive
-     * frame caps from our clients, sufficient to cover "shmem_max_size".
-     * The problem here is that we're sort of forced to assume that we get
-     * these slots contiguously. If they're not, we have a problem.
+    /* Allocate a Cnode slot in our CSpace to receive frame caps from our
+     * clients into. The kernel only transfers one cap per message into the
+     * receiver's CSpace, so clients send the frames of a multi-page shmem
+     * window one message at a time, and the server moves each one out of the
+     * receive slot as it arrives.
      *
      * If a client tries to send us too many frames, we respond with an error,
      * and indicate our shmem_max_size in the SSMSGREG_RESPONSE
      * message register.
      */
-    get_serial_server()->frame_cap_recv_cspaths = calloc(shmem_max_n_pages,
+    server->frame_cap_recv_cspaths = calloc(SERIAL_SERVER_N_RECV_SLOTS,
                                                          sizeof(cspacepath_t));
-    if (get_serial_server()->frame_cap_recv_cspaths == NULL) {
+    if (server->frame_cap_recv_cspaths == NULL) {
         error = seL4_NotEnoughMemory;
         goto out;
     }
 
-    for (size_t i = 0; i < shmem_max_n_pages; i++) {
+    for (size_t i = 0; i < SERIAL_SERVER_N_RECV_SLOTS; i++) {
         error = vka_cspace_alloc_path(parent_vka,
-                                      &get_serial_server()->frame_cap_recv_cspaths[i]);
+                                      &server->frame_cap_recv_cspaths[i]);
         if (error != 0) {
-            ZF_LOGE(SERSERVP"spawn_thread: Failed to alloc enough cnode slots "
-                    "to receive shmem frame caps equal to %zd bytes.",
-                    shmem_max_size);
+            ZF_LOGE(SERSERVP"spawn_thread: Failed to alloc cnode slot "
+                    "to receive shmem frame caps.");
             goto out;
         }
     }
 
     sel4utils_thread_config_t config = thread_config_default(parent_simple, parent_cspace_cspath.root,
-                                                             seL4_NilData, get_serial_server()->server_ep_obj.cptr, priority);
+                                                             seL4_NilData, server->server_ep_obj.cptr,
+                                                             instance_config->priority);
+    if (config_set(CONFIG_KERNEL_MCS)) {
+        /* On MCS the core is set by the scheduling context. */
+        seL4_Time timeslice_us = CONFIG_BOOT_THREAD_TIME_SLICE * US_IN_MS;
+        config.sched_params = sched_params_round_robin(config.sched_params, parent_simple,
+                                                       instance_config->core, timeslice_us);
+    }
     error = sel4utils_configure_thread_config(parent_vka, parent_vspace, parent_vspace,
-                                              config, &get_serial_server()->server_thread);
+                                              config, &server->server_thread);
     if (error != 0) {
         ZF_LOGE(SERSERVP"spawn_thread: sel4utils_configure_thread failed "
                 "with %d.", error);
         goto out;
     }
+    if (!config_set(CONFIG_KERNEL_MCS) && instance_config->core != 0) {
+        error = sel4utils_set_sched_affinity(&server->server_thread,
+                                             sched_params_core(config.sched_params,
+                                                               instance_config->core));
+        if (error != 0) {
+            ZF_LOGE(SERSERVP"spawn_thread: Failed to move the server thread to "
+                    "core %zd.", (size_t)instance_config->core);
+            goto out;
+        }
+    }
 
-    NAME_THREAD(get_serial_server()->server_thread.tcb.cptr, "serial server");
-    error = sel4utils_start_thread(&get_serial_server()->server_thread,
+    /* Ring clients signal a notification bound to the server thread, so that
+     * the server can wait for them and for IPC at the same time.
+     */
+    error = vka_alloc_notification(parent_vka, &server->ring_ntfn_obj);
+    if (error != 0) {
+        ZF_LOGE(SERSERVP"spawn_thread: Failed to alloc ring notification.");
+        goto out;
+    }
+    error = vka_mint_object(parent_vka, &server->ring_ntfn_obj,
+                            &server->_badged_ring_ntfn_cspath,
+                            seL4_AllRights, SERIAL_SERVER_RING_NTFN_BADGE);
+    if (error != 0) {
+        ZF_LOGE(SERSERVP"spawn_thread: Failed to mint badged ring notification.");
+        goto out;
+    }
+    error = seL4_TCB_BindNotification(server->server_thread.tcb.cptr,
+                                      server->ring_ntfn_obj.cptr);
+    if (error != 0) {
+        ZF_LOGE(SERSERVP"spawn_thread: Failed to bind ring notification to the "
+                "server thread.");
+        goto out;
+    }
+
+    NAME_THREAD(server->server_thread.tcb.cptr, "serial server");
+    error = sel4utils_start_thread(&server->server_thread,
                                    (sel4utils_thread_entry_fn)&serial_server_main,
-                                   NULL, NULL, 1);
+                                   server, NULL, 1);
     if (error != 0) {
         ZF_LOGE(SERSERVP"spawn_thread: sel4utils_start_thread failed with "
                 "%d.", error);
@@ -132,7 +210,7 @@ serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
      */
     seL4_SetMR(SSMSGREG_FUNC, FUNC_SERVER_SPAWN_SYNC_REQ);
     tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_SPAWN_SYNC_REQ_END);
-    tag = seL4_Call(get_serial_server()->_badged_server_ep_cspath.capPtr, tag);
+    tag = seL4_Call(server->_badged_server_ep_cspath.capPtr, tag);
 
     /* Did all go well with the server? */
     if (seL4_GetMR(SSMSGREG_FUNC) != FUNC_SERVER_SPAWN_SYNC_ACK) {
@@ -148,98 +226,239 @@ serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
         goto out;
     }
 
-    get_serial_server()->shmem_max_size = shmem_max_size;
-    get_serial_server()->shmem_max_n_pages = shmem_max_n_pages;
+    server->shmem_max_size = shmem_max_size;
+    server->shmem_max_n_pages = shmem_max_n_pages;
+    __atomic_store_n(&server->spawned, true, __ATOMIC_RELEASE);
     return 0;
 
 out:
-    if (get_serial_server()->frame_cap_recv_cspaths != NULL) {
-        for (size_t i = 0; i < shmem_max_n_pages; i++) {
+    if (server->frame_cap_recv_cspaths != NULL) {
+        for (size_t i = 0; i < SERIAL_SERVER_N_RECV_SLOTS; i++) {
             /* Since the array was allocated with calloc(), it was zero'd out. So
              * those indexes that didn't get allocated will have NULL in them.
              * Break early on the first index that has NULL.
              */
-            if (get_serial_server()->frame_cap_recv_cspaths[i].capPtr == 0) {
+            if (server->frame_cap_recv_cspaths[i].capPtr == 0) {
                 break;
             }
-            vka_cspace_free_path(parent_vka, get_serial_server()->frame_cap_recv_cspaths[i]);
+            vka_cspace_free_path(parent_vka, server->frame_cap_recv_cspaths[i]);
         }
     }
-    free(get_serial_server()->frame_cap_recv_cspaths);
+    free(server->frame_cap_recv_cspaths);
 
-    if (get_serial_server()->_badged_server_ep_cspath.capPtr != 0) {
-        vka_cspace_free_path(parent_vka, get_serial_server()->_badged_server_ep_cspath);
+    if (server->_badged_server_ep_cspath.capPtr != 0) {
+        vka_cspace_free_path(parent_vka, server->_badged_server_ep_cspath);
+    }
+    if (server->_badged_ring_ntfn_cspath.capPtr != 0) {
+        vka_cnode_delete(&server->_badged_ring_ntfn_cspath);
+        vka_cspace_free_path(parent_vka, server->_badged_ring_ntfn_cspath);
+    }
+    if (server->ring_ntfn_obj.cptr != 0) {
+        vka_free_object(parent_vka, &server->ring_ntfn_obj);
     }
-    if (get_serial_server()->parent_badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
-        serial_server_badge_value_free(get_serial_server()->parent_badge_value);
+    if (server->parent_badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+        serial_server_badge_value_free(server, server->parent_badge_value);
     }
-    vka_free_object(parent_vka, &get_serial_server()->server_ep_obj);
+    free(server->registry);
+    server->registry = NULL;
+    server->registry_n_entries = 0;
+    vka_free_object(parent_vka, &server->server_ep_obj);
     return error;
 }
 
+seL4_Error
+serial_server_parent_spawn_thread(simple_t *parent_simple, vka_t *parent_vka,
+                                  vspace_t *parent_vspace,
+                                  uint8_t priority)
+{
+    serial_server_instance_config_t config = {
+        .priority = priority,
+        .core = 0,
+        .device = NULL,
+    };
+
+    return serial_server_parent_spawn_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                               parent_simple, parent_vka,
+                                               parent_vspace, &config);
+}
+
+/** Counts the badge values an instance has given out. */
+static size_t
+serial_server_n_clients(serial_server_context_t *server)
+{
+    size_t n = 0;
+
+    for (int i = 0; i < server->registry_n_entries; i++) {
+        if (server->registry[i].badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+            n++;
+        }
+    }
+    return n;
+}
+
 int
-serial_server_parent_vka_mint_endpoint(vka_t *client_vka,
-                                       cspacepath_t *badged_server_ep_cspath)
+serial_server_parent_pick_instance(seL4_Word core)
 {
-    if (client_vka == NULL || badged_server_ep_cspath == NULL) {
+    int best = -1;
+    bool best_on_core = false;
+    size_t best_n_clients = 0;
+
+    for (int i = 0; i < SERIAL_SERVER_MAX_INSTANCES; i++) {
+        serial_server_context_t *server = serial_server_get_instance(i);
+        bool on_core;
+        size_t n_clients;
+
+        if (!__atomic_load_n(&server->spawned, __ATOMIC_ACQUIRE)
+            || __atomic_load_n(&server->dying, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        on_core = server->core == core;
+        n_clients = serial_server_n_clients(server);
+        if (best == -1
+            || (on_core && !best_on_core)
+            || (on_core == best_on_core && n_clients < best_n_clients)) {
+            best = i;
+            best_on_core = on_core;
+            best_n_clients = n_clients;
+        }
+    }
+    return best;
+}
+
+int
+serial_server_parent_vka_mint_endpoint_instance(int instance, vka_t *client_vka,
+                                                cspacepath_t *badged_server_ep_cspath)
+{
+    serial_server_context_t *server = serial_server_get_instance(instance);
+
+    if (server == NULL || client_vka == NULL || badged_server_ep_cspath == NULL) {
         return seL4_InvalidArgument;
     }
 
-    seL4_Word new_badge_value = serial_server_badge_value_alloc();
+    seL4_Word new_badge_value = serial_server_badge_value_alloc(server);
     if (new_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
         return -1;
     }
 
     /* Mint the Endpoint to a new client. */
-    return vka_mint_object_inter_cspace(get_serial_server()->server_vka,
-                                        &get_serial_server()->server_ep_obj,
+    return vka_mint_object_inter_cspace(server->server_vka,
+                                        &server->server_ep_obj,
                                         client_vka,
                                         badged_server_ep_cspath,
                                         seL4_AllRights,
                                         new_badge_value);
 }
 
+int
+serial_server_parent_vka_mint_endpoint(vka_t *client_vka,
+                                       cspacepath_t *badged_server_ep_cspath)
+{
+    return serial_server_parent_vka_mint_endpoint_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                                           client_vka,
+                                                           badged_server_ep_cspath);
+}
+
 static inline void
-parent_ep_obj_to_cspath(cspacepath_t *result)
+parent_ep_obj_to_cspath(serial_server_context_t *server, cspacepath_t *result)
 {
     if (result == NULL) {
         return;
     }
-    vka_cspace_make_path(get_serial_server()->server_vka,
-                         get_serial_server()->server_ep_obj.cptr,
+    vka_cspace_make_path(server->server_vka,
+                         server->server_ep_obj.cptr,
                          result);
 }
 
 int
-serial_server_allocate_client_badged_ep(cspacepath_t dest_slot)
+serial_server_allocate_client_badged_ep_instance(int instance,
+                                                 cspacepath_t dest_slot)
 {
+    serial_server_context_t *server = serial_server_get_instance(instance);
     cspacepath_t server_ep_cspath;
 
-    seL4_Word new_badge_value = serial_server_badge_value_alloc();
+    if (server == NULL) {
+        return seL4_InvalidArgument;
+    }
+
+    seL4_Word new_badge_value = serial_server_badge_value_alloc(server);
     if (new_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
         return -1;
     }
 
-    parent_ep_obj_to_cspath(&server_ep_cspath);
+    parent_ep_obj_to_cspath(server, &server_ep_cspath);
     return vka_cnode_mint(&dest_slot, &server_ep_cspath, seL4_AllRights,
                           new_badge_value);
 }
 
+int
+serial_server_allocate_client_badged_ep(cspacepath_t dest_slot)
+{
+    return serial_server_allocate_client_badged_ep_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                                            dest_slot);
+}
+
 seL4_CPtr
-serial_server_parent_mint_endpoint_to_process(sel4utils_process_t *p)
+serial_server_parent_mint_endpoint_to_process_instance(int instance,
+                                                       sel4utils_process_t *p)
 {
-    if (p == NULL) {
+    serial_server_context_t *server = serial_server_get_instance(instance);
+
+    if (server == NULL || p == NULL) {
         return 0;
     }
 
     cspacepath_t server_ep_cspath;
-    seL4_Word new_badge_value = serial_server_badge_value_alloc();
+    seL4_Word new_badge_value = serial_server_badge_value_alloc(server);
     if (new_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
         return -1;
     }
 
-    parent_ep_obj_to_cspath(&server_ep_cspath);
+    parent_ep_obj_to_cspath(server, &server_ep_cspath);
     return sel4utils_mint_cap_to_process(p, server_ep_cspath,
                                          seL4_AllRights,
                                          new_badge_value);
 }
+
+seL4_CPtr
+serial_server_parent_mint_endpoint_to_process(sel4utils_process_t *p)
+{
+    return serial_server_parent_mint_endpoint_to_process_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                                                  p);
+}
+
+void
+serial_server_parent_set_client_quota_instance(int instance, size_t quota)
+{
+    serial_server_context_t *server = serial_server_get_instance(instance);
+
+    if (server == NULL) {
+        return;
+    }
+    server->client_quota = quota;
+}
+
+void
+serial_server_parent_set_client_quota(size_t quota)
+{
+    serial_server_parent_set_client_quota_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                                   quota);
+}
+
+void
+serial_server_parent_get_stats_instance(int instance,
+                                        serial_server_stats_t *stats)
+{
+    serial_server_context_t *server = serial_server_get_instance(instance);
+
+    if (server == NULL || stats == NULL) {
+        return;
+    }
+    *stats = server->stats;
+}
+
+void
+serial_server_parent_get_stats(serial_server_stats_t *stats)
+{
+    serial_server_parent_get_stats_instance(SERIAL_SERVER_DEFAULT_INSTANCE,
+                                            stats);
+}
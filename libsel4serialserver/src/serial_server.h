@@ -5,7 +5,10 @@
  */
 #pragma once
 
+#include <autoconf.h>
+#include <sel4serialserver/gen_config.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <sel4/sel4.h>
 
@@ -14,6 +17,11 @@
 #include <vka/vka.h>
 #include <vka/object.h>
 #include <vspace/vspace.h>
+#include <platsupport/io.h>
+#include <platsupport/irq.h>
+#include <utils/util.h>
+
+#include <serial_server/parent.h>
 
 /** @file APIs for managing and interacting with the serial server thread.
  *
@@ -31,7 +39,59 @@
 
 #define SERIAL_SERVER_BADGE_VALUE_EMPTY (0)
 
-#define SERIAL_SERVER_SHMEM_MAX_SIZE (BIT(seL4_PageBits))
+/* Size of the shmem window that clients ask for by default, and the largest
+ * one that the server accepts.
+ */
+#define SERIAL_SERVER_SHMEM_DEFAULT_SIZE (BIT(seL4_PageBits))
+#define SERIAL_SERVER_SHMEM_MAX_SIZE (CONFIG_SERIAL_SERVER_SHMEM_MAX_SIZE)
+
+/* A message transfers at most one cap into the receiver's CSpace. */
+#define SERIAL_SERVER_N_RECV_SLOTS (1)
+
+/* Badge of the notification that ring clients signal. The notification is bound
+ * to the server's TCB, so this is the badge the server receives on its Endpoint.
+ * Endpoint badges are allocated densely from 1 and never reach this bit.
+ */
+#define SERIAL_SERVER_RING_NTFN_BADGE (BIT(seL4_BadgeBits - 1))
+
+/* Badge bits of the same notification that the serial device's IRQs are
+ * delivered on, one bit per IRQ.
+ */
+#define SERIAL_SERVER_RX_IRQ_BADGE_BITS (4)
+#define SERIAL_SERVER_RX_IRQ_BADGE_MASK \
+    (MASK(SERIAL_SERVER_RX_IRQ_BADGE_BITS) << (seL4_BadgeBits - 1 - SERIAL_SERVER_RX_IRQ_BADGE_BITS))
+
+/* Any of these bits set in a badge means the bound notification was signalled. */
+#define SERIAL_SERVER_NTFN_BADGE_MASK \
+    (SERIAL_SERVER_RING_NTFN_BADGE | SERIAL_SERVER_RX_IRQ_BADGE_MASK)
+
+#define SERIAL_SERVER_RX_BUFFER_SIZE (CONFIG_SERIAL_SERVER_RX_BUFFER_SIZE)
+
+#define SERIAL_SERVER_MAX_INSTANCES (CONFIG_SERIAL_SERVER_MAX_INSTANCES)
+
+#define SERIAL_SERVER_MAX_CLIENTS (CONFIG_SERIAL_SERVER_MAX_CLIENTS)
+
+/* Most bytes written out for one client before moving on to the next, when
+ * the server writes out queued data.
+ */
+#define SERIAL_SERVER_DRAIN_CHUNK (256)
+
+/* Header at the start of the shmem of a ring connection. The rest of the shmem
+ * holds the data of a single-producer, single-consumer byte ring.
+ *
+ * The ring is empty when head == tail, and one byte is always left unused so
+ * that a full ring can be told apart from an empty one. The client only ever
+ * writes tail and the server only ever writes head, so neither needs a lock.
+ * The client signals the server only when it appends to a ring that the server
+ * had completely drained.
+ */
+typedef struct serial_server_ring {
+    /* Offset into data that the client will write to next. */
+    uint32_t tail ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    /* Offset into data that the server will read from next. */
+    uint32_t head ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    char data[] ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+} serial_server_ring_t;
 
 /* IPC values returned in the "label" message header. */
 enum serial_server_errors {
@@ -61,6 +121,37 @@ enum serial_server_funcs {
 
     FUNC_KILL_REQ,
     FUNC_KILL_ACK,
+
+    /* Same message layout as FUNC_CONNECT_REQ/ACK, but the shmem is used as
+     * a serial_server_ring_t, and the ACK carries a cap to the notification
+     * that the client signals when it appends to an empty ring.
+     */
+    FUNC_CONNECT_RING_REQ,
+    FUNC_CONNECT_RING_ACK,
+
+    FUNC_RING_SYNC_REQ,
+    FUNC_RING_SYNC_ACK,
+
+    /* Carries one Frame of a multi-page shmem window ahead of the
+     * FUNC_CONNECT_REQ, FUNC_CONNECT_RING_REQ or FUNC_SHMEM_RESIZE_REQ that
+     * carries the last one. The ACK has the same layout as FUNC_CONNECT_ACK.
+     */
+    FUNC_SHMEM_FRAME_REQ,
+    FUNC_SHMEM_FRAME_ACK,
+
+    /* Same message layout as FUNC_CONNECT_REQ/ACK. */
+    FUNC_SHMEM_RESIZE_REQ,
+    FUNC_SHMEM_RESIZE_ACK,
+
+    /* A blocking FUNC_READ_REQ may carry a cap to a notification, which the
+     * server signals when input arrives for a client that it told to wait.
+     * The ACK carries the input itself in message registers.
+     */
+    FUNC_READ_REQ,
+    FUNC_READ_ACK,
+
+    FUNC_FOCUS_REQ,
+    FUNC_FOCUS_ACK,
 };
 
 /* Designated purposes of each message register in the mini-protocol. */
@@ -98,19 +189,92 @@ enum serial_server_msgregs {
 
     SSMSGREG_KILL_REQ_END = SSMSGREG_LABEL0,
 
-    SSMSGREG_KILL_ACK_END = SSMSGREG_LABEL0
+    SSMSGREG_KILL_ACK_END = SSMSGREG_LABEL0,
+
+    SSMSGREG_RING_SYNC_REQ_END = SSMSGREG_LABEL0,
+
+    SSMSGREG_RING_SYNC_ACK_N_BYTES_WRITTEN = SSMSGREG_LABEL0,
+    SSMSGREG_RING_SYNC_ACK_END,
+
+    SSMSGREG_SHMEM_FRAME_REQ_SHMEM_SIZE = SSMSGREG_LABEL0,
+    SSMSGREG_SHMEM_FRAME_REQ_INDEX,
+    SSMSGREG_SHMEM_FRAME_REQ_END,
+
+    SSMSGREG_READ_REQ_MAX_LEN = SSMSGREG_LABEL0,
+    SSMSGREG_READ_REQ_BLOCK,
+    SSMSGREG_READ_REQ_END,
+
+    SSMSGREG_READ_ACK_N_BYTES_READ = SSMSGREG_LABEL0,
+    /* Non-zero if the client should wait on its notification before asking
+     * again, zero if it has to poll.
+     */
+    SSMSGREG_READ_ACK_WAIT,
+    /* The input, packed into as many registers as it takes. */
+    SSMSGREG_READ_ACK_DATA,
+
+    SSMSGREG_FOCUS_REQ_END = SSMSGREG_LABEL0,
+
+    SSMSGREG_FOCUS_ACK_END = SSMSGREG_LABEL0
 };
 
+/* Most bytes of input returned by one FUNC_READ_REQ. */
+#define SERIAL_SERVER_READ_MAX_LEN \
+    ((seL4_MsgMaxLength - SSMSGREG_READ_ACK_DATA) * sizeof(seL4_Word))
+
+/* Data that a client has written, and the server has acked but not yet
+ * written out. Also used for input that no client has read yet. Only touched
+ * by the server thread.
+ */
+typedef struct serial_server_queue {
+    char *buff;
+    /* The client's quota. 0 if the client's writes are not buffered. */
+    size_t size;
+    size_t head;
+    size_t len;
+} serial_server_queue_t;
+
 /* Per-client context maintained by the server. */
 typedef struct _serial_server_registry_entry {
     seL4_Word badge_value;
     volatile char *shmem;
     seL4_CPtr *shmem_frame_caps;
     size_t shmem_size;
+    /* Non-NULL if the client connected in ring mode. ring_size is the size
+     * of the ring's data, as computed by the server.
+     */
+    serial_server_ring_t *ring;
+    size_t ring_size;
+    serial_server_queue_t queue;
+    /* Frames of a multi-page shmem window received so far, see
+     * FUNC_SHMEM_FRAME_REQ.
+     */
+    seL4_CPtr *staged_frame_caps;
+    size_t n_staged_frames;
+    size_t staged_shmem_size;
+    /* Notification the client waits on for input, if it has made a blocking
+     * read, and whether it is waiting on it now.
+     */
+    seL4_CPtr rx_ntfn;
+    bool rx_waiting;
 } serial_server_registry_entry_t;
 
-/* State maintained by the server. */
+/* State maintained by the server. There is one of these per instance, and
+ * each instance has its own thread, Endpoint and badge space.
+ */
 typedef struct _serial_server_context {
+    int instance;
+    /* Set once the instance is running, and only cleared by the server thread
+     * when it has been torn down after a kill.
+     */
+    bool spawned;
+    /* Set while a killed instance tears itself down. */
+    bool dying;
+    seL4_Word core;
+    /* NULL if the instance drives the platform console. */
+    ps_chardevice_t *device;
+    /* False if another instance already reads the same device. */
+    bool reads_device;
+
     simple_t *server_simple;
     vka_t *server_vka;
     seL4_CPtr server_cspace;
@@ -120,28 +284,68 @@ typedef struct _serial_server_context {
     vka_object_t server_ep_obj;
     size_t shmem_max_size, shmem_max_n_pages;
 
+    /* Allocated once at spawn time with SERIAL_SERVER_MAX_CLIENTS entries, as
+     * the server thread walks it while the parent allocates badges.
+     */
     int registry_n_entries;
     serial_server_registry_entry_t *registry;
 
     seL4_Word parent_badge_value;
     cspacepath_t _badged_server_ep_cspath;
+
+    /* Bound to server_thread, and handed out to ring clients as a cap badged
+     * with SERIAL_SERVER_RING_NTFN_BADGE.
+     */
+    vka_object_t ring_ntfn_obj;
+    cspacepath_t _badged_ring_ntfn_cspath;
+
+    /* Size of the write-back queue given to each new client. */
+    size_t client_quota;
+    /* Set when a ring client has signalled, until all rings are empty. */
+    bool rings_pending;
+    /* Client whose colour the output is currently in. */
+    seL4_Word output_badge_value;
+
+    /* Input that has not been read yet, and the client it goes to. rx.size
+     * is 0 if the device can't be read.
+     */
+    serial_server_queue_t rx;
+    seL4_Word focus_badge_value;
+    /* Delivers the device's IRQs on ring_ntfn_obj. rx_irq_driven is false if
+     * no IRQ could be registered, in which case input is polled for.
+     */
+    ps_irq_ops_t rx_irq_ops;
+    ps_malloc_ops_t rx_malloc_ops;
+    bool rx_irq_driven;
+    serial_server_stats_t stats;
 } serial_server_context_t;
 
-/* Global server instance accessor functions. */
+/** Returns an instance's context, whether or not it has been spawned.
+ * @return NULL if instance is out of range.
+ */
+serial_server_context_t *serial_server_get_instance(int instance);
+
+/** Returns the context of the instance that the calling Server thread runs.
+ * Only valid on a Server thread.
+ */
 serial_server_context_t *get_serial_server(void);
 
 /** Internal library function: acts as the main() for the server thread.
+ * @param server The instance that the thread runs.
  */
-void serial_server_main(void);
+void serial_server_main(serial_server_context_t *server);
 
-serial_server_registry_entry_t *serial_server_registry_get_entry_by_badge(seL4_Word badge_value);
+serial_server_registry_entry_t *serial_server_registry_get_entry_by_badge(serial_server_context_t *server,
+                                                                         seL4_Word badge_value);
 
 /** Determines whether or not a badge value has been reserved and given out.
+ * @param server The instance whose badge space the badge value is in.
  * @param badge_value The badge value in question.
  * @return True only if the badge value has been given out.
  *         False if the badge value is invalid, or hasn't been given out.
  */
-bool serial_server_badge_is_allocated(seL4_Word badge_value);
+bool serial_server_badge_is_allocated(serial_server_context_t *server,
+                                      seL4_Word badge_value);
 
 /** Returns an unused, unique badge value to the caller, and will NOT attempt
  * to resize the pool of available badge values to fulfill the request.
@@ -149,20 +353,24 @@ bool serial_server_badge_is_allocated(seL4_Word badge_value);
  * The server maintains a list of badge values, so it can also be used to
  * allocate and ration out badge values.
  *
+ * @param server The instance to allocate from.
  * @return Returns a positive integer GREATER THAN 0 if successful.
  *         Returns 0 if unsuccessful.
  */
-seL4_Word serial_server_badge_value_get_unused(void);
+seL4_Word serial_server_badge_value_get_unused(serial_server_context_t *server);
 
 /** Returns a new, unique badge value to the caller, and WILL allocate new
  * badge values to satisfy the request.
  *
+ * @param server The instance to allocate from.
  * @return Returns a positive integer GREATER THAN 0 if successful.
  *         Returns 0 if unsuccessful.
  */
-seL4_Word serial_server_badge_value_alloc(void);
+seL4_Word serial_server_badge_value_alloc(serial_server_context_t *server);
 
 /** Returns a badge value to the pool of available badge values.
+ * @param server The instance the badge value was allocated from.
  * @param badge_value The badge value to free.
  */
-void serial_server_badge_value_free(seL4_Word badge_value);
+void serial_server_badge_value_free(serial_server_context_t *server,
+                                    seL4_Word badge_value);
@@ -8,6 +8,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include <sel4/sel4.h>
 #include <vka/vka.h>
@@ -19,13 +20,18 @@
 #include <sel4utils/api.h>
 #include <sel4utils/strerror.h>
 #include <sel4platsupport/platsupport.h>
+#include <sel4platsupport/io.h>
+#include <sel4platsupport/irq.h>
 
 #include "serial_server.h"
 #include <serial_server/client.h>
 #include <serial_server/parent.h>
 
-/* Define global instance. */
-static serial_server_context_t serial_server;
+/* Every instance that can be spawned, and the one that the calling Server
+ * thread runs.
+ */
+static serial_server_context_t serial_servers[SERIAL_SERVER_MAX_INSTANCES];
+static __thread serial_server_context_t *serial_server;
 
 static char *colors[] = {
     ANSI_COLOR(RED),
@@ -60,9 +66,17 @@ static char *colors[] = {
 #define NUM_COLORS ARRAY_SIZE(colors)
 #define BADGE_TO_COLOR(badge) (colors[(badge) % NUM_COLORS])
 
+serial_server_context_t *serial_server_get_instance(int instance)
+{
+    if (instance < 0 || instance >= SERIAL_SERVER_MAX_INSTANCES) {
+        return NULL;
+    }
+    return &serial_servers[instance];
+}
+
 serial_server_context_t *get_serial_server(void)
 {
-    return &serial_server;
+    return serial_server;
 }
 
 static inline seL4_MessageInfo_t recv(seL4_Word *sender_badge)
@@ -70,32 +84,38 @@ static inline seL4_MessageInfo_t recv(seL4_Word *sender_badge)
     return api_recv(get_serial_server()->server_ep_obj.cptr, sender_badge, get_serial_server()->server_thread.reply.cptr);
 }
 
+static inline seL4_MessageInfo_t nbrecv(seL4_Word *sender_badge)
+{
+    return api_nbrecv(get_serial_server()->server_ep_obj.cptr, sender_badge, get_serial_server()->server_thread.reply.cptr);
+}
+
 static inline void reply(seL4_MessageInfo_t tag)
 {
     api_reply(get_serial_server()->server_thread.reply.cptr, tag);
 }
 
-serial_server_registry_entry_t *serial_server_registry_get_entry_by_badge(seL4_Word badge_value)
+serial_server_registry_entry_t *serial_server_registry_get_entry_by_badge(serial_server_context_t *server,
+                                                                         seL4_Word badge_value)
 {
     if (badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY
-        || get_serial_server()->registry == NULL
-        || badge_value > get_serial_server()->registry_n_entries) {
+        || server->registry == NULL
+        || badge_value > server->registry_n_entries) {
         return NULL;
     }
     /* If the badge value has been released, return NULL. */
-    if (get_serial_server()->registry[badge_value - 1].badge_value
+    if (server->registry[badge_value - 1].badge_value
         == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
         return NULL;
     }
 
-    return &get_serial_server()->registry[badge_value - 1];
+    return &server->registry[badge_value - 1];
 }
 
-bool serial_server_badge_is_allocated(seL4_Word badge_value)
+bool serial_server_badge_is_allocated(serial_server_context_t *server, seL4_Word badge_value)
 {
     serial_server_registry_entry_t *tmp;
 
-    tmp = serial_server_registry_get_entry_by_badge(badge_value);
+    tmp = serial_server_registry_get_entry_by_badge(server, badge_value);
     if (tmp == NULL) {
         return false;
     }
@@ -103,59 +123,44 @@ bool serial_server_badge_is_allocated(seL4_Word badge_value)
     return tmp->badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY;
 }
 
-seL4_Word serial_server_badge_value_get_unused(void)
+seL4_Word serial_server_badge_value_get_unused(serial_server_context_t *server)
 {
-    if (get_serial_server()->registry == NULL) {
+    if (server->registry == NULL) {
         return SERIAL_SERVER_BADGE_VALUE_EMPTY;
     }
 
-    for (int i = 0; i < get_serial_server()->registry_n_entries; i++) {
-        if (get_serial_server()->registry[i].badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+    for (int i = 0; i < server->registry_n_entries; i++) {
+        if (server->registry[i].badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
             continue;
         }
 
         /* Badge value 0 will never be allocated, so index 0 is actually
          * badge 1, and index 1 is badge 2, and so on ad infinitum.
          */
-        get_serial_server()->registry[i].badge_value = i + 1;
-        return get_serial_server()->registry[i].badge_value;
+        memset(&server->registry[i], 0,
+               sizeof(server->registry[i]));
+        /* The server thread may see the entry as soon as the badge is set. */
+        __atomic_store_n(&server->registry[i].badge_value, i + 1, __ATOMIC_RELEASE);
+        return server->registry[i].badge_value;
     }
 
     return SERIAL_SERVER_BADGE_VALUE_EMPTY;
 }
 
-seL4_Word serial_server_badge_value_alloc(void)
+seL4_Word serial_server_badge_value_alloc(serial_server_context_t *server)
 {
-    serial_server_registry_entry_t *tmp;
     seL4_Word ret;
 
-    ret = serial_server_badge_value_get_unused();
-    if (ret != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
-        /* Success */
-        return ret;
+    /* The registry is never resized: the server thread may be walking it. */
+    ret = serial_server_badge_value_get_unused(server);
+    if (ret == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+        ZF_LOGD(SERSERVS"badge_value_alloc: All %d badges in use.",
+                server->registry_n_entries);
     }
-
-    tmp = realloc(get_serial_server()->registry,
-                  sizeof(*get_serial_server()->registry)
-                  * (get_serial_server()->registry_n_entries + 1));
-    if (tmp == NULL) {
-        ZF_LOGD(SERSERVS"badge_value_alloc: Failed resize pool.");
-        return SERIAL_SERVER_BADGE_VALUE_EMPTY;
-    }
-
-    get_serial_server()->registry = tmp;
-    get_serial_server()->registry[get_serial_server()->registry_n_entries].badge_value =
-        SERIAL_SERVER_BADGE_VALUE_EMPTY;
-    get_serial_server()->registry_n_entries++;
-
-    /* If it fails again (some other caller raced us and got the new ID before
-     * we did) that's tough luck -- the caller should probably look into
-     * serializing the calls.
-     */
-    return serial_server_badge_value_get_unused();
+    return ret;
 }
 
-void serial_server_badge_value_free(seL4_Word badge_value)
+void serial_server_badge_value_free(serial_server_context_t *server, seL4_Word badge_value)
 {
     serial_server_registry_entry_t *tmp;
 
@@ -163,7 +168,7 @@ void serial_server_badge_value_free(seL4_Word badge_value)
         return;
     }
 
-    tmp = serial_server_registry_get_entry_by_badge(badge_value);
+    tmp = serial_server_registry_get_entry_by_badge(server, badge_value);
     if (tmp == NULL) {
         return;
     }
@@ -177,7 +182,7 @@ static void serial_server_registry_insert(seL4_Word badge_value, void *shmem,
 {
     serial_server_registry_entry_t *tmp;
 
-    tmp = serial_server_registry_get_entry_by_badge(badge_value);
+    tmp = serial_server_registry_get_entry_by_badge(get_serial_server(), badge_value);
     /* If this is NULL, something went very wrong, because this function is only
      * called after the server checks to ensure that the badge value has been
      * allocated in the registry. Technically, this should never happen, but
@@ -189,17 +194,20 @@ static void serial_server_registry_insert(seL4_Word badge_value, void *shmem,
     tmp->shmem = shmem;
     tmp->shmem_size = shmem_size;
     tmp->shmem_frame_caps = shmem_frame_caps;
+    tmp->ring = NULL;
+    tmp->ring_size = 0;
+    memset(&tmp->queue, 0, sizeof(tmp->queue));
 }
 
 static void serial_server_registry_remove(seL4_Word badge_value)
 {
     serial_server_registry_entry_t *tmp;
 
-    tmp = serial_server_registry_get_entry_by_badge(badge_value);
+    tmp = serial_server_registry_get_entry_by_badge(get_serial_server(), badge_value);
     if (tmp == NULL) {
         return;
     }
-    serial_server_badge_value_free(badge_value);
+    serial_server_badge_value_free(get_serial_server(), badge_value);
 }
 
 static void serial_server_set_frame_recv_path(void)
@@ -209,45 +217,90 @@ static void serial_server_set_frame_recv_path(void)
                            get_serial_server()->frame_cap_recv_cspaths[0].capDepth);
 }
 
-/** Processes all FUNC_CONNECT_REQ IPC messages. Establishes
- * shared mem mappings with new clients and sets up book-keeping metadata.
- *
- * Clients calling connect() will pass us a list of Frame caps which we must
- * map in order to establish shared mem with those clients. In this function,
- * the library maps the client's frames into the server's VSpace.
+/** Deletes and frees a list of Frame caps received from a client.
  */
-seL4_Error serial_server_func_connect(seL4_MessageInfo_t tag,
-                                      seL4_Word client_badge_value,
-                                      size_t client_shmem_size)
+static void serial_server_free_frame_caps(seL4_CPtr *frame_caps, size_t n_caps)
+{
+    cspacepath_t frame_cspath;
+
+    for (size_t i = 0; i < n_caps; i++) {
+        /* The lists are alloc'd with calloc, so we can depend on unused slots
+         * being filled with 0s. Break on first unallocated.
+         */
+        if (frame_caps[i] == 0) {
+            break;
+        }
+        vka_cspace_make_path(get_serial_server()->server_vka, frame_caps[i],
+                             &frame_cspath);
+        vka_cnode_delete(&frame_cspath);
+        vka_cspace_free_path(get_serial_server()->server_vka, frame_cspath);
+    }
+}
+
+/** Drops the Frames a client has sent ahead of a connect or resize request.
+ */
+static void serial_server_unstage_frames(serial_server_registry_entry_t *client_data)
+{
+    if (client_data->staged_frame_caps == NULL) {
+        return;
+    }
+    serial_server_free_frame_caps(client_data->staged_frame_caps,
+                                  client_data->n_staged_frames);
+    free(client_data->staged_frame_caps);
+    client_data->staged_frame_caps = NULL;
+    client_data->n_staged_frames = 0;
+    client_data->staged_shmem_size = 0;
+}
+
+/** Moves the cap that a client sent us out of the receive slot, or else
+ * it would be overwritten by the next message.
+ */
+static seL4_Error serial_server_take_cap(seL4_Word client_badge_value,
+                                         seL4_CPtr *cap)
 {
     seL4_Error error;
-    size_t client_shmem_n_pages;
-    void *shmem_tmp = NULL;
-    seL4_CPtr *client_frame_caps = NULL;
-    cspacepath_t client_frame_cspath_tmp;
+    cspacepath_t client_cspath_tmp;
+
+    /* Make a copy of the frame before we zero-out the receive slot, or else
+     * when we delete the receive slot, the frame will be revoked and unmapped.
+     */
+    error = vka_cspace_alloc_path(get_serial_server()->server_vka,
+                                  &client_cspath_tmp);
+    if (error != 0) {
+        ZF_LOGE(SERSERVS"connect: Failed to alloc CSpace slot for cap "
+                "received from client badge %lx.", (long)client_badge_value);
+        return error;
+    }
+
+    error = vka_cnode_move(&client_cspath_tmp,
+                           &get_serial_server()->frame_cap_recv_cspaths[0]);
+    if (error != 0) {
+        ZF_LOGE(SERSERVS"connect: Failed to move cap received "
+                " from client badge %lx.", (long)client_badge_value);
+        vka_cspace_free_path(get_serial_server()->server_vka,
+                             client_cspath_tmp);
+        return error;
+    }
+
+    *cap = client_cspath_tmp.capPtr;
+    ZF_LOGD("connect: moved received client cap from recv slot %"PRIxPTR" to slot %"PRIxPTR".",
+            get_serial_server()->frame_cap_recv_cspaths[0].capPtr, *cap);
+    return seL4_NoError;
+}
 
+/** Checks a shmem window size that a client asks for.
+ */
+static seL4_Error serial_server_check_shmem_size(seL4_Word client_badge_value,
+                                                 size_t client_shmem_size)
+{
     if (client_shmem_size == 0) {
         ZF_LOGW(SERSERVS"connect: Invalid shared mem window size of 0B.\n");
         return seL4_InvalidArgument;
     }
-
-    client_shmem_n_pages = BYTES_TO_4K_PAGES(client_shmem_size);
-    /* The client should be allocated a badge value by the Parent, before it
-     * attempts to connect to the Server.
-     *
-     * The reason being that when the badge is allocated, the metadata array
-     * is resized as well, so badge allocation is also metadata allocation.
-     */
-    if (client_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY
-        || !serial_server_badge_is_allocated(client_badge_value)) {
-        ZF_LOGW(SERSERVS"connect: Please allocate a badge value to this new "
-                "client.\n");
-        return -1;
-    }
     /* Make sure that the client didn't request a shmem mapping larger than the
      * server is willing to handle.
      */
-    if (client_shmem_n_pages > BYTES_TO_4K_PAGES(get_serial_server()->shmem_max_size)) {
+    if (BYTES_TO_4K_PAGES(client_shmem_size) > get_serial_server()->shmem_max_n_pages) {
         /* If the client asks for a shmem mapping too large, we refuse, and
          * send the value of shmem_max_size in SSMSGREG_RESPONSE
          * so it can try again.
@@ -259,14 +312,99 @@ seL4_Error serial_server_func_connect(seL4_MessageInfo_t tag,
                 get_serial_server()->shmem_max_size);
         return (seL4_Error) SERIAL_SERVER_ERROR_SHMEM_TOO_LARGE;
     }
+    return seL4_NoError;
+}
+
+/** Processes all FUNC_SHMEM_FRAME_REQ IPC messages.
+ *
+ * A message can only carry one cap into our CSpace, so a client with a shmem
+ * window of several pages sends all but the last of its Frames in messages of
+ * their own, in order, before the connect or resize request. We hold on to
+ * them here until that request arrives.
+ */
+static seL4_Error serial_server_func_shmem_frame(seL4_MessageInfo_t tag,
+                                                 serial_server_registry_entry_t *client_data,
+                                                 size_t client_shmem_size,
+                                                 size_t index)
+{
+    seL4_Error error;
+    size_t client_shmem_n_pages;
+
+    error = serial_server_check_shmem_size(client_data->badge_value,
+                                           client_shmem_size);
+    if (error != seL4_NoError) {
+        serial_server_unstage_frames(client_data);
+        return error;
+    }
+    client_shmem_n_pages = BYTES_TO_4K_PAGES(client_shmem_size);
+
+    if (index == 0) {
+        /* Start over, in case an earlier attempt was abandoned. */
+        serial_server_unstage_frames(client_data);
+        client_data->staged_frame_caps = calloc(client_shmem_n_pages, sizeof(seL4_CPtr));
+        if (client_data->staged_frame_caps == NULL) {
+            ZF_LOGE(SERSERVS"connect: Failed to alloc frame cap list for client "
+                    "shmem.");
+            return seL4_NotEnoughMemory;
+        }
+        client_data->staged_shmem_size = client_shmem_size;
+    }
+
+    if (seL4_MessageInfo_get_extraCaps(tag) != 1
+        || client_data->staged_frame_caps == NULL
+        || client_data->staged_shmem_size != client_shmem_size
+        || index != client_data->n_staged_frames
+        || index + 1 >= client_shmem_n_pages) {
+        ZF_LOGW(SERSERVS"connect: Unexpected Frame %zd of a %zdB shmem window "
+                "from client badge %x.",
+                index, client_shmem_size, client_data->badge_value);
+        serial_server_unstage_frames(client_data);
+        return seL4_InvalidArgument;
+    }
+
+    error = serial_server_take_cap(client_data->badge_value,
+                                   &client_data->staged_frame_caps[index]);
+    if (error != seL4_NoError) {
+        serial_server_unstage_frames(client_data);
+        return error;
+    }
+    client_data->n_staged_frames++;
+    return seL4_NoError;
+}
+
+/** Maps a shmem window that a client has sent us into our VSpace. The last
+ * Frame of the window comes with the request itself, the others must have
+ * been sent ahead with FUNC_SHMEM_FRAME_REQ.
+ *
+ * @param shmem [out] The window.
+ * @param frame_caps [out] Our copies of the Frame caps of the window.
+ */
+static seL4_Error serial_server_shmem_map(seL4_MessageInfo_t tag,
+                                          serial_server_registry_entry_t *client_data,
+                                          size_t client_shmem_size,
+                                          void **shmem, seL4_CPtr **frame_caps)
+{
+    seL4_Error error;
+    size_t client_shmem_n_pages;
+    seL4_CPtr *client_frame_caps;
+
+    error = serial_server_check_shmem_size(client_data->badge_value,
+                                           client_shmem_size);
+    if (error != seL4_NoError) {
+        goto out;
+    }
+    client_shmem_n_pages = BYTES_TO_4K_PAGES(client_shmem_size);
 
-    if (seL4_MessageInfo_get_extraCaps(tag) != client_shmem_n_pages) {
+    if (seL4_MessageInfo_get_extraCaps(tag) != 1
+        || client_data->n_staged_frames != client_shmem_n_pages - 1
+        || (client_shmem_n_pages > 1 && client_data->staged_shmem_size != client_shmem_size)) {
         ZF_LOGW(SERSERVS"connect: Received %d Frame caps from client "
                 "badge %x.\n\tbut client requested shmem mapping of %d "
                 "frames. Possible cap transfer error.",
-                seL4_MessageInfo_get_extraCaps(tag), client_badge_value,
-                client_shmem_n_pages);
-        return seL4_InvalidCapability;
+                client_data->n_staged_frames + seL4_MessageInfo_get_extraCaps(tag),
+                client_data->badge_value, client_shmem_n_pages);
+        error = seL4_InvalidCapability;
+        goto out;
     }
 
     /* Prepare an array of the client's shmem Frame caps to be mapped into our
@@ -276,116 +414,709 @@ seL4_Error serial_server_func_connect(seL4_MessageInfo_t tag,
     if (client_frame_caps == NULL) {
         ZF_LOGE(SERSERVS"connect: Failed to alloc frame cap list for client "
                 "shmem.");
-        return seL4_NotEnoughMemory;
+        error = seL4_NotEnoughMemory;
+        goto out;
+    }
+    if (client_data->n_staged_frames != 0) {
+        memcpy(client_frame_caps, client_data->staged_frame_caps,
+               client_data->n_staged_frames * sizeof(seL4_CPtr));
+        free(client_data->staged_frame_caps);
+        client_data->staged_frame_caps = NULL;
+        client_data->n_staged_frames = 0;
+        client_data->staged_shmem_size = 0;
     }
-    for (size_t i = 0; i < client_shmem_n_pages; i++) {
-        /* For each frame, we need to make an seL4_CNode_Copy of it before
-         * we zero-out the receive slots, or else when we delete the receive
-         * slots, the frames will be revoked and unmapped.
-         */
-        error = vka_cspace_alloc_path(get_serial_server()->server_vka,
-                                      &client_frame_cspath_tmp);
-        if (error != 0) {
-            ZF_LOGE(SERSERVS"connect: Failed to alloc CSpace slot for frame "
-                    "%zd of %zd received from client badge %lx.",
-                    i + 1, client_shmem_n_pages, (long)client_badge_value);
-            goto out;
-        }
-
-        /* Copy the frame cap from the recv slot to the perm slot now. */
-        error = vka_cnode_move(&client_frame_cspath_tmp,
-                               &get_serial_server()->frame_cap_recv_cspaths[i]);
-        if (error != 0) {
-            ZF_LOGE(SERSERVS"connect: Failed to move %zuth frame-cap received "
-                    " from client badge %lx.", i + 1, (long)client_badge_value);
-            goto out;
-        }
 
-        client_frame_caps[i] = client_frame_cspath_tmp.capPtr;
-        ZF_LOGD("connect: moved received client Frame cap %d from recv slot %"PRIxPTR" to slot %"PRIxPTR".",
-                i + 1, get_serial_server()->frame_cap_recv_cspaths[i].capPtr,
-                client_frame_caps[i]);
+    error = serial_server_take_cap(client_data->badge_value,
+                                   &client_frame_caps[client_shmem_n_pages - 1]);
+    if (error != seL4_NoError) {
+        goto free_caps;
     }
 
     /* Map the frames into the vspace. */
-    shmem_tmp = vspace_map_pages(get_serial_server()->server_vspace, client_frame_caps,
-                                 NULL,
-                                 seL4_AllRights, client_shmem_n_pages,
-                                 seL4_PageBits,
-                                 true);
-    if (shmem_tmp == NULL) {
+    *shmem = vspace_map_pages(get_serial_server()->server_vspace, client_frame_caps,
+                              NULL,
+                              seL4_AllRights, client_shmem_n_pages,
+                              seL4_PageBits,
+                              true);
+    if (*shmem == NULL) {
         ZF_LOGE(SERSERVS"connect: Failed to map shmem.");
         error = seL4_NotEnoughMemory;
-        goto out;
+        goto free_caps;
+    }
+
+    *frame_caps = client_frame_caps;
+    return seL4_NoError;
+
+free_caps:
+    serial_server_free_frame_caps(client_frame_caps, client_shmem_n_pages);
+    free(client_frame_caps);
+out:
+    serial_server_unstage_frames(client_data);
+    return error;
+}
+
+/** Processes all FUNC_CONNECT_REQ IPC messages. Establishes
+ * shared mem mappings with new clients and sets up book-keeping metadata.
+ *
+ * Clients calling connect() will pass us a list of Frame caps which we must
+ * map in order to establish shared mem with those clients. In this function,
+ * the library maps the client's frames into the server's VSpace.
+ */
+seL4_Error serial_server_func_connect(seL4_MessageInfo_t tag,
+                                      seL4_Word client_badge_value,
+                                      size_t client_shmem_size)
+{
+    seL4_Error error;
+    void *shmem_tmp;
+    seL4_CPtr *client_frame_caps;
+
+    /* The client should be allocated a badge value by the Parent, before it
+     * attempts to connect to the Server.
+     *
+     * The reason being that when the badge is allocated, the metadata array
+     * is resized as well, so badge allocation is also metadata allocation.
+     */
+    if (client_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY
+        || !serial_server_badge_is_allocated(get_serial_server(), client_badge_value)) {
+        ZF_LOGW(SERSERVS"connect: Please allocate a badge value to this new "
+                "client.\n");
+        return -1;
+    }
+
+    error = serial_server_shmem_map(tag,
+                                    serial_server_registry_get_entry_by_badge(get_serial_server(),
+                                                                              client_badge_value),
+                                    client_shmem_size, &shmem_tmp,
+                                    &client_frame_caps);
+    if (error != seL4_NoError) {
+        return error;
     }
 
     serial_server_registry_insert(client_badge_value, shmem_tmp,
                                   client_frame_caps, client_shmem_size);
 
     ZF_LOGI(SERSERVS"connect: New client: badge %x, shmem %p, %d pages.",
-            client_badge_value, shmem_tmp, client_shmem_n_pages);
+            client_badge_value, shmem_tmp, BYTES_TO_4K_PAGES(client_shmem_size));
 
     return seL4_NoError;
+}
 
-out:
-    if (shmem_tmp != NULL) {
-        vspace_unmap_pages(get_serial_server()->server_vspace, shmem_tmp,
-                           client_shmem_n_pages, seL4_PageBits,
-                           VSPACE_PRESERVE);
+/** Returns the device that this instance drives. */
+static ps_chardevice_t *serial_server_device(void)
+{
+    if (get_serial_server()->device != NULL) {
+        return get_serial_server()->device;
     }
+    return platsupport_serial_get_console();
+}
 
-    if (client_frame_caps != NULL) {
-        for (size_t i = 0; i < client_shmem_n_pages; i++) {
-            /* Because client_frame_caps was alloc'd with calloc, we can depend on
-             * the unused slots being filled with 0s. Break on first unallocated.
-             */
-            if (client_frame_caps[i] == 0) {
-                break;
+/** Writes a buffer out to the device. Output to the platform console goes
+ * through libc, like everything else that is printed to it.
+ */
+static void serial_server_puts(volatile const char *buff, size_t len)
+{
+    ps_chardevice_t *device = get_serial_server()->device;
+    ssize_t ret;
+
+    if (device == NULL) {
+        fwrite((void *)buff, len, 1, stdout);
+        return;
+    }
+    while (len != 0) {
+        ret = ps_cdev_write(device, (void *)buff, len, NULL, NULL);
+        if (ret <= 0) {
+            ZF_LOGW(SERSERVS"output: Device write failed, dropping %zdB.", len);
+            return;
+        }
+        buff += ret;
+        len -= ret;
+    }
+}
+
+/** Writes out a buffer of data on behalf of a client.
+ *
+ * If the buffer wraps around the end of a ring, the second part is passed in
+ * buff2, otherwise len2 is 0. The colour is only switched when the output
+ * moves on to a different client, and is reset by serial_server_output_idle().
+ */
+static void serial_server_output(seL4_Word badge_value,
+                                 volatile char *buff, size_t len,
+                                 volatile char *buff2, size_t len2)
+{
+    if (config_set(CONFIG_SERIAL_SERVER_COLOURED_OUTPUT)
+        && badge_value != get_serial_server()->output_badge_value) {
+        serial_server_puts(COLOR_RESET, strlen(COLOR_RESET));
+        serial_server_puts(BADGE_TO_COLOR(badge_value),
+                           strlen(BADGE_TO_COLOR(badge_value)));
+        get_serial_server()->output_badge_value = badge_value;
+    }
+    serial_server_puts(buff, len);
+    if (len2 != 0) {
+        serial_server_puts(buff2, len2);
+    }
+    get_serial_server()->stats.bytes_written += len + len2;
+}
+
+/** Called when there is nothing left to write out. */
+static void serial_server_output_idle(void)
+{
+    if (config_set(CONFIG_SERIAL_SERVER_COLOURED_OUTPUT)
+        && get_serial_server()->output_badge_value != SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+        serial_server_puts(COLOR_RESET, strlen(COLOR_RESET));
+        get_serial_server()->output_badge_value = SERIAL_SERVER_BADGE_VALUE_EMPTY;
+    }
+}
+
+static bool serial_server_output_pending(void)
+{
+    return get_serial_server()->rings_pending
+           || get_serial_server()->stats.queue_depth != 0;
+}
+
+/** Gives a client a write-back queue of client_quota bytes. If that fails, or
+ * the quota is 0, the client's writes are written out before they are acked.
+ */
+static void serial_server_queue_init(serial_server_registry_entry_t *client_data)
+{
+    size_t quota = get_serial_server()->client_quota;
+
+    memset(&client_data->queue, 0, sizeof(client_data->queue));
+    if (quota == 0) {
+        return;
+    }
+
+    client_data->queue.buff = malloc(quota);
+    if (client_data->queue.buff == NULL) {
+        ZF_LOGW(SERSERVS"connect: Failed to alloc write-back queue for client "
+                "badge %x. Its writes will not be buffered.",
+                client_data->badge_value);
+        return;
+    }
+    client_data->queue.size = quota;
+}
+
+/** Appends as much of a client's data to its queue as its quota allows.
+ *
+ * @return The number of bytes queued.
+ */
+static size_t serial_server_queue_push(serial_server_queue_t *queue,
+                                       volatile char *data, size_t len)
+{
+    size_t tail, first;
+
+    len = MIN(len, queue->size - queue->len);
+    tail = (queue->head + queue->len) % queue->size;
+    first = MIN(len, queue->size - tail);
+    memcpy(&queue->buff[tail], (void *)data, first);
+    memcpy(queue->buff, (void *)(data + first), len - first);
+    queue->len += len;
+
+    get_serial_server()->stats.queue_depth += len;
+    get_serial_server()->stats.max_queue_depth = MAX(get_serial_server()->stats.max_queue_depth,
+                                                     get_serial_server()->stats.queue_depth);
+    return len;
+}
+
+/** Writes out up to max_len bytes from the front of a client's queue.
+ *
+ * @return The number of bytes written out.
+ */
+static size_t serial_server_queue_drain(serial_server_registry_entry_t *client_data,
+                                        size_t max_len)
+{
+    serial_server_queue_t *queue = &client_data->queue;
+    size_t len, first;
+
+    len = MIN(queue->len, max_len);
+    if (len == 0) {
+        return 0;
+    }
+    first = MIN(len, queue->size - queue->head);
+    serial_server_output(client_data->badge_value, &queue->buff[queue->head],
+                         first, queue->buff, len - first);
+
+    queue->head = (queue->head + len) % queue->size;
+    queue->len -= len;
+    get_serial_server()->stats.queue_depth -= len;
+    return len;
+}
+
+/** Writes out up to max_len bytes of what a ring client has appended to its
+ * ring.
+ *
+ * @return The number of bytes written out. If this is 0, the client is
+ *         guaranteed to signal the server when it next appends to the ring.
+ */
+static size_t serial_server_ring_drain(serial_server_registry_entry_t *client_data,
+                                       size_t max_len)
+{
+    serial_server_ring_t *ring = client_data->ring;
+    uint32_t head, tail;
+    size_t len, len2 = 0;
+
+    /* We are the only writer of head. */
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (tail == head) {
+        return 0;
+    }
+    if (tail >= client_data->ring_size || head >= client_data->ring_size) {
+        /* Don't trust the client with our address space. */
+        ZF_LOGW(SERSERVS"drain: Client badge %x has a corrupt ring "
+                "(head %u, tail %u). Ignoring.",
+                client_data->badge_value, head, tail);
+        return 0;
+    }
+
+    if (tail > head) {
+        len = MIN(tail - head, max_len);
+    } else {
+        len = MIN(client_data->ring_size - head, max_len);
+        len2 = MIN(tail, max_len - len);
+    }
+    serial_server_output(client_data->badge_value, &ring->data[head], len,
+                         ring->data, len2);
+
+    head = (head + len + len2) % client_data->ring_size;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    /* Order the store of head before the next load of tail. Pairs with the
+     * fence in serial_server_ring_publish.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return len + len2;
+}
+
+/** Writes out up to SERIAL_SERVER_DRAIN_CHUNK bytes for every client that has
+ * data waiting, either in its write-back queue or in its ring, taking the
+ * clients in turn so that output from different clients is interleaved
+ * fairly.
+ *
+ * @return The number of bytes written out. If this is 0, nothing is waiting.
+ */
+static size_t serial_server_drain_step(void)
+{
+    size_t pass = 0;
+
+    for (int i = 0; i < get_serial_server()->registry_n_entries; i++) {
+        serial_server_registry_entry_t *curr = &get_serial_server()->registry[i];
+
+        if (curr->badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+            continue;
+        }
+        if (curr->ring != NULL) {
+            if (get_serial_server()->rings_pending) {
+                pass += serial_server_ring_drain(curr, SERIAL_SERVER_DRAIN_CHUNK);
             }
-            client_frame_cspath_tmp.capPtr = client_frame_caps[i];
-            vka_cspace_free_path(get_serial_server()->server_vka,
-                                 client_frame_cspath_tmp);
+        } else if (curr->queue.len != 0) {
+            pass += serial_server_queue_drain(curr, SERIAL_SERVER_DRAIN_CHUNK);
         }
     }
 
-    free(client_frame_caps);
-    return error;
+    /* Every ring came up empty, so each ring client will signal us again. */
+    if (pass == 0) {
+        get_serial_server()->rings_pending = false;
+    }
+    return pass;
+}
+
+/** Writes out everything that is waiting to be written out.
+ *
+ * @return The number of bytes written out.
+ */
+static size_t serial_server_drain_all(void)
+{
+    size_t total = 0, pass;
+
+    get_serial_server()->rings_pending = true;
+    do {
+        pass = serial_server_drain_step();
+        total += pass;
+    } while (pass != 0);
+
+    return total;
 }
 
 static int serial_server_func_write(serial_server_registry_entry_t *client_data,
                                     size_t message_len, size_t *bytes_written)
 {
+    size_t queued;
+
     *bytes_written = 0;
 
     if (client_data == NULL || bytes_written == NULL) {
         ZF_LOGE(SERSERVS"printf: Got NULL for required argument.");
         return seL4_InvalidArgument;
     }
+    if (client_data->ring != NULL) {
+        /* The shmem of a ring client is not a flat buffer. */
+        return seL4_IllegalOperation;
+    }
     if (message_len > client_data->shmem_size) {
         return seL4_RangeError;
     }
 
-    /* Write out */
-    if (config_set(CONFIG_SERIAL_SERVER_COLOURED_OUTPUT)) {
-        printf("%s", COLOR_RESET);
-        printf("%s", BADGE_TO_COLOR(client_data->badge_value));
+    if (client_data->queue.size == 0) {
+        /* Write-through */
+        serial_server_output(client_data->badge_value, client_data->shmem,
+                             message_len, NULL, 0);
+        *bytes_written = message_len;
+        return 0;
     }
-    fwrite((void *)client_data->shmem, message_len, 1, stdout);
-    if (config_set(CONFIG_SERIAL_SERVER_COLOURED_OUTPUT)) {
-        printf("%s", COLOR_RESET);
+
+    /* Write-back: the client is acked as soon as its data is queued. */
+    queued = serial_server_queue_push(&client_data->queue, client_data->shmem,
+                                      message_len);
+    while (queued < message_len) {
+        /* The client is over its quota. Make room by writing out a chunk for
+         * every client in turn, so that the other clients don't lose their
+         * place in the output.
+         */
+        get_serial_server()->stats.quota_stalls++;
+        serial_server_drain_step();
+        queued += serial_server_queue_push(&client_data->queue,
+                                           client_data->shmem + queued,
+                                           message_len - queued);
     }
+    get_serial_server()->stats.bytes_queued += message_len;
+
     *bytes_written = message_len;
     return 0;
 }
 
-static void serial_server_func_disconnect(serial_server_registry_entry_t *client_data)
+/** Sets up the shmem of a ring client as an empty ring.
+ */
+static void serial_server_ring_attach(serial_server_registry_entry_t *client_data)
+{
+    client_data->ring = (serial_server_ring_t *)client_data->shmem;
+    client_data->ring_size = client_data->shmem_size - sizeof(serial_server_ring_t);
+    /* The client is blocked on us until we reply, so it can't race us. */
+    client_data->ring->head = 0;
+    client_data->ring->tail = 0;
+}
+
+/** Processes all FUNC_CONNECT_RING_REQ IPC messages. Connects the client as
+ * for FUNC_CONNECT_REQ, and then sets its shmem up to be used as a ring.
+ */
+static seL4_Error serial_server_func_connect_ring(seL4_MessageInfo_t tag,
+                                                  seL4_Word client_badge_value,
+                                                  size_t client_shmem_size)
+{
+    serial_server_registry_entry_t *client_data;
+    seL4_Error error;
+
+    client_data = serial_server_registry_get_entry_by_badge(get_serial_server(), client_badge_value);
+    assert(client_data != NULL);
+
+    if (client_shmem_size <= sizeof(serial_server_ring_t) + 1) {
+        ZF_LOGW(SERSERVS"connect: Shared mem of %zdB is too small for a ring.",
+                client_shmem_size);
+        serial_server_unstage_frames(client_data);
+        return seL4_RangeError;
+    }
+
+    error = serial_server_func_connect(tag, client_badge_value,
+                                       client_shmem_size);
+    if (error != seL4_NoError) {
+        return error;
+    }
+
+    serial_server_ring_attach(client_data);
+    return seL4_NoError;
+}
+
+/** Unmaps a client's shmem window and releases the Frame caps behind it.
+ */
+static void serial_server_shmem_unmap(serial_server_registry_entry_t *client_data)
 {
-    /* Tear down shmem and release the badge value for reuse. */
     vspace_unmap_pages(get_serial_server()->server_vspace,
                        (void *)client_data->shmem,
                        BYTES_TO_4K_PAGES(client_data->shmem_size),
                        seL4_PageBits, get_serial_server()->server_vka);
     free(client_data->shmem_frame_caps);
+    client_data->shmem = NULL;
+    client_data->shmem_frame_caps = NULL;
+    client_data->shmem_size = 0;
+}
+
+/** Processes all FUNC_SHMEM_RESIZE_REQ IPC messages. Switches a connected
+ * client over to a new shmem window, which it has sent us the same way as for
+ * FUNC_CONNECT_REQ.
+ */
+static seL4_Error serial_server_func_resize(seL4_MessageInfo_t tag,
+                                            serial_server_registry_entry_t *client_data,
+                                            size_t client_shmem_size)
+{
+    seL4_Error error;
+    void *shmem_tmp;
+    seL4_CPtr *client_frame_caps;
+
+    if (client_data->shmem == NULL
+        || (client_data->ring != NULL
+            && client_shmem_size <= sizeof(serial_server_ring_t) + 1)) {
+        serial_server_unstage_frames(client_data);
+        return seL4_IllegalOperation;
+    }
+
+    error = serial_server_shmem_map(tag, client_data, client_shmem_size,
+                                    &shmem_tmp, &client_frame_caps);
+    if (error != seL4_NoError) {
+        return error;
+    }
+
+    /* Write out what is left in the old ring. Queued data was copied out of
+     * the shmem, so it is not affected.
+     */
+    if (client_data->ring != NULL) {
+        while (serial_server_ring_drain(client_data, client_data->ring_size) != 0);
+    }
+    serial_server_shmem_unmap(client_data);
+
+    client_data->shmem = shmem_tmp;
+    client_data->shmem_frame_caps = client_frame_caps;
+    client_data->shmem_size = client_shmem_size;
+    if (client_data->ring != NULL) {
+        serial_server_ring_attach(client_data);
+    }
+
+    ZF_LOGI(SERSERVS"resize: Client badge %x, shmem %p, %d pages.",
+            client_data->badge_value, shmem_tmp,
+            BYTES_TO_4K_PAGES(client_shmem_size));
+    return seL4_NoError;
+}
+
+/** Appends a byte of input to the input buffer, or drops it if the buffer is
+ * full.
+ */
+static void serial_server_rx_push(char c)
+{
+    serial_server_queue_t *rx = &get_serial_server()->rx;
+
+    get_serial_server()->stats.rx_bytes++;
+    if (rx->len == rx->size) {
+        get_serial_server()->stats.rx_dropped++;
+        return;
+    }
+    rx->buff[(rx->head + rx->len) % rx->size] = c;
+    rx->len++;
+}
+
+/** Moves everything the device has received into the input buffer. */
+static void serial_server_rx_poll(void)
+{
+    ps_chardevice_t *device = serial_server_device();
+    int c;
+
+    if (get_serial_server()->rx.size == 0) {
+        return;
+    }
+    while ((c = ps_cdev_getchar(device)) != EOF) {
+        serial_server_rx_push(c);
+    }
+}
+
+/** Signals the client with the focus if it is waiting for input and there is
+ * some.
+ */
+static void serial_server_rx_notify(void)
+{
+    serial_server_registry_entry_t *client_data;
+
+    if (get_serial_server()->rx.len == 0) {
+        return;
+    }
+    client_data = serial_server_registry_get_entry_by_badge(get_serial_server(),
+                                                            get_serial_server()->focus_badge_value);
+    if (client_data == NULL || !client_data->rx_waiting) {
+        return;
+    }
+    client_data->rx_waiting = false;
+    seL4_Signal(client_data->rx_ntfn);
+}
+
+static void serial_server_rx_irq(void *data, ps_irq_acknowledge_fn_t ack_fn,
+                                 void *ack_data)
+{
+    ps_cdev_handle_irq(serial_server_device(), (int)(uintptr_t)data);
+    serial_server_rx_poll();
+    ack_fn(ack_data);
+}
+
+/** Sets up the input buffer, and has the device's IRQs delivered on the
+ * notification bound to the server thread. If the device can't be read there
+ * is no input. If its IRQs can't be registered, input is polled for whenever
+ * a client reads.
+ */
+static void serial_server_rx_init(void)
+{
+    ps_chardevice_t *device = serial_server_device();
+    ps_irq_t irq;
+    irq_id_t irq_id;
+    int error;
+
+    memset(&get_serial_server()->rx, 0, sizeof(get_serial_server()->rx));
+    if (!get_serial_server()->reads_device) {
+        /* Another instance reads the console. */
+        return;
+    }
+    if (device == NULL || device->read == NULL || SERIAL_SERVER_RX_BUFFER_SIZE == 0) {
+        ZF_LOGI(SERSERVS"main: The serial device can't be read.");
+        return;
+    }
+    get_serial_server()->rx.buff = malloc(SERIAL_SERVER_RX_BUFFER_SIZE);
+    if (get_serial_server()->rx.buff == NULL) {
+        ZF_LOGW(SERSERVS"main: Failed to alloc input buffer.");
+        return;
+    }
+    get_serial_server()->rx.size = SERIAL_SERVER_RX_BUFFER_SIZE;
+
+    if (device->irqs == NULL || device->irqs[0] < 0) {
+        return;
+    }
+
+    sel4platsupport_new_malloc_ops(&get_serial_server()->rx_malloc_ops);
+    error = sel4platsupport_new_mini_irq_ops(&get_serial_server()->rx_irq_ops,
+                                             get_serial_server()->server_vka,
+                                             get_serial_server()->server_simple,
+                                             &get_serial_server()->rx_malloc_ops,
+                                             get_serial_server()->ring_ntfn_obj.cptr,
+                                             SERIAL_SERVER_RX_IRQ_BADGE_MASK);
+    if (error != 0) {
+        ZF_LOGW(SERSERVS"main: Failed to create IRQ ops. Input will be polled.");
+        return;
+    }
+
+    for (const int *n = device->irqs; *n >= 0; n++) {
+#ifdef CONFIG_ARCH_X86
+        irq = (ps_irq_t) {
+            .type = PS_IOAPIC,
+            .ioapic = { .ioapic = 0, .pin = *n, .level = 0, .polarity = 0, .vector = *n }
+        };
+#else
+        irq = (ps_irq_t) {
+            .type = PS_INTERRUPT, .irq = { .number = *n }
+        };
+#endif
+        irq_id = ps_irq_register(&get_serial_server()->rx_irq_ops, irq,
+                                 serial_server_rx_irq, (void *)(uintptr_t)*n);
+        if (irq_id < 0) {
+            ZF_LOGW(SERSERVS"main: Failed to register serial IRQ %d. Input "
+                    "will be polled.", *n);
+            continue;
+        }
+        get_serial_server()->rx_irq_driven = true;
+    }
+}
+
+/** Handles the serial device's IRQs, as signalled in badge. */
+static void serial_server_rx_handle_irq(seL4_Word badge)
+{
+    sel4platsupport_irq_handle(&get_serial_server()->rx_irq_ops,
+                               MINI_IRQ_INTERFACE_NTFN_ID,
+                               badge & SERIAL_SERVER_RX_IRQ_BADGE_MASK);
+    serial_server_rx_notify();
+}
+
+/** Processes all FUNC_READ_REQ IPC messages. Copies up to max_len bytes of
+ * input into the message registers from SSMSGREG_READ_ACK_DATA on.
+ *
+ * Only the client with the focus gets input. If no client has the focus, the
+ * caller takes it.
+ *
+ * @param wait [out] Set if nothing was read, the client asked to block, and
+ *             it will be signalled when input arrives.
+ */
+static seL4_Error serial_server_func_read(seL4_MessageInfo_t tag,
+                                          serial_server_registry_entry_t *client_data,
+                                          size_t max_len, bool block,
+                                          size_t *bytes_read, bool *wait)
+{
+    serial_server_queue_t *rx = &get_serial_server()->rx;
+    char *data = (char *)&seL4_GetIPCBuffer()->msg[SSMSGREG_READ_ACK_DATA];
+    seL4_Error error;
+    size_t first;
+
+    *bytes_read = 0;
+    *wait = false;
+
+    if (seL4_MessageInfo_get_extraCaps(tag) == 1) {
+        if (client_data->rx_ntfn != seL4_CapNull) {
+            /* Already have one. Empty the receive slot for the next cap. */
+            vka_cnode_delete(&get_serial_server()->frame_cap_recv_cspaths[0]);
+        } else {
+            error = serial_server_take_cap(client_data->badge_value,
+                                           &client_data->rx_ntfn);
+            if (error != seL4_NoError) {
+                return error;
+            }
+        }
+    }
+
+    if (rx->size == 0) {
+        /* There will never be anything to read. */
+        return block ? seL4_IllegalOperation : seL4_NoError;
+    }
+
+    if (get_serial_server()->focus_badge_value == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+        get_serial_server()->focus_badge_value = client_data->badge_value;
+    }
+
+    serial_server_rx_poll();
+    if (get_serial_server()->focus_badge_value == client_data->badge_value) {
+        *bytes_read = MIN(MIN(max_len, SERIAL_SERVER_READ_MAX_LEN), rx->len);
+        first = MIN(*bytes_read, rx->size - rx->head);
+        memcpy(data, &rx->buff[rx->head], first);
+        memcpy(data + first, rx->buff, *bytes_read - first);
+        rx->head = (rx->head + *bytes_read) % rx->size;
+        rx->len -= *bytes_read;
+    }
+
+    if (*bytes_read == 0 && block) {
+        /* Without IRQs, or a notification to signal, the client polls. */
+        client_data->rx_waiting = get_serial_server()->rx_irq_driven
+                                  && client_data->rx_ntfn != seL4_CapNull;
+        *wait = client_data->rx_waiting;
+    }
+    return seL4_NoError;
+}
+
+/** Processes all FUNC_FOCUS_REQ IPC messages. From now on, input goes to the
+ * caller.
+ */
+static void serial_server_func_focus(serial_server_registry_entry_t *client_data)
+{
+    get_serial_server()->focus_badge_value = client_data->badge_value;
+    serial_server_rx_notify();
+}
+
+static void serial_server_func_disconnect(serial_server_registry_entry_t *client_data)
+{
+    /* Write out whatever the client left behind. */
+    if (client_data->ring != NULL) {
+        while (serial_server_ring_drain(client_data, client_data->ring_size) != 0);
+        client_data->ring = NULL;
+        client_data->ring_size = 0;
+    }
+    serial_server_queue_drain(client_data, client_data->queue.len);
+    free(client_data->queue.buff);
+    memset(&client_data->queue, 0, sizeof(client_data->queue));
+    serial_server_unstage_frames(client_data);
+
+    if (client_data->rx_ntfn != seL4_CapNull) {
+        cspacepath_t rx_ntfn_cspath;
+
+        vka_cspace_make_path(get_serial_server()->server_vka,
+                             client_data->rx_ntfn, &rx_ntfn_cspath);
+        vka_cnode_delete(&rx_ntfn_cspath);
+        vka_cspace_free_path(get_serial_server()->server_vka, rx_ntfn_cspath);
+        client_data->rx_ntfn = seL4_CapNull;
+    }
+    client_data->rx_waiting = false;
+    if (get_serial_server()->focus_badge_value == client_data->badge_value) {
+        get_serial_server()->focus_badge_value = SERIAL_SERVER_BADGE_VALUE_EMPTY;
+    }
+
+    /* Tear down shmem and release the badge value for reuse. */
+    serial_server_shmem_unmap(client_data);
     serial_server_registry_remove(client_data->badge_value);
 }
 
@@ -435,7 +1166,7 @@ void serial_server_registry_dump(bool dump_frame_caps)
     }
 }
 
-void serial_server_main(void)
+void serial_server_main(serial_server_context_t *server)
 {
     seL4_MessageInfo_t tag;
     seL4_Word sender_badge;
@@ -443,16 +1174,26 @@ void serial_server_main(void)
     int keep_going = 1;
     UNUSED seL4_Error error;
     serial_server_registry_entry_t *client_data = NULL;
-    size_t buff_len, bytes_written;
+    size_t buff_len, bytes_written, bytes_read;
+    bool rx_wait;
+
+    serial_server = server;
 
-    /* Bind to the serial driver. */
-    error = platsupport_serial_setup_simple(get_serial_server()->server_vspace,
-                                            get_serial_server()->server_simple,
-                                            get_serial_server()->server_vka);
+    /* Bind to the serial driver, unless we were given a device of our own,
+     * which the Parent has already initialised.
+     */
+    error = 0;
+    if (get_serial_server()->device == NULL) {
+        error = platsupport_serial_setup_simple(get_serial_server()->server_vspace,
+                                                get_serial_server()->server_simple,
+                                                get_serial_server()->server_vka);
+    }
     if (error != 0) {
         ZF_LOGE(SERSERVS"main: Failed to bind to serial.");
     } else {
         ZF_LOGI(SERSERVS"main: Bound to the serial driver.");
+        /* The Parent is blocked on us until we reply, so we can use its vka. */
+        serial_server_rx_init();
     }
 
     /* The Parent will seL4_Call() the us, the Server, right after spawning us.
@@ -482,7 +1223,32 @@ void serial_server_main(void)
         /* Set the CNode slots where caps from clients will go */
         serial_server_set_frame_recv_path();
 
-        tag = recv(&sender_badge);
+        if (serial_server_output_pending()) {
+            /* Only write out queued data while no requests are waiting, so
+             * that clients are acked as quickly as possible.
+             */
+            tag = nbrecv(&sender_badge);
+            if (sender_badge == SERIAL_SERVER_BADGE_VALUE_EMPTY) {
+                serial_server_drain_step();
+                continue;
+            }
+        } else {
+            serial_server_output_idle();
+            tag = recv(&sender_badge);
+        }
+
+        if (sender_badge & SERIAL_SERVER_NTFN_BADGE_MASK) {
+            /* A ring client or the serial device signalled the bound
+             * notification. There is no one to reply to.
+             */
+            if (sender_badge & SERIAL_SERVER_RING_NTFN_BADGE) {
+                get_serial_server()->rings_pending = true;
+            }
+            if (sender_badge & SERIAL_SERVER_RX_IRQ_BADGE_MASK) {
+                serial_server_rx_handle_irq(sender_badge);
+            }
+            continue;
+        }
         ZF_LOGD(SERSERVS "main: Got message from %x", sender_badge);
 
         func = seL4_GetMR(SSMSGREG_FUNC);
@@ -492,8 +1258,8 @@ void serial_server_main(void)
          * New connection requests are of course, exempt from the requirement to
          * already have an established connection.
          */
-        if (func != FUNC_CONNECT_REQ) {
-            client_data = serial_server_registry_get_entry_by_badge(sender_badge);
+        if (func != FUNC_CONNECT_REQ && func != FUNC_CONNECT_RING_REQ) {
+            client_data = serial_server_registry_get_entry_by_badge(get_serial_server(), sender_badge);
             if (client_data == NULL) {
                 ZF_LOGW(SERSERVS"main: Got message from unregistered client "
                         "badge %x. Ignoring.",
@@ -509,6 +1275,10 @@ void serial_server_main(void)
             error = serial_server_func_connect(tag,
                                                sender_badge,
                                                seL4_GetMR(SSMSGREG_CONNECT_REQ_SHMEM_SIZE));
+            if (error == seL4_NoError) {
+                serial_server_queue_init(serial_server_registry_get_entry_by_badge(get_serial_server(),
+                                                                                   sender_badge));
+            }
 
             seL4_SetMR(SSMSGREG_FUNC, FUNC_CONNECT_ACK);
             seL4_SetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE,
@@ -517,6 +1287,61 @@ void serial_server_main(void)
             reply(tag);
             break;
 
+        case FUNC_CONNECT_RING_REQ:
+            ZF_LOGD(SERSERVS"main: Got ring connect request from client badge "
+                    "%x.", sender_badge);
+            error = serial_server_func_connect_ring(tag,
+                                                    sender_badge,
+                                                    seL4_GetMR(SSMSGREG_CONNECT_REQ_SHMEM_SIZE));
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_CONNECT_RING_ACK);
+            seL4_SetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE,
+                       get_serial_server()->shmem_max_size);
+            if (error == seL4_NoError) {
+                seL4_SetCap(0, get_serial_server()->_badged_ring_ntfn_cspath.capPtr);
+            }
+            tag = seL4_MessageInfo_new(error, 0, error == seL4_NoError ? 1 : 0,
+                                       SSMSGREG_CONNECT_ACK_END);
+            reply(tag);
+            break;
+
+        case FUNC_SHMEM_FRAME_REQ:
+            error = serial_server_func_shmem_frame(tag, client_data,
+                                                   seL4_GetMR(SSMSGREG_SHMEM_FRAME_REQ_SHMEM_SIZE),
+                                                   seL4_GetMR(SSMSGREG_SHMEM_FRAME_REQ_INDEX));
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_SHMEM_FRAME_ACK);
+            seL4_SetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE,
+                       get_serial_server()->shmem_max_size);
+            tag = seL4_MessageInfo_new(error, 0, 0, SSMSGREG_CONNECT_ACK_END);
+            reply(tag);
+            break;
+
+        case FUNC_SHMEM_RESIZE_REQ:
+            ZF_LOGD(SERSERVS"main: Got resize request from client badge %x.",
+                    sender_badge);
+            error = serial_server_func_resize(tag, client_data,
+                                              seL4_GetMR(SSMSGREG_CONNECT_REQ_SHMEM_SIZE));
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_SHMEM_RESIZE_ACK);
+            seL4_SetMR(SSMSGREG_CONNECT_ACK_MAX_SHMEM_SIZE,
+                       get_serial_server()->shmem_max_size);
+            tag = seL4_MessageInfo_new(error, 0, 0, SSMSGREG_CONNECT_ACK_END);
+            reply(tag);
+            break;
+
+        case FUNC_RING_SYNC_REQ:
+            /* Drain everyone, not just the caller, so that a client with a
+             * full ring can't jump the queue.
+             */
+            bytes_written = serial_server_drain_all();
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_RING_SYNC_ACK);
+            seL4_SetMR(SSMSGREG_RING_SYNC_ACK_N_BYTES_WRITTEN, bytes_written);
+            tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_RING_SYNC_ACK_END);
+            reply(tag);
+            break;
+
         case FUNC_WRITE_REQ:
             /* The Server's ABI for the write() request is as follows:
              *
@@ -548,6 +1373,31 @@ void serial_server_main(void)
             reply(tag);
             break;
 
+        case FUNC_READ_REQ:
+            error = serial_server_func_read(tag, client_data,
+                                            seL4_GetMR(SSMSGREG_READ_REQ_MAX_LEN),
+                                            seL4_GetMR(SSMSGREG_READ_REQ_BLOCK),
+                                            &bytes_read, &rx_wait);
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_READ_ACK);
+            seL4_SetMR(SSMSGREG_READ_ACK_N_BYTES_READ, bytes_read);
+            seL4_SetMR(SSMSGREG_READ_ACK_WAIT, rx_wait);
+            tag = seL4_MessageInfo_new(error, 0, 0,
+                                       SSMSGREG_READ_ACK_DATA
+                                       + (bytes_read + sizeof(seL4_Word) - 1) / sizeof(seL4_Word));
+            reply(tag);
+            break;
+
+        case FUNC_FOCUS_REQ:
+            ZF_LOGD(SERSERVS"main: Client badge %x took the input focus.",
+                    sender_badge);
+            serial_server_func_focus(client_data);
+
+            seL4_SetMR(SSMSGREG_FUNC, FUNC_FOCUS_ACK);
+            tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_FOCUS_ACK_END);
+            reply(tag);
+            break;
+
         case FUNC_DISCONNECT_REQ:
             ZF_LOGD(SERSERVS"main: Got disconnect request from client badge %x.",
                     sender_badge);
@@ -561,10 +1411,10 @@ void serial_server_main(void)
         case FUNC_KILL_REQ:
             ZF_LOGI(SERSERVS"main: Got KILL request from client badge %x.",
                     sender_badge);
-            /* The actual contents of the Reply don't matter here. */
-            seL4_SetMR(SSMSGREG_FUNC, FUNC_KILL_ACK);
-            tag = seL4_MessageInfo_new(0, 0, 0, SSMSGREG_KILL_ACK_END);
-            reply(tag);
+            /* No new clients are assigned to a dying instance. The kill is
+             * acked once the instance has been torn down, below.
+             */
+            __atomic_store_n(&get_serial_server()->dying, true, __ATOMIC_RELEASE);
             /* Break out of the loop */
             keep_going = 0;
             break;
@@ -576,7 +1426,20 @@ void serial_server_main(void)
     }
 
     serial_server_func_kill();
+    serial_server_output_idle();
+
+    /* Once spawned is cleared the instance can be spawned again, which
+     * reinitialises the context, so take what is still needed from it first.
+     */
+    seL4_CPtr reply_cptr = get_serial_server()->server_thread.reply.cptr;
+    seL4_CPtr tcb_cptr = get_serial_server()->server_thread.tcb.cptr;
+    __atomic_store_n(&get_serial_server()->reads_device, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&get_serial_server()->spawned, false, __ATOMIC_RELEASE);
+
+    /* The actual contents of the Reply don't matter here. */
+    seL4_SetMR(SSMSGREG_FUNC, FUNC_KILL_ACK);
+    api_reply(reply_cptr, seL4_MessageInfo_new(0, 0, 0, SSMSGREG_KILL_ACK_END));
     /* After we break out of the loop, seL4_TCB_Suspend ourselves */
     ZF_LOGI(SERSERVS"main: Suspending.");
-    seL4_TCB_Suspend(get_serial_server()->server_thread.tcb.cptr);
+    seL4_TCB_Suspend(tcb_cptr);
 }
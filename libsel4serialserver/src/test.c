@@ -6,6 +6,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <sel4/sel4.h>
 #include <vka/capops.h>
@@ -314,3 +315,225 @@ test_write_inputs(struct env *env)
 DEFINE_TEST(SERSERV_PARENT_010, "Test a series of unexpected input values to write()",
             test_write_inputs, true)
 
+
+static int
+test_parent_ring_write_and_printf(struct env *env)
+{
+    int error;
+    serial_client_context_t conn;
+    cspacepath_t badged_server_ep_cspath;
+
+    error = serial_server_parent_spawn_thread(&env->simple,
+                                              &env->vka, &env->vspace,
+                                              SERSERV_TEST_PRIO_SERVER);
+    test_eq(error, 0);
+
+    error = serial_server_parent_vka_mint_endpoint(&env->vka, &badged_server_ep_cspath);
+    test_eq(error, 0);
+
+    error = serial_server_client_connect_ring(badged_server_ep_cspath.capPtr,
+                                              &env->vka, &env->vspace, &conn);
+    test_eq(error, 0);
+
+    /* Write more than fits in the ring, so that the client has to wait for
+     * the server to drain it at least once.
+     */
+    for (size_t written = 0; written < 2 * BIT(seL4_PageBits);
+         written += strlen(test_str)) {
+        error = serial_server_write(&conn, test_str, strlen(test_str));
+        test_eq(error, (int)strlen(test_str));
+    }
+    error = serial_server_printf(&conn, test_str);
+    test_eq(error, (int)strlen(test_str));
+
+    /* The shmem of a ring connection can't be flushed directly. */
+    error = serial_server_flush(&conn, strlen(test_str));
+    test_lt(error, 0);
+
+    error = serial_server_sync(&conn);
+    test_eq(error, 0);
+
+    serial_server_disconnect(&conn);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SERSERV_PARENT_011, "Write() and printf() through a ring connection",
+            test_parent_ring_write_and_printf, true)
+
+static int
+test_parent_write_back(struct env *env)
+{
+    int error;
+    serial_client_context_t conn;
+    cspacepath_t badged_server_ep_cspath;
+    serial_server_stats_t before, after;
+
+    error = serial_server_parent_spawn_thread(&env->simple,
+                                              &env->vka, &env->vspace,
+                                              SERSERV_TEST_PRIO_SERVER);
+    test_eq(error, 0);
+    serial_server_parent_set_client_quota(BIT(seL4_PageBits));
+
+    error = serial_server_parent_vka_mint_endpoint(&env->vka, &badged_server_ep_cspath);
+    test_eq(error, 0);
+
+    error = serial_server_client_connect(badged_server_ep_cspath.capPtr,
+                                         &env->vka, &env->vspace, &conn);
+    test_eq(error, 0);
+
+    /* Write more than the quota. The server never lets a client queue more
+     * than its quota, however the writes are interleaved with the server
+     * writing queued data out.
+     */
+    serial_server_parent_get_stats(&before);
+    for (size_t written = 0; written < 2 * BIT(seL4_PageBits);
+         written += strlen(test_str)) {
+        error = serial_server_write(&conn, test_str, strlen(test_str));
+        test_eq(error, (int)strlen(test_str));
+    }
+    serial_server_parent_get_stats(&after);
+
+    test_geq(after.bytes_queued - before.bytes_queued, 2 * BIT(seL4_PageBits));
+    test_leq(after.max_queue_depth, BIT(seL4_PageBits));
+
+    /* Disconnecting writes out everything that was queued. */
+    serial_server_disconnect(&conn);
+    serial_server_parent_get_stats(&after);
+    test_eq(after.queue_depth, 0);
+
+    return sel4test_get_result();
+}
+DEFINE_TEST(SERSERV_PARENT_012, "Write() through the server's write-back queue",
+            test_parent_write_back, true)
+
+static int
+test_parent_large_shmem(struct env *env)
+{
+    int error;
+    serial_client_context_t conn;
+    cspacepath_t badged_server_ep_cspath;
+    const size_t big_len = 3 * BIT(seL4_PageBits) + 1;
+    char *big;
+
+    error = serial_server_parent_spawn_thread(&env->simple,
+                                              &env->vka, &env->vspace,
+                                              SERSERV_TEST_PRIO_SERVER);
+    test_eq(error, 0);
+
+    error = serial_server_parent_vka_mint_endpoint(&env->vka, &badged_server_ep_cspath);
+    test_eq(error, 0);
+
+    error = serial_server_client_connect_sized(badged_server_ep_cspath.capPtr,
+                                              &env->vka, &env->vspace,
+                                              2 * BIT(seL4_PageBits), false,
+                                              &conn);
+    test_eq(error, 0);
+    test_eq(conn.shmem_size, 2 * BIT(seL4_PageBits));
+
+    big = malloc(big_len + 1);
+    test_assert(big != NULL);
+    memset(big, '.', big_len - 1);
+    big[big_len - 1] = '\n';
+    big[big_len] = '\0';
+
+    /* Longer than the window, so has to go through in pieces. */
+    error = serial_server_write_stream(&conn, big, big_len);
+    test_eq(error, (int)big_len);
+    error = serial_server_printf(&conn, "%s", big);
+    test_eq(error, (int)big_len);
+
+    error = serial_server_client_grow(&conn, 4 * BIT(seL4_PageBits));
+    test_eq(error, 0);
+    test_eq(conn.shmem_size, 4 * BIT(seL4_PageBits));
+
+    /* Now fits in one piece. */
+    error = serial_server_write(&conn, big, big_len);
+    test_eq(error, (int)big_len);
+
+    free(big);
+    serial_server_disconnect(&conn);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SERSERV_PARENT_013, "Write() and printf() through a multi-page shmem window",
+            test_parent_large_shmem, true)
+
+static int
+test_parent_read(struct env *env)
+{
+    int error;
+    serial_client_context_t conn;
+    cspacepath_t badged_server_ep_cspath;
+    char buff[16];
+    ssize_t n;
+
+    error = serial_server_parent_spawn_thread(&env->simple,
+                                              &env->vka, &env->vspace,
+                                              SERSERV_TEST_PRIO_SERVER);
+    test_eq(error, 0);
+
+    error = serial_server_parent_vka_mint_endpoint(&env->vka, &badged_server_ep_cspath);
+    test_eq(error, 0);
+
+    error = serial_server_client_connect(badged_server_ep_cspath.capPtr,
+                                         &env->vka, &env->vspace, &conn);
+    test_eq(error, 0);
+
+    error = serial_server_set_focus(&conn);
+    test_eq(error, 0);
+
+    /* Nobody is typing, so all we can check is that polling doesn't fail or
+     * return more than we asked for.
+     */
+    n = serial_server_read(&conn, buff, sizeof(buff), false);
+    test_geq(n, 0);
+    test_leq(n, (ssize_t)sizeof(buff));
+
+    serial_server_disconnect(&conn);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SERSERV_PARENT_014, "Poll for input with read()",
+            test_parent_read, true)
+
+static int
+test_parent_instances(struct env *env)
+{
+    int error, instance;
+    serial_client_context_t conn;
+    cspacepath_t badged_server_ep_cspath;
+    serial_server_instance_config_t config = {
+        .priority = SERSERV_TEST_PRIO_SERVER,
+        .core = 0,
+        .device = NULL,
+    };
+    serial_server_stats_t before, after;
+
+    error = serial_server_parent_spawn_instance(1, &env->simple, &env->vka,
+                                                &env->vspace, &config);
+    test_eq(error, 0);
+    /* Write-through, so that the stats are up to date when writes return. */
+    serial_server_parent_set_client_quota_instance(1, 0);
+
+    instance = serial_server_parent_pick_instance(0);
+    test_geq(instance, 0);
+
+    error = serial_server_parent_vka_mint_endpoint_instance(1, &env->vka,
+                                                            &badged_server_ep_cspath);
+    test_eq(error, 0);
+
+    error = serial_server_client_connect(badged_server_ep_cspath.capPtr,
+                                         &env->vka, &env->vspace, &conn);
+    test_eq(error, 0);
+
+    /* The output goes through instance 1, and only instance 1. */
+    serial_server_parent_get_stats_instance(1, &before);
+    error = serial_server_printf(&conn, test_str);
+    test_eq(error, (int)strlen(test_str));
+    serial_server_parent_get_stats_instance(1, &after);
+    test_eq(after.bytes_written - before.bytes_written, strlen(test_str));
+
+    error = serial_server_kill(&conn);
+    test_eq(error, 0);
+
+    return sel4test_get_result();
+}
+DEFINE_TEST(SERSERV_PARENT_015, "Connect to and print through a second server instance",
+            test_parent_instances, true)
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A mutex that spins for a while before it blocks.
+ *
+ * The lock state is the same as that of a binary semaphore (see
+ * bin_sem_bare.h). An uncontended lock is a single compare and swap. A
+ * contended lock first retries with exponential backoff, for up to spin_limit
+ * iterations of the backoff loop, and only then decrements the semaphore and
+ * blocks on the notification. On SMP systems with short critical sections this
+ * saves the two kernel entries of blocking and being woken up.
+ *
+ * Spinning stops early once another thread is blocked on the mutex, as the
+ * mutex is then handed straight to that thread when it is released.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sel4/sel4.h>
+#ifdef CONFIG_DEBUG_BUILD
+#include <sel4debug/debug.h>
+#endif
+#include <vka/vka.h>
+#include <vka/object.h>
+#include <sync/bin_sem_bare.h>
+
+/* Spinning only pays off if the lock holder can run at the same time. */
+#if CONFIG_MAX_NUM_NODES > 1
+#define SYNC_ADAPTIVE_MUTEX_DEFAULT_SPIN_LIMIT 1000
+#else
+#define SYNC_ADAPTIVE_MUTEX_DEFAULT_SPIN_LIMIT 0
+#endif
+
+/* Longest single backoff, in iterations of sync_cpu_relax(). */
+#define SYNC_ADAPTIVE_MUTEX_MAX_BACKOFF 64
+
+/* Counters kept by the mutex. They are only updated by the thread that holds
+ * the mutex, so are exact if read while holding it.
+ */
+typedef struct {
+    /* Times the mutex was acquired. */
+    uint64_t acquires;
+    /* Acquires that found the mutex held. */
+    uint64_t contended;
+    /* Contended acquires that got the mutex by spinning. */
+    uint64_t spin_acquires;
+    /* Contended acquires that blocked on the notification. */
+    uint64_t blocks;
+    /* Backoff iterations spent spinning, over all acquires. */
+    uint64_t spin_iterations;
+} sync_adaptive_mutex_stats_t;
+
+/* This struct is intended to be opaque, but is left here so you can
+ * stack-allocate mutexes. Callers should not touch any of its members.
+ */
+typedef struct {
+    vka_object_t notification;
+    volatile int value;
+    unsigned int spin_limit;
+    sync_adaptive_mutex_stats_t stats;
+} sync_adaptive_mutex_t;
+
+/* Tell the processor we are in a spin loop. */
+static inline void sync_cpu_relax(void)
+{
+#if defined(CONFIG_ARCH_X86)
+    __asm__ volatile("pause" ::: "memory");
+#elif defined(CONFIG_ARCH_AARCH64) || defined(CONFIG_ARCH_ARM_V7A) || defined(CONFIG_ARCH_ARM_V8A)
+    __asm__ volatile("yield" ::: "memory");
+#else
+    __asm__ volatile("" ::: "memory");
+#endif
+}
+
+/* Initialise an unmanaged adaptive mutex with a notification object
+ * @param mutex         A mutex object to be initialised.
+ * @param notification  A notification object to use for the lock.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_adaptive_mutex_init(sync_adaptive_mutex_t *mutex, seL4_CPtr notification)
+{
+    if (mutex == NULL) {
+        ZF_LOGE("Mutex passed to sync_adaptive_mutex_init was NULL");
+        return -1;
+    }
+#ifdef CONFIG_DEBUG_BUILD
+    /* Check the cap actually is a notification. */
+    assert(debug_cap_is_notification(notification));
+#endif
+
+    mutex->notification.cptr = notification;
+    mutex->value = 1;
+    mutex->spin_limit = SYNC_ADAPTIVE_MUTEX_DEFAULT_SPIN_LIMIT;
+    mutex->stats = (sync_adaptive_mutex_stats_t) {
+        0
+    };
+    return 0;
+}
+
+/* Set how long a contended lock spins before it blocks
+ * @param mutex         An initialised mutex.
+ * @param spin_limit    Iterations of the backoff loop to spin for. 0 blocks
+ *                      straight away, like sync_mutex_t. */
+static inline void sync_adaptive_mutex_set_spin_limit(sync_adaptive_mutex_t *mutex, unsigned int spin_limit)
+{
+    mutex->spin_limit = spin_limit;
+}
+
+/* Slow path of sync_adaptive_mutex_lock, for when the mutex is held.
+ * @param mutex         An initialised mutex to acquire.
+ * @return              0 on success, an error code on failure. */
+int sync_adaptive_mutex_lock_contended(sync_adaptive_mutex_t *mutex);
+
+/* Try to acquire an adaptive mutex without spinning or blocking
+ * @param mutex         An initialised mutex to acquire.
+ * @return              0 if the mutex was acquired, -1 if it is held. */
+static inline int sync_adaptive_mutex_trylock(sync_adaptive_mutex_t *mutex)
+{
+    int val = 1;
+    if (!__atomic_compare_exchange_n(&mutex->value, &val, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    mutex->stats.acquires++;
+    return 0;
+}
+
+/* Acquire an adaptive mutex
+ * @param mutex         An initialised mutex to acquire.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_adaptive_mutex_lock(sync_adaptive_mutex_t *mutex)
+{
+    if (mutex == NULL) {
+        ZF_LOGE("Mutex passed to sync_adaptive_mutex_lock was NULL");
+        return -1;
+    }
+    if (sync_adaptive_mutex_trylock(mutex) == 0) {
+        return 0;
+    }
+    return sync_adaptive_mutex_lock_contended(mutex);
+}
+
+/* Release an adaptive mutex
+ * @param mutex         An initialised mutex to release.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_adaptive_mutex_unlock(sync_adaptive_mutex_t *mutex)
+{
+    if (mutex == NULL) {
+        ZF_LOGE("Mutex passed to sync_adaptive_mutex_unlock was NULL");
+        return -1;
+    }
+    return sync_bin_sem_bare_post(mutex->notification.cptr, &mutex->value);
+}
+
+/* Read the counters of an adaptive mutex
+ * @param mutex         An initialised mutex.
+ * @param stats         Filled in with the counters. */
+static inline void sync_adaptive_mutex_get_stats(sync_adaptive_mutex_t *mutex, sync_adaptive_mutex_stats_t *stats)
+{
+    *stats = mutex->stats;
+}
+
+/* Allocate and initialise a managed adaptive mutex
+ * @param vka           A VKA instance used to allocate a notification object.
+ * @param mutex         A mutex object to initialise.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_adaptive_mutex_new(vka_t *vka, sync_adaptive_mutex_t *mutex)
+{
+    if (mutex == NULL) {
+        ZF_LOGE("Mutex passed to sync_adaptive_mutex_new was NULL");
+        return -1;
+    }
+    int error = vka_alloc_notification(vka, &(mutex->notification));
+
+    if (error != 0) {
+        return error;
+    } else {
+        return sync_adaptive_mutex_init(mutex, mutex->notification.cptr);
+    }
+}
+
+/* Deallocate a managed adaptive mutex (do not use with sync_adaptive_mutex_init)
+ * @param vka           A VKA instance used to deallocate the notification object.
+ * @param mutex         A mutex object initialised by sync_adaptive_mutex_new.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_adaptive_mutex_destroy(vka_t *vka, sync_adaptive_mutex_t *mutex)
+{
+    if (mutex == NULL) {
+        ZF_LOGE("Mutex passed to sync_adaptive_mutex_destroy was NULL");
+        return -1;
+    }
+    vka_free_object(vka, &(mutex->notification));
+    return 0;
+}
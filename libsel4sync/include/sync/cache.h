@@ -0,0 +1,14 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <utils/util.h>
+
+/* Size of an L1 cache line. Fields written by different threads are aligned to
+ * this so that they do not share a line. */
+#define SYNC_CACHE_LINE_SIZE BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS)
@@ -16,10 +16,27 @@
 #include <platsupport/sync/atomic.h>
 #include <stdbool.h>
 
+/* A thread waiting on its own notification, see sync_cv_wait_private. These
+ * live on the stack of the waiting thread and are only touched with the lock
+ * held. */
+typedef struct sync_cv_waiter {
+    seL4_CPtr notification;
+    bool woken;
+    struct sync_cv_waiter *prev;
+    struct sync_cv_waiter *next;
+} sync_cv_waiter_t;
+
 typedef struct {
     vka_object_t notification;
+    /* Threads in sync_cv_wait that have not been given a wake up */
     volatile int waiters;
-    volatile bool broadcasting;
+    /* Wake ups given but not yet taken. The notification is only signalled
+     * when this becomes non-zero and by each woken thread that leaves it
+     * non-zero, so at most one signal is outstanding. */
+    volatile int wakeups;
+    /* Queue of threads in sync_cv_wait_private, oldest first */
+    sync_cv_waiter_t *head;
+    sync_cv_waiter_t *tail;
 } sync_cv_t;
 
 /* Initialise an unmanaged condition variable
@@ -40,15 +57,56 @@ static inline int sync_cv_init(sync_cv_t *cv, seL4_CPtr notification)
 
     cv->notification.cptr = notification;
     cv->waiters = 0;
-    cv->broadcasting = false;
+    cv->wakeups = 0;
+    cv->head = NULL;
+    cv->tail = NULL;
     return 0;
 }
 
+static inline void sync_cv_waiter_unlink(sync_cv_t *cv, sync_cv_waiter_t *waiter)
+{
+    if (waiter->prev != NULL) {
+        waiter->prev->next = waiter->next;
+    } else {
+        cv->head = waiter->next;
+    }
+    if (waiter->next != NULL) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        cv->tail = waiter->prev;
+    }
+}
+
+/* Wake the oldest thread in sync_cv_wait_private, if any. Called with the
+ * lock held.
+ * @return              true if a thread was woken. */
+static inline bool sync_cv_wake_private(sync_cv_t *cv)
+{
+    sync_cv_waiter_t *waiter = cv->head;
+    if (waiter == NULL) {
+        return false;
+    }
+    sync_cv_waiter_unlink(cv, waiter);
+    waiter->woken = true;
+    seL4_Signal(waiter->notification);
+    return true;
+}
+
+/* Give n threads in sync_cv_wait a wake up. Called with the lock held.
+ * @return              true if the notification must be signalled. */
+static inline bool sync_cv_add_wakeups(sync_cv_t *cv, int n)
+{
+    cv->waiters -= n;
+    return __atomic_fetch_add(&cv->wakeups, n, __ATOMIC_RELEASE) == 0;
+}
+
 /* Wait on a condition variable.
  * This assumes that you already hold the lock and will block until notified
  * by sync_cv_signal or sync_cv_broadcast. It returns once you hold the lock
  * again. Note that a spurious wake up is possible and the condition should
- * always be checked again after sync_cv_wait returns.
+ * always be checked again after sync_cv_wait returns. A thread that starts
+ * waiting while the threads of an earlier signal or broadcast are still being
+ * woken is woken along with them.
  * @param lock          The lock on the monitor.
  * @param cv            The condition variable to wait on.
  * @return              0 on success, an error code on failure. */
@@ -59,9 +117,19 @@ static inline int sync_cv_wait(sync_bin_sem_t *lock, sync_cv_t *cv)
         return -1;
     }
 
-    /* Increment waiters count and release the lock */
-    cv->waiters++;
-    cv->broadcasting = false;
+    /* If wake ups are still being handed out, take one more so that we are
+     * woken with them. Otherwise we could take the wake up of a thread that
+     * was waiting before and has not blocked yet, and strand it. The count is
+     * only raised while it is non-zero, as the thread that takes it to zero
+     * does not pass the notification on. */
+    int wakeups = __atomic_load_n(&cv->wakeups, __ATOMIC_RELAXED);
+    while (wakeups > 0 && !__atomic_compare_exchange_n(&cv->wakeups, &wakeups, wakeups + 1, true,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (wakeups == 0) {
+        cv->waiters++;
+    }
+
+    /* Release the lock */
     int error = sync_bin_sem_post(lock);
     if (error != 0) {
         return error;
@@ -70,27 +138,69 @@ static inline int sync_cv_wait(sync_bin_sem_t *lock, sync_cv_t *cv)
     /* Wait to be notified */
     seL4_Wait(cv->notification.cptr, NULL);
 
+    /* Take our wake up and pass the notification on if there are more, before
+     * going for the lock, so that the rest of a broadcast does not wait for
+     * each thread in turn to get the lock. */
+    if (__atomic_sub_fetch(&cv->wakeups, 1, __ATOMIC_ACQ_REL) > 0) {
+        seL4_Signal(cv->notification.cptr);
+    }
+
     /* Reacquire the lock */
-    error = sync_bin_sem_wait(lock);
+    return sync_bin_sem_wait(lock);
+}
+
+/* Wait on a condition variable, blocking on a notification of the caller.
+ * This behaves as sync_cv_wait, except that the waiter is queued on the
+ * condition variable with its own notification. sync_cv_broadcast then signals
+ * every such waiter directly, so they all wake at once rather than one after
+ * the other. It also wakes exactly the threads that were waiting: with the
+ * shared notification of sync_cv_wait, a thread that has not blocked yet when
+ * a broadcast goes out can lose its wake up to one that starts waiting later.
+ * The notification may be used for other things when not waiting, but a stale
+ * signal on it is seen as a spurious wake up.
+ * @param lock          The lock on the monitor.
+ * @param cv            The condition variable to wait on.
+ * @param notification  A notification that only the calling thread waits on.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_cv_wait_private(sync_bin_sem_t *lock, sync_cv_t *cv, seL4_CPtr notification)
+{
+    if (cv == NULL) {
+        ZF_LOGE("Condition variable passed to sync_cv_wait_private is NULL");
+        return -1;
+    }
+
+    /* Queue ourselves and release the lock */
+    sync_cv_waiter_t waiter = {
+        .notification = notification,
+        .woken = false,
+        .prev = cv->tail,
+        .next = NULL,
+    };
+    if (cv->tail != NULL) {
+        cv->tail->next = &waiter;
+    } else {
+        cv->head = &waiter;
+    }
+    cv->tail = &waiter;
+    int error = sync_bin_sem_post(lock);
     if (error != 0) {
+        sync_cv_waiter_unlink(cv, &waiter);
         return error;
     }
 
-    /* Wake up and decrement waiters count */
-    cv->waiters--;
+    /* Wait to be notified */
+    seL4_Wait(notification, NULL);
 
-    /* Handle the case where a broadcast is ongoing */
-    if (cv->broadcasting) {
-        if (cv->waiters > 0) {
-            /* Signal the next thread and continue */
-            seL4_Signal(cv->notification.cptr);
-        } else {
-            /* This is the last thread, so stop broadcasting */
-            cv->broadcasting = false;
+    /* Reacquire the lock. Our queue entry is on the stack, so take it
+     * off the queue if the wake up was not from the condition variable. */
+    error = sync_bin_sem_wait(lock);
+    if (!waiter.woken) {
+        if (error != 0) {
+            ZF_LOGF("Failed to reacquire lock to dequeue condition variable waiter");
         }
+        sync_cv_waiter_unlink(cv, &waiter);
     }
-
-    return 0;
+    return error;
 }
 
 /* Signal a condition variable.
@@ -103,7 +213,10 @@ static inline int sync_cv_signal(sync_cv_t *cv)
         ZF_LOGE("Condition variable passed to sync_cv_signal is NULL");
         return -1;
     }
-    if (cv->waiters > 0) {
+    if (sync_cv_wake_private(cv)) {
+        return 0;
+    }
+    if (cv->waiters > 0 && sync_cv_add_wakeups(cv, 1)) {
         seL4_Signal(cv->notification.cptr);
     }
 
@@ -121,8 +234,11 @@ static inline int sync_cv_broadcast(sync_cv_t *cv)
         return -1;
     }
 
-    if (cv->waiters > 0) {
-        cv->broadcasting = true;
+    while (cv->head != NULL) {
+        sync_cv_wake_private(cv);
+    }
+
+    if (cv->waiters > 0 && sync_cv_add_wakeups(cv, cv->waiters)) {
         seL4_Signal(cv->notification.cptr);
     }
 
@@ -143,19 +259,21 @@ static inline int sync_cv_broadcast_release(sync_bin_sem_t *lock, sync_cv_t *cv)
         return -1;
     }
 
-    if (cv->waiters > 0) {
-        cv->broadcasting = true;
-
-        int error = sync_bin_sem_post(lock);
-        if (error != 0) {
-            return error;
-        }
+    /* Queue entries are only valid while we hold the lock, so private
+     * waiters are signalled before it is released. */
+    while (cv->head != NULL) {
+        sync_cv_wake_private(cv);
+    }
 
+    bool wake = cv->waiters > 0 && sync_cv_add_wakeups(cv, cv->waiters);
+    int error = sync_bin_sem_post(lock);
+    if (error != 0) {
+        return error;
+    }
+    if (wake) {
         seL4_Signal(cv->notification.cptr);
-        return 0;
-    } else {
-        return sync_bin_sem_post(lock);
     }
+    return 0;
 }
 
 /* Initialise a managed condition variable.
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* Futex-style waiting on an address.
+ *
+ * The other primitives in this library each need their own notification.
+ * Here a thread waits on any int in memory, and a pool shared by the whole
+ * component provides the notifications. A waiting thread borrows a
+ * notification from the pool, queues itself in a hash bucket for the address,
+ * and blocks. A waker looks the address up in the same bucket and signals the
+ * notifications of the threads queued on it. The pool only needs as many
+ * notifications as threads that can block at once, however many addresses are
+ * waited on.
+ *
+ * On top of this, sync_futex_mutex_t is a mutex that is just an int and needs
+ * no kernel object of its own.
+ *
+ * The buckets and the pool's free notifications are protected by a single
+ * lock per pool, which is only held for a few instructions. A thread that
+ * finds it held blocks on a notification of the pool instead of spinning, so
+ * it never depends on seL4_Yield letting the holder run; seL4_Yield only
+ * hands the core to threads of the same priority. A thread that finds every
+ * notification of the pool lent out also blocks, on another notification of
+ * the pool, until one is returned.
+ *
+ * Threads of any priority may share a pool, but there is no priority
+ * inheritance: a low priority thread that is preempted while holding the pool
+ * lock, or while holding a futex mutex, delays higher priority threads that
+ * need it for as long as it is kept from running. Threads that must not be
+ * delayed by lower priority threads should use their own pool.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sel4/sel4.h>
+#include <sync/bin_sem_bare.h>
+#include <vka/vka.h>
+#include <vka/object.h>
+#include <utils/util.h>
+
+/* Number of hash buckets in a pool. */
+#define SYNC_FUTEX_BUCKET_BITS 6
+#define SYNC_FUTEX_BUCKETS BIT(SYNC_FUTEX_BUCKET_BITS)
+
+/* A thread waiting on an address. These live on the stack of the waiting
+ * thread and are only touched with the pool lock held. */
+typedef struct sync_futex_waiter {
+    volatile int *addr;
+    seL4_CPtr notification;
+    volatile bool woken;
+    struct sync_futex_waiter *next;
+} sync_futex_waiter_t;
+
+typedef struct {
+    /* Number of queued waiters, read without the lock by wakers */
+    volatile int waiters;
+    /* Queue of waiters on any address that hashes to this bucket, oldest
+     * first */
+    sync_futex_waiter_t *head;
+    sync_futex_waiter_t *tail;
+} sync_futex_bucket_t;
+
+/* This struct is intended to be opaque. Callers should not touch any of its
+ * members. */
+typedef struct {
+    sync_futex_bucket_t buckets[SYNC_FUTEX_BUCKETS];
+    /* Binary semaphore protecting the buckets and the free stack */
+    seL4_CPtr lock_notification;
+    volatile int lock_value;
+    /* Threads waiting for a notification to be returned to the free stack
+     * block on free_notification */
+    seL4_CPtr free_notification;
+    int num_starved;
+    /* Stack of notifications that no thread is waiting on */
+    int num_free;
+    seL4_CPtr *free;
+    /* Only set for pools made by sync_futex_pool_new, which also allocates
+     * the lock and free notifications at the end of notifications */
+    int num_notifications;
+    vka_object_t *notifications;
+} sync_futex_pool_t;
+
+/* A mutex that needs no notification of its own. 0 is unlocked, 1 is locked
+ * and 2 is locked with possible waiters. */
+typedef struct {
+    volatile int state;
+} sync_futex_mutex_t;
+
+#define SYNC_FUTEX_MUTEX_INIT { 0 }
+
+/* Initialise an unmanaged futex pool
+ * @param pool              A pool object to be initialised.
+ * @param lock_notification A notification object that threads block on while
+ *                          the pool lock is held.
+ * @param free_notification A notification object that threads block on while
+ *                          every notification in notifications is lent out.
+ * @param notifications     Notification objects to lend to waiting threads.
+ *                          The array is used by the pool as storage, and must
+ *                          stay valid for as long as the pool is used.
+ * @param num_notifications The number of entries in notifications. A thread
+ *                          that waits while all of them are in use blocks
+ *                          until one is returned.
+ * @return                  0 on success, an error code on failure. */
+int sync_futex_pool_init(sync_futex_pool_t *pool, seL4_CPtr lock_notification, seL4_CPtr free_notification,
+                         seL4_CPtr *notifications, int num_notifications);
+
+/* Allocate and initialise a managed futex pool
+ * @param vka               A VKA instance used to allocate notification objects.
+ * @param pool              A pool object to initialise.
+ * @param num_notifications The number of notification objects to lend to
+ *                          waiting threads. Two more are allocated for the
+ *                          pool itself.
+ * @return                  0 on success, an error code on failure. */
+int sync_futex_pool_new(vka_t *vka, sync_futex_pool_t *pool, int num_notifications);
+
+/* Deallocate a managed futex pool (do not use with sync_futex_pool_init). No
+ * thread may be waiting on the pool.
+ * @param vka               A VKA instance used to deallocate the notification objects.
+ * @param pool              A pool object initialised by sync_futex_pool_new.
+ * @return                  0 on success, an error code on failure. */
+int sync_futex_pool_destroy(vka_t *vka, sync_futex_pool_t *pool);
+
+/* Block while *addr holds expected
+ * The value is checked with the pool lock held, so a thread that changes it
+ * and then calls sync_futex_wake cannot be missed. As with any futex, this can
+ * return without a wake up and the caller should check its condition again.
+ * @param pool              An initialised pool.
+ * @param addr              Address to wait on.
+ * @param expected          Value *addr must still hold for the thread to block.
+ * @return                  0 after waiting, -EAGAIN if *addr did not hold
+ *                          expected, another error code on failure. */
+int sync_futex_wait(sync_futex_pool_t *pool, volatile int *addr, int expected);
+
+/* Wake threads waiting on an address, oldest first
+ * @param pool              An initialised pool.
+ * @param addr              Address the threads wait on.
+ * @param count             The most threads to wake. INT_MAX wakes all.
+ * @return                  The number of threads woken. */
+int sync_futex_wake(sync_futex_pool_t *pool, volatile int *addr, int count);
+
+/* Initialise a futex mutex
+ * @param mutex             A mutex object to be initialised. */
+static inline void sync_futex_mutex_init(sync_futex_mutex_t *mutex)
+{
+    mutex->state = 0;
+}
+
+/* Acquire a futex mutex
+ * @param pool              The pool the mutex blocks on.
+ * @param mutex             An initialised mutex to acquire.
+ * @return                  0 on success, an error code on failure. */
+static inline int sync_futex_mutex_lock(sync_futex_pool_t *pool, sync_futex_mutex_t *mutex)
+{
+    int state = 0;
+    if (__atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    /* Mark the mutex as contended so the holder knows to wake us */
+    if (state != 2) {
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+    while (state != 0) {
+        int error = sync_futex_wait(pool, &mutex->state, 2);
+        if (error != 0 && error != -EAGAIN) {
+            return error;
+        }
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+/* Try to acquire a futex mutex without blocking
+ * @param mutex             An initialised mutex to acquire.
+ * @return                  0 if the mutex was acquired, -1 if it is held. */
+static inline int sync_futex_mutex_trylock(sync_futex_mutex_t *mutex)
+{
+    int state = 0;
+    return __atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+/* Release a futex mutex
+ * @param pool              The pool the mutex blocks on.
+ * @param mutex             An initialised mutex to release.
+ * @return                  0 on success, an error code on failure. */
+static inline int sync_futex_mutex_unlock(sync_futex_pool_t *pool, sync_futex_mutex_t *mutex)
+{
+    if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+        /* There may be waiters */
+        __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+        sync_futex_wake(pool, &mutex->state, 1);
+    }
+    return 0;
+}
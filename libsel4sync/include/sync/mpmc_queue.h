@@ -0,0 +1,214 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A bounded lock-free multi-producer, multi-consumer queue of fixed size
+ * elements.
+ *
+ * Each slot carries a sequence number that says whether it is ready to be
+ * written or read in the current lap of the queue. Producers claim a slot by
+ * advancing enqueue_pos with a compare and swap, fill it, then publish it by
+ * bumping its sequence number; consumers do the same with dequeue_pos. The two
+ * positions live on separate cache lines. A thread that is preempted between
+ * claiming and publishing a slot only holds up the threads that want that
+ * slot, never the whole queue.
+ *
+ * As with sync_spsc_ring_t, the queue may live in memory shared between
+ * address spaces: one side formats it with sync_mpmc_queue_init and every
+ * other user attaches with sync_mpmc_queue_attach. The blocking calls sleep on
+ * a notification shared by all consumers (or all producers) and are only
+ * signalled while one of them has said it is asleep.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sel4/sel4.h>
+#include <utils/util.h>
+#include <sync/cache.h>
+
+#define SYNC_MPMC_QUEUE_MAGIC 0x4d504d43
+
+/* Each slot is a sequence number followed by the element, padded so that
+ * elements stay 8 byte aligned. */
+#define SYNC_MPMC_QUEUE_SLOT_HEADER 8
+#define SYNC_MPMC_QUEUE_SLOT_SIZE(elem_size) (SYNC_MPMC_QUEUE_SLOT_HEADER + ROUND_UP((elem_size), 8))
+
+/* Layout of the shared memory. */
+typedef struct sync_mpmc_queue_shared {
+    /* Set by sync_mpmc_queue_init and not changed after. */
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t elem_size;
+    /* Next slot to be claimed by a producer. */
+    uint32_t enqueue_pos ALIGN(SYNC_CACHE_LINE_SIZE);
+    /* Consumers asleep on an empty queue. Kept on the line producers write as
+     * they check it on every enqueue. */
+    uint32_t consumers_waiting;
+    /* Next slot to be claimed by a consumer. */
+    uint32_t dequeue_pos ALIGN(SYNC_CACHE_LINE_SIZE);
+    /* Producers asleep on a full queue. */
+    uint32_t producers_waiting;
+    char slots[] ALIGN(SYNC_CACHE_LINE_SIZE);
+} sync_mpmc_queue_shared_t;
+
+/* Handle on a queue, one for each address space. Callers should not touch any
+ * of its members. */
+typedef struct {
+    sync_mpmc_queue_shared_t *shared;
+    uint32_t capacity;
+    uint32_t elem_size;
+    uint32_t slot_size;
+    /* Signalled by producers when there is data, waited on by consumers */
+    seL4_CPtr data_notification;
+    /* Signalled by consumers when there is space, waited on by producers */
+    seL4_CPtr space_notification;
+} sync_mpmc_queue_t;
+
+/* Number of bytes of memory needed for a queue
+ * @param capacity      Number of elements, must be a power of 2.
+ * @param elem_size     Size of one element in bytes.
+ * @return              Bytes needed. */
+static inline size_t sync_mpmc_queue_mem_size(uint32_t capacity, uint32_t elem_size)
+{
+    return sizeof(sync_mpmc_queue_shared_t) + (size_t) capacity * SYNC_MPMC_QUEUE_SLOT_SIZE(elem_size);
+}
+
+/* Format memory as an empty queue and set up a handle on it
+ * @param queue                 Handle to initialise.
+ * @param mem                   Memory for the queue, aligned to a cache line.
+ * @param mem_size              Size of mem in bytes.
+ * @param capacity              Number of elements, must be a power of 2.
+ * @param elem_size             Size of one element in bytes.
+ * @param data_notification     Notification consumers block on, or
+ *                              seL4_CapNull if they never block.
+ * @param space_notification    Notification producers block on, or
+ *                              seL4_CapNull if they never block.
+ * @return                      0 on success, an error code on failure. */
+int sync_mpmc_queue_init(sync_mpmc_queue_t *queue, void *mem, size_t mem_size, uint32_t capacity,
+                         uint32_t elem_size, seL4_CPtr data_notification, seL4_CPtr space_notification);
+
+/* Set up a handle on a queue that has been formatted by sync_mpmc_queue_init,
+ * possibly in another address space
+ * @param queue                 Handle to initialise.
+ * @param mem                   Memory of the queue.
+ * @param mem_size              Size of mem in bytes.
+ * @param data_notification     As for sync_mpmc_queue_init.
+ * @param space_notification    As for sync_mpmc_queue_init.
+ * @return                      0 on success, an error code on failure. */
+int sync_mpmc_queue_attach(sync_mpmc_queue_t *queue, void *mem, size_t mem_size,
+                           seL4_CPtr data_notification, seL4_CPtr space_notification);
+
+static inline uint32_t *sync_mpmc_queue_slot_seq(sync_mpmc_queue_t *queue, uint32_t pos)
+{
+    return (uint32_t *) &queue->shared->slots[(size_t)(pos & (queue->capacity - 1)) * queue->slot_size];
+}
+
+static inline void *sync_mpmc_queue_slot_data(sync_mpmc_queue_t *queue, uint32_t pos)
+{
+    return &queue->shared->slots[(size_t)(pos & (queue->capacity - 1)) * queue->slot_size +
+                                 SYNC_MPMC_QUEUE_SLOT_HEADER];
+}
+
+/* Wake one sleeper if any have said they are asleep. See
+ * sync_spsc_ring_wake. */
+static inline void sync_mpmc_queue_wake(uint32_t *waiting, seL4_CPtr notification)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+        seL4_Signal(notification);
+    }
+}
+
+/* Claim the slot at *pos_ptr, which is ready when its sequence number is
+ * pos + lap. */
+static inline int sync_mpmc_queue_claim(sync_mpmc_queue_t *queue, uint32_t *pos_ptr, uint32_t lap,
+                                        uint32_t *claimed)
+{
+    uint32_t pos = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+    while (true) {
+        uint32_t seq = __atomic_load_n(sync_mpmc_queue_slot_seq(queue, pos), __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(seq - (pos + lap));
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(pos_ptr, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *claimed = pos;
+                return 0;
+            }
+            /* pos now holds the new position, try again */
+        } else if (diff < 0) {
+            /* The slot is still in use from the previous lap */
+            if ((int32_t)(seq - (pos + lap - queue->capacity)) < 0) {
+                ZF_LOGE("Queue corrupt (pos %u, seq %u)", pos, seq);
+                return -EINVAL;
+            }
+            return -1;
+        } else {
+            /* Another thread got this slot, start again from where it left */
+            uint32_t old_pos = pos;
+            pos = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+            if (pos == old_pos) {
+                /* The claim of the slot happens before it is published, so
+                 * the position must have moved on. */
+                ZF_LOGE("Queue corrupt (pos %u, seq %u)", pos, seq);
+                return -EINVAL;
+            }
+        }
+    }
+}
+
+/* Append an element without blocking
+ * @param queue         Handle on the queue.
+ * @param elem          Element to copy in.
+ * @return              0 on success, -1 if the queue is full, -EINVAL if it
+ *                      is corrupt. */
+static inline int sync_mpmc_queue_try_enqueue(sync_mpmc_queue_t *queue, const void *elem)
+{
+    uint32_t pos;
+    int error = sync_mpmc_queue_claim(queue, &queue->shared->enqueue_pos, 0, &pos);
+    if (error != 0) {
+        return error;
+    }
+    memcpy(sync_mpmc_queue_slot_data(queue, pos), elem, queue->elem_size);
+    __atomic_store_n(sync_mpmc_queue_slot_seq(queue, pos), pos + 1, __ATOMIC_RELEASE);
+    sync_mpmc_queue_wake(&queue->shared->consumers_waiting, queue->data_notification);
+    return 0;
+}
+
+/* Remove the oldest element without blocking
+ * @param queue         Handle on the queue.
+ * @param elem          Where to copy the element to.
+ * @return              0 on success, -1 if the queue is empty, -EINVAL if it
+ *                      is corrupt. */
+static inline int sync_mpmc_queue_try_dequeue(sync_mpmc_queue_t *queue, void *elem)
+{
+    uint32_t pos;
+    int error = sync_mpmc_queue_claim(queue, &queue->shared->dequeue_pos, 1, &pos);
+    if (error != 0) {
+        return error;
+    }
+    memcpy(elem, sync_mpmc_queue_slot_data(queue, pos), queue->elem_size);
+    __atomic_store_n(sync_mpmc_queue_slot_seq(queue, pos), pos + queue->capacity, __ATOMIC_RELEASE);
+    sync_mpmc_queue_wake(&queue->shared->producers_waiting, queue->space_notification);
+    return 0;
+}
+
+/* Append an element, blocking on the space notification while the queue is
+ * full
+ * @param queue         Handle on the queue.
+ * @param elem          Element to copy in.
+ * @return              0 on success, an error code on failure. */
+int sync_mpmc_queue_enqueue(sync_mpmc_queue_t *queue, const void *elem);
+
+/* Remove the oldest element, blocking on the data notification while the
+ * queue is empty
+ * @param queue         Handle on the queue.
+ * @param elem          Where to copy the element to.
+ * @return              0 on success, an error code on failure. */
+int sync_mpmc_queue_dequeue(sync_mpmc_queue_t *queue, void *elem);
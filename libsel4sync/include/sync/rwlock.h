@@ -0,0 +1,206 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A reader-writer lock with writer preference.
+ *
+ * The lock state is a single word holding the number of readers, a bit for a
+ * writer and a bit that is set while any thread is queued. When the queued bit
+ * is clear, readers and writers take and release the lock with one atomic
+ * operation and no system calls. Otherwise they take a short internal guard
+ * (a binary semaphore) to queue themselves or to hand the lock on.
+ *
+ * New readers queue behind a waiting writer, so a stream of readers cannot
+ * starve writers. When a writer releases the lock it admits all queued readers
+ * as one batch before the next writer, so writers cannot starve readers
+ * either. The lock is handed directly to the threads it wakes.
+ *
+ * Readers and writers wait on separate notifications. At most one wake up is
+ * ever outstanding on each: a batch of readers is woken one after another, each
+ * woken reader waking the next.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <assert.h>
+#include <sel4/sel4.h>
+#ifdef CONFIG_DEBUG_BUILD
+#include <sel4debug/debug.h>
+#endif
+#include <vka/vka.h>
+#include <vka/object.h>
+#include <sync/bin_sem_bare.h>
+
+#define SYNC_RWLOCK_WRITER          (1 << 30)
+#define SYNC_RWLOCK_WAITERS         (1 << 29)
+#define SYNC_RWLOCK_READERS_MASK    (SYNC_RWLOCK_WAITERS - 1)
+
+/* This struct is intended to be opaque, but is left here so you can
+ * stack-allocate locks. Callers should not touch any of its members.
+ */
+typedef struct {
+    vka_object_t guard_notification;
+    vka_object_t read_notification;
+    vka_object_t write_notification;
+    volatile int guard_value;
+    volatile int state;
+    /* The following are protected by the guard. */
+    int waiting_readers;
+    int waiting_writers;
+    /* Readers of the current batch that are still to be woken. */
+    int read_wake;
+} sync_rwlock_t;
+
+/* Initialise an unmanaged reader-writer lock with notification objects
+ * @param lock                  A lock object to be initialised.
+ * @param guard_notification    A notification object for the internal guard.
+ * @param read_notification     A notification object readers wait on.
+ * @param write_notification    A notification object writers wait on.
+ * @return                      0 on success, an error code on failure. */
+static inline int sync_rwlock_init(sync_rwlock_t *lock, seL4_CPtr guard_notification,
+                                   seL4_CPtr read_notification, seL4_CPtr write_notification)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_init was NULL");
+        return -1;
+    }
+#ifdef CONFIG_DEBUG_BUILD
+    /* Check the caps actually are notifications. */
+    assert(debug_cap_is_notification(guard_notification));
+    assert(debug_cap_is_notification(read_notification));
+    assert(debug_cap_is_notification(write_notification));
+#endif
+
+    lock->guard_notification.cptr = guard_notification;
+    lock->read_notification.cptr = read_notification;
+    lock->write_notification.cptr = write_notification;
+    lock->guard_value = 1;
+    lock->state = 0;
+    lock->waiting_readers = 0;
+    lock->waiting_writers = 0;
+    lock->read_wake = 0;
+    return 0;
+}
+
+/* Slow paths of the functions below, for when threads are queued. */
+int sync_rwlock_read_lock_contended(sync_rwlock_t *lock);
+int sync_rwlock_read_unlock_contended(sync_rwlock_t *lock);
+int sync_rwlock_write_lock_contended(sync_rwlock_t *lock);
+int sync_rwlock_write_unlock_contended(sync_rwlock_t *lock);
+
+/* Acquire a reader-writer lock for reading
+ * @param lock          An initialised lock to acquire.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_read_lock(sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_read_lock was NULL");
+        return -1;
+    }
+    int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    if (!(state & (SYNC_RWLOCK_WRITER | SYNC_RWLOCK_WAITERS)) &&
+        __atomic_compare_exchange_n(&lock->state, &state, state + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return sync_rwlock_read_lock_contended(lock);
+}
+
+/* Release a reader-writer lock held for reading
+ * @param lock          An initialised lock held for reading.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_read_unlock(sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_read_unlock was NULL");
+        return -1;
+    }
+    int state = __atomic_sub_fetch(&lock->state, 1, __ATOMIC_RELEASE);
+    assert((state & SYNC_RWLOCK_READERS_MASK) != SYNC_RWLOCK_READERS_MASK);
+    if ((state & SYNC_RWLOCK_WAITERS) && !(state & SYNC_RWLOCK_READERS_MASK)) {
+        /* We were the last reader and someone is queued. */
+        return sync_rwlock_read_unlock_contended(lock);
+    }
+    return 0;
+}
+
+/* Acquire a reader-writer lock for writing
+ * @param lock          An initialised lock to acquire.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_write_lock(sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_write_lock was NULL");
+        return -1;
+    }
+    int state = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &state, SYNC_RWLOCK_WRITER, 0, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    return sync_rwlock_write_lock_contended(lock);
+}
+
+/* Release a reader-writer lock held for writing
+ * @param lock          An initialised lock held for writing.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_write_unlock(sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_write_unlock was NULL");
+        return -1;
+    }
+    int state = SYNC_RWLOCK_WRITER;
+    if (__atomic_compare_exchange_n(&lock->state, &state, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    assert(state & SYNC_RWLOCK_WRITER);
+    return sync_rwlock_write_unlock_contended(lock);
+}
+
+/* Allocate and initialise a managed reader-writer lock
+ * @param vka           A VKA instance used to allocate the notification objects.
+ * @param lock          A lock object to initialise.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_new(vka_t *vka, sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_new was NULL");
+        return -1;
+    }
+    int error = vka_alloc_notification(vka, &(lock->guard_notification));
+    if (error != 0) {
+        return error;
+    }
+    error = vka_alloc_notification(vka, &(lock->read_notification));
+    if (error != 0) {
+        vka_free_object(vka, &(lock->guard_notification));
+        return error;
+    }
+    error = vka_alloc_notification(vka, &(lock->write_notification));
+    if (error != 0) {
+        vka_free_object(vka, &(lock->read_notification));
+        vka_free_object(vka, &(lock->guard_notification));
+        return error;
+    }
+    return sync_rwlock_init(lock, lock->guard_notification.cptr, lock->read_notification.cptr,
+                            lock->write_notification.cptr);
+}
+
+/* Deallocate a managed reader-writer lock (do not use with sync_rwlock_init)
+ * @param vka           A VKA instance used to deallocate the notification objects.
+ * @param lock          A lock object initialised by sync_rwlock_new.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_rwlock_destroy(vka_t *vka, sync_rwlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_rwlock_destroy was NULL");
+        return -1;
+    }
+    vka_free_object(vka, &(lock->write_notification));
+    vka_free_object(vka, &(lock->read_notification));
+    vka_free_object(vka, &(lock->guard_notification));
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A sequence lock, for small records that are read far more often than they
+ * are written.
+ *
+ * Readers never write to shared memory and never block; they copy the record
+ * and retry if a write happened in the meantime. Writers must exclude each
+ * other by other means, for example a sync_mutex_t, or by there only being one
+ * writer. No notification is needed, so a seqlock can also protect a record in
+ * memory shared between address spaces.
+ *
+ * Fields of the protected record should be accessed with relaxed __atomic
+ * loads and stores (or through volatile pointers), as readers may see them
+ * mid-update:
+ *
+ *     uint32_t seq;
+ *     do {
+ *         seq = sync_seqlock_read_begin(&lock);
+ *         x = __atomic_load_n(&record.x, __ATOMIC_RELAXED);
+ *         y = __atomic_load_n(&record.y, __ATOMIC_RELAXED);
+ *     } while (sync_seqlock_read_retry(&lock, seq));
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <utils/util.h>
+
+typedef struct {
+    /* Odd while a write is in progress. */
+    volatile uint32_t sequence;
+} sync_seqlock_t;
+
+/* Initialise a seqlock
+ * @param lock          A seqlock object to be initialised.
+ * @return              0 on success, an error code on failure. */
+static inline int sync_seqlock_init(sync_seqlock_t *lock)
+{
+    if (lock == NULL) {
+        ZF_LOGE("Lock passed to sync_seqlock_init was NULL");
+        return -1;
+    }
+    lock->sequence = 0;
+    return 0;
+}
+
+/* Start reading the protected record
+ * @param lock          An initialised seqlock.
+ * @return              The sequence to pass to sync_seqlock_read_retry. */
+static inline uint32_t sync_seqlock_read_begin(sync_seqlock_t *lock)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE)) & 1) {
+        /* A write is in progress, anything we read would be discarded. */
+    }
+    return seq;
+}
+
+/* Finish reading the protected record
+ * @param lock          An initialised seqlock.
+ * @param seq           The value returned by sync_seqlock_read_begin.
+ * @return              true if a write overlapped the read and the values read
+ *                      must be discarded, false if they are consistent. */
+static inline bool sync_seqlock_read_retry(sync_seqlock_t *lock, uint32_t seq)
+{
+    /* Order the reads of the record before the second read of the sequence */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) != seq;
+}
+
+/* Start writing the protected record. The caller must exclude other writers.
+ * @param lock          An initialised seqlock. */
+static inline void sync_seqlock_write_begin(sync_seqlock_t *lock)
+{
+    uint32_t seq = lock->sequence;
+    assert(!(seq & 1));
+    __atomic_store_n(&lock->sequence, seq + 1, __ATOMIC_RELAXED);
+    /* Order the sequence update before the writes of the record */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Finish writing the protected record
+ * @param lock          An initialised seqlock, after sync_seqlock_write_begin. */
+static inline void sync_seqlock_write_end(sync_seqlock_t *lock)
+{
+    uint32_t seq = lock->sequence;
+    assert(seq & 1);
+    __atomic_store_n(&lock->sequence, seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/* A lock-free single-producer, single-consumer ring of fixed size elements.
+ *
+ * The ring lives in memory that may be shared between address spaces, for
+ * example a frame mapped into two processes. One side formats the memory with
+ * sync_spsc_ring_init and the other attaches to it with sync_spsc_ring_attach.
+ * Each side then uses its own sync_spsc_ring_t handle.
+ *
+ * The producer only writes head and the consumer only writes tail, and the two
+ * live on separate cache lines. Each side also caches the other's index and
+ * only rereads it when the ring looks full (or empty), so in the steady state
+ * a push or pop touches no cache line written by the other side.
+ *
+ * The blocking calls sleep on a notification. A side only announces that it
+ * is asleep after finding the ring empty (or full), and the other side only
+ * signals when it sees that announcement, so no system calls are made while
+ * both sides keep up with each other.
+ *
+ * Memory shared with another address space cannot be trusted. An index that
+ * is out of range is reported as an error, never followed.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sel4/sel4.h>
+#include <utils/util.h>
+#include <sync/cache.h>
+
+#define SYNC_SPSC_RING_MAGIC 0x53505343
+
+/* Layout of the shared memory. */
+typedef struct sync_spsc_ring_shared {
+    /* Set by sync_spsc_ring_init and not changed after. */
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t elem_size;
+    /* Next element the producer will write, only written by the producer. */
+    uint32_t head ALIGN(SYNC_CACHE_LINE_SIZE);
+    /* Set by the consumer when it goes to sleep on an empty ring. Kept on the
+     * line the producer writes as the producer checks it on every push. */
+    uint32_t consumer_waiting;
+    /* Next element the consumer will read, only written by the consumer. */
+    uint32_t tail ALIGN(SYNC_CACHE_LINE_SIZE);
+    /* Set by the producer when it goes to sleep on a full ring. */
+    uint32_t producer_waiting;
+    char data[] ALIGN(SYNC_CACHE_LINE_SIZE);
+} sync_spsc_ring_shared_t;
+
+/* Handle on a ring, one for each side. Callers should not touch any of its
+ * members. */
+typedef struct {
+    sync_spsc_ring_shared_t *shared;
+    uint32_t capacity;
+    uint32_t elem_size;
+    /* Our own index, and the last value read of the other side's index. These
+     * are kept here so that the other side cannot change our view of them. */
+    uint32_t head;
+    uint32_t tail;
+    /* Signalled by the producer when there is data, waited on by the consumer */
+    seL4_CPtr data_notification;
+    /* Signalled by the consumer when there is space, waited on by the producer */
+    seL4_CPtr space_notification;
+} sync_spsc_ring_t;
+
+/* Number of bytes of memory needed for a ring
+ * @param capacity      Number of elements, must be a power of 2.
+ * @param elem_size     Size of one element in bytes.
+ * @return              Bytes needed. */
+static inline size_t sync_spsc_ring_mem_size(uint32_t capacity, uint32_t elem_size)
+{
+    return sizeof(sync_spsc_ring_shared_t) + (size_t) capacity * elem_size;
+}
+
+/* Format memory as an empty ring and set up a handle on it
+ * @param ring                  Handle to initialise.
+ * @param mem                   Memory for the ring, aligned to a cache line.
+ * @param mem_size              Size of mem in bytes.
+ * @param capacity              Number of elements, must be a power of 2.
+ * @param elem_size             Size of one element in bytes.
+ * @param data_notification     Notification the consumer blocks on, or
+ *                              seL4_CapNull if it never blocks.
+ * @param space_notification    Notification the producer blocks on, or
+ *                              seL4_CapNull if it never blocks.
+ * @return                      0 on success, an error code on failure. */
+int sync_spsc_ring_init(sync_spsc_ring_t *ring, void *mem, size_t mem_size, uint32_t capacity,
+                        uint32_t elem_size, seL4_CPtr data_notification, seL4_CPtr space_notification);
+
+/* Set up a handle on a ring that has been formatted by sync_spsc_ring_init,
+ * possibly in another address space
+ * @param ring                  Handle to initialise.
+ * @param mem                   Memory of the ring.
+ * @param mem_size              Size of mem in bytes.
+ * @param data_notification     As for sync_spsc_ring_init.
+ * @param space_notification    As for sync_spsc_ring_init.
+ * @return                      0 on success, an error code on failure. */
+int sync_spsc_ring_attach(sync_spsc_ring_t *ring, void *mem, size_t mem_size,
+                          seL4_CPtr data_notification, seL4_CPtr space_notification);
+
+/* Wake the other side if it has said it is asleep. Dekker style: we have just
+ * published our index, the other side set its flag before checking our index
+ * one last time, and the fence makes sure one of us sees the other. */
+static inline void sync_spsc_ring_wake(uint32_t *waiting, seL4_CPtr notification)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED)) {
+        seL4_Signal(notification);
+    }
+}
+
+/* Append an element without blocking. Only the producer may call this.
+ * @param ring          Producer's handle.
+ * @param elem          Element to copy in.
+ * @return              0 on success, -1 if the ring is full, -EINVAL if it is
+ *                      corrupt. */
+static inline int sync_spsc_ring_try_push(sync_spsc_ring_t *ring, const void *elem)
+{
+    sync_spsc_ring_shared_t *shared = ring->shared;
+    uint32_t head = ring->head;
+
+    if (head - ring->tail >= ring->capacity) {
+        ring->tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+        uint32_t used = head - ring->tail;
+        if (used > ring->capacity) {
+            ZF_LOGE("Ring corrupt (head %u, tail %u)", head, ring->tail);
+            return -EINVAL;
+        }
+        if (used == ring->capacity) {
+            return -1;
+        }
+    }
+
+    memcpy(&shared->data[(size_t)(head & (ring->capacity - 1)) * ring->elem_size], elem, ring->elem_size);
+    ring->head = head + 1;
+    __atomic_store_n(&shared->head, ring->head, __ATOMIC_RELEASE);
+    sync_spsc_ring_wake(&shared->consumer_waiting, ring->data_notification);
+    return 0;
+}
+
+/* Remove the oldest element without blocking. Only the consumer may call this.
+ * @param ring          Consumer's handle.
+ * @param elem          Where to copy the element to.
+ * @return              0 on success, -1 if the ring is empty, -EINVAL if it is
+ *                      corrupt. */
+static inline int sync_spsc_ring_try_pop(sync_spsc_ring_t *ring, void *elem)
+{
+    sync_spsc_ring_shared_t *shared = ring->shared;
+    uint32_t tail = ring->tail;
+
+    if (ring->head == tail) {
+        ring->head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+        uint32_t used = ring->head - tail;
+        if (used > ring->capacity) {
+            ZF_LOGE("Ring corrupt (head %u, tail %u)", ring->head, tail);
+            return -EINVAL;
+        }
+        if (used == 0) {
+            return -1;
+        }
+    }
+
+    memcpy(elem, &shared->data[(size_t)(tail & (ring->capacity - 1)) * ring->elem_size], ring->elem_size);
+    ring->tail = tail + 1;
+    __atomic_store_n(&shared->tail, ring->tail, __ATOMIC_RELEASE);
+    sync_spsc_ring_wake(&shared->producer_waiting, ring->space_notification);
+    return 0;
+}
+
+/* Append an element, blocking on the space notification while the ring is
+ * full. Only the producer may call this.
+ * @param ring          Producer's handle.
+ * @param elem          Element to copy in.
+ * @return              0 on success, an error code on failure. */
+int sync_spsc_ring_push(sync_spsc_ring_t *ring, const void *elem);
+
+/* Remove the oldest element, blocking on the data notification while the ring
+ * is empty. Only the consumer may call this.
+ * @param ring          Consumer's handle.
+ * @param elem          Where to copy the element to.
+ * @return              0 on success, an error code on failure. */
+int sync_spsc_ring_pop(sync_spsc_ring_t *ring, void *elem);
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sync/adaptive_mutex.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <utils/util.h>
+
+#include <sel4/sel4.h>
+#include <platsupport/sync/atomic.h>
+
+int sync_adaptive_mutex_lock_contended(sync_adaptive_mutex_t *mutex)
+{
+    unsigned int spins = 0;
+    unsigned int backoff = 1;
+    int val;
+
+    while (spins < mutex->spin_limit) {
+        for (unsigned int i = 0; i < backoff; i++) {
+            sync_cpu_relax();
+        }
+        spins += backoff;
+        backoff = MIN(backoff * 2, SYNC_ADAPTIVE_MUTEX_MAX_BACKOFF);
+
+        val = __atomic_load_n(&mutex->value, __ATOMIC_RELAXED);
+        if (val < 0) {
+            /* Someone is blocked on the mutex and will be handed it next, so
+             * there is no point spinning any longer. */
+            break;
+        }
+        if (val > 0 && __atomic_compare_exchange_n(&mutex->value, &val, val - 1, 0,
+                                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            mutex->stats.acquires++;
+            mutex->stats.contended++;
+            mutex->stats.spin_acquires++;
+            mutex->stats.spin_iterations += spins;
+            return 0;
+        }
+    }
+
+    /* As sync_bin_sem_bare_wait, but we want to know whether we blocked. */
+    int oldval;
+    int result = sync_atomic_decrement_safe(&mutex->value, &oldval, __ATOMIC_ACQUIRE);
+    if (result != 0) {
+        /* Failed decrement; too many outstanding lock holders. */
+        return -1;
+    }
+    bool blocked = oldval <= 0;
+    if (blocked) {
+        seL4_Wait(mutex->notification.cptr, NULL);
+        /* Even though we performed an acquire barrier during the atomic
+         * decrement we did not actually have the lock yet, so we have
+         * to do another one now */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+
+    mutex->stats.acquires++;
+    mutex->stats.contended++;
+    mutex->stats.spin_iterations += spins;
+    if (blocked) {
+        mutex->stats.blocks++;
+    }
+    return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sync/futex.h>
+#include <sync/bin_sem_bare.h>
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <utils/util.h>
+
+#include <sel4/sel4.h>
+
+static void futex_lock(sync_futex_pool_t *pool)
+{
+    UNUSED int error = sync_bin_sem_bare_wait(pool->lock_notification, &pool->lock_value);
+    assert(error == 0);
+}
+
+static void futex_unlock(sync_futex_pool_t *pool)
+{
+    sync_bin_sem_bare_post(pool->lock_notification, &pool->lock_value);
+}
+
+static sync_futex_bucket_t *futex_bucket(sync_futex_pool_t *pool, volatile int *addr)
+{
+    /* Fibonacci hashing of the word address */
+    uint32_t key = (uint32_t)((uintptr_t) addr / sizeof(int));
+    return &pool->buckets[(key * 2654435769u) >> (32 - SYNC_FUTEX_BUCKET_BITS)];
+}
+
+/* Signal a thread waiting for a free notification, if there is one. Signals
+ * to free_notification can merge, so this is also called whenever a thread
+ * takes a notification and leaves others behind, to pass the wake up on.
+ * Must be called with the pool lock held. */
+static void futex_wake_starved(sync_futex_pool_t *pool)
+{
+    if (pool->num_free > 0 && pool->num_starved > 0) {
+        seL4_Signal(pool->free_notification);
+    }
+}
+
+/* Must be called with the pool lock held. */
+static void futex_give_notification(sync_futex_pool_t *pool, seL4_CPtr notification)
+{
+    pool->free[pool->num_free] = notification;
+    pool->num_free++;
+    futex_wake_starved(pool);
+}
+
+int sync_futex_pool_init(sync_futex_pool_t *pool, seL4_CPtr lock_notification, seL4_CPtr free_notification,
+                         seL4_CPtr *notifications, int num_notifications)
+{
+    if (pool == NULL) {
+        ZF_LOGE("Pool passed to sync_futex_pool_init was NULL");
+        return -1;
+    }
+    if (lock_notification == seL4_CapNull || free_notification == seL4_CapNull) {
+        ZF_LOGE("Futex pool needs lock and free notifications");
+        return -1;
+    }
+    if (notifications == NULL || num_notifications <= 0) {
+        ZF_LOGE("Futex pool needs at least one notification");
+        return -1;
+    }
+
+    for (int i = 0; i < SYNC_FUTEX_BUCKETS; i++) {
+        pool->buckets[i] = (sync_futex_bucket_t) {
+            0
+        };
+    }
+    pool->lock_notification = lock_notification;
+    pool->lock_value = 1;
+    pool->free_notification = free_notification;
+    pool->num_starved = 0;
+    pool->free = notifications;
+    pool->num_free = num_notifications;
+    pool->num_notifications = 0;
+    pool->notifications = NULL;
+    return 0;
+}
+
+int sync_futex_pool_new(vka_t *vka, sync_futex_pool_t *pool, int num_notifications)
+{
+    if (pool == NULL) {
+        ZF_LOGE("Pool passed to sync_futex_pool_new was NULL");
+        return -1;
+    }
+    if (num_notifications <= 0) {
+        ZF_LOGE("Futex pool needs at least one notification");
+        return -1;
+    }
+
+    /* The lock and free notifications go after the ones that are lent out */
+    int num_objects = num_notifications + 2;
+    vka_object_t *objects = calloc(num_objects, sizeof(*objects));
+    seL4_CPtr *cptrs = calloc(num_notifications, sizeof(*cptrs));
+    if (objects == NULL || cptrs == NULL) {
+        ZF_LOGE("Failed to allocate futex pool");
+        free(objects);
+        free(cptrs);
+        return -1;
+    }
+
+    for (int i = 0; i < num_objects; i++) {
+        int error = vka_alloc_notification(vka, &objects[i]);
+        if (error != 0) {
+            ZF_LOGE("Failed to allocate notification %d of futex pool", i);
+            while (i-- > 0) {
+                vka_free_object(vka, &objects[i]);
+            }
+            free(objects);
+            free(cptrs);
+            return error;
+        }
+        if (i < num_notifications) {
+            cptrs[i] = objects[i].cptr;
+        }
+    }
+
+    int error = sync_futex_pool_init(pool, objects[num_notifications].cptr, objects[num_notifications + 1].cptr,
+                                     cptrs, num_notifications);
+    if (error != 0) {
+        return error;
+    }
+    pool->num_notifications = num_notifications;
+    pool->notifications = objects;
+    return 0;
+}
+
+int sync_futex_pool_destroy(vka_t *vka, sync_futex_pool_t *pool)
+{
+    if (pool == NULL) {
+        ZF_LOGE("Pool passed to sync_futex_pool_destroy was NULL");
+        return -1;
+    }
+    if (pool->num_free != pool->num_notifications) {
+        ZF_LOGE("Destroying futex pool with %d waiting threads", pool->num_notifications - pool->num_free);
+        return -1;
+    }
+    for (int i = 0; i < pool->num_notifications + 2; i++) {
+        vka_free_object(vka, &pool->notifications[i]);
+    }
+    free(pool->notifications);
+    free(pool->free);
+    pool->notifications = NULL;
+    pool->free = NULL;
+    pool->num_notifications = 0;
+    pool->num_free = 0;
+    return 0;
+}
+
+int sync_futex_wait(sync_futex_pool_t *pool, volatile int *addr, int expected)
+{
+    if (pool == NULL) {
+        ZF_LOGE("Pool passed to sync_futex_wait was NULL");
+        return -1;
+    }
+
+    futex_lock(pool);
+    while (pool->num_free == 0) {
+        /* Every notification is lent out. There is no point waiting for one
+         * if the value has already changed. */
+        if (__atomic_load_n(addr, __ATOMIC_ACQUIRE) != expected) {
+            futex_unlock(pool);
+            return -EAGAIN;
+        }
+        pool->num_starved++;
+        futex_unlock(pool);
+        seL4_Wait(pool->free_notification, NULL);
+        futex_lock(pool);
+        pool->num_starved--;
+    }
+    pool->num_free--;
+    seL4_CPtr notification = pool->free[pool->num_free];
+    futex_wake_starved(pool);
+
+    sync_futex_bucket_t *bucket = futex_bucket(pool, addr);
+    sync_futex_waiter_t waiter = {
+        .addr = addr,
+        .notification = notification,
+        .woken = false,
+        .next = NULL,
+    };
+
+    /* Announce ourselves before looking at the value. Pairs with the fence in
+     * sync_futex_wake, which skips the lock if it sees no waiters. */
+    __atomic_fetch_add(&bucket->waiters, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(addr, __ATOMIC_RELAXED) != expected) {
+        __atomic_fetch_sub(&bucket->waiters, 1, __ATOMIC_RELAXED);
+        futex_give_notification(pool, notification);
+        futex_unlock(pool);
+        return -EAGAIN;
+    }
+    if (bucket->tail != NULL) {
+        bucket->tail->next = &waiter;
+    } else {
+        bucket->head = &waiter;
+    }
+    bucket->tail = &waiter;
+    futex_unlock(pool);
+
+    /* The waker takes us off the queue before it signals. It may signal after
+     * we have seen woken, which leaves the notification signalled; whoever
+     * borrows it next then wakes once for nothing and waits again. */
+    while (!__atomic_load_n(&waiter.woken, __ATOMIC_ACQUIRE)) {
+        seL4_Wait(notification, NULL);
+    }
+
+    futex_lock(pool);
+    futex_give_notification(pool, notification);
+    futex_unlock(pool);
+    return 0;
+}
+
+int sync_futex_wake(sync_futex_pool_t *pool, volatile int *addr, int count)
+{
+    if (pool == NULL) {
+        ZF_LOGE("Pool passed to sync_futex_wake was NULL");
+        return 0;
+    }
+
+    sync_futex_bucket_t *bucket = futex_bucket(pool, addr);
+    /* Order the caller's change to *addr before looking for waiters */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bucket->waiters, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+
+    int woken = 0;
+    futex_lock(pool);
+    sync_futex_waiter_t *prev = NULL;
+    sync_futex_waiter_t *curr = bucket->head;
+    while (curr != NULL && woken < count) {
+        sync_futex_waiter_t *next = curr->next;
+        if (curr->addr != addr) {
+            prev = curr;
+            curr = next;
+            continue;
+        }
+
+        if (prev != NULL) {
+            prev->next = next;
+        } else {
+            bucket->head = next;
+        }
+        if (bucket->tail == curr) {
+            bucket->tail = prev;
+        }
+        __atomic_fetch_sub(&bucket->waiters, 1, __ATOMIC_RELAXED);
+
+        /* curr is on the waiter's stack and may be gone as soon as woken is
+         * set. */
+        seL4_CPtr notification = curr->notification;
+        __atomic_store_n(&curr->woken, true, __ATOMIC_RELEASE);
+        seL4_Signal(notification);
+        woken++;
+        curr = next;
+    }
+    futex_unlock(pool);
+    return woken;
+}
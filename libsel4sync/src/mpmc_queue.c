@@ -0,0 +1,161 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sync/mpmc_queue.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <utils/util.h>
+
+#include <sel4/sel4.h>
+
+static int mpmc_queue_check(void *mem, size_t mem_size, uint32_t capacity, uint32_t elem_size)
+{
+    if (mem == NULL || !IS_ALIGNED((uintptr_t) mem, CONFIG_L1_CACHE_LINE_SIZE_BITS)) {
+        ZF_LOGE("Queue memory must be cache line aligned");
+        return -EINVAL;
+    }
+    if (capacity == 0 || capacity > BIT(30) || (capacity & (capacity - 1)) != 0) {
+        ZF_LOGE("Queue capacity %u is not a power of 2", capacity);
+        return -EINVAL;
+    }
+    /* Rule out overflow in the size calculations before doing them */
+    if (elem_size == 0 || elem_size > UINT16_MAX ||
+        SYNC_MPMC_QUEUE_SLOT_SIZE(elem_size) > (SIZE_MAX - sizeof(sync_mpmc_queue_shared_t)) / capacity ||
+        mem_size < sync_mpmc_queue_mem_size(capacity, elem_size)) {
+        ZF_LOGE("Queue of %u elements of %u bytes does not fit in %zu bytes", capacity, elem_size, mem_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void mpmc_queue_handle_init(sync_mpmc_queue_t *queue, sync_mpmc_queue_shared_t *shared,
+                                   seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    queue->shared = shared;
+    queue->capacity = shared->capacity;
+    queue->elem_size = shared->elem_size;
+    queue->slot_size = SYNC_MPMC_QUEUE_SLOT_SIZE(shared->elem_size);
+    queue->data_notification = data_notification;
+    queue->space_notification = space_notification;
+}
+
+int sync_mpmc_queue_init(sync_mpmc_queue_t *queue, void *mem, size_t mem_size, uint32_t capacity,
+                         uint32_t elem_size, seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    if (queue == NULL) {
+        ZF_LOGE("Queue passed to sync_mpmc_queue_init was NULL");
+        return -EINVAL;
+    }
+    int error = mpmc_queue_check(mem, mem_size, capacity, elem_size);
+    if (error != 0) {
+        return error;
+    }
+
+    sync_mpmc_queue_shared_t *shared = mem;
+    shared->capacity = capacity;
+    shared->elem_size = elem_size;
+    shared->enqueue_pos = 0;
+    shared->consumers_waiting = 0;
+    shared->dequeue_pos = 0;
+    shared->producers_waiting = 0;
+    mpmc_queue_handle_init(queue, shared, data_notification, space_notification);
+
+    /* Slot i is ready for the producer that claims position i */
+    for (uint32_t i = 0; i < capacity; i++) {
+        *sync_mpmc_queue_slot_seq(queue, i) = i;
+    }
+    /* Whoever attaches must see the rest of the queue once they see this */
+    __atomic_store_n(&shared->magic, SYNC_MPMC_QUEUE_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int sync_mpmc_queue_attach(sync_mpmc_queue_t *queue, void *mem, size_t mem_size,
+                           seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    if (queue == NULL) {
+        ZF_LOGE("Queue passed to sync_mpmc_queue_attach was NULL");
+        return -EINVAL;
+    }
+    sync_mpmc_queue_shared_t *shared = mem;
+    if (shared == NULL || __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != SYNC_MPMC_QUEUE_MAGIC) {
+        ZF_LOGE("Memory does not hold a queue");
+        return -EINVAL;
+    }
+    /* Take a copy so that the other side cannot change them after the check */
+    uint32_t capacity = shared->capacity;
+    uint32_t elem_size = shared->elem_size;
+    int error = mpmc_queue_check(mem, mem_size, capacity, elem_size);
+    if (error != 0) {
+        return error;
+    }
+    mpmc_queue_handle_init(queue, shared, data_notification, space_notification);
+    queue->capacity = capacity;
+    queue->elem_size = elem_size;
+    queue->slot_size = SYNC_MPMC_QUEUE_SLOT_SIZE(elem_size);
+    return 0;
+}
+
+/* Block on notification until op stops reporting that the queue is full (or
+ * empty). Unlike the SPSC ring, several threads may sleep on the same
+ * notification, so waiting is a count, and the notification only wakes one of
+ * them at a time. */
+static int mpmc_queue_block(sync_mpmc_queue_t *queue, int (*op)(sync_mpmc_queue_t *, void *), void *elem,
+                            uint32_t *waiting, seL4_CPtr notification)
+{
+    int error = op(queue, elem);
+    if (error != -1) {
+        return error;
+    }
+    if (notification == seL4_CapNull) {
+        ZF_LOGE("Queue has no notification to block on");
+        return -EINVAL;
+    }
+
+    __atomic_fetch_add(waiting, 1, __ATOMIC_RELAXED);
+    while (true) {
+        /* We said we are asleep, look one more time. See
+         * sync_spsc_ring_wake for the other half. */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        error = op(queue, elem);
+        if (error != -1) {
+            break;
+        }
+        seL4_Wait(notification, NULL);
+    }
+    __atomic_fetch_sub(waiting, 1, __ATOMIC_RELAXED);
+
+    /* Signals to a notification nobody is blocked on collapse into one, so
+     * one wake up may stand for several. Pass it on if others still sleep. */
+    if (error == 0 && __atomic_load_n(waiting, __ATOMIC_RELAXED) > 0) {
+        seL4_Signal(notification);
+    }
+    return error;
+}
+
+static int mpmc_queue_try_enqueue(sync_mpmc_queue_t *queue, void *elem)
+{
+    return sync_mpmc_queue_try_enqueue(queue, elem);
+}
+
+static int mpmc_queue_try_dequeue(sync_mpmc_queue_t *queue, void *elem)
+{
+    return sync_mpmc_queue_try_dequeue(queue, elem);
+}
+
+int sync_mpmc_queue_enqueue(sync_mpmc_queue_t *queue, const void *elem)
+{
+    return mpmc_queue_block(queue, mpmc_queue_try_enqueue, (void *) elem, &queue->shared->producers_waiting,
+                            queue->space_notification);
+}
+
+int sync_mpmc_queue_dequeue(sync_mpmc_queue_t *queue, void *elem)
+{
+    return mpmc_queue_block(queue, mpmc_queue_try_dequeue, elem, &queue->shared->consumers_waiting,
+                            queue->data_notification);
+}
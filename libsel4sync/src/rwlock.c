@@ -0,0 +1,168 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sync/rwlock.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <utils/util.h>
+
+#include <sel4/sel4.h>
+
+static int guard_lock(sync_rwlock_t *lock)
+{
+    return sync_bin_sem_bare_wait(lock->guard_notification.cptr, &lock->guard_value);
+}
+
+static int guard_unlock(sync_rwlock_t *lock)
+{
+    return sync_bin_sem_bare_post(lock->guard_notification.cptr, &lock->guard_value);
+}
+
+/* Wait for the lock to be handed to us. */
+static void wait_for_handoff(seL4_CPtr notification)
+{
+    seL4_Wait(notification, NULL);
+    /* The thread that woke us set the lock state on our behalf */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+/* The waiters bit must stay set while any thread is queued. Called with the
+ * guard held. */
+static int waiters_bit(sync_rwlock_t *lock)
+{
+    return (lock->waiting_readers > 0 || lock->waiting_writers > 0) ? SYNC_RWLOCK_WAITERS : 0;
+}
+
+int sync_rwlock_read_lock_contended(sync_rwlock_t *lock)
+{
+    int error = guard_lock(lock);
+    if (error != 0) {
+        return error;
+    }
+
+    /* Either take the lock or set the waiters bit. Doing either with a
+     * compare and swap means a writer cannot release the lock through its
+     * fast path without seeing that we are about to queue. */
+    bool acquired;
+    int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    int new_state;
+    do {
+        acquired = !(state & SYNC_RWLOCK_WRITER) && lock->waiting_writers == 0;
+        new_state = acquired ? state + 1 : state | SYNC_RWLOCK_WAITERS;
+    } while (!__atomic_compare_exchange_n(&lock->state, &state, new_state, 0, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    if (!acquired) {
+        lock->waiting_readers++;
+    }
+    error = guard_unlock(lock);
+    if (error != 0 || acquired) {
+        return error;
+    }
+
+    wait_for_handoff(lock->read_notification.cptr);
+
+    /* Pass the wake up on to the next reader of our batch, if any. */
+    error = guard_lock(lock);
+    if (error != 0) {
+        return error;
+    }
+    bool wake = lock->read_wake > 0;
+    if (wake) {
+        lock->read_wake--;
+    }
+    error = guard_unlock(lock);
+    if (wake) {
+        seL4_Signal(lock->read_notification.cptr);
+    }
+    return error;
+}
+
+int sync_rwlock_read_unlock_contended(sync_rwlock_t *lock)
+{
+    int error = guard_lock(lock);
+    if (error != 0) {
+        return error;
+    }
+
+    /* Nothing but the guard holder changes the state while threads are queued
+     * and the lock is free, so there is no need for a compare and swap. A
+     * writer may have taken the lock since our decrement, in which case it
+     * will wake the queue when it is done. */
+    int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    bool wake = !(state & (SYNC_RWLOCK_WRITER | SYNC_RWLOCK_READERS_MASK)) && lock->waiting_writers > 0;
+    if (wake) {
+        lock->waiting_writers--;
+        __atomic_store_n(&lock->state, SYNC_RWLOCK_WRITER | waiters_bit(lock), __ATOMIC_RELAXED);
+    }
+
+    error = guard_unlock(lock);
+    if (wake) {
+        seL4_Signal(lock->write_notification.cptr);
+    }
+    return error;
+}
+
+int sync_rwlock_write_lock_contended(sync_rwlock_t *lock)
+{
+    int error = guard_lock(lock);
+    if (error != 0) {
+        return error;
+    }
+
+    bool acquired;
+    int state = __atomic_load_n(&lock->state, __ATOMIC_RELAXED);
+    int new_state;
+    do {
+        acquired = !(state & (SYNC_RWLOCK_WRITER | SYNC_RWLOCK_READERS_MASK));
+        new_state = state | (acquired ? SYNC_RWLOCK_WRITER : SYNC_RWLOCK_WAITERS);
+    } while (!__atomic_compare_exchange_n(&lock->state, &state, new_state, 0, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+
+    if (!acquired) {
+        lock->waiting_writers++;
+    }
+    error = guard_unlock(lock);
+    if (error != 0 || acquired) {
+        return error;
+    }
+
+    wait_for_handoff(lock->write_notification.cptr);
+    return 0;
+}
+
+int sync_rwlock_write_unlock_contended(sync_rwlock_t *lock)
+{
+    int error = guard_lock(lock);
+    if (error != 0) {
+        return error;
+    }
+
+    /* We hold the lock and the waiters bit is set, so no fast path can change
+     * the state under us. Admit all queued readers first so that writers
+     * cannot starve them, then the next writer. */
+    seL4_CPtr wake = seL4_CapNull;
+    if (lock->waiting_readers > 0) {
+        int readers = lock->waiting_readers;
+        lock->waiting_readers = 0;
+        lock->read_wake = readers - 1;
+        __atomic_store_n(&lock->state, readers | waiters_bit(lock), __ATOMIC_RELEASE);
+        wake = lock->read_notification.cptr;
+    } else if (lock->waiting_writers > 0) {
+        lock->waiting_writers--;
+        __atomic_store_n(&lock->state, SYNC_RWLOCK_WRITER | waiters_bit(lock), __ATOMIC_RELEASE);
+        wake = lock->write_notification.cptr;
+    } else {
+        __atomic_store_n(&lock->state, 0, __ATOMIC_RELEASE);
+    }
+
+    error = guard_unlock(lock);
+    if (wake != seL4_CapNull) {
+        seL4_Signal(wake);
+    }
+    return error;
+}
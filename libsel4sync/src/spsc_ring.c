@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sync/spsc_ring.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <utils/util.h>
+
+#include <sel4/sel4.h>
+
+static int spsc_ring_check(void *mem, size_t mem_size, uint32_t capacity, uint32_t elem_size)
+{
+    if (mem == NULL || !IS_ALIGNED((uintptr_t) mem, CONFIG_L1_CACHE_LINE_SIZE_BITS)) {
+        ZF_LOGE("Ring memory must be cache line aligned");
+        return -EINVAL;
+    }
+    if (capacity == 0 || capacity > BIT(31) || (capacity & (capacity - 1)) != 0) {
+        ZF_LOGE("Ring capacity %u is not a power of 2", capacity);
+        return -EINVAL;
+    }
+    /* Rule out overflow in the size calculation before doing it */
+    if (elem_size == 0 || elem_size > (SIZE_MAX - sizeof(sync_spsc_ring_shared_t)) / capacity ||
+        mem_size < sync_spsc_ring_mem_size(capacity, elem_size)) {
+        ZF_LOGE("Ring of %u elements of %u bytes does not fit in %zu bytes", capacity, elem_size, mem_size);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static void spsc_ring_handle_init(sync_spsc_ring_t *ring, sync_spsc_ring_shared_t *shared,
+                                  seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    ring->shared = shared;
+    ring->capacity = shared->capacity;
+    ring->elem_size = shared->elem_size;
+    ring->head = __atomic_load_n(&shared->head, __ATOMIC_ACQUIRE);
+    ring->tail = __atomic_load_n(&shared->tail, __ATOMIC_ACQUIRE);
+    ring->data_notification = data_notification;
+    ring->space_notification = space_notification;
+}
+
+int sync_spsc_ring_init(sync_spsc_ring_t *ring, void *mem, size_t mem_size, uint32_t capacity,
+                        uint32_t elem_size, seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    if (ring == NULL) {
+        ZF_LOGE("Ring passed to sync_spsc_ring_init was NULL");
+        return -EINVAL;
+    }
+    int error = spsc_ring_check(mem, mem_size, capacity, elem_size);
+    if (error != 0) {
+        return error;
+    }
+
+    sync_spsc_ring_shared_t *shared = mem;
+    shared->capacity = capacity;
+    shared->elem_size = elem_size;
+    shared->head = 0;
+    shared->consumer_waiting = 0;
+    shared->tail = 0;
+    shared->producer_waiting = 0;
+    /* Whoever attaches must see the rest of the header once they see this */
+    __atomic_store_n(&shared->magic, SYNC_SPSC_RING_MAGIC, __ATOMIC_RELEASE);
+
+    spsc_ring_handle_init(ring, shared, data_notification, space_notification);
+    return 0;
+}
+
+int sync_spsc_ring_attach(sync_spsc_ring_t *ring, void *mem, size_t mem_size,
+                          seL4_CPtr data_notification, seL4_CPtr space_notification)
+{
+    if (ring == NULL) {
+        ZF_LOGE("Ring passed to sync_spsc_ring_attach was NULL");
+        return -EINVAL;
+    }
+    sync_spsc_ring_shared_t *shared = mem;
+    if (shared == NULL || __atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != SYNC_SPSC_RING_MAGIC) {
+        ZF_LOGE("Memory does not hold a ring");
+        return -EINVAL;
+    }
+    int error = spsc_ring_check(mem, mem_size, shared->capacity, shared->elem_size);
+    if (error != 0) {
+        return error;
+    }
+    spsc_ring_handle_init(ring, shared, data_notification, space_notification);
+    if (ring->head - ring->tail > ring->capacity) {
+        ZF_LOGE("Ring corrupt (head %u, tail %u)", ring->head, ring->tail);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* Block on notification until op stops reporting that the ring is full (or
+ * empty). */
+static int spsc_ring_block(sync_spsc_ring_t *ring, int (*op)(sync_spsc_ring_t *, void *), void *elem,
+                           uint32_t *waiting, seL4_CPtr notification)
+{
+    while (true) {
+        int error = op(ring, elem);
+        if (error != -1) {
+            return error;
+        }
+        if (notification == seL4_CapNull) {
+            ZF_LOGE("Ring has no notification to block on");
+            return -EINVAL;
+        }
+
+        /* Say we are going to sleep, then look one more time. See
+         * sync_spsc_ring_wake for the other half. */
+        __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        error = op(ring, elem);
+        if (error != -1) {
+            /* The other side may have signalled us already, in which case the
+             * next block returns straight away and looks again. */
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return error;
+        }
+        seL4_Wait(notification, NULL);
+    }
+}
+
+static int spsc_ring_try_push(sync_spsc_ring_t *ring, void *elem)
+{
+    return sync_spsc_ring_try_push(ring, elem);
+}
+
+static int spsc_ring_try_pop(sync_spsc_ring_t *ring, void *elem)
+{
+    return sync_spsc_ring_try_pop(ring, elem);
+}
+
+int sync_spsc_ring_push(sync_spsc_ring_t *ring, const void *elem)
+{
+    return spsc_ring_block(ring, spsc_ring_try_push, (void *) elem, &ring->shared->producer_waiting,
+                           ring->space_notification);
+}
+
+int sync_spsc_ring_pop(sync_spsc_ring_t *ring, void *elem)
+{
+    return spsc_ring_block(ring, spsc_ring_try_pop, elem, &ring->shared->consumer_waiting,
+                           ring->data_notification);
+}
@@ -57,4 +57,72 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
  * @return 0 on success
  */
 int sel4utils_iommu_dma_alloc_iospace(void *dma_cookie, void *vaddr, size_t size);
+
+typedef struct sel4utils_iommu_dma_pin_config {
+    /* window of io virtual addresses to map pinned buffers at. Must not overlap
+     * any buffer that is mapped at its vaddr */
+    uintptr_t iova_base;
+    size_t iova_size;
+    /* number of unpinned mappings to keep before unmapping the least recently used half */
+    size_t max_cached;
+} sel4utils_iommu_dma_pin_config_t;
+
+typedef struct sel4utils_iommu_dma_pin_stats {
+    /* pins that reused an existing mapping */
+    size_t num_hits;
+    /* pins that created a new mapping */
+    size_t num_misses;
+    /* mappings that have been unmapped */
+    size_t num_evictions;
+    /* unpinned mappings currently kept */
+    size_t num_cached;
+} sel4utils_iommu_dma_pin_stats_t;
+
+/**
+ * Allow ps_dma_pin to be used on any buffer backed by frames known to the dma manager's vspace,
+ * not only on buffers allocated by the dma manager.
+ *
+ * Such buffers are mapped into every iospace at an io virtual address allocated from a window,
+ * and ps_dma_pin returns that address. Mappings are kept when the buffer is unpinned, so pinning
+ * the same buffer again does not need to map it. Once more than max_cached unpinned mappings are
+ * kept, the least recently used are unmapped in a batch.
+ *
+ * A buffer must only be freed, or its memory remapped, while it is not pinned. As the cached
+ * mappings keep the frames mapped into the iospaces, sel4utils_iommu_dma_invalidate_pin_cache
+ * must be called on the buffer before its memory is unmapped or freed, so the device can no
+ * longer reach it. Pinning also checks, without a system call, that the buffer is still backed
+ * by the same frame caps and, where the vspace's allocator records it, the same physical memory,
+ * and replaces the mapping if it is not.
+ *
+ * @param dma_man A dma manager created with sel4utils_make_iommu_dma_alloc
+ * @param config Window and cache configuration
+ * @return 0 on success
+ */
+int sel4utils_iommu_dma_enable_pin_cache(ps_dma_man_t *dma_man, sel4utils_iommu_dma_pin_config_t config);
+
+/**
+ * Unmap every cached mapping of a buffer that is not currently pinned.
+ *
+ * @param dma_man A dma manager with the pin cache enabled
+ */
+void sel4utils_iommu_dma_flush_pin_cache(ps_dma_man_t *dma_man);
+
+/**
+ * Unmap the cached mappings of buffers in a range of memory that is about to be unmapped or
+ * freed. None of the buffers may be pinned.
+ *
+ * @param dma_man A dma manager with the pin cache enabled
+ * @param vaddr Start of the range
+ * @param size Size of the range in bytes
+ */
+void sel4utils_iommu_dma_invalidate_pin_cache(ps_dma_man_t *dma_man, void *vaddr, size_t size);
+
+/**
+ * Retrieve the statistics of the pin cache.
+ *
+ * @param dma_man A dma manager with the pin cache enabled
+ * @param stats Filled out with the current statistics
+ * @return 0 on success
+ */
+int sel4utils_iommu_dma_pin_stats(ps_dma_man_t *dma_man, sel4utils_iommu_dma_pin_stats_t *stats);
 #endif /* CONFIG_IOMMU */
@@ -52,6 +52,48 @@ typedef struct irq_server irq_server_t;
 
 typedef int thread_id_t;
 
+/*
+ * Configuration of the polling mode of irq server threads.
+ *
+ * In polling mode, a thread that has been woken by an IRQ keeps polling its
+ * notification instead of blocking on it again, so IRQs that arrive in quick
+ * succession are handled without a wakeup each. The thread returns to blocking
+ * once 'poll_budget' consecutive polls find nothing, or, if a clock is given,
+ * once 'poll_window_ns' has passed without an IRQ arriving.
+ *
+ * When IRQs are forwarded to a delivery endpoint, the badges of IRQs that arrive
+ * while polling are combined, and sent in a single IPC once 'coalesce_events' IRQs
+ * have accumulated or polling stops. An IRQ is not delivered again by the kernel
+ * before its handler acknowledges it, so no IRQs are lost by combining badges.
+ */
+typedef struct irq_server_poll_config {
+    /* Number of consecutive empty polls before blocking, 0 disables polling mode */
+    size_t poll_budget;
+    /* Number of IRQs to accumulate before sending them to the delivery endpoint,
+     * 0 or 1 sends every IRQ as soon as it is seen */
+    size_t coalesce_events;
+    /* Optional clock, called from the irq server threads, that limits polling to
+     * 'poll_window_ns' after the last IRQ that arrived */
+    uint64_t (*get_time_ns)(void *cookie);
+    void *time_cookie;
+    uint64_t poll_window_ns;
+} irq_server_poll_config_t;
+
+/* Counters kept by each irq server thread. They are updated without
+ * synchronisation, so values read from another thread may be slightly stale. */
+typedef struct irq_server_thread_stats {
+    /* Number of times the thread was woken from a blocking wait */
+    uint64_t num_wakeups;
+    /* Number of polls of the notification while in polling mode */
+    uint64_t num_polls;
+    /* Number of IRQs that were handled or delivered */
+    uint64_t num_events;
+    /* Number of IPCs sent to the delivery endpoint */
+    uint64_t num_deliveries;
+    /* Number of badges merged into the overflow word of a full event ring */
+    uint64_t num_overflows;
+} irq_server_thread_stats_t;
+
 /**
  * Initialises an IRQ server. The server will manage threads that are
  * explicitly created by the user to handle incoming IRQs. The server
@@ -97,6 +139,80 @@ irq_server_t *irq_server_new(vspace_t *vspace, vka_t *vka, seL4_Word priority,
 thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
                                   seL4_Word usable_mask, thread_id_t id_hint);
 
+/**
+ * Creates a new thread to wait on IRQs, like 'irq_server_thread_new', and pins it to a core.
+ * IRQs can then be placed on the thread with 'irq_server_register_irq_on_core' or
+ * 'irq_server_route_irq'.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @param[in] provided_ntfn     Notification cap to be provided to thread, can be
+ *                              'seL4_CapNull'
+ * @param[in] usable_mask       Mask of bits indicating which bits of the badge space
+ *                              the thread can use, will be ignore if 'provided_ntfn' is
+ *                              'null'
+ * @param[in] id_hint           'Hint' to be passed to the IRQ server when assigning an
+ *                              ID, >= 0 for a valid hint, -1 otherwise
+ * @param[in] core              The core to run the thread on
+ */
+thread_id_t irq_server_thread_new_on_core(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
+                                          seL4_Word usable_mask, thread_id_t id_hint, int core);
+
+/**
+ * Makes threads that are created afterwards with 'irq_server_thread_new' append IRQ
+ * events to a ring in shared memory instead of sending an IPC to the delivery endpoint
+ * for each of them. The consumer notification is only signalled when a ring becomes
+ * non-empty, and the consumer handles all queued events with 'irq_server_handle_events'
+ * or 'irq_server_wait_for_events'. Each thread has its own ring of 64 events.
+ *
+ * An IRQ can arrive again as soon as its handler has acknowledged it, so a consumer that
+ * falls behind can let a ring fill up. Badges that arrive while the ring is full are ORed
+ * into an overflow word of the ring instead of being dropped, and each one is counted in
+ * the thread's 'num_overflows' statistic. As a badge is a bitmask of IRQs, the merged
+ * word still names every IRQ that arrived. The consumer does not need to do anything to
+ * recover them: 'irq_server_handle_events' takes the overflow word along with the ring
+ * and runs the handler of each IRQ set in it once. IRQs that arrived several times while
+ * the ring was full are therefore only handled once, as with a notification badge.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @param[in] consumer_ntfn     Notification that the consumer waits on, or
+ *                              'seL4_CapNull' to send IPCs again for new threads
+ * @return                      0 on success, otherwise an error code
+ */
+int irq_server_set_event_ring(irq_server_t *irq_server, seL4_CPtr consumer_ntfn);
+
+/**
+ * Handles all events that are queued in the event rings of the IRQ server threads.
+ * Must only be called from a single thread.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @return                      The number of events handled, otherwise an error code
+ */
+int irq_server_handle_events(irq_server_t *irq_server);
+
+/**
+ * Waits on the consumer notification given to 'irq_server_set_event_ring', then handles
+ * all queued events. Wakeups can be spurious, in which case 0 is returned.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @return                      The number of events handled, otherwise an error code
+ */
+int irq_server_wait_for_events(irq_server_t *irq_server);
+
+/**
+ * Sets the polling configuration used by threads that are created afterwards
+ * with 'irq_server_thread_new'. Threads that already exist are not affected.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @param[in] config            The polling configuration, see irq_server_poll_config_t
+ * @return                      0 on success, otherwise an error code
+ */
+int irq_server_set_poll_config(irq_server_t *irq_server, irq_server_poll_config_t config);
+
+/**
+ * Retrieves the counters of an IRQ server thread.
+ * @param[in]  irq_server       A handle to the IRQ server
+ * @param[in]  thread_id        ID of a thread created with 'irq_server_thread_new'
+ * @param[out] ret_stats        Filled out with the counters of the thread
+ * @return                      0 on success, otherwise an error code
+ */
+int irq_server_thread_get_stats(irq_server_t *irq_server, thread_id_t thread_id,
+                                irq_server_thread_stats_t *ret_stats);
+
 /**
  * Enable an IRQ and register a callback function. This functionality is
  * delegated to the IRQ interface in libplatsupport.
@@ -112,6 +228,49 @@ thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_n
 irq_id_t irq_server_register_irq(irq_server_t *irq_server, ps_irq_t irq,
                                  irq_callback_fn_t callback, void *callback_data);
 
+/**
+ * Enable an IRQ and register a callback function, like 'irq_server_register_irq',
+ * but place the IRQ on a thread that is pinned to a particular core.
+ * @param[in] irq_server        The IRQ server which shall be responsible for the IRQ
+ * @param[in] irq               Information about the IRQ that will be registered
+ * @param[in] callback          A callback function to call when the requested IRQ arrives
+ * @param[in] callback_data     Client data which should be passed to the registered call
+ *                              back function
+ * @param[in] core              The core whose threads should handle the IRQ
+ * @return                      On success, returns an ID for the IRQ. Otherwise, returns
+ *                              an error code
+ */
+irq_id_t irq_server_register_irq_on_core(irq_server_t *irq_server, ps_irq_t irq,
+                                         irq_callback_fn_t callback, void *callback_data, int core);
+
+/**
+ * Moves a registered IRQ to a thread that is pinned to a particular core.
+ *
+ * IRQs are not handled by the old or the new thread while the IRQ is moved. The IRQ is
+ * only moved once its handler has acknowledged the last delivery, and no delivery of it is
+ * waiting to be handled, as pairing it with the new thread acknowledges it. A delivery that
+ * the kernel made just before the move, and the old thread has not received yet, is
+ * discarded, and the IRQ is raised again on the new thread if the device still asserts it.
+ * Must not be called from an IRQ callback.
+ * @param[in] irq_server        The IRQ server which is responsible for the IRQ
+ * @param[in] irq_id            ID of the IRQ, as returned when it was registered
+ * @param[in] core              The core whose threads should handle the IRQ
+ * @return                      0 on success, -EBUSY if the IRQ is being handled and the
+ *                              move should be tried again later, otherwise an error code
+ */
+int irq_server_route_irq(irq_server_t *irq_server, irq_id_t irq_id, int core);
+
+/**
+ * Spreads the IRQs that are handled by pinned threads across the cores, based on the
+ * number of times each IRQ has arrived since the previous rebalance. The busiest IRQs
+ * are placed first, each on the core with the least load so far. IRQs are moved as
+ * described for 'irq_server_route_irq', and IRQs that are being handled are left where
+ * they are.
+ * @param[in] irq_server        A handle to the IRQ server
+ * @return                      The number of IRQs that were moved, otherwise an error code
+ */
+int irq_server_rebalance(irq_server_t *irq_server);
+
 /**
  * Redirects control to the IRQ subsystem to process an arriving IRQ.  The
  * server will read the appropriate message registers to retrieve the
@@ -14,10 +14,31 @@
 #include <vspace/vspace.h>
 #include <platsupport/io.h>
 
+typedef struct sel4utils_dma_pool_config {
+    /* allocations larger than BIT(max_class_bits) bypass the pool, 0 for the default */
+    size_t max_class_bits;
+    /* size of the physically contiguous slabs that are carved into buffers, 0 for the default */
+    size_t slab_size_bits;
+} sel4utils_dma_pool_config_t;
+
+typedef struct sel4utils_dma_pool_stats {
+    /* memory held by the pool in slabs */
+    size_t slab_bytes;
+    size_t num_slabs;
+    /* memory of the slabs that is currently handed out */
+    size_t allocated_bytes;
+    /* allocations and frees served by the pool */
+    size_t num_allocs;
+    size_t num_frees;
+    /* allocations too large for the pool */
+    size_t num_bypass_allocs;
+} sel4utils_dma_pool_stats_t;
+
 /**
  * Creates an implementation of a dma manager that is designed to allocate at page granularity. Due
  * to implementation details it will round up all allocations to the next power of 2, or 4k (whichever
- * is larger). This allocator will put mappings into the vspace with custom cookie values and you
+ * is larger). Allocations are aligned to their size, both physically and virtually, so alignments
+ * above 4k are supported. This allocator will put mappings into the vspace with custom cookie values and you
  * must free all dma allocations before tearing down the vspace
  * @param vka Allocation interface for allocating untypeds (for frames) and slots
  * @param vspace Virtual memory manager used for mapping frames
@@ -26,3 +47,48 @@
  */
 int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man);
 
+
+/**
+ * Creates a dma manager as per sel4utils_new_page_dma_alloc that caches buffers in power of 2 size
+ * classes. Physically contiguous slabs are carved into buffers of a single size class, and freed
+ * buffers stay mapped and are reused by the next allocation of the same class and cacheability.
+ * Buffers are aligned to their size class. Slabs are never returned.
+ * A reused buffer is zeroed before it is handed out, as a fresh one would be. The free lists are
+ * kept outside of the buffers, so a device writing to a freed buffer cannot corrupt the pool.
+ *
+ * @param vka Allocation interface for allocating untypeds (for frames) and slots
+ * @param vspace Virtual memory manager used for mapping frames
+ * @param config Size classes and slab size of the pool
+ * @param dma_man Pointer to dma manager struct that will be filled out
+ * @return 0 on success
+ */
+int sel4utils_new_page_dma_pool(vka_t *vka, vspace_t *vspace, sel4utils_dma_pool_config_t config,
+                                ps_dma_man_t *dma_man);
+
+/**
+ * Retrieve the utilisation statistics of a dma pool.
+ *
+ * @param dma_man A dma manager created by sel4utils_new_page_dma_pool
+ * @param stats Filled out with the current statistics
+ * @return 0 on success
+ */
+int sel4utils_page_dma_pool_stats(ps_dma_man_t *dma_man, sel4utils_dma_pool_stats_t *stats);
+
+/* One buffer of a scatter-gather list */
+typedef struct sel4utils_dma_sg {
+    void *addr;
+    size_t size;
+} sel4utils_dma_sg_t;
+
+/**
+ * Perform a cache operation on a list of buffers allocated from a page dma manager or pool.
+ * Buffers that are adjacent in memory are operated on together, and any barrier is only
+ * issued once for the whole list.
+ *
+ * @param dma_man A dma manager created by sel4utils_new_page_dma_alloc or sel4utils_new_page_dma_pool
+ * @param sg List of buffers
+ * @param num Number of buffers in the list
+ * @param op Cache operation to perform
+ */
+void sel4utils_page_dma_cache_op_sg(ps_dma_man_t *dma_man, sel4utils_dma_sg_t *sg, size_t num,
+                                    dma_cache_op_t op);
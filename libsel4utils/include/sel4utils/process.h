@@ -187,6 +187,83 @@ int sel4utils_configure_process(sel4utils_process_t *process, vka_t *vka, vspace
 int sel4utils_configure_process_custom(sel4utils_process_t *process, vka_t *target_vka,
                                        vspace_t *spawner_vspace, sel4utils_process_config_t config);
 
+/* A single process to be created by sel4utils_configure_processes_parallel */
+typedef struct sel4utils_process_batch_entry {
+    /* uninitialised process struct, initialised by a worker */
+    sel4utils_process_t *process;
+    /* config to create the process with */
+    sel4utils_process_config_t config;
+    /* arguments to pass to the process when it is spawned */
+    int argc;
+    char **argv;
+    /* set by the worker that configured this process. The vka must be used to
+     * destroy the process */
+    vka_t *vka;
+    /* 0 if the process was configured successfully */
+    int error;
+} sel4utils_process_batch_entry_t;
+
+/* A worker thread used by sel4utils_configure_processes_parallel */
+typedef struct sel4utils_process_batch_worker {
+    /* allocator used for all objects of the processes this worker creates. This
+     * must not be shared with any other worker unless it is thread safe. */
+    vka_t *vka;
+    /* vspace used by the worker for temporary mappings while loading elf files.
+     * This must be safe to use concurrently with the vspaces of all other workers. */
+    vspace_t *spawner_vspace;
+    /* config of the worker thread. The sched_params are also passed to
+     * sel4utils_set_sched_affinity to pin the worker on SMP kernels */
+    sel4utils_thread_config_t thread_config;
+    /* internal worker state */
+    sel4utils_thread_t thread;
+    struct sel4utils_process_batch *batch;
+} sel4utils_process_batch_worker_t;
+
+/**
+ * Configure a batch of processes concurrently.
+ *
+ * One thread is created for each worker and pinned to the core given in its thread config.
+ * Workers take processes from the batch until none are left and configure them with
+ * sel4utils_configure_process_custom using their own allocators. This function returns once
+ * all processes have been attempted; none of the processes are started.
+ *
+ * The C library heap is used by the workers, so must be thread safe.
+ *
+ * @param vka          allocator used for the worker threads and their bookkeeping.
+ * @param vspace       the current vspace, used to create the worker threads.
+ * @param workers      array of initialised worker descriptions.
+ * @param num_workers  number of workers.
+ * @param entries      array of processes to create.
+ * @param num_entries  number of processes to create.
+ *
+ * @return 0 if every process was configured, -1 otherwise. Check entries[i].error to see
+ *         which processes failed.
+ */
+int sel4utils_configure_processes_parallel(vka_t *vka, vspace_t *vspace,
+                                           sel4utils_process_batch_worker_t *workers, size_t num_workers,
+                                           sel4utils_process_batch_entry_t *entries, size_t num_entries);
+
+/**
+ * Spawn a batch of processes configured by sel4utils_configure_processes_parallel.
+ *
+ * All arguments are written before any of the processes are resumed, so that
+ * processes are released together.
+ *
+ * @param vspace       the current vspace.
+ * @param entries      array of configured processes.
+ * @param num_entries  number of processes.
+ * @param resume       true to start the processes.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int sel4utils_spawn_processes(vspace_t *vspace, sel4utils_process_batch_entry_t *entries,
+                              size_t num_entries, bool resume);
+
+/**
+ * Destroy every successfully configured process in a batch.
+ */
+void sel4utils_destroy_processes(sel4utils_process_batch_entry_t *entries, size_t num_entries);
+
 /**
  * Copy a cap into a process' cspace.
  *
@@ -22,7 +22,18 @@
  * When the slab allocator runs out, it will delegate any
  * further allocations.
  *
- * This allocator does not implement free, alloc_at, paddr or device related functions.
+ * The objects of each type are retyped straight from the slab's untyped in batches, one
+ * invocation per run of contiguous slots, and handed out by moving the cap. Freed objects
+ * are not reused: their memory stays part of the slab's untyped.
+ *
+ * A slab made by slab_init_recycling also reuses freed objects. Each object is then retyped
+ * from an untyped of its own size, and handed out as a copy of a cap held by the slab.
+ * Freeing such an object revokes its untyped, which deletes every cap to the object
+ * (including any the user derived) and so finalises it, then retypes a fresh object to be
+ * handed out again. This costs a cslot, a retype and a revoke per object more than the
+ * default.
+ *
+ * This allocator does not implement alloc_at, paddr or device related functions.
  */
 
 /**
@@ -34,3 +45,13 @@
  * @return 0 on success
  */
 int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount]);
+
+/**
+ * As slab_init, but freed objects are reset and handed out again.
+ *
+ * @param slab_vka empty allocator to initialise
+ * @param delegate initialised allocator to perform allocations with
+ * @param object_freq frequency of objects required for slab allocation (indexed by object type).
+ * @return 0 on success
+ */
+int slab_init_recycling(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount]);
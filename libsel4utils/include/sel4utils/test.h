@@ -0,0 +1,9 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/* TODO This temporary work around to ensure tests are included. Find a better solution. */
+void get_sel4utils_tests();
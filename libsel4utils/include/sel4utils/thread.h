@@ -43,6 +43,19 @@ typedef struct sel4utils_thread {
     vka_object_t reply;
 } sel4utils_thread_t;
 
+/* A range of memory tracked by an incremental checkpoint */
+typedef struct sel4utils_checkpoint_region {
+    /* page aligned start of the region */
+    uintptr_t start;
+    size_t num_pages;
+    /* cacheability of the reservation, kept when the pages are remapped */
+    int cacheable;
+    /* saved contents of the region */
+    void *data;
+    /* bitmap of pages that have been written since the last checkpoint */
+    seL4_Word *dirty;
+} sel4utils_checkpoint_region_t;
+
 typedef struct sel4utils_checkpoint {
     /* checkpointed stack */
     void *stack;
@@ -50,6 +63,11 @@ typedef struct sel4utils_checkpoint {
     sel4utils_thread_t *thread;
     /* stack pointer this checkpoint preserves */
     uintptr_t sp;
+    /* vspace the tracked regions are mapped in, NULL unless this is an incremental checkpoint */
+    vspace_t *vspace;
+    /* regions tracked by an incremental checkpoint, the first is always the stack */
+    sel4utils_checkpoint_region_t *regions;
+    size_t num_regions;
 } sel4utils_checkpoint_t;
 
 typedef void (*sel4utils_thread_entry_fn)(void *arg0, void *arg1, void *ipc_buf);
@@ -160,6 +178,8 @@ int sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint
 
 /**
  * Rollback a thread to a previous checkpoint, restoring its register set and stack.
+ * For incremental checkpoints only the pages written since the checkpoint are restored,
+ * which includes any extra regions added to the checkpoint.
  *
  * This is not atomic and callers should make sure the target thread is stopped or that the
  * caller is higher priority such that the target is not switched to by the kernel mid-restore.
@@ -178,6 +198,69 @@ int sel4utils_checkpoint_restore(sel4utils_checkpoint_t *checkpoint, bool free,
  */
 void sel4utils_free_checkpoint(sel4utils_checkpoint_t *checkpoint);
 
+/**
+ * Checkpoint a thread incrementally. Requirements on the thread are as per
+ * sel4utils_checkpoint_thread.
+ *
+ * The whole stack of the thread is saved once, and its pages are then remapped read-only.
+ * Writes by the thread raise faults on the thread's fault endpoint, which must be passed to
+ * sel4utils_checkpoint_handle_fault. Only pages that were written since the checkpoint are
+ * copied by sel4utils_checkpoint_update and sel4utils_checkpoint_restore.
+ *
+ * As the pages are remapped, the caller must not write to the tracked regions of a thread
+ * that shares its vspace.
+ *
+ * @param thread     the thread to checkpoint
+ * @param vspace     sel4utils vspace the thread's stack is mapped in, must be able to return the
+ *                   frame caps of the stack. Pages are remapped with the cacheability of their
+ *                   reservation.
+ * @param checkpoint pointer to uninitialised checkpoint struct
+ * @param suspend    true if the thread should be suspended
+ *
+ * @return 0 on success.
+ */
+int sel4utils_checkpoint_thread_incremental(sel4utils_thread_t *thread, vspace_t *vspace,
+                                            sel4utils_checkpoint_t *checkpoint, bool suspend);
+
+/**
+ * Extend an incremental checkpoint to cover another region of the thread's memory, such as
+ * its heap or data reservations. The current contents of the region become part of the
+ * checkpoint.
+ *
+ * @param checkpoint an incremental checkpoint
+ * @param vaddr      start of the region, must be page aligned and mapped in the checkpoint vspace
+ *                   with 4K pages. Regions backed by large pages are rejected.
+ * @param size       size of the region in bytes
+ *
+ * @return 0 on success.
+ */
+int sel4utils_checkpoint_add_region(sel4utils_checkpoint_t *checkpoint, void *vaddr, size_t size);
+
+/**
+ * Move an incremental checkpoint to the current state of the thread, copying only
+ * the pages that were written since the previous checkpoint.
+ *
+ * @param checkpoint an incremental checkpoint
+ * @param suspend    true if the thread should be suspended
+ *
+ * @return 0 on success.
+ */
+int sel4utils_checkpoint_update(sel4utils_checkpoint_t *checkpoint, bool suspend);
+
+/**
+ * Handle a fault raised by a thread that is being checkpointed incrementally. This must be
+ * called directly after receiving the fault, as the fault is read from the message registers.
+ *
+ * If the fault was a write to a tracked page, the page is marked dirty and made writable,
+ * and the caller should reply to the fault to restart the thread.
+ *
+ * @param checkpoint an incremental checkpoint
+ * @param tag        the message info tag delivered by the fault.
+ *
+ * @return true if the fault was handled.
+ */
+bool sel4utils_checkpoint_handle_fault(sel4utils_checkpoint_t *checkpoint, seL4_MessageInfo_t tag);
+
 /**
  * Start a fault handling thread that will print the name of the thread that faulted
  * as well as debugging information. The thread will start at priority 0.
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+/**
+ * A pool of worker threads that execute small tasks.
+ *
+ * Each worker owns a deque of tasks. Tasks submitted by a worker are pushed onto its own
+ * deque, tasks submitted from any other thread are placed in a shared queue. Idle workers
+ * first drain their own deque, then the shared queue, and then steal from the other workers.
+ * Workers that find no work block on their own notification until new work is submitted.
+ */
+
+#pragma once
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <sel4/sel4.h>
+#include <stdbool.h>
+#include <vka/vka.h>
+#include <vspace/vspace.h>
+#include <simple/simple.h>
+
+/* Number of tasks each worker deque and the shared queue can hold, must be a power of 2 */
+#define SEL4UTILS_THREAD_POOL_QUEUE_SIZE 256
+
+typedef void (*sel4utils_task_fn)(void *arg);
+
+/* Tasks are owned by the submitter and must remain valid until they have run */
+typedef struct sel4utils_task {
+    sel4utils_task_fn fn;
+    void *arg;
+} sel4utils_task_t;
+
+typedef struct sel4utils_thread_pool sel4utils_thread_pool_t;
+
+typedef struct sel4utils_thread_pool_config {
+    /* number of worker threads to create */
+    size_t num_workers;
+    /* priority of the worker threads */
+    uint8_t priority;
+    /* place worker i on core i % CONFIG_MAX_NUM_NODES */
+    bool one_per_core;
+    /* timeslice of the scheduling context given to each worker on the MCS kernel */
+    seL4_Time timeslice_us;
+} sel4utils_thread_pool_config_t;
+
+/**
+ * Create a thread pool and start its workers.
+ *
+ * @param vka     allocator for the worker threads and their notifications.
+ * @param vspace  the current vspace. The workers run in this vspace.
+ * @param simple  simple interface used to find the cspace and scheduling control caps.
+ * @param config  configuration of the pool.
+ *
+ * @return the pool, or NULL on error.
+ */
+sel4utils_thread_pool_t *sel4utils_thread_pool_new(vka_t *vka, vspace_t *vspace, simple_t *simple,
+                                                   sel4utils_thread_pool_config_t config);
+
+/**
+ * Submit a task to the pool. May be called from any thread, including from tasks running in
+ * the pool. Tasks submitted from outside of the pool must not be submitted concurrently.
+ *
+ * If the queue the task would be placed on is full, the task is run by the caller.
+ *
+ * @param pool the pool to run the task in.
+ * @param task the task to run.
+ */
+void sel4utils_thread_pool_submit(sel4utils_thread_pool_t *pool, sel4utils_task_t *task);
+
+/**
+ * Block until every task that has been submitted to the pool has completed. Must not be
+ * called from a task.
+ *
+ * @param pool the pool to wait for.
+ */
+void sel4utils_thread_pool_wait(sel4utils_thread_pool_t *pool);
+
+/**
+ * Stop all workers and release all resources of the pool. The pool must be idle.
+ *
+ * @param pool the pool to destroy.
+ */
+void sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool);
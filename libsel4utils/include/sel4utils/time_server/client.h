@@ -6,6 +6,7 @@
 #pragma once
 
 #include <platsupport/ltimer.h>
+#include <sel4utils/time_server/clock_page.h>
 
 /* the timer op is set in mr0 */
 typedef enum rpc_timer_ops {
@@ -36,3 +37,16 @@ typedef enum rpc_timer_ops {
 int sel4utils_rpc_ltimer_init(ltimer_t *ltimer, ps_io_ops_t ops,
                               seL4_CPtr ep, seL4_Word label);
 
+
+/**
+ * Make an rpc ltimer read the time from a clock page published by the server, instead of
+ * calling the server. The time is still requested from the server while the page is not
+ * valid, or has not been updated for too long. The ltimer never returns an earlier time
+ * than it has returned before, even when it switches between the page and the server.
+ *
+ * @param ltimer an ltimer initialised with sel4utils_rpc_ltimer_init
+ * @param clock_page the clock page mapped into this address space, or NULL to always
+ *                   call the server
+ * @return 0 on success
+ */
+int sel4utils_rpc_ltimer_set_clock_page(ltimer_t *ltimer, sel4utils_clock_page_t *clock_page);
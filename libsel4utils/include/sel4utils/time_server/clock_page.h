@@ -0,0 +1,125 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/**
+ * A page, shared between a time server and its clients, that lets clients read the time
+ * without a system call.
+ *
+ * The server periodically publishes a timestamp together with the cycle count at which it
+ * was taken, and a rate for the cycle counter measured between updates. Clients extrapolate
+ * from the timestamp with their own cycle counter. Updates are protected by a sequence count:
+ * readers retry if an update was in progress.
+ *
+ * The published time never goes backwards. If clients have extrapolated past the server's
+ * timer, the new timestamp continues from the extrapolated time rather than the timer's, and
+ * the rate is slowed for the next interval so the page converges back onto the timer.
+ *
+ * sel4utils_timer_wheel_set_clock_page keeps a page updated from a timer wheel. Other time
+ * servers must call sel4utils_clock_page_update themselves, from a periodic timeout.
+ *
+ * This only works where the cycle counter is readable at user level and the same on every
+ * core: the TSC on x86, and the PMU cycle counter exported to user level on single core
+ * ARM systems. Elsewhere the page is never valid and clients keep using RPC.
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sel4bench/sel4bench.h>
+
+#if defined(CONFIG_ARCH_X86) || (defined(CONFIG_EXPORT_PMU_USER) && CONFIG_MAX_NUM_NODES == 1)
+#define SEL4UTILS_CLOCK_PAGE_SUPPORTED 1
+#else
+#define SEL4UTILS_CLOCK_PAGE_SUPPORTED 0
+#endif
+
+/* Fixed point shift of the cycles to nanoseconds multiplier */
+#define SEL4UTILS_CLOCK_PAGE_SHIFT 32
+
+typedef struct sel4utils_clock_page {
+    /* odd while the server is updating the page */
+    uint32_t seq;
+    /* 0 until the rate of the cycle counter has been measured */
+    uint32_t valid;
+    /* time in nanoseconds at base_cycles */
+    uint64_t base_ns;
+    uint64_t base_cycles;
+    /* ns = base_ns + ((cycles - base_cycles) * mult) >> SEL4UTILS_CLOCK_PAGE_SHIFT */
+    uint64_t mult;
+    /* extrapolating further than this many cycles would overflow */
+    uint64_t max_cycles;
+    /* Only used by the server: the last time read from its timer, and the cycle count at
+     * that time, to measure the rate of the cycle counter against the timer */
+    uint64_t ref_ns;
+    uint64_t ref_cycles;
+} sel4utils_clock_page_t;
+
+/**
+ * Initialise a clock page. Until sel4utils_clock_page_update has been called twice the
+ * page is not valid.
+ *
+ * @param page the page to initialise.
+ */
+void sel4utils_clock_page_init(sel4utils_clock_page_t *page);
+
+/**
+ * Publish the current time. Must be called by the time server often enough that clients
+ * do not extrapolate past max_cycles, which is several seconds, and at a roughly constant
+ * period, as that is the interval over which any lead on the timer is made up. On ARM the
+ * cycle counter must have been started with sel4bench_init.
+ *
+ * @param page   the page to update.
+ * @param now_ns the current time of the server's timer.
+ */
+void sel4utils_clock_page_update(sel4utils_clock_page_t *page, uint64_t now_ns);
+
+/**
+ * Read the time from a clock page.
+ *
+ * @param page    the page to read.
+ * @param[out] ns the current time.
+ *
+ * @return true on success, false if the page cannot be used and the time must be
+ *         requested from the server.
+ */
+static inline bool sel4utils_clock_page_read(sel4utils_clock_page_t *page, uint64_t *ns)
+{
+    if (!SEL4UTILS_CLOCK_PAGE_SUPPORTED) {
+        return false;
+    }
+
+    uint32_t seq;
+    uint64_t base_ns, base_cycles, mult, max_cycles;
+    uint64_t cycles;
+    do {
+        seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        if (!__atomic_load_n(&page->valid, __ATOMIC_RELAXED)) {
+            return false;
+        }
+        base_ns = __atomic_load_n(&page->base_ns, __ATOMIC_RELAXED);
+        base_cycles = __atomic_load_n(&page->base_cycles, __ATOMIC_RELAXED);
+        mult = __atomic_load_n(&page->mult, __ATOMIC_RELAXED);
+        max_cycles = __atomic_load_n(&page->max_cycles, __ATOMIC_RELAXED);
+        cycles = sel4bench_get_cycle_count();
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq);
+
+    /* the counter is only as wide as ccnt_t */
+    uint64_t delta = (ccnt_t)(cycles - base_cycles);
+    if (delta > max_cycles) {
+        /* the server has not updated the page for too long */
+        return false;
+    }
+
+    *ns = base_ns + ((delta * mult) >> SEL4UTILS_CLOCK_PAGE_SHIFT);
+    return true;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#pragma once
+
+/**
+ * A hierarchical timing wheel that multiplexes any number of timeouts over the single
+ * timeout of one seL4_timer_t.
+ *
+ * Time is divided into ticks of a configurable length. Timeouts are kept in a wheel of
+ * slots per level, where each slot of a level covers a whole turn of the level below.
+ * Adding and cancelling a timeout are constant time, and all timeouts of a tick are
+ * expired together when the timer IRQ is handled. The hardware timer is only programmed
+ * for the next tick that has something to do.
+ *
+ * The wheel can also act as a time server: clients identified by their badge use the
+ * RPC protocol of sel4utils_rpc_ltimer_init, and are signalled on a notification when
+ * their timeout expires.
+ *
+ * The wheel is not thread safe.
+ */
+
+#include <sel4/sel4.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sel4platsupport/timer.h>
+#include <sel4utils/time_server/clock_page.h>
+
+typedef struct sel4utils_timer_wheel sel4utils_timer_wheel_t;
+typedef struct sel4utils_timeout sel4utils_timeout_t;
+
+/* Called when a timeout expires. The timeout may be added again from the callback */
+typedef void (*sel4utils_timeout_fn_t)(sel4utils_timeout_t *timeout, void *data);
+
+/* Timeouts are owned by the caller and must remain valid until they expire or are cancelled */
+struct sel4utils_timeout {
+    /* tick the timeout expires at */
+    uint64_t expires;
+    sel4utils_timeout_fn_t fn;
+    void *data;
+    /* slot list, pprev is NULL when the timeout is not pending */
+    sel4utils_timeout_t *next;
+    sel4utils_timeout_t **pprev;
+};
+
+/**
+ * Create a timer wheel.
+ *
+ * @param timer   an initialised timer. The wheel takes over its timeout and must be told
+ *                about its IRQs with sel4utils_timer_wheel_handle_irq.
+ * @param tick_ns length of a tick in nanoseconds. Timeouts expire on the first tick at or
+ *                after the requested time.
+ *
+ * @return the wheel, or NULL on error.
+ */
+sel4utils_timer_wheel_t *sel4utils_timer_wheel_new(seL4_timer_t *timer, uint64_t tick_ns);
+
+/**
+ * Cancel every timeout and release the wheel. The timer is not destroyed.
+ *
+ * @param wheel the wheel to destroy.
+ */
+void sel4utils_timer_wheel_destroy(sel4utils_timer_wheel_t *wheel);
+
+/**
+ * Initialise a timeout before its first use.
+ *
+ * @param timeout the timeout to initialise.
+ * @param fn      function to call when the timeout expires.
+ * @param data    passed to fn.
+ */
+void sel4utils_timeout_init(sel4utils_timeout_t *timeout, sel4utils_timeout_fn_t fn, void *data);
+
+/**
+ * Add a timeout to the wheel. If the timeout is already pending it is moved.
+ *
+ * @param wheel   the wheel.
+ * @param timeout an initialised timeout.
+ * @param ns      absolute time, as returned by sel4utils_timer_wheel_get_time, to expire at.
+ *                Times in the past expire when the wheel next processes a tick.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_timer_wheel_add(sel4utils_timer_wheel_t *wheel, sel4utils_timeout_t *timeout, uint64_t ns);
+
+/**
+ * Cancel a timeout.
+ *
+ * @param wheel   the wheel.
+ * @param timeout the timeout to cancel.
+ *
+ * @return true if the timeout was pending.
+ */
+bool sel4utils_timer_wheel_cancel(sel4utils_timer_wheel_t *wheel, sel4utils_timeout_t *timeout);
+
+/**
+ * Get the current time of the underlying timer.
+ *
+ * @param wheel   the wheel.
+ * @param[out] ns the current time in nanoseconds.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_timer_wheel_get_time(sel4utils_timer_wheel_t *wheel, uint64_t *ns);
+
+/**
+ * Expire every timeout that is due and program the timer for the next one.
+ *
+ * @param wheel the wheel.
+ *
+ * @return the number of timeouts that expired, or -1 on error.
+ */
+int sel4utils_timer_wheel_process(sel4utils_timer_wheel_t *wheel);
+
+/**
+ * Handle an IRQ of the underlying timer, then expire every timeout that is due.
+ *
+ * @param wheel the wheel.
+ * @param badge badge received on the notification the timer was initialised with.
+ *
+ * @return the number of timeouts that expired, or -1 on error.
+ */
+int sel4utils_timer_wheel_handle_irq(sel4utils_timer_wheel_t *wheel, seL4_Word badge);
+
+/**
+ * Allow the wheel to serve timer RPCs from clients. Clients are identified by the badge
+ * of the endpoint they call, which is used as an index, so badges should be allocated
+ * densely from 1.
+ *
+ * @param wheel       the wheel.
+ * @param max_clients clients may use badges up to, but not including, this value.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_timer_wheel_serve_clients(sel4utils_timer_wheel_t *wheel, size_t max_clients);
+
+/**
+ * Keep a clock page updated with the time of the wheel's timer. The page is initialised and
+ * then updated every period_ns from a timeout of the wheel, until the wheel is destroyed.
+ *
+ * @param wheel     the wheel.
+ * @param page      the clock page, which is usually mapped into the clients' address spaces.
+ * @param period_ns time between updates, which must be well under the few seconds that
+ *                  clients can extrapolate for.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_timer_wheel_set_clock_page(sel4utils_timer_wheel_t *wheel, sel4utils_clock_page_t *page,
+                                         uint64_t period_ns);
+
+/**
+ * Register a client. The client has one timeout, as for an ltimer, and the notification is
+ * signalled whenever it expires.
+ *
+ * @param wheel the wheel.
+ * @param badge badge of the endpoint cap the client calls.
+ * @param ntfn  notification to signal the client with.
+ *
+ * @return 0 on success.
+ */
+int sel4utils_timer_wheel_register_client(sel4utils_timer_wheel_t *wheel, seL4_Word badge, seL4_CPtr ntfn);
+
+/**
+ * Cancel the timeout of a client and forget it.
+ *
+ * @param wheel the wheel.
+ * @param badge badge the client was registered with.
+ */
+void sel4utils_timer_wheel_unregister_client(sel4utils_timer_wheel_t *wheel, seL4_Word badge);
+
+/**
+ * Handle a timer RPC from a client, see rpc_ltimer_ops_t. The reply is written to the
+ * message registers.
+ *
+ * A periodic timeout stays on its original schedule. If the server falls behind, for
+ * example because it was not scheduled, the periods that were missed are dropped: the
+ * client is signalled once, and then at the first period after the current time.
+ *
+ * @param wheel the wheel.
+ * @param badge badge the message was received with.
+ * @param info  message info of the received message.
+ *
+ * @return message info to reply to the client with.
+ */
+seL4_MessageInfo_t sel4utils_timer_wheel_handle_rpc(sel4utils_timer_wheel_t *wheel, seL4_Word badge,
+                                                    seL4_MessageInfo_t info);
@@ -340,6 +340,15 @@ int sel4utils_bootstrap_clone_into_vspace(vspace_t *current, vspace_t *clone, re
  */
 void sel4utils_get_image_region(uintptr_t *va_start, uintptr_t *va_end);
 
+/**
+ * Find out how pages in the reservation containing vaddr are mapped.
+ *
+ * @param vspace the virtual memory allocator to use.
+ * @param vaddr a virtual address inside a reservation.
+ * @return 1 if the reservation is cacheable, 0 if it is not, -1 if vaddr is not reserved.
+ */
+int sel4utils_get_cacheable(vspace_t *vspace, void *vaddr);
+
 /**
  *
  * @return the physical address that vaddr is mapped to.
@@ -5,7 +5,11 @@
  */
 #pragma once
 
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+#include <stdbool.h>
 #include <sel4/sel4.h>
+#include <utils/util.h>
 
 static inline int seL4_ARCH_PageDirectory_Clean_Data(seL4_CPtr root, seL4_Word start, seL4_Word end)
 {
@@ -27,3 +31,24 @@ static inline int seL4_ARCH_PageDirectory_Unify_Instruction(seL4_CPtr root, seL4
     return seL4_ARM_VSpace_Unify_Instruction(root, start, end);
 }
 
+
+#ifdef CONFIG_SEL4UTILS_USER_CACHE_MAINTENANCE
+/* Clean, or clean and invalidate, the data cache lines of a range by virtual address
+ * without entering the kernel. Not complete until sel4utils_user_cache_sync is called. */
+static inline void sel4utils_user_clean_data_range(seL4_Word start, seL4_Word end, bool invalidate)
+{
+    seL4_Word line = BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS);
+    for (seL4_Word cur = ROUND_DOWN(start, line); cur < end; cur += line) {
+        if (invalidate) {
+            asm volatile("dc civac, %0" :: "r"(cur) : "memory");
+        } else {
+            asm volatile("dc cvac, %0" :: "r"(cur) : "memory");
+        }
+    }
+}
+
+static inline void sel4utils_user_cache_sync(void)
+{
+    asm volatile("dsb sy" ::: "memory");
+}
+#endif /* CONFIG_SEL4UTILS_USER_CACHE_MAINTENANCE */
@@ -15,125 +15,340 @@
 #include <stdlib.h>
 #include <vka/capops.h>
 #include <string.h>
+#include <vspace/page.h>
 #include <utils/zf_log.h>
 
+/* Reference counts of the pages mapped into an iospace. This is an open addressed
+ * hash table with linear probing, keyed by page address. */
+typedef struct iospace_refs {
+    /* page address of each entry, 0 if the entry is empty */
+    uintptr_t *pages;
+    uint32_t *counts;
+    /* number of entries, always a power of 2 */
+    size_t size;
+    size_t used;
+} iospace_refs_t;
+
+#define IOSPACE_REFS_MIN_SIZE 64
+
+#define PIN_CACHE_BUCKETS 256
+
+/* A buffer that has been mapped into every iospace at an allocated io virtual address */
+typedef struct iova_mapping iova_mapping_t;
+struct iova_mapping {
+    uintptr_t vaddr;
+    size_t num_pages;
+    uintptr_t iova;
+    /* frame cap and physical address of each page when it was mapped, to detect the vaddr
+     * being backed by different memory since */
+    seL4_CPtr *frames;
+    uintptr_t *paddrs;
+    uint32_t pins;
+    iova_mapping_t *hash_next;
+    /* least recently unpinned list, only for mappings with no pins */
+    iova_mapping_t *lru_prev;
+    iova_mapping_t *lru_next;
+};
+
+/* Mappings of buffers that were not allocated by the dma manager, kept after they
+ * are unpinned in case they are pinned again */
+typedef struct pin_cache {
+    uintptr_t iova_base;
+    size_t iova_pages;
+    /* bitmap of allocated pages of the iova window */
+    seL4_Word *iova_used;
+    /* where to start looking for free iova pages */
+    size_t iova_hint;
+    /* reservation of the iova window in each iospace */
+    reservation_t *reservations;
+    iova_mapping_t *buckets[PIN_CACHE_BUCKETS];
+    /* most and least recently unpinned mappings */
+    iova_mapping_t *lru_head;
+    iova_mapping_t *lru_tail;
+    size_t num_cached;
+    size_t max_cached;
+    sel4utils_iommu_dma_pin_stats_t stats;
+} pin_cache_t;
+
 typedef struct dma_man {
     vka_t vka;
     vspace_t vspace;
     int num_iospaces;
     vspace_t *iospaces;
     sel4utils_alloc_data_t *iospace_data;
+    iospace_refs_t *iospace_refs;
+    /* NULL unless sel4utils_iommu_dma_enable_pin_cache was called */
+    pin_cache_t *pin_cache;
 } dma_man_t;
 
+static inline size_t refs_hash(iospace_refs_t *refs, uintptr_t page)
+{
+    /* Fibonacci hashing of the page number */
+    return ((page >> seL4_PageBits) * (uintptr_t) 0x9E3779B97F4A7C15ull) & (refs->size - 1);
+}
+
+static uint32_t *refs_lookup(iospace_refs_t *refs, uintptr_t page)
+{
+    if (refs->size == 0) {
+        return NULL;
+    }
+    for (size_t i = refs_hash(refs, page); refs->pages[i] != 0; i = (i + 1) & (refs->size - 1)) {
+        if (refs->pages[i] == page) {
+            return &refs->counts[i];
+        }
+    }
+    return NULL;
+}
+
+static void refs_insert(iospace_refs_t *refs, uintptr_t page, uint32_t count)
+{
+    size_t i = refs_hash(refs, page);
+    while (refs->pages[i] != 0) {
+        i = (i + 1) & (refs->size - 1);
+    }
+    refs->pages[i] = page;
+    refs->counts[i] = count;
+    refs->used++;
+}
+
+/* Make sure that num more pages can be inserted while keeping the table at most 3/4 full */
+static int refs_reserve(iospace_refs_t *refs, size_t num)
+{
+    size_t size = MAX(refs->size, IOSPACE_REFS_MIN_SIZE);
+    while ((refs->used + num) * 4 > size * 3) {
+        size *= 2;
+    }
+    if (size == refs->size) {
+        return 0;
+    }
+
+    iospace_refs_t new = {
+        .pages = calloc(size, sizeof(uintptr_t)),
+        .counts = calloc(size, sizeof(uint32_t)),
+        .size = size,
+        .used = 0
+    };
+    if (new.pages == NULL || new.counts == NULL) {
+        ZF_LOGE("Failed to allocate refcount table of %zu entries", size);
+        free(new.pages);
+        free(new.counts);
+        return -1;
+    }
+
+    for (size_t i = 0; i < refs->size; i++) {
+        if (refs->pages[i] != 0) {
+            refs_insert(&new, refs->pages[i], refs->counts[i]);
+        }
+    }
+    free(refs->pages);
+    free(refs->counts);
+    *refs = new;
+    return 0;
+}
+
+static void refs_remove(iospace_refs_t *refs, uintptr_t page)
+{
+    uint32_t *count = refs_lookup(refs, page);
+    assert(count);
+    size_t hole = count - refs->counts;
+    refs->pages[hole] = 0;
+    refs->used--;
+
+    /* shift back any following entries that would no longer be found past the hole */
+    for (size_t i = (hole + 1) & (refs->size - 1); refs->pages[i] != 0; i = (i + 1) & (refs->size - 1)) {
+        size_t home = refs_hash(refs, refs->pages[i]);
+        if (((i - home) & (refs->size - 1)) >= ((i - hole) & (refs->size - 1))) {
+            refs->pages[hole] = refs->pages[i];
+            refs->counts[hole] = refs->counts[i];
+            refs->pages[i] = 0;
+            hole = i;
+        }
+    }
+}
+
+/* Drop a reference to every page of a range in one iospace, unmapping runs of pages
+ * whose last reference was dropped together */
+static void unmap_iospace_range(dma_man_t *dma, int i, uintptr_t start, uintptr_t end)
+{
+    vspace_t *iospace = dma->iospaces + i;
+    iospace_refs_t *refs = dma->iospace_refs + i;
+    uintptr_t run_start = 0;
+    size_t run_pages = 0;
+
+    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE_4K) {
+        uint32_t *count = refs_lookup(refs, addr);
+        assert(count);
+        (*count)--;
+        if (*count == 0) {
+            refs_remove(refs, addr);
+            if (run_pages == 0) {
+                run_start = addr;
+            }
+            run_pages++;
+            continue;
+        }
+        if (run_pages > 0) {
+            /* deletes and frees the copied frame caps */
+            vspace_unmap_pages(iospace, (void *)run_start, run_pages, seL4_PageBits, &dma->vka);
+            run_pages = 0;
+        }
+    }
+
+    if (run_pages > 0) {
+        vspace_unmap_pages(iospace, (void *)run_start, run_pages, seL4_PageBits, &dma->vka);
+    }
+}
+
 static void unmap_range(dma_man_t *dma, uintptr_t addr, size_t size)
 {
     uintptr_t start = ROUND_DOWN(addr, PAGE_SIZE_4K);
     uintptr_t end = addr + size;
-    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE_4K) {
-        for (int i = 0; i < dma->num_iospaces; i++) {
-            uintptr_t *cookie = (uintptr_t *)vspace_get_cookie(dma->iospaces + i, (void *)addr);
-            assert(cookie);
-            (*cookie)--;
-            if (*cookie == 0) {
-                seL4_CPtr page = vspace_get_cap(dma->iospaces + i, (void *)addr);
-                cspacepath_t page_path;
-                assert(page);
-                vspace_unmap_pages(dma->iospaces + i, (void *)addr, 1, seL4_PageBits, NULL);
-                vka_cspace_make_path(&dma->vka, page, &page_path);
-                vka_cnode_delete(&page_path);
-                vka_cspace_free(&dma->vka, page);
-                free(cookie);
-            }
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        unmap_iospace_range(dma, i, start, end);
+    }
+}
+
+/* Map a run of pages that are not yet mapped into an iospace, with a single reservation */
+static int map_iospace_run(dma_man_t *dma, int i, uintptr_t start, size_t num_pages, seL4_CPtr *frames)
+{
+    vspace_t *iospace = dma->iospaces + i;
+    iospace_refs_t *refs = dma->iospace_refs + i;
+    size_t num_copied = 0;
+    int error;
+
+    if (refs_reserve(refs, num_pages)) {
+        return -1;
+    }
+
+    seL4_CPtr *copies = calloc(num_pages, sizeof(seL4_CPtr));
+    if (copies == NULL) {
+        ZF_LOGE("Failed to allocate %zu caps", num_pages);
+        return -1;
+    }
+
+    /* each mapping needs its own copy of the frame cap */
+    for (; num_copied < num_pages; num_copied++) {
+        cspacepath_t page_path, copy_path;
+        error = vka_cspace_alloc_path(&dma->vka, &copy_path);
+        if (error) {
+            ZF_LOGE("Failed to allocate slot");
+            goto error;
+        }
+        vka_cspace_make_path(&dma->vka, frames[num_copied], &page_path);
+        error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
+        if (error) {
+            ZF_LOGE("Failed to copy frame cap");
+            vka_cspace_free(&dma->vka, copy_path.capPtr);
+            goto error;
         }
+        copies[num_copied] = copy_path.capPtr;
     }
+
+    reservation_t res = vspace_reserve_range_at(iospace, (void *)start, num_pages * PAGE_SIZE_4K, seL4_AllRights, 1);
+    if (!res.res) {
+        ZF_LOGE("Failed to create a reservation");
+        goto error;
+    }
+    error = vspace_map_pages_at_vaddr(iospace, copies, NULL, (void *)start, num_pages, seL4_PageBits, res);
+    vspace_free_reservation(iospace, res);
+    if (error) {
+        ZF_LOGE("Failed to map frames into iospace");
+        vspace_unmap_pages(iospace, (void *)start, num_pages, seL4_PageBits, VSPACE_PRESERVE);
+        goto error;
+    }
+
+    for (size_t j = 0; j < num_pages; j++) {
+        refs_insert(refs, start + j * PAGE_SIZE_4K, 1);
+    }
+    free(copies);
+    return 0;
+
+error:
+    for (size_t j = 0; j < num_copied; j++) {
+        cspacepath_t copy_path;
+        vka_cspace_make_path(&dma->vka, copies[j], &copy_path);
+        vka_cnode_delete(&copy_path);
+        vka_cspace_free(&dma->vka, copies[j]);
+    }
+    free(copies);
+    return -1;
+}
+
+/* Take a reference to every page of a range in one iospace, mapping the pages that
+ * are not mapped yet */
+static int map_iospace_range(dma_man_t *dma, int i, uintptr_t start, uintptr_t end, seL4_CPtr *frames)
+{
+    iospace_refs_t *refs = dma->iospace_refs + i;
+    uintptr_t addr = start;
+
+    while (addr < end) {
+        uint32_t *count = refs_lookup(refs, addr);
+        if (count) {
+            (*count)++;
+            addr += PAGE_SIZE_4K;
+            continue;
+        }
+
+        uintptr_t run_end = addr + PAGE_SIZE_4K;
+        while (run_end < end && refs_lookup(refs, run_end) == NULL) {
+            run_end += PAGE_SIZE_4K;
+        }
+        int error = map_iospace_run(dma, i, addr, (run_end - addr) / PAGE_SIZE_4K,
+                                    frames + (addr - start) / PAGE_SIZE_4K);
+        if (error) {
+            unmap_iospace_range(dma, i, start, addr);
+            return error;
+        }
+        addr = run_end;
+    }
+
+    return 0;
 }
 
 int sel4utils_iommu_dma_alloc_iospace(void *cookie, void *vaddr, size_t size)
 {
     dma_man_t *dma = (dma_man_t *)cookie;
-    int error;
 
-    /* for each page duplicate and map it into all the iospaces */
     uintptr_t start = ROUND_DOWN((uintptr_t)vaddr, PAGE_SIZE_4K);
-    uintptr_t end = (uintptr_t)vaddr + size;
-    seL4_CPtr last_page = 0;
-    for (uintptr_t addr = start; addr < end; addr += PAGE_SIZE_4K) {
-        cspacepath_t page_path;
-        seL4_CPtr page = vspace_get_cap(&dma->vspace, (void *)addr);
-        if (!page) {
+    uintptr_t end = ROUND_UP((uintptr_t)vaddr + size, PAGE_SIZE_4K);
+    size_t num_pages = (end - start) / PAGE_SIZE_4K;
+
+    seL4_CPtr *frames = malloc(num_pages * sizeof(seL4_CPtr));
+    if (frames == NULL) {
+        ZF_LOGE("Failed to allocate %zu caps", num_pages);
+        return -1;
+    }
+
+    /* find the frames that back the region */
+    for (size_t j = 0; j < num_pages; j++) {
+        frames[j] = vspace_get_cap(&dma->vspace, (void *)(start + j * PAGE_SIZE_4K));
+        if (!frames[j]) {
             ZF_LOGE("Failed to retrieve frame cap for malloc region. "
                     "Is your malloc backed by the correct vspace? "
                     "If you allocated your own buffer, does the dma manager's vspace "
                     "know about the caps to the frames that back the buffer?");
-            unmap_range(dma, start, addr + 1);
+            free(frames);
             return -1;
         }
-        if (page == last_page) {
+        if (j > 0 && frames[j] == frames[j - 1]) {
             ZF_LOGE("Found the same frame two pages in a row. We only support 4K mappings");
-            unmap_range(dma, start, addr + 1);
+            free(frames);
             return -1;
         }
-        last_page = page;
-        vka_cspace_make_path(&dma->vka, page, &page_path);
-        /* work out the size of this page */
-        for (int i = 0; i < dma->num_iospaces; i++) {
-            /* see if its already mapped */
-            uintptr_t *cookie = (uintptr_t *)vspace_get_cookie(dma->iospaces + i, (void *)addr);
-            if (cookie) {
-                /* increment the counter */
-                (*cookie)++;
-            } else {
-                cspacepath_t copy_path;
-                /* allocate slot for the cap */
-                error = vka_cspace_alloc_path(&dma->vka, &copy_path);
-                if (error) {
-                    ZF_LOGE("Failed to allocate slot");
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                /* copy the cap */
-                error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
-                if (error) {
-                    ZF_LOGE("Failed to copy frame cap");
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                /* now map it in */
-                reservation_t res = vspace_reserve_range_at(dma->iospaces + i, (void *)addr, PAGE_SIZE_4K, seL4_AllRights, 1);
-                if (!res.res) {
-                    ZF_LOGE("Failed to create a reservation");
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                cookie = malloc(sizeof(*cookie));
-                if (!cookie) {
-                    ZF_LOGE("Failed to malloc %zu bytes", sizeof(*cookie));
-                    vspace_free_reservation(dma->iospaces + i, res);
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                *cookie = 1;
-                error = vspace_map_pages_at_vaddr(dma->iospaces + i, &copy_path.capPtr, (uintptr_t *)&cookie, (void *)addr, 1,
-                                                  seL4_PageBits, res);
-                if (error) {
-                    ZF_LOGE("Failed to map frame into iospace");
-                    free(cookie);
-                    vspace_free_reservation(dma->iospaces + i, res);
-                    vka_cnode_delete(&copy_path);
-                    vka_cspace_free(&dma->vka, copy_path.capPtr);
-                    unmap_range(dma, start, addr + 1);
-                    return -1;
-                }
-                vspace_free_reservation(dma->iospaces + i, res);
+    }
+
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        int error = map_iospace_range(dma, i, start, end, frames);
+        if (error) {
+            for (int j = 0; j < i; j++) {
+                unmap_iospace_range(dma, j, start, end);
             }
+            free(frames);
+            return -1;
         }
     }
 
+    free(frames);
     return 0;
 }
 
@@ -167,13 +382,427 @@ static void dma_free(void *cookie, void *addr, size_t size)
     free(addr);
 }
 
+static inline bool iova_page_used(pin_cache_t *cache, size_t page)
+{
+    return cache->iova_used[page / seL4_WordBits] & BIT(page % seL4_WordBits);
+}
+
+static void iova_set_range(pin_cache_t *cache, size_t first, size_t num, bool used)
+{
+    for (size_t page = first; page < first + num; page++) {
+        if (used) {
+            cache->iova_used[page / seL4_WordBits] |= BIT(page % seL4_WordBits);
+        } else {
+            cache->iova_used[page / seL4_WordBits] &= ~BIT(page % seL4_WordBits);
+        }
+    }
+}
+
+/* Next fit allocation of a range of pages from the iova window */
+static uintptr_t iova_alloc(pin_cache_t *cache, size_t num_pages)
+{
+    size_t run = 0;
+    for (size_t scanned = 0; scanned < cache->iova_pages + num_pages; scanned++) {
+        size_t page = (cache->iova_hint + scanned) % cache->iova_pages;
+        if (page == 0) {
+            /* ranges do not wrap around the end of the window */
+            run = 0;
+        }
+        if (iova_page_used(cache, page)) {
+            run = 0;
+            continue;
+        }
+        run++;
+        if (run == num_pages) {
+            size_t first = page + 1 - num_pages;
+            iova_set_range(cache, first, num_pages, true);
+            cache->iova_hint = (page + 1) % cache->iova_pages;
+            return cache->iova_base + first * PAGE_SIZE_4K;
+        }
+    }
+    return 0;
+}
+
+static void iova_free(pin_cache_t *cache, uintptr_t iova, size_t num_pages)
+{
+    iova_set_range(cache, (iova - cache->iova_base) / PAGE_SIZE_4K, num_pages, false);
+}
+
+static inline iova_mapping_t **pin_cache_bucket(pin_cache_t *cache, uintptr_t vaddr)
+{
+    return &cache->buckets[(vaddr >> seL4_PageBits) % PIN_CACHE_BUCKETS];
+}
+
+static iova_mapping_t *pin_cache_lookup(pin_cache_t *cache, uintptr_t vaddr)
+{
+    for (iova_mapping_t *m = *pin_cache_bucket(cache, vaddr); m != NULL; m = m->hash_next) {
+        if (m->vaddr == vaddr) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+static void lru_remove(pin_cache_t *cache, iova_mapping_t *m)
+{
+    if (m->lru_prev) {
+        m->lru_prev->lru_next = m->lru_next;
+    } else {
+        cache->lru_head = m->lru_next;
+    }
+    if (m->lru_next) {
+        m->lru_next->lru_prev = m->lru_prev;
+    } else {
+        cache->lru_tail = m->lru_prev;
+    }
+    m->lru_prev = NULL;
+    m->lru_next = NULL;
+    cache->num_cached--;
+}
+
+static void lru_push(pin_cache_t *cache, iova_mapping_t *m)
+{
+    m->lru_prev = NULL;
+    m->lru_next = cache->lru_head;
+    if (cache->lru_head) {
+        cache->lru_head->lru_prev = m;
+    } else {
+        cache->lru_tail = m;
+    }
+    cache->lru_head = m;
+    cache->num_cached++;
+}
+
+/* Unmap an unpinned mapping from every iospace and forget it */
+static void pin_cache_evict(dma_man_t *dma, iova_mapping_t *m)
+{
+    pin_cache_t *cache = dma->pin_cache;
+    assert(m->pins == 0);
+
+    lru_remove(cache, m);
+    for (iova_mapping_t **p = pin_cache_bucket(cache, m->vaddr); *p != NULL; p = &(*p)->hash_next) {
+        if (*p == m) {
+            *p = m->hash_next;
+            break;
+        }
+    }
+
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        /* deletes and frees the copied frame caps, the kernel invalidates the iotlb */
+        vspace_unmap_pages(dma->iospaces + i, (void *)m->iova, m->num_pages, seL4_PageBits, &dma->vka);
+    }
+    iova_free(cache, m->iova, m->num_pages);
+    cache->stats.num_evictions++;
+    free(m->frames);
+    free(m->paddrs);
+    free(m);
+}
+
+/* Map frames into every iospace at an iova */
+static int pin_cache_map(dma_man_t *dma, uintptr_t iova, seL4_CPtr *frames, size_t num_pages)
+{
+    pin_cache_t *cache = dma->pin_cache;
+
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        for (size_t j = 0; j < num_pages; j++) {
+            cspacepath_t page_path, copy_path;
+            int error = vka_cspace_alloc_path(&dma->vka, &copy_path);
+            if (!error) {
+                vka_cspace_make_path(&dma->vka, frames[j], &page_path);
+                error = vka_cnode_copy(&copy_path, &page_path, seL4_AllRights);
+                if (error) {
+                    vka_cspace_free(&dma->vka, copy_path.capPtr);
+                }
+            }
+            if (!error) {
+                error = vspace_map_pages_at_vaddr(dma->iospaces + i, &copy_path.capPtr, NULL,
+                                                  (void *)(iova + j * PAGE_SIZE_4K), 1, seL4_PageBits,
+                                                  cache->reservations[i]);
+                if (error) {
+                    vka_cnode_delete(&copy_path);
+                    vka_cspace_free(&dma->vka, copy_path.capPtr);
+                }
+            }
+            if (error) {
+                ZF_LOGE("Failed to map frame into iospace");
+                vspace_unmap_pages(dma->iospaces + i, (void *)iova, j, seL4_PageBits, &dma->vka);
+                for (int k = 0; k < i; k++) {
+                    vspace_unmap_pages(dma->iospaces + k, (void *)iova, num_pages, seL4_PageBits, &dma->vka);
+                }
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static uintptr_t frame_paddr(seL4_CPtr frame)
+{
+    seL4_ARCH_Page_GetAddress_t res = seL4_ARCH_Page_GetAddress(frame);
+    return res.error ? 0 : res.paddr;
+}
+
+/* Physical address of a page from the records of the vspace's allocator, without a system
+ * call, or 0 if the allocator does not know it */
+static uintptr_t page_cookie_paddr(dma_man_t *dma, uintptr_t vaddr)
+{
+    vka_t *vka = get_alloc_data(&dma->vspace)->vka;
+    if (vka == NULL || vka->utspace_paddr == NULL || vspace_get_cookie(&dma->vspace, (void *)vaddr) == 0) {
+        return 0;
+    }
+    uintptr_t paddr = sel4utils_get_paddr(&dma->vspace, (void *)vaddr, kobject_get_type(KOBJECT_FRAME, seL4_PageBits),
+                                          seL4_PageBits);
+    return paddr == VKA_NO_PADDR ? 0 : paddr;
+}
+
+/* Check that the vaddr of a mapping is still backed by the memory the iova maps, against what
+ * was recorded when it was mapped. This runs on every hit, so it makes no system calls. The
+ * cap alone is not enough, as a slot may have been freed and reused for another frame, so
+ * where the allocator knows the physical address of the page it is compared as well. */
+static bool pin_cache_frames_match(dma_man_t *dma, iova_mapping_t *m)
+{
+    for (size_t j = 0; j < m->num_pages; j++) {
+        uintptr_t vaddr = m->vaddr + j * PAGE_SIZE_4K;
+        if (vspace_get_cap(&dma->vspace, (void *)vaddr) != m->frames[j]) {
+            return false;
+        }
+        uintptr_t paddr = page_cookie_paddr(dma, vaddr);
+        if (paddr != 0 && paddr != m->paddrs[j]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uintptr_t pin_cache_pin(dma_man_t *dma, void *addr, size_t size)
+{
+    pin_cache_t *cache = dma->pin_cache;
+    uintptr_t vaddr = ROUND_DOWN((uintptr_t)addr, PAGE_SIZE_4K);
+    size_t num_pages = (ROUND_UP((uintptr_t)addr + size, PAGE_SIZE_4K) - vaddr) / PAGE_SIZE_4K;
+    uintptr_t offset = (uintptr_t)addr - vaddr;
+
+    iova_mapping_t *m = pin_cache_lookup(cache, vaddr);
+    if (m != NULL) {
+        if (m->num_pages >= num_pages && pin_cache_frames_match(dma, m)) {
+            if (m->pins == 0) {
+                lru_remove(cache, m);
+            }
+            m->pins++;
+            cache->stats.num_hits++;
+            return m->iova + offset;
+        }
+        if (m->pins != 0) {
+            ZF_LOGE("Buffer %p is already pinned with a different size", addr);
+            return 0;
+        }
+        /* too small, or the memory has been remapped since */
+        pin_cache_evict(dma, m);
+    }
+    cache->stats.num_misses++;
+
+    m = calloc(1, sizeof(*m));
+    seL4_CPtr *frames = calloc(num_pages, sizeof(seL4_CPtr));
+    uintptr_t *paddrs = calloc(num_pages, sizeof(uintptr_t));
+    if (m == NULL || frames == NULL || paddrs == NULL) {
+        ZF_LOGE("Failed to allocate mapping of %zu pages", num_pages);
+        free(m);
+        free(frames);
+        free(paddrs);
+        return 0;
+    }
+
+    for (size_t j = 0; j < num_pages; j++) {
+        frames[j] = vspace_get_cap(&dma->vspace, (void *)(vaddr + j * PAGE_SIZE_4K));
+        if (frames[j]) {
+            paddrs[j] = frame_paddr(frames[j]);
+        }
+        if (!frames[j] || (j > 0 && frames[j] == frames[j - 1]) || paddrs[j] == 0) {
+            ZF_LOGE("Buffer %p is not backed by 4K frames known to the dma manager's vspace", addr);
+            free(m);
+            free(frames);
+            free(paddrs);
+            return 0;
+        }
+    }
+
+    uintptr_t iova = iova_alloc(cache, num_pages);
+    /* make room by unmapping the least recently used mappings */
+    while (iova == 0 && cache->lru_tail != NULL) {
+        pin_cache_evict(dma, cache->lru_tail);
+        iova = iova_alloc(cache, num_pages);
+    }
+    if (iova == 0) {
+        ZF_LOGE("Out of io virtual address space");
+        free(m);
+        free(frames);
+        free(paddrs);
+        return 0;
+    }
+
+    if (pin_cache_map(dma, iova, frames, num_pages)) {
+        iova_free(cache, iova, num_pages);
+        free(m);
+        free(frames);
+        free(paddrs);
+        return 0;
+    }
+
+    m->vaddr = vaddr;
+    m->num_pages = num_pages;
+    m->iova = iova;
+    m->frames = frames;
+    m->paddrs = paddrs;
+    m->pins = 1;
+    iova_mapping_t **bucket = pin_cache_bucket(cache, vaddr);
+    m->hash_next = *bucket;
+    *bucket = m;
+
+    return iova + offset;
+}
+
+static void pin_cache_unpin(dma_man_t *dma, void *addr, size_t size)
+{
+    pin_cache_t *cache = dma->pin_cache;
+    iova_mapping_t *m = pin_cache_lookup(cache, ROUND_DOWN((uintptr_t)addr, PAGE_SIZE_4K));
+    if (m == NULL || m->pins == 0) {
+        ZF_LOGE("Unpinning buffer %p that is not pinned", addr);
+        return;
+    }
+
+    m->pins--;
+    if (m->pins > 0) {
+        return;
+    }
+
+    /* keep the mapping for the next pin, but once too many are cached unmap the oldest
+     * half in one go */
+    lru_push(cache, m);
+    if (cache->num_cached > cache->max_cached) {
+        while (cache->num_cached > cache->max_cached / 2) {
+            pin_cache_evict(dma, cache->lru_tail);
+        }
+    }
+}
+
 static uintptr_t dma_pin(void *cookie, void *addr, size_t size)
 {
-    return (uintptr_t)addr;
+    dma_man_t *dma = cookie;
+    /* buffers allocated by the dma manager are mapped at their vaddr */
+    if (dma->pin_cache == NULL || dma->num_iospaces == 0 ||
+        refs_lookup(dma->iospace_refs, ROUND_DOWN((uintptr_t)addr, PAGE_SIZE_4K)) != NULL) {
+        return (uintptr_t)addr;
+    }
+    return pin_cache_pin(dma, addr, size);
 }
 
 static void dma_unpin(void *cookie, void *addr, size_t size)
 {
+    dma_man_t *dma = cookie;
+    if (dma->pin_cache == NULL || dma->num_iospaces == 0 ||
+        refs_lookup(dma->iospace_refs, ROUND_DOWN((uintptr_t)addr, PAGE_SIZE_4K)) != NULL) {
+        return;
+    }
+    pin_cache_unpin(dma, addr, size);
+}
+
+int sel4utils_iommu_dma_enable_pin_cache(ps_dma_man_t *dma_man, sel4utils_iommu_dma_pin_config_t config)
+{
+    dma_man_t *dma = dma_man->cookie;
+
+    if (dma->pin_cache != NULL) {
+        ZF_LOGE("Pin cache already enabled");
+        return -1;
+    }
+
+    if (!IS_ALIGNED(config.iova_base, seL4_PageBits) || config.iova_base == 0 ||
+        config.iova_size < PAGE_SIZE_4K) {
+        ZF_LOGE("Invalid iova window");
+        return -1;
+    }
+
+    pin_cache_t *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return -1;
+    }
+    cache->iova_base = config.iova_base;
+    cache->iova_pages = config.iova_size / PAGE_SIZE_4K;
+    cache->max_cached = config.max_cached;
+    cache->iova_used = calloc(DIV_ROUND_UP(cache->iova_pages, seL4_WordBits), sizeof(seL4_Word));
+    cache->reservations = calloc(dma->num_iospaces, sizeof(reservation_t));
+    if (cache->iova_used == NULL || cache->reservations == NULL) {
+        goto error;
+    }
+
+    /* reserve the window in each iospace so it is not used for buffers mapped at their vaddr */
+    for (int i = 0; i < dma->num_iospaces; i++) {
+        cache->reservations[i] = vspace_reserve_range_at(dma->iospaces + i, (void *)cache->iova_base,
+                                                         cache->iova_pages * PAGE_SIZE_4K, seL4_AllRights, 1);
+        if (!cache->reservations[i].res) {
+            ZF_LOGE("Failed to reserve iova window in iospace %d", i);
+            for (int j = 0; j < i; j++) {
+                vspace_free_reservation(dma->iospaces + j, cache->reservations[j]);
+            }
+            goto error;
+        }
+    }
+
+    dma->pin_cache = cache;
+    return 0;
+
+error:
+    free(cache->iova_used);
+    free(cache->reservations);
+    free(cache);
+    return -1;
+}
+
+void sel4utils_iommu_dma_flush_pin_cache(ps_dma_man_t *dma_man)
+{
+    dma_man_t *dma = dma_man->cookie;
+    if (dma->pin_cache == NULL) {
+        return;
+    }
+    while (dma->pin_cache->lru_tail != NULL) {
+        pin_cache_evict(dma, dma->pin_cache->lru_tail);
+    }
+}
+
+void sel4utils_iommu_dma_invalidate_pin_cache(ps_dma_man_t *dma_man, void *vaddr, size_t size)
+{
+    dma_man_t *dma = dma_man->cookie;
+    pin_cache_t *cache = dma->pin_cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    uintptr_t start = ROUND_DOWN((uintptr_t)vaddr, PAGE_SIZE_4K);
+    uintptr_t end = (uintptr_t)vaddr + size;
+    for (size_t b = 0; b < PIN_CACHE_BUCKETS; b++) {
+        iova_mapping_t *m = cache->buckets[b];
+        while (m != NULL) {
+            iova_mapping_t *next = m->hash_next;
+            if (m->vaddr < end && start < m->vaddr + m->num_pages * PAGE_SIZE_4K) {
+                if (m->pins != 0) {
+                    ZF_LOGE("Buffer %p is still pinned", (void *)m->vaddr);
+                } else {
+                    pin_cache_evict(dma, m);
+                }
+            }
+            m = next;
+        }
+    }
+}
+
+int sel4utils_iommu_dma_pin_stats(ps_dma_man_t *dma_man, sel4utils_iommu_dma_pin_stats_t *stats)
+{
+    dma_man_t *dma = dma_man->cookie;
+    if (dma->pin_cache == NULL || stats == NULL) {
+        return -1;
+    }
+    *stats = dma->pin_cache->stats;
+    stats->num_cached = dma->pin_cache->num_cached;
+    return 0;
 }
 
 static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
@@ -212,6 +841,10 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
     if (!dma->iospace_data) {
         goto error;
     }
+    dma->iospace_refs = calloc(num_iospaces, sizeof(iospace_refs_t));
+    if (!dma->iospace_refs) {
+        goto error;
+    }
     for (unsigned int i = 0; i < num_iospaces; i++) {
         int err = sel4utils_get_vspace_with_map(&dma->vspace, dma->iospaces + i, dma->iospace_data + i, &dma->vka, iospaces[i],
                                                 NULL, NULL, sel4utils_map_page_iommu);
@@ -224,6 +857,9 @@ int sel4utils_make_iommu_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *d
     }
     return 0;
 error:
+    if (dma->iospace_refs) {
+        free(dma->iospace_refs);
+    }
     if (dma->iospace_data) {
         free(dma->iospace_data);
     }
@@ -19,6 +19,30 @@
 
 #define IRQ_SERVER_MESSAGE_LENGTH 2
 
+#define IRQ_SERVER_NO_CORE -1
+
+/* Number of entries in an event ring, must be a power of 2. A ring entry holds the
+ * badge of IRQs that have arrived. An IRQ may arrive again as soon as its handler has
+ * acknowledged it, so a slow consumer can let the ring fill up. Badges that do not fit
+ * are merged into the ring's overflow word instead */
+#define IRQ_SERVER_RING_SIZE 64
+compile_time_assert(irq_server_ring_size_pow2, (IRQ_SERVER_RING_SIZE & (IRQ_SERVER_RING_SIZE - 1)) == 0);
+compile_time_assert(irq_server_ring_fits_badges, IRQ_SERVER_RING_SIZE >= seL4_BadgeBits);
+
+/* Single producer, single consumer ring of events in a page shared between an IRQ
+ * thread and the thread that handles the events. The indices are free running */
+typedef struct irq_server_ring {
+    /* Written by the IRQ thread */
+    uint32_t tail ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    /* Badges that arrived while the ring was full, or'd together. Set by the IRQ thread and
+     * cleared by the consumer */
+    seL4_Word overflow;
+    /* Written by the consumer */
+    uint32_t head ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    seL4_Word badges[IRQ_SERVER_RING_SIZE] ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+} irq_server_ring_t;
+compile_time_assert(irq_server_ring_fits_page, sizeof(irq_server_ring_t) <= PAGE_SIZE_4K);
+
 typedef struct irq_server_node {
     seL4_CPtr ntfn;
     size_t max_irqs_bound;
@@ -27,13 +51,48 @@ typedef struct irq_server_node {
 
 typedef struct irq_server_thread irq_server_thread_t;
 
+/* An IRQ registered through the server. The server registers its own callback with the
+ * IRQ interface so that it can count the events of each IRQ */
+typedef struct irq_server_irq {
+    bool allocated;
+    irq_id_t irq_id;
+    irq_callback_fn_t callback;
+    void *callback_data;
+    irq_server_thread_t *thread;
+    /* Bit of the IRQ in the badge of the thread's notification */
+    seL4_Word badge;
+    /* Set when the callback is called, and cleared once the handler has acknowledged the
+     * IRQ. The IRQ is not moved while it is set */
+    bool ack_pending;
+    /* Acknowledgement of the IRQ interface, wrapped by the one given to the callback */
+    ps_irq_acknowledge_fn_t acknowledge_fn;
+    void *ack_data;
+    /* Updated by the thread that handles the IRQ */
+    uint64_t num_events;
+    /* Value of num_events at the last rebalance */
+    uint64_t balanced_events;
+} irq_server_irq_t;
+
 /* This is also forwarded declared as we have a pointer to a struct of the same type */
 struct irq_server_thread {
     thread_id_t thread_id;
+    /* Core the thread is pinned to, or IRQ_SERVER_NO_CORE */
+    int core;
     irq_server_node_t *node;
+    /* Held while the IRQs of this thread are handled, or are being paired with or unpaired
+     * from its notification. Counts down from 1, and contenders block on lock_ntfn */
+    int lock_value;
+    vka_object_t lock_ntfn;
+    /* Badges that have been taken from the notification but not handled yet */
+    seL4_Word in_flight;
     seL4_CPtr delivery_ep;
     seL4_Word label;
     sel4utils_thread_t thread;
+    irq_server_poll_config_t poll_config;
+    irq_server_thread_stats_t stats;
+    /* Events are appended here instead of being sent to delivery_ep if not NULL */
+    irq_server_ring_t *ring;
+    seL4_CPtr consumer_ntfn;
     /* Linked list chain of threads */
     irq_server_thread_t *next;
 };
@@ -46,10 +105,15 @@ struct irq_server {
     irq_server_thread_t *server_threads;
     size_t num_irqs;
     size_t max_irqs;
+    /* Array of max_irqs entries */
+    irq_server_irq_t *irqs;
 
     /* New thread parameters */
     seL4_Word priority;
     seL4_CPtr cspace;
+    irq_server_poll_config_t poll_config;
+    /* Notification to signal when an event ring becomes non-empty, if rings are used */
+    seL4_CPtr consumer_ntfn;
 
     /* Allocation interfaces */
     vka_t *vka;
@@ -59,12 +123,31 @@ struct irq_server {
     ps_malloc_ops_t *malloc_ops;
 };
 
+static void irq_server_thread_lock(irq_server_thread_t *thread_info)
+{
+    if (__atomic_fetch_sub(&thread_info->lock_value, 1, __ATOMIC_ACQUIRE) <= 0) {
+        seL4_Wait(thread_info->lock_ntfn.cptr, NULL);
+        /* The lock was only handed over by the signal */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+}
+
+static void irq_server_thread_unlock(irq_server_thread_t *thread_info)
+{
+    if (__atomic_fetch_add(&thread_info->lock_value, 1, __ATOMIC_RELEASE) < 0) {
+        seL4_Signal(thread_info->lock_ntfn.cptr);
+    }
+}
+
 /* Executes the registered callback for incoming IRQs */
 static void irq_server_node_handle_irq(irq_server_thread_t *thread_info,
                                        ps_irq_ops_t *irq_ops, seL4_Word badge)
 {
     ntfn_id_t target_ntfn = thread_info->thread_id;
+    irq_server_thread_lock(thread_info);
+    __atomic_fetch_and(&thread_info->in_flight, ~badge, __ATOMIC_RELAXED);
     int error = sel4platsupport_irq_handle(irq_ops, target_ntfn, badge);
+    irq_server_thread_unlock(thread_info);
     if (error) {
         if (error == -EINVAL) {
             ZF_LOGE("Passed in a wrong ntfn_id to the IRQ interface! Something is very wrong with the IRQ server");
@@ -74,27 +157,81 @@ static void irq_server_node_handle_irq(irq_server_thread_t *thread_info,
     }
 }
 
+/* Acknowledges an IRQ on behalf of its handler */
+static int irq_server_irq_acknowledge(void *ack_data)
+{
+    irq_server_irq_t *server_irq = ack_data;
+    int error = server_irq->acknowledge_fn(server_irq->ack_data);
+    /* Only cleared once the IRQ interface is done with the IRQ, as it may be moved from now */
+    __atomic_store_n(&server_irq->ack_pending, false, __ATOMIC_RELEASE);
+    return error;
+}
+
+/* Counts an event of an IRQ and forwards it to the registered callback */
+static void irq_server_irq_callback(void *data, ps_irq_acknowledge_fn_t acknowledge_fn, void *ack_data)
+{
+    irq_server_irq_t *server_irq = data;
+    server_irq->num_events++;
+    server_irq->acknowledge_fn = acknowledge_fn;
+    server_irq->ack_data = ack_data;
+    __atomic_store_n(&server_irq->ack_pending, true, __ATOMIC_RELAXED);
+    server_irq->callback(server_irq->callback_data, irq_server_irq_acknowledge, server_irq);
+}
+
+static irq_server_irq_t *irq_server_find_irq(irq_server_t *irq_server, irq_id_t irq_id)
+{
+    for (size_t i = 0; i < irq_server->max_irqs; i++) {
+        if (irq_server->irqs[i].allocated && irq_server->irqs[i].irq_id == irq_id) {
+            return &irq_server->irqs[i];
+        }
+    }
+    return NULL;
+}
+
 /* Registers an IRQ callback and enables the IRQ */
-static irq_id_t irq_server_node_register_irq(irq_server_node_t *node, ps_irq_t irq, irq_callback_fn_t callback,
-                                             void *callback_data, ntfn_id_t ntfn_id, irq_server_t *irq_server)
+static irq_id_t irq_server_node_register_irq(irq_server_thread_t *thread, ps_irq_t irq, irq_callback_fn_t callback,
+                                             void *callback_data, irq_server_t *irq_server)
 {
     int error;
 
-    irq_id_t irq_id = ps_irq_register(&(irq_server->irq_ops), irq, callback, callback_data);
+    irq_server_irq_t *server_irq = NULL;
+    for (size_t i = 0; i < irq_server->max_irqs; i++) {
+        if (!irq_server->irqs[i].allocated) {
+            server_irq = &irq_server->irqs[i];
+            break;
+        }
+    }
+    if (server_irq == NULL) {
+        ZF_LOGE("The IRQ server is managing its maximum number of IRQs");
+        return -EMFILE;
+    }
+
+    *server_irq = (irq_server_irq_t) {
+        .callback = callback, .callback_data = callback_data, .thread = thread
+    };
+
+    irq_id_t irq_id = ps_irq_register(&(irq_server->irq_ops), irq, irq_server_irq_callback, server_irq);
     if (irq_id < 0) {
         ZF_LOGE("Failed to register an IRQ");
         /* The ID also serves as an error code */
         return irq_id;
     }
 
-    error = sel4platsupport_irq_set_ntfn(&(irq_server->irq_ops), ntfn_id, irq_id, NULL);
+    /* thread_id is synonymous with a ntfn_id */
+    irq_server_thread_lock(thread);
+    error = sel4platsupport_irq_set_ntfn(&(irq_server->irq_ops), (ntfn_id_t) thread->thread_id, irq_id,
+                                         &server_irq->badge);
+    irq_server_thread_unlock(thread);
     if (error) {
         ZF_LOGE("Failed to pair an IRQ with a notification");
         ps_irq_unregister(&(irq_server->irq_ops), irq_id);
         return error;
     }
 
-    node->num_irqs_bound++;
+    server_irq->irq_id = irq_id;
+    server_irq->allocated = true;
+    thread->node->num_irqs_bound++;
+    irq_server->num_irqs++;
 
     /* Success, return the ID that was assigned to the IRQ */
     return irq_id;
@@ -113,40 +250,122 @@ static irq_server_node_t *irq_server_node_new(seL4_CPtr ntfn, size_t max_irqs_bo
     return new_node;
 }
 
+/* Forwards a badge of IRQs that have arrived, either to the registered endpoint or
+ * directly to the handlers */
+static void irq_server_thread_deliver(irq_server_thread_t *my_thread_info, ps_irq_ops_t *irq_ops,
+                                      seL4_Word badge)
+{
+    irq_server_ring_t *ring = my_thread_info->ring;
+    if (ring != NULL) {
+        /* Event ring registered. Append the badge and only wake the consumer if it may
+         * have seen the ring empty */
+        uint32_t tail = ring->tail;
+        if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < IRQ_SERVER_RING_SIZE) {
+            ring->badges[tail % IRQ_SERVER_RING_SIZE] = badge;
+            __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+        } else {
+            /* Badges are bitmasks of IRQs, so merging them loses nothing the handlers need */
+            __atomic_fetch_or(&ring->overflow, badge, __ATOMIC_RELEASE);
+            my_thread_info->stats.num_overflows++;
+        }
+        /* Orders the store of tail or overflow before the load of head, pairs with the
+         * fence in irq_server_ring_drain */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_RELAXED) == tail) {
+            seL4_Signal(my_thread_info->consumer_ntfn);
+            my_thread_info->stats.num_deliveries++;
+        }
+    } else if (my_thread_info->delivery_ep != seL4_CapNull) {
+        /* Synchronous endpoint registered. Send IPC */
+        seL4_MessageInfo_t info = seL4_MessageInfo_new(my_thread_info->label, 0, 0, IRQ_SERVER_MESSAGE_LENGTH);
+        seL4_SetMR(0, badge);
+        seL4_SetMR(1, (uintptr_t)my_thread_info);
+        seL4_Send(my_thread_info->delivery_ep, info);
+        my_thread_info->stats.num_deliveries++;
+    } else {
+        /* No synchronous endpoint. Get the IRQ interface to invoke callbacks */
+        irq_server_node_handle_irq(my_thread_info, irq_ops, badge);
+    }
+}
+
+/* Keeps polling the notification after an IRQ has woken the thread, until the budget
+ * or time window runs out without another IRQ arriving */
+static void irq_server_thread_poll(irq_server_thread_t *my_thread_info, ps_irq_ops_t *irq_ops,
+                                   seL4_Word badge)
+{
+    irq_server_poll_config_t *config = &my_thread_info->poll_config;
+    bool coalesce = my_thread_info->ring != NULL || my_thread_info->delivery_ep != seL4_CapNull;
+    seL4_Word pending = badge;
+    size_t pending_events = POPCOUNTL(badge);
+    size_t empty_polls = 0;
+    uint64_t last_irq_time = config->get_time_ns ? config->get_time_ns(config->time_cookie) : 0;
+
+    while (1) {
+        if (pending && (!coalesce || pending_events >= config->coalesce_events)) {
+            irq_server_thread_deliver(my_thread_info, irq_ops, pending);
+            pending = 0;
+            pending_events = 0;
+        }
+
+        if (config->get_time_ns) {
+            if (config->get_time_ns(config->time_cookie) - last_irq_time >= config->poll_window_ns) {
+                break;
+            }
+        } else if (empty_polls >= config->poll_budget) {
+            break;
+        }
+
+        seL4_Word polled = 0;
+        seL4_Poll(my_thread_info->node->ntfn, &polled);
+        my_thread_info->stats.num_polls++;
+        if (polled == 0) {
+            empty_polls++;
+            continue;
+        }
+
+        empty_polls = 0;
+        if (config->get_time_ns) {
+            last_irq_time = config->get_time_ns(config->time_cookie);
+        }
+        __atomic_fetch_or(&my_thread_info->in_flight, polled, __ATOMIC_RELAXED);
+        my_thread_info->stats.num_events += POPCOUNTL(polled);
+        pending_events += POPCOUNTL(polled & ~pending);
+        pending |= polled;
+    }
+
+    if (pending) {
+        irq_server_thread_deliver(my_thread_info, irq_ops, pending);
+    }
+}
+
 /* IRQ handler thread. Wait on a notification object for IRQs. When one arrives, send a
  * synchronous message to the registered endpoint. If no synchronous endpoint was
  * registered, call the appropriate handler function directly (must be thread safe) */
 static void _irq_thread_entry(irq_server_thread_t *my_thread_info, ps_irq_ops_t *irq_ops)
 {
-    seL4_CPtr ep;
     seL4_CPtr ntfn;
-    uintptr_t thread_info_ptr;
-    seL4_Word label;
+    bool polling;
 
-    ep = my_thread_info->delivery_ep;
     ntfn = my_thread_info->node->ntfn;
-    thread_info_ptr = (uintptr_t)my_thread_info;
-    label = my_thread_info->label;
+    polling = my_thread_info->poll_config.poll_budget > 0;
     ZF_LOGD("thread started. Waiting on endpoint %lu\n", ntfn);
 
     while (1) {
         seL4_Word badge = 0;
         seL4_Wait(ntfn, &badge);
-        if (ep != seL4_CapNull) {
-            /* Synchronous endpoint registered. Send IPC */
-            seL4_MessageInfo_t info = seL4_MessageInfo_new(label, 0, 0, IRQ_SERVER_MESSAGE_LENGTH);
-            seL4_SetMR(0, badge);
-            seL4_SetMR(1, thread_info_ptr);
-            seL4_Send(ep, info);
+        __atomic_fetch_or(&my_thread_info->in_flight, badge, __ATOMIC_RELAXED);
+        my_thread_info->stats.num_wakeups++;
+        my_thread_info->stats.num_events += POPCOUNTL(badge);
+        if (polling) {
+            irq_server_thread_poll(my_thread_info, irq_ops, badge);
         } else {
-            /* No synchronous endpoint. Get the IRQ interface to invoke callbacks */
-            irq_server_node_handle_irq(my_thread_info, irq_ops, badge);
+            irq_server_thread_deliver(my_thread_info, irq_ops, badge);
         }
     }
 }
 
-thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
-                                  seL4_Word usable_mask, thread_id_t id_hint)
+static thread_id_t irq_server_thread_new_common(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
+                                                seL4_Word usable_mask, thread_id_t id_hint, int core)
 {
     bool thread_created = false;
     int error;
@@ -217,10 +436,40 @@ thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_n
     new_thread->label = irq_server->label;
     new_thread->node = new_node;
     new_thread->thread_id = thread_id_to_use;
+    new_thread->core = core;
+    new_thread->poll_config = irq_server->poll_config;
+
+    error = vka_alloc_notification(irq_server->vka, &new_thread->lock_ntfn);
+    if (error) {
+        ZF_LOGE("Failed to allocate a notification for the thread lock");
+        error = -ENOMEM;
+        goto fail;
+    }
+    new_thread->lock_value = 1;
+
+    if (irq_server->consumer_ntfn != seL4_CapNull) {
+        new_thread->ring = vspace_new_pages(irq_server->vspace, seL4_AllRights, 1, seL4_PageBits);
+        if (new_thread->ring == NULL) {
+            ZF_LOGE("Failed to allocate an event ring");
+            error = -ENOMEM;
+            goto fail;
+        }
+        memset(new_thread->ring, 0, sizeof(irq_server_ring_t));
+        new_thread->consumer_ntfn = irq_server->consumer_ntfn;
+    }
 
     /* Create the IRQ thread */
     sel4utils_thread_config_t config = thread_config_default(irq_server->simple, irq_server->cspace,
                                                              seL4_NilData, 0, irq_server->priority);
+    if (core != IRQ_SERVER_NO_CORE) {
+        if (config_set(CONFIG_KERNEL_MCS)) {
+            /* the sched control cap used to configure the sc determines the core */
+            config.sched_params = sched_params_round_robin(config.sched_params, irq_server->simple, core,
+                                                           CONFIG_BOOT_THREAD_TIME_SLICE * US_IN_MS);
+        } else {
+            config.sched_params = sched_params_core(config.sched_params, core);
+        }
+    }
     error = sel4utils_configure_thread_config(irq_server->vka, irq_server->vspace,
                                               irq_server->vspace, config, &(new_thread->thread));
     if (error) {
@@ -230,6 +479,14 @@ thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_n
 
     thread_created = true;
 
+    if (core != IRQ_SERVER_NO_CORE && !config_set(CONFIG_KERNEL_MCS)) {
+        error = sel4utils_set_sched_affinity(&new_thread->thread, config.sched_params);
+        if (error) {
+            ZF_LOGE("Failed to move IRQ server thread to core %d", core);
+            goto fail;
+        }
+    }
+
     /* Start the thread */
     error = sel4utils_start_thread(&new_thread->thread, (void *)_irq_thread_entry,
                                    new_thread, &(irq_server->irq_ops), 1);
@@ -264,13 +521,37 @@ fail:
         sel4utils_clean_up_thread(irq_server->vka, irq_server->vspace, &(new_thread->thread));
     }
 
+    if (new_thread && new_thread->lock_ntfn.cptr) {
+        vka_free_object(irq_server->vka, &new_thread->lock_ntfn);
+    }
+
+    if (new_thread && new_thread->ring) {
+        vspace_unmap_pages(irq_server->vspace, new_thread->ring, 1, seL4_PageBits, VSPACE_FREE);
+    }
+
     if (new_thread) {
-        ps_free(irq_server->malloc_ops, sizeof(irq_server_thread_t), new_node);
+        ps_free(irq_server->malloc_ops, sizeof(irq_server_thread_t), new_thread);
     }
 
     return error;
 }
 
+thread_id_t irq_server_thread_new(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
+                                  seL4_Word usable_mask, thread_id_t id_hint)
+{
+    return irq_server_thread_new_common(irq_server, provided_ntfn, usable_mask, id_hint, IRQ_SERVER_NO_CORE);
+}
+
+thread_id_t irq_server_thread_new_on_core(irq_server_t *irq_server, seL4_CPtr provided_ntfn,
+                                          seL4_Word usable_mask, thread_id_t id_hint, int core)
+{
+    if (core < 0 || core >= CONFIG_MAX_NUM_NODES) {
+        ZF_LOGE("Invalid core %d", core);
+        return -EINVAL;
+    }
+    return irq_server_thread_new_common(irq_server, provided_ntfn, usable_mask, id_hint, core);
+}
+
 void irq_server_handle_irq_ipc(irq_server_t *irq_server, seL4_MessageInfo_t msginfo)
 {
     seL4_Word badge = 0;
@@ -290,6 +571,120 @@ void irq_server_handle_irq_ipc(irq_server_t *irq_server, seL4_MessageInfo_t msgi
     }
 }
 
+int irq_server_set_poll_config(irq_server_t *irq_server, irq_server_poll_config_t config)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    if (config.get_time_ns && config.poll_budget == 0) {
+        ZF_LOGE("A clock was given but polling mode is disabled");
+        return -EINVAL;
+    }
+
+    irq_server->poll_config = config;
+    return 0;
+}
+
+int irq_server_thread_get_stats(irq_server_t *irq_server, thread_id_t thread_id,
+                                irq_server_thread_stats_t *ret_stats)
+{
+    if (irq_server == NULL || ret_stats == NULL) {
+        ZF_LOGE("irq_server or ret_stats is NULL");
+        return -EINVAL;
+    }
+
+    for (irq_server_thread_t *st = irq_server->server_threads; st != NULL; st = st->next) {
+        if (st->thread_id == thread_id) {
+            *ret_stats = st->stats;
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int irq_server_set_event_ring(irq_server_t *irq_server, seL4_CPtr consumer_ntfn)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    irq_server->consumer_ntfn = consumer_ntfn;
+    return 0;
+}
+
+/* Handles every event in a ring, returns the number of events handled */
+static size_t irq_server_ring_drain(irq_server_t *irq_server, irq_server_thread_t *thread)
+{
+    irq_server_ring_t *ring = thread->ring;
+    uint32_t head = ring->head;
+    size_t num_events = 0;
+
+    while (1) {
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        seL4_Word overflow = __atomic_exchange_n(&ring->overflow, 0, __ATOMIC_ACQUIRE);
+        if (head == tail && overflow == 0) {
+            /* Check again in case the IRQ thread added an event without signalling because
+             * it saw a head from before the last batch was published */
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_RELAXED) == head &&
+                __atomic_load_n(&ring->overflow, __ATOMIC_RELAXED) == 0) {
+                break;
+            }
+            continue;
+        }
+        for (; head != tail; head++) {
+            irq_server_node_handle_irq(thread, &(irq_server->irq_ops), ring->badges[head % IRQ_SERVER_RING_SIZE]);
+            num_events++;
+        }
+        /* Hand the slots back as soon as they are consumed, so the IRQ thread does not see
+         * the ring full while it is being drained */
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        if (overflow != 0) {
+            irq_server_node_handle_irq(thread, &(irq_server->irq_ops), overflow);
+            num_events++;
+        }
+    }
+
+    return num_events;
+}
+
+int irq_server_handle_events(irq_server_t *irq_server)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    size_t num_events = 0;
+    for (irq_server_thread_t *st = irq_server->server_threads; st != NULL; st = st->next) {
+        if (st->ring != NULL) {
+            num_events += irq_server_ring_drain(irq_server, st);
+        }
+    }
+
+    return num_events;
+}
+
+int irq_server_wait_for_events(irq_server_t *irq_server)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    if (irq_server->consumer_ntfn == seL4_CapNull) {
+        ZF_LOGE("No event ring notification was registered with the IRQ server");
+        return -EINVAL;
+    }
+
+    seL4_Wait(irq_server->consumer_ntfn, NULL);
+    return irq_server_handle_events(irq_server);
+}
+
 /* Register for a function to be called when an IRQ arrives */
 irq_id_t irq_server_register_irq(irq_server_t *irq_server, ps_irq_t irq,
                                  irq_callback_fn_t callback, void *callback_data)
@@ -305,9 +700,7 @@ irq_id_t irq_server_register_irq(irq_server_t *irq_server, ps_irq_t irq,
     /* Try to assign the IRQ to an existing node/thread */
     for (st = irq_server->server_threads; st != NULL; st = st->next) {
         if (st->node->num_irqs_bound < st->node->max_irqs_bound) {
-            /* thread_id is synonymous with a ntfn_id */
-            ret_id = irq_server_node_register_irq(st->node, irq, callback, callback_data,
-                                                  (ntfn_id_t) st->thread_id, irq_server);
+            ret_id = irq_server_node_register_irq(st, irq, callback, callback_data, irq_server);
             if (ret_id >= 0) {
                 return ret_id;
             }
@@ -319,6 +712,204 @@ irq_id_t irq_server_register_irq(irq_server_t *irq_server, ps_irq_t irq,
     return -ENOENT;
 }
 
+/* Finds the least loaded thread pinned to a core that can take another IRQ */
+static irq_server_thread_t *irq_server_find_thread_on_core(irq_server_t *irq_server, int core)
+{
+    irq_server_thread_t *best = NULL;
+    for (irq_server_thread_t *st = irq_server->server_threads; st != NULL; st = st->next) {
+        if (st->core == core && st->node->num_irqs_bound < st->node->max_irqs_bound &&
+            (best == NULL || st->node->num_irqs_bound < best->node->num_irqs_bound)) {
+            best = st;
+        }
+    }
+    return best;
+}
+
+irq_id_t irq_server_register_irq_on_core(irq_server_t *irq_server, ps_irq_t irq,
+                                         irq_callback_fn_t callback, void *callback_data, int core)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    irq_server_thread_t *st = irq_server_find_thread_on_core(irq_server, core);
+    if (st == NULL) {
+        ZF_LOGE("No threads on core %d are available to take this interrupt, consider making more", core);
+        return -ENOENT;
+    }
+
+    return irq_server_node_register_irq(st, irq, callback, callback_data, irq_server);
+}
+
+/* Pairs an IRQ with the notification of another thread, with both threads locked */
+static int irq_server_move_irq_locked(irq_server_t *irq_server, irq_server_irq_t *server_irq,
+                                      irq_server_thread_t *source, irq_server_thread_t *target)
+{
+    /* Pairing with the new notification acknowledges the IRQ, so wait until the handler
+     * has acknowledged it and no delivery of it is waiting to be handled */
+    if (__atomic_load_n(&server_irq->ack_pending, __ATOMIC_ACQUIRE) ||
+        (__atomic_load_n(&source->in_flight, __ATOMIC_RELAXED) & server_irq->badge)) {
+        return -EBUSY;
+    }
+
+    /* A delivery that the kernel has made but the old thread has not taken from its
+     * notification yet is dropped, and the acknowledgement below lets the IRQ be
+     * raised again on the new thread */
+    int error = sel4platsupport_irq_unset_ntfn(&(irq_server->irq_ops), server_irq->irq_id);
+    if (error) {
+        ZF_LOGE("Failed to unpair IRQ %d", server_irq->irq_id);
+        return error;
+    }
+
+    seL4_Word badge = 0;
+    error = sel4platsupport_irq_set_ntfn(&(irq_server->irq_ops), (ntfn_id_t) target->thread_id,
+                                         server_irq->irq_id, &badge);
+    if (error) {
+        ZF_LOGE("Failed to pair IRQ %d with thread %d", server_irq->irq_id, target->thread_id);
+        ZF_LOGF_IF(sel4platsupport_irq_set_ntfn(&(irq_server->irq_ops), (ntfn_id_t) source->thread_id,
+                                                server_irq->irq_id, &server_irq->badge),
+                   "Failed to restore IRQ %d after a failed move", server_irq->irq_id);
+        return error;
+    }
+
+    source->node->num_irqs_bound--;
+    target->node->num_irqs_bound++;
+    server_irq->thread = target;
+    server_irq->badge = badge;
+
+    return 0;
+}
+
+/* Pairs an IRQ with the notification of another thread. Both threads are locked, so neither
+ * handles IRQs while the IRQ interface is updated, and the callback of the IRQ is not running */
+static int irq_server_move_irq_to_thread(irq_server_t *irq_server, irq_server_irq_t *server_irq,
+                                         irq_server_thread_t *target)
+{
+    irq_server_thread_t *source = server_irq->thread;
+    if (source == target) {
+        return 0;
+    }
+
+    irq_server_thread_lock(source);
+    irq_server_thread_lock(target);
+    int error = irq_server_move_irq_locked(irq_server, server_irq, source, target);
+    irq_server_thread_unlock(target);
+    irq_server_thread_unlock(source);
+
+    return error;
+}
+
+int irq_server_route_irq(irq_server_t *irq_server, irq_id_t irq_id, int core)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    irq_server_irq_t *server_irq = irq_server_find_irq(irq_server, irq_id);
+    if (server_irq == NULL) {
+        ZF_LOGE("IRQ %d was not registered with the IRQ server", irq_id);
+        return -EINVAL;
+    }
+
+    if (server_irq->thread->core == core) {
+        return 0;
+    }
+
+    irq_server_thread_t *target = irq_server_find_thread_on_core(irq_server, core);
+    if (target == NULL) {
+        ZF_LOGE("No threads on core %d are available to take IRQ %d", core, irq_id);
+        return -ENOENT;
+    }
+
+    return irq_server_move_irq_to_thread(irq_server, server_irq, target);
+}
+
+/* Number of events of an IRQ since the last rebalance */
+static inline uint64_t irq_load(irq_server_irq_t *server_irq)
+{
+    return server_irq->num_events - server_irq->balanced_events;
+}
+
+static int compare_irq_load(const void *a, const void *b)
+{
+    uint64_t load_a = irq_load(*(irq_server_irq_t *const *) a);
+    uint64_t load_b = irq_load(*(irq_server_irq_t *const *) b);
+    /* Sort the busiest IRQs first */
+    return (load_a < load_b) - (load_a > load_b);
+}
+
+int irq_server_rebalance(irq_server_t *irq_server)
+{
+    if (irq_server == NULL) {
+        ZF_LOGE("irq_server is NULL");
+        return -EINVAL;
+    }
+
+    uint64_t core_load[CONFIG_MAX_NUM_NODES] = {0};
+    size_t core_capacity[CONFIG_MAX_NUM_NODES] = {0};
+    for (irq_server_thread_t *st = irq_server->server_threads; st != NULL; st = st->next) {
+        if (st->core != IRQ_SERVER_NO_CORE) {
+            core_capacity[st->core] += st->node->max_irqs_bound;
+        }
+    }
+
+    /* Only IRQs handled by pinned threads are moved */
+    irq_server_irq_t **sorted = NULL;
+    int error = ps_calloc(irq_server->malloc_ops, irq_server->max_irqs, sizeof(irq_server_irq_t *),
+                          (void **) &sorted);
+    if (error) {
+        ZF_LOGE("Failed to allocate memory for rebalancing");
+        return -ENOMEM;
+    }
+    size_t num_sorted = 0;
+    for (size_t i = 0; i < irq_server->max_irqs; i++) {
+        irq_server_irq_t *server_irq = &irq_server->irqs[i];
+        if (server_irq->allocated && server_irq->thread->core != IRQ_SERVER_NO_CORE) {
+            sorted[num_sorted++] = server_irq;
+        }
+    }
+    qsort(sorted, num_sorted, sizeof(irq_server_irq_t *), compare_irq_load);
+
+    /* Greedily place the busiest IRQs on the least loaded core with room for them */
+    int num_moved = 0;
+    for (size_t i = 0; i < num_sorted; i++) {
+        irq_server_irq_t *server_irq = sorted[i];
+        uint64_t load = irq_load(server_irq);
+        int best_core = IRQ_SERVER_NO_CORE;
+        for (int core = 0; core < CONFIG_MAX_NUM_NODES; core++) {
+            if (core_capacity[core] > 0 &&
+                (best_core == IRQ_SERVER_NO_CORE || core_load[core] < core_load[best_core])) {
+                best_core = core;
+            }
+        }
+        if (best_core == IRQ_SERVER_NO_CORE) {
+            break;
+        }
+
+        if (best_core != server_irq->thread->core) {
+            irq_server_thread_t *target = irq_server_find_thread_on_core(irq_server, best_core);
+            if (target == NULL || irq_server_move_irq_to_thread(irq_server, server_irq, target) != 0) {
+                /* Leave it where it is */
+                best_core = server_irq->thread->core;
+            } else {
+                num_moved++;
+            }
+        }
+
+        core_load[best_core] += load;
+        if (core_capacity[best_core] > 0) {
+            core_capacity[best_core]--;
+        }
+        server_irq->balanced_events = server_irq->num_events;
+    }
+
+    ps_free(irq_server->malloc_ops, irq_server->max_irqs * sizeof(irq_server_irq_t *), sorted);
+
+    return num_moved;
+}
+
 irq_server_t *irq_server_new(vspace_t *vspace, vka_t *vka, seL4_Word priority,
                              simple_t *simple, seL4_CPtr cspace, seL4_CPtr delivery_ep, seL4_Word label,
                              size_t num_irqs, ps_malloc_ops_t *malloc_ops)
@@ -349,12 +940,21 @@ irq_server_t *irq_server_new(vspace_t *vspace, vka_t *vka, seL4_Word priority,
         return NULL;
     }
 
+    error = ps_calloc(malloc_ops, num_irqs, sizeof(irq_server_irq_t), (void **) &new->irqs);
+    if (error) {
+        ZF_LOGE("Failed to allocate memory for the IRQ bookkeeping");
+        vka_free_object(vka, &(new->reply));
+        ps_free(malloc_ops, sizeof(irq_server_t), new);
+        return NULL;
+    }
+
     /* Set max_ntfn_ids to equal the number of IRQs. We can calculate the ntfn IDs we need,
      * but this is really complex, and leads to code that is hard to maintain. */
     irq_interface_config_t irq_config = { .max_irq_ids = num_irqs, .max_ntfn_ids = num_irqs } ;
     error = sel4platsupport_new_irq_ops(&(new->irq_ops), vka, simple, irq_config, malloc_ops);
     if (error) {
         ZF_LOGE("Failed to initialise supporting backend for IRQ server");
+        ps_free(malloc_ops, num_irqs * sizeof(irq_server_irq_t), new->irqs);
         vka_free_object(vka, &(new->reply));
         ps_free(malloc_ops, sizeof(irq_server_t), new);
         return NULL;
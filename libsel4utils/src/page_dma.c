@@ -16,15 +16,51 @@
 #include <string.h>
 #include <sel4utils/arch/cache.h>
 
+/* Smallest buffer handed out by a pool */
+#define DMA_POOL_MIN_CLASS_BITS 6
+#define DMA_POOL_DEFAULT_MAX_CLASS_BITS 16
+#define DMA_POOL_DEFAULT_SLAB_SIZE_BITS 16
+
+/* A buffer carved out of a pool slab. These are kept outside the buffers, as a device may
+ * write to a buffer at any time, even after it has been freed. */
+typedef struct dma_pool_buffer {
+    void *addr;
+    /* set once the buffer has been handed out, so it must be zeroed before it is reused */
+    bool used;
+    struct dma_pool_buffer *next;
+} dma_pool_buffer_t;
+
+/* Buffers of one size and cacheability handed out by a pool */
+typedef struct dma_size_class {
+    size_t size_bits;
+    /* free buffers of this class */
+    dma_pool_buffer_t *free_list;
+    size_t num_free;
+    size_t num_allocated;
+} dma_size_class_t;
+
 typedef struct dma_man {
     vka_t vka;
     vspace_t vspace;
+    /* the following are only used by pools. Size classes are indexed by cacheability
+     * and then size bits. */
+    bool is_pool;
+    size_t max_class_bits;
+    size_t slab_size_bits;
+    dma_size_class_t classes[2][seL4_WordBits];
+    sel4utils_dma_pool_stats_t stats;
 } dma_man_t;
 
 typedef struct dma_alloc {
     void *base;
     vka_object_t ut;
     uintptr_t paddr;
+    /* size of the frames backing the allocation */
+    size_t frame_bits;
+    /* size class this allocation has been carved into, NULL if it was handed out whole */
+    dma_size_class_t *class;
+    /* the buffers it has been carved into, indexed by offset in the allocation */
+    dma_pool_buffer_t *buffers;
 } dma_alloc_t;
 
 static void dma_free(void *cookie, void *addr, size_t size)
@@ -33,11 +69,12 @@ static void dma_free(void *cookie, void *addr, size_t size)
     dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, addr);
     assert(alloc);
     assert(alloc->base == addr);
-    int num_pages = BIT(alloc->ut.size_bits) / PAGE_SIZE_4K;
-    for (int i = 0; i < num_pages; i++) {
+    size_t frame_size = BIT(alloc->frame_bits);
+    int num_frames = BIT(alloc->ut.size_bits) / frame_size;
+    for (int i = 0; i < num_frames; i++) {
         cspacepath_t path;
-        seL4_CPtr frame = vspace_get_cap(&dma->vspace, addr + i * PAGE_SIZE_4K);
-        vspace_unmap_pages(&dma->vspace, addr + i * PAGE_SIZE_4K, 1, PAGE_BITS_4K, NULL);
+        seL4_CPtr frame = vspace_get_cap(&dma->vspace, addr + i * frame_size);
+        vspace_unmap_pages(&dma->vspace, addr + i * frame_size, 1, alloc->frame_bits, NULL);
         vka_cspace_make_path(&dma->vka, frame, &path);
         vka_cnode_delete(&path);
         vka_cspace_free(&dma->vka, frame);
@@ -64,10 +101,12 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
     reservation_t res = {NULL};
     dma_alloc_t *alloc = NULL;
     unsigned int num_frames = 0;
+    size_t frame_bits = PAGE_BITS_4K;
     void *base = NULL;
-    /* We align to the 4K boundary, but do not support more */
-    if (align > PAGE_SIZE_4K) {
-        return NULL;
+    /* Allocations are naturally aligned, both physically and virtually, so
+     * larger alignments are satisfied by allocating at least that much */
+    if (align > size) {
+        size = align;
     }
     /* Round up to the next page size */
     size = ROUND_UP(size, PAGE_SIZE_4K);
@@ -91,8 +130,11 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
         ZF_LOGE("Allocated untyped has no physical address");
         goto handle_error;
     }
+    /* Use large frames when the allocation is big enough, so that fewer frames need to be
+     * created and mapped, and cache maintenance can be done a large frame at a time */
+    frame_bits = size_bits >= seL4_LargePageBits ? seL4_LargePageBits : PAGE_BITS_4K;
     /* Allocate all the frames */
-    num_frames = size / PAGE_SIZE_4K;
+    num_frames = size / BIT(frame_bits);
     frames = calloc(num_frames, sizeof(cspacepath_t));
     if (!frames) {
         goto handle_error;
@@ -102,17 +144,17 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
         if (error) {
             goto handle_error;
         }
-        error = seL4_Untyped_Retype(ut.cptr, kobject_get_type(KOBJECT_FRAME, PAGE_BITS_4K), size_bits, frames[i].root,
+        error = seL4_Untyped_Retype(ut.cptr, kobject_get_type(KOBJECT_FRAME, frame_bits), frame_bits, frames[i].root,
                                     frames[i].dest, frames[i].destDepth, frames[i].offset, 1);
         if (error != seL4_NoError) {
             goto handle_error;
         }
     }
     /* Grab a reservation */
-    res = vspace_reserve_range(&dma->vspace, size, seL4_AllRights, cached, &base);
+    res = vspace_reserve_range_aligned(&dma->vspace, size, size_bits, seL4_AllRights, cached, &base);
     if (!res.res) {
         ZF_LOGE("Failed to reserve");
-        return NULL;
+        goto handle_error;
     }
     alloc = malloc(sizeof(*alloc));
     if (alloc == NULL) {
@@ -121,23 +163,28 @@ static void *dma_alloc(void *cookie, size_t size, int align, int cached, ps_mem_
     alloc->base = base;
     alloc->ut = ut;
     alloc->paddr = paddr;
+    alloc->frame_bits = frame_bits;
+    alloc->class = NULL;
+    alloc->buffers = NULL;
     /* Map in all the pages */
     for (unsigned i = 0; i < num_frames; i++) {
-        error = vspace_map_pages_at_vaddr(&dma->vspace, &frames[i].capPtr, (uintptr_t *)&alloc, base + i * PAGE_SIZE_4K, 1,
-                                          PAGE_BITS_4K, res);
+        error = vspace_map_pages_at_vaddr(&dma->vspace, &frames[i].capPtr, (uintptr_t *)&alloc,
+                                          base + i * BIT(frame_bits), 1, frame_bits, res);
         if (error) {
             goto handle_error;
         }
     }
     /* no longer need the reservation */
     vspace_free_reservation(&dma->vspace, res);
+    /* the frame caps are tracked by the vspace */
+    free(frames);
     return base;
 handle_error:
     if (alloc) {
         free(alloc);
     }
     if (res.res) {
-        vspace_unmap_pages(&dma->vspace, base, num_frames, PAGE_BITS_4K, NULL);
+        vspace_unmap_pages(&dma->vspace, base, num_frames, frame_bits, NULL);
         vspace_free_reservation(&dma->vspace, res);
     }
     if (frames) {
@@ -157,14 +204,25 @@ static void dma_unpin(void *cookie, void *addr, size_t size)
 {
 }
 
-static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+/* Perform a cache operation on a range of memory, one kernel invocation per frame. User
+ * level operations are not complete until dma_cache_sync is called. */
+static void dma_cache_range(dma_man_t *dma, uintptr_t start, uintptr_t end, dma_cache_op_t op)
 {
-    dma_man_t *dma = cookie;
+#ifdef CONFIG_SEL4UTILS_USER_CACHE_MAINTENANCE
+    /* EL0 can clean, but not invalidate without cleaning */
+    if (op != DMA_CACHE_OP_INVALIDATE) {
+        sel4utils_user_clean_data_range(start, end, op == DMA_CACHE_OP_CLEAN_INVALIDATE);
+        return;
+    }
+#endif
     seL4_CPtr root = vspace_get_root(&dma->vspace);
-    uintptr_t end = (uintptr_t)addr + size;
-    uintptr_t cur = (uintptr_t)addr;
+    uintptr_t cur = start;
     while (cur < end) {
-        uintptr_t top = ROUND_UP(cur + 1, PAGE_SIZE_4K);
+        /* the kernel will not operate across a frame boundary, so find the size
+         * of the frame cur is in */
+        dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, (void *)cur);
+        size_t frame_size = alloc ? BIT(alloc->frame_bits) : PAGE_SIZE_4K;
+        uintptr_t top = ROUND_UP(cur + 1, frame_size);
         if (top > end) {
             top = end;
         }
@@ -183,6 +241,196 @@ static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t o
     }
 }
 
+static void dma_cache_sync(void)
+{
+#ifdef CONFIG_SEL4UTILS_USER_CACHE_MAINTENANCE
+    sel4utils_user_cache_sync();
+#endif
+}
+
+static void dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+    /* DMA is cache coherent on architectures other than arm */
+    if (!config_set(CONFIG_ARCH_ARM)) {
+        return;
+    }
+
+    dma_cache_range(cookie, (uintptr_t)addr, (uintptr_t)addr + size, op);
+    dma_cache_sync();
+}
+
+void sel4utils_page_dma_cache_op_sg(ps_dma_man_t *dma_man, sel4utils_dma_sg_t *sg, size_t num,
+                                    dma_cache_op_t op)
+{
+    if (!config_set(CONFIG_ARCH_ARM) || num == 0) {
+        return;
+    }
+
+    /* merge entries that are adjacent in memory, which is common for descriptor rings */
+    uintptr_t start = (uintptr_t)sg[0].addr;
+    uintptr_t end = start + sg[0].size;
+    for (size_t i = 1; i < num; i++) {
+        uintptr_t next = (uintptr_t)sg[i].addr;
+        if (next != end) {
+            dma_cache_range(dma_man->cookie, start, end, op);
+            start = next;
+        }
+        end = next + sg[i].size;
+    }
+    dma_cache_range(dma_man->cookie, start, end, op);
+    dma_cache_sync();
+}
+
+static size_t dma_pool_class_bits(size_t size)
+{
+    size_t size_bits = LOG_BASE_2(size);
+    if (BIT(size_bits) != size) {
+        size_bits++;
+    }
+    return MAX(size_bits, DMA_POOL_MIN_CLASS_BITS);
+}
+
+/* Allocate a new slab for a size class and carve it into buffers */
+static int dma_pool_grow(dma_man_t *dma, dma_size_class_t *class, int cached)
+{
+    size_t slab_size = BIT(MAX(dma->slab_size_bits, class->size_bits));
+    void *slab = dma_alloc(dma, slab_size, PAGE_SIZE_4K, cached, PS_MEM_NORMAL);
+    if (slab == NULL) {
+        ZF_LOGE("Failed to allocate slab of %zu bytes", slab_size);
+        return -1;
+    }
+
+    size_t num_buffers = slab_size >> class->size_bits;
+    dma_pool_buffer_t *buffers = calloc(num_buffers, sizeof(*buffers));
+    if (buffers == NULL) {
+        ZF_LOGE("Failed to allocate buffer list of slab");
+        dma_free(dma, slab, slab_size);
+        return -1;
+    }
+
+    dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, slab);
+    assert(alloc);
+    alloc->class = class;
+    alloc->buffers = buffers;
+
+    for (size_t i = 0; i < num_buffers; i++) {
+        buffers[i].addr = slab + (i << class->size_bits);
+        buffers[i].next = class->free_list;
+        class->free_list = &buffers[i];
+        class->num_free++;
+    }
+
+    dma->stats.slab_bytes += slab_size;
+    dma->stats.num_slabs++;
+    return 0;
+}
+
+static void *dma_pool_alloc(void *cookie, size_t size, int align, int cached, ps_mem_flags_t flags)
+{
+    dma_man_t *dma = cookie;
+    size_t size_bits = dma_pool_class_bits(MAX(size, (size_t) align));
+    if (size_bits > dma->max_class_bits) {
+        dma->stats.num_bypass_allocs++;
+        return dma_alloc(cookie, size, align, cached, flags);
+    }
+
+    dma_size_class_t *class = &dma->classes[!!cached][size_bits];
+    if (class->free_list == NULL) {
+        if (dma_pool_grow(dma, class, cached)) {
+            return NULL;
+        }
+    }
+
+    dma_pool_buffer_t *buffer = class->free_list;
+    class->free_list = buffer->next;
+    buffer->next = NULL;
+    class->num_free--;
+    class->num_allocated++;
+    dma->stats.allocated_bytes += BIT(size_bits);
+    dma->stats.num_allocs++;
+    /* Buffers of a new slab come from freshly retyped frames, which are zeroed. A buffer that
+     * has been used before is zeroed here, so stale data is never handed out. The zeroes are
+     * cleaned out of the cache, so they are not written back over data from a device later. */
+    if (buffer->used) {
+        memset(buffer->addr, 0, BIT(size_bits));
+        if (cached) {
+            dma_cache_op(dma, buffer->addr, BIT(size_bits), DMA_CACHE_OP_CLEAN);
+        }
+    }
+    buffer->used = true;
+    return buffer->addr;
+}
+
+static void dma_pool_free(void *cookie, void *addr, size_t size)
+{
+    dma_man_t *dma = cookie;
+    dma_alloc_t *alloc = (dma_alloc_t *)vspace_get_cookie(&dma->vspace, addr);
+    assert(alloc);
+    dma_size_class_t *class = alloc->class;
+    if (class == NULL) {
+        dma_free(cookie, addr, size);
+        return;
+    }
+
+    /* keep the buffer mapped for the next allocation of this class */
+    assert(class->num_allocated > 0);
+    dma_pool_buffer_t *buffer = &alloc->buffers[(addr - alloc->base) >> class->size_bits];
+    assert(buffer->addr == addr);
+    buffer->next = class->free_list;
+    class->free_list = buffer;
+    class->num_free++;
+    class->num_allocated--;
+    dma->stats.allocated_bytes -= BIT(class->size_bits);
+    dma->stats.num_frees++;
+}
+
+int sel4utils_page_dma_pool_stats(ps_dma_man_t *dma_man, sel4utils_dma_pool_stats_t *stats)
+{
+    if (dma_man == NULL || stats == NULL) {
+        return -1;
+    }
+
+    dma_man_t *dma = dma_man->cookie;
+    if (!dma->is_pool) {
+        ZF_LOGE("Not a dma pool");
+        return -1;
+    }
+
+    *stats = dma->stats;
+    return 0;
+}
+
+int sel4utils_new_page_dma_pool(vka_t *vka, vspace_t *vspace, sel4utils_dma_pool_config_t config,
+                                ps_dma_man_t *dma_man)
+{
+    size_t max_class_bits = config.max_class_bits ? config.max_class_bits : DMA_POOL_DEFAULT_MAX_CLASS_BITS;
+    size_t slab_size_bits = config.slab_size_bits ? config.slab_size_bits : DMA_POOL_DEFAULT_SLAB_SIZE_BITS;
+    if (max_class_bits < DMA_POOL_MIN_CLASS_BITS || max_class_bits >= seL4_WordBits ||
+        slab_size_bits < seL4_PageBits || slab_size_bits >= seL4_WordBits) {
+        ZF_LOGE("Invalid dma pool config");
+        return -1;
+    }
+
+    int error = sel4utils_new_page_dma_alloc(vka, vspace, dma_man);
+    if (error) {
+        return error;
+    }
+
+    dma_man_t *dma = dma_man->cookie;
+    dma->is_pool = true;
+    dma->max_class_bits = max_class_bits;
+    dma->slab_size_bits = slab_size_bits;
+    for (int cached = 0; cached < 2; cached++) {
+        for (size_t i = 0; i < seL4_WordBits; i++) {
+            dma->classes[cached][i].size_bits = i;
+        }
+    }
+
+    dma_man->dma_alloc_fn = dma_pool_alloc;
+    dma_man->dma_free_fn = dma_pool_free;
+    return 0;
+}
+
 int sel4utils_new_page_dma_alloc(vka_t *vka, vspace_t *vspace, ps_dma_man_t *dma_man)
 {
     dma_man_t *dma = calloc(1, sizeof(*dma));
@@ -31,7 +31,8 @@ extern char _cpio_archive_end[];
 
 void sel4utils_allocated_object(void *cookie, vka_object_t object)
 {
-    static bool recurse = false;
+    /* processes may be configured concurrently, see sel4utils_configure_processes_parallel */
+    static __thread bool recurse = false;
 
     if (recurse) {
         ZF_LOGF("VSPACE RECURSION ON MALLOC, YOU ARE DEAD\n");
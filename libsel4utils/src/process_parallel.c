@@ -0,0 +1,186 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sel4/sel4.h>
+#include <vka/object.h>
+#include <sel4utils/process.h>
+#include <sel4utils/thread.h>
+#include <sel4utils/util.h>
+
+/* State shared between the workers of one call to sel4utils_configure_processes_parallel */
+typedef struct sel4utils_process_batch {
+    sel4utils_process_batch_entry_t *entries;
+    size_t num_entries;
+    /* index of the next entry to be claimed by a worker */
+    size_t next;
+    /* number of workers that have not yet finished */
+    size_t remaining;
+    /* signalled by the last worker to finish */
+    seL4_CPtr done_ntfn;
+} sel4utils_process_batch_t;
+
+static void process_batch_worker_entry(sel4utils_process_batch_worker_t *worker, UNUSED void *arg1,
+                                       UNUSED void *ipc_buf)
+{
+    sel4utils_process_batch_t *batch = worker->batch;
+
+    while (1) {
+        size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->num_entries) {
+            break;
+        }
+        sel4utils_process_batch_entry_t *entry = &batch->entries[i];
+        entry->vka = worker->vka;
+        entry->error = sel4utils_configure_process_custom(entry->process, worker->vka,
+                                                          worker->spawner_vspace, entry->config);
+        if (entry->error) {
+            ZF_LOGE("Failed to configure process %zu", i);
+        }
+    }
+
+    /* the last worker out wakes the spawning thread */
+    if (__atomic_sub_fetch(&batch->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+        seL4_Signal(batch->done_ntfn);
+    }
+
+    /* wait to be cleaned up */
+    seL4_TCB_Suspend(worker->thread.tcb.cptr);
+}
+
+int sel4utils_configure_processes_parallel(vka_t *vka, vspace_t *vspace,
+                                           sel4utils_process_batch_worker_t *workers, size_t num_workers,
+                                           sel4utils_process_batch_entry_t *entries, size_t num_entries)
+{
+    if (workers == NULL || num_workers == 0 || entries == NULL) {
+        ZF_LOGE("Invalid arguments");
+        return -1;
+    }
+
+    if (num_entries == 0) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < num_entries; i++) {
+        entries[i].vka = NULL;
+        entries[i].error = -1;
+    }
+
+    vka_object_t done_ntfn = {0};
+    int error = vka_alloc_notification(vka, &done_ntfn);
+    if (error) {
+        ZF_LOGE("Failed to allocate notification");
+        return -1;
+    }
+
+    sel4utils_process_batch_t batch = {
+        .entries = entries,
+        .num_entries = num_entries,
+        .next = 0,
+        .remaining = num_workers,
+        .done_ntfn = done_ntfn.cptr
+    };
+
+    size_t num_configured = 0;
+    for (; num_configured < num_workers; num_configured++) {
+        sel4utils_process_batch_worker_t *worker = &workers[num_configured];
+        worker->batch = &batch;
+        error = sel4utils_configure_thread_config(vka, vspace, vspace, worker->thread_config, &worker->thread);
+        if (error) {
+            ZF_LOGE("Failed to configure worker %zu", num_configured);
+            break;
+        }
+        if (CONFIG_MAX_NUM_NODES > 1) {
+            error = sel4utils_set_sched_affinity(&worker->thread, worker->thread_config.sched_params);
+            if (error) {
+                ZF_LOGE("Failed to set affinity of worker %zu", num_configured);
+                sel4utils_clean_up_thread(vka, vspace, &worker->thread);
+                break;
+            }
+        }
+    }
+
+    if (num_configured == 0) {
+        vka_free_object(vka, &done_ntfn);
+        return -1;
+    }
+
+    /* the workers that could not be created will never finish */
+    __atomic_store_n(&batch.remaining, num_configured, __ATOMIC_RELAXED);
+
+    bool wait = true;
+    for (size_t i = 0; i < num_configured; i++) {
+        error = sel4utils_start_thread(&workers[i].thread, (sel4utils_thread_entry_fn) process_batch_worker_entry,
+                                       &workers[i], NULL, 1);
+        if (error) {
+            ZF_LOGE("Failed to start worker %zu", i);
+            /* account for the workers that will never run. If the started workers have
+             * already finished, nobody is left to signal us */
+            wait = __atomic_sub_fetch(&batch.remaining, num_configured - i, __ATOMIC_ACQ_REL) != 0;
+            break;
+        }
+    }
+
+    if (wait) {
+        seL4_Wait(done_ntfn.cptr, NULL);
+    }
+
+    for (size_t i = 0; i < num_configured; i++) {
+        sel4utils_clean_up_thread(vka, vspace, &workers[i].thread);
+    }
+    vka_free_object(vka, &done_ntfn);
+
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].error) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int sel4utils_spawn_processes(vspace_t *vspace, sel4utils_process_batch_entry_t *entries,
+                              size_t num_entries, bool resume)
+{
+    for (size_t i = 0; i < num_entries; i++) {
+        sel4utils_process_batch_entry_t *entry = &entries[i];
+        if (entry->error) {
+            ZF_LOGE("Process %zu was not configured", i);
+            return -1;
+        }
+        int error = sel4utils_spawn_process_v(entry->process, entry->vka, vspace,
+                                              entry->argc, entry->argv, 0);
+        if (error) {
+            ZF_LOGE("Failed to spawn process %zu", i);
+            return -1;
+        }
+    }
+
+    if (resume) {
+        for (size_t i = 0; i < num_entries; i++) {
+            int error = seL4_TCB_Resume(entries[i].process->thread.tcb.cptr);
+            if (error) {
+                ZF_LOGE("Failed to resume process %zu", i);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void sel4utils_destroy_processes(sel4utils_process_batch_entry_t *entries, size_t num_entries)
+{
+    for (size_t i = 0; i < num_entries; i++) {
+        if (entries[i].error == 0 && entries[i].vka != NULL) {
+            sel4utils_destroy_process(entries[i].process, entries[i].vka);
+            entries[i].error = -1;
+        }
+    }
+}
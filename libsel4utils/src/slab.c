@@ -16,6 +16,12 @@ typedef struct {
     seL4_CPtr next;
     /* list of objects in the slab */
     vka_object_t *objects;
+    /* untyped each object was retyped from, revoked to reset the object once it is freed.
+     * Only used when recycling. */
+    vka_object_t *untypeds;
+    /* stack of indices of objects that have been freed and can be handed out again */
+    seL4_CPtr *free_list;
+    seL4_CPtr num_free;
 } slab_t;
 
 typedef struct {
@@ -25,6 +31,8 @@ typedef struct {
     slab_t slabs[seL4_ObjectTypeCount];
     /* untyped to allocate from */
     vka_object_t untyped;
+    /* whether freed objects are reset and handed out again */
+    bool recycle;
 } slab_data_t;
 
 typedef struct {
@@ -60,6 +68,39 @@ static void delegate_cspace_free(void *data, seL4_CPtr slot)
     vka_cspace_free(sdata->delegate, slot);
 }
 
+/* Retype objects into the slots of a slab. Slots that are adjacent in the same cnode are
+ * filled with a single retype invocation. */
+static seL4_Error retype_objects(vka_t *delegate, vka_object_t *untyped, vka_object_t *objects, size_t n,
+                                 size_t size_bits, seL4_Word type)
+{
+    size_t i = 0;
+    while (i < n) {
+        cspacepath_t start;
+        vka_cspace_make_path(delegate, objects[i].cptr, &start);
+
+        size_t count = 1;
+        while (i + count < n && count < CONFIG_RETYPE_FAN_OUT_LIMIT) {
+            cspacepath_t path;
+            vka_cspace_make_path(delegate, objects[i + count].cptr, &path);
+            if (path.root != start.root || path.dest != start.dest || path.destDepth != start.destDepth ||
+                path.offset != start.offset + count) {
+                break;
+            }
+            count++;
+        }
+
+        seL4_Error error = seL4_Untyped_Retype(untyped->cptr, type, size_bits, start.root, start.dest,
+                                               start.destDepth, start.offset, count);
+        if (error != seL4_NoError) {
+            ZF_LOGE("Failed to retype %zu objects", count);
+            return error;
+        }
+        i += count;
+    }
+
+    return seL4_NoError;
+}
+
 static int slab_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word type,
         seL4_Word size_bits, seL4_Word *res)
 {
@@ -70,19 +111,49 @@ static int slab_utspace_alloc(void *data, const cspacepath_t *dest, seL4_Word ty
     }
 
     slab_t *slab = &sdata->slabs[type];
-    if (slab->next == slab->n) {
+    if (!sdata->recycle) {
+        if (slab->next == slab->n) {
+            ZF_LOGW("Slab of type %lu expired, using delegate allocator", type);
+            return vka_utspace_alloc(sdata->delegate, dest, type, size_bits, res);
+        }
+
+        cspacepath_t src;
+        vka_cspace_make_path(sdata->delegate, slab->objects[slab->next].cptr, &src);
+        if (vka_cnode_move(dest, &src) != seL4_NoError) {
+            ZF_LOGW("Dest invalid\n");
+            return -1;
+        }
+
+        *res = (seL4_Word) &slab->objects[slab->next];
+        slab->next++;
+        return 0;
+    }
+
+    seL4_CPtr index;
+    if (slab->num_free > 0) {
+        index = slab->free_list[slab->num_free - 1];
+    } else if (slab->next < slab->n) {
+        index = slab->next;
+    } else {
         ZF_LOGW("Slab of type %lu expired, using delegate allocator", type);
         return vka_utspace_alloc(sdata->delegate, dest, type, size_bits, res);
     }
 
+    /* hand out a copy, so the slab keeps a cap to the object and can reuse it once freed */
     cspacepath_t src;
-    vka_cspace_make_path(sdata->delegate, slab->objects[slab->next].cptr, &src);
-    if (vka_cnode_move(dest, &src) != seL4_NoError) {
+    vka_cspace_make_path(sdata->delegate, slab->objects[index].cptr, &src);
+    if (vka_cnode_copy(dest, &src, seL4_AllRights) != seL4_NoError) {
         ZF_LOGW("Dest invalid\n");
         return -1;
     }
 
-    slab->next++;
+    if (slab->num_free > 0) {
+        slab->num_free--;
+    } else {
+        slab->next++;
+    }
+
+    *res = (seL4_Word) &slab->objects[index];
     return 0;
 }
 
@@ -102,8 +173,44 @@ static int delegate_utspace_alloc_at(void *data, const cspacepath_t *dest, seL4_
 static void
 slab_utspace_free(void *data, seL4_Word type, seL4_Word size_bits, seL4_Word target)
 {
-    //TODO this should be possible - swap the object in at next, but do we need it?
-    ZF_LOGW("slab_utspace_free not implemented");
+    slab_data_t *sdata = data;
+
+    if (type >= seL4_ObjectTypeCount) {
+        return;
+    }
+
+    slab_t *slab = &sdata->slabs[type];
+    vka_object_t *object = (vka_object_t *) target;
+    if (slab->n == 0 || object < slab->objects || object >= slab->objects + slab->n) {
+        /* allocated by the delegate after the slab expired */
+        vka_utspace_free(sdata->delegate, type, size_bits, target);
+        return;
+    }
+
+    if (!sdata->recycle) {
+        /* the caller deleted the only cap, so the object is gone, but its memory is part of
+         * the slab's untyped and is not reused */
+        return;
+    }
+
+    /* Deleting the caller's copy did not finalise the object, as the slab still holds a cap to
+     * it. Revoking the untyped deletes that cap and any others derived from it, which finalises
+     * the object, and frees the memory to retype a fresh one. */
+    size_t index = object - slab->objects;
+    cspacepath_t path;
+    vka_cspace_make_path(sdata->delegate, slab->untypeds[index].cptr, &path);
+    if (vka_cnode_revoke(&path) != seL4_NoError) {
+        ZF_LOGE("Failed to revoke untyped of freed object, not recycling it");
+        return;
+    }
+    if (retype_objects(sdata->delegate, &slab->untypeds[index], object, 1, object->size_bits, type) != seL4_NoError) {
+        ZF_LOGE("Failed to retype freed object, not recycling it");
+        return;
+    }
+
+    assert(slab->num_free < slab->n);
+    slab->free_list[slab->num_free] = index;
+    slab->num_free++;
 }
 
 static size_t calculate_total_size(size_t object_freq[seL4_ObjectTypeCount]) {
@@ -126,45 +233,63 @@ static void slab_destroy(vka_t *slab)
     ZF_LOGW("Slab destroy not implemented");
 }
 
-static seL4_Error alloc_object(vka_t *delegate, vka_object_t *untyped, size_t size_bits, seL4_Word type,
-                               vka_object_t *object)
-{
-    /* allocate slot for object */
-    object->type = type;
-    object->size_bits = size_bits;
-    seL4_Error error = vka_cspace_alloc(delegate, &object->cptr);
-    if (error != seL4_NoError) {
-        ZF_LOGE("Failed to allocate cslot");
-        return error;
-    }
-
-    /* convert to cspacepath */
-    cspacepath_t path;
-    vka_cspace_make_path(delegate, object->cptr, &path);
-
-    /* retype object */
-    return seL4_Untyped_Retype(untyped->cptr, type, size_bits, path.root, path.dest,
-                                        path.destDepth, path.offset, 1);
-}
-
 static int alloc_object_slab(vka_t *delegate, vka_object_t *untyped, slab_t *slab, size_t n,
-                             size_t size_bits, seL4_Word type)
+                             size_t size_bits, seL4_Word type, bool recycle)
 {
     ZF_LOGI("Preallocating %zu objects of %zu size bits, %lu type\n", n, size_bits, (long) type);
 
     slab->n = n;
     slab->next = 0;
+    slab->num_free = 0;
+
+    if (n == 0) {
+        return 0;
+    }
+
+    slab->objects = calloc(n, sizeof(vka_object_t));
+    if (slab->objects == NULL) {
+        ZF_LOGI("Failed to allocate %zu objects of %zu size bits, %lu type", n, size_bits, (long) type);
+        return -1;
+    }
+
+    /* allocate slots for the objects first, so that runs of contiguous slots can be found */
+    for (int i = 0; i < slab->n; i++) {
+        slab->objects[i].type = type;
+        slab->objects[i].size_bits = size_bits;
+        if (vka_cspace_alloc(delegate, &slab->objects[i].cptr) != seL4_NoError) {
+            ZF_LOGE("Failed to allocate cslot");
+            return -1;
+        }
+    }
 
-    if (n > 0) {
-        slab->objects = calloc(n, sizeof(vka_object_t));
-        if (slab->objects == NULL) {
-            ZF_LOGI("Failed to allocate %zu objects of %zu size bits, %lu type", n, size_bits, (long) type);
+    if (!recycle) {
+        return retype_objects(delegate, untyped, slab->objects, n, size_bits, type) == seL4_NoError ? 0 : -1;
+    }
+
+    /* Each object gets an untyped of its own, so that it can be reset by revoking that
+     * untyped once it is freed */
+    slab->untypeds = calloc(n, sizeof(vka_object_t));
+    slab->free_list = calloc(n, sizeof(seL4_CPtr));
+    if (slab->untypeds == NULL || slab->free_list == NULL) {
+        ZF_LOGI("Failed to allocate %zu objects of %zu size bits, %lu type", n, size_bits, (long) type);
+        return -1;
+    }
+
+    for (int i = 0; i < slab->n; i++) {
+        slab->untypeds[i].type = seL4_UntypedObject;
+        slab->untypeds[i].size_bits = size_bits;
+        if (vka_cspace_alloc(delegate, &slab->untypeds[i].cptr) != seL4_NoError) {
+            ZF_LOGE("Failed to allocate cslot");
             return -1;
         }
     }
 
+    if (retype_objects(delegate, untyped, slab->untypeds, n, size_bits, seL4_UntypedObject) != seL4_NoError) {
+        return -1;
+    }
+
     for (int i = 0; i < slab->n; i++) {
-        if (alloc_object(delegate, untyped, size_bits, type, &slab->objects[i]) != seL4_NoError) {
+        if (retype_objects(delegate, &slab->untypeds[i], &slab->objects[i], 1, size_bits, type) != seL4_NoError) {
             return -1;
         }
     }
@@ -173,8 +298,9 @@ static int alloc_object_slab(vka_t *delegate, vka_object_t *untyped, slab_t *sla
     return 0;
 }
 
-int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount]) {
-
+static int slab_init_common(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount],
+                            bool recycle)
+{
     slab_data_t *data = calloc(1, sizeof(slab_data_t));
 
     if (!data) {
@@ -184,6 +310,7 @@ int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTy
 
     slab_vka->data = data;
     data->delegate = delegate;
+    data->recycle = recycle;
 
     slab_vka->cspace_alloc = delegate_cspace_alloc;
     slab_vka->cspace_make_path = delegate_cspace_make_path;
@@ -223,7 +350,7 @@ int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTy
     for (int i = 0; i < seL4_ObjectTypeCount && object_descs[i].size_bits != 0; i++) {
         int type = object_descs[i].type;
         error = alloc_object_slab(delegate, &data->untyped, &data->slabs[type],
-                                  object_freq[type], object_descs[i].size_bits, type);
+                                  object_freq[type], object_descs[i].size_bits, type, recycle);
         if (error != 0) {
             ZF_LOGE("Failed to create slab\n");
             slab_destroy(slab_vka);
@@ -233,3 +360,13 @@ int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTy
 
     return 0;
 }
+
+int slab_init(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount])
+{
+    return slab_init_common(slab_vka, delegate, object_freq, false);
+}
+
+int slab_init_recycling(vka_t *slab_vka, vka_t *delegate, size_t object_freq[seL4_ObjectTypeCount])
+{
+    return slab_init_common(slab_vka, delegate, object_freq, true);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdint.h>
+
+#include <sel4/sel4.h>
+#include <sel4platsupport/timer.h>
+#include <sel4utils/test.h>
+#include <sel4utils/time_server/timer_wheel.h>
+
+#include <sel4test/test.h>
+#include <sel4test/testutil.h>
+
+#define TIMER_WHEEL_TEST_TICK_NS 1000
+
+void get_sel4utils_tests()
+{
+}
+
+/* An ltimer whose time only moves when the test says so */
+typedef struct fake_ltimer {
+    uint64_t now;
+    /* relative timeout of the last call to set_timeout */
+    uint64_t timeout;
+} fake_ltimer_t;
+
+static int fake_get_time(void *data, uint64_t *time)
+{
+    fake_ltimer_t *fake = data;
+    *time = fake->now;
+    return 0;
+}
+
+static int fake_set_timeout(void *data, uint64_t ns, timeout_type_t type)
+{
+    fake_ltimer_t *fake = data;
+    fake->timeout = ns;
+    return 0;
+}
+
+static void count_expiry(sel4utils_timeout_t *timeout, void *data)
+{
+    (*(int *) data)++;
+}
+
+static int
+test_timer_wheel_level1_current_block(struct env *env)
+{
+    fake_ltimer_t fake = {0};
+    seL4_timer_t timer = {0};
+    timer.ltimer.get_time = fake_get_time;
+    timer.ltimer.set_timeout = fake_set_timeout;
+    timer.ltimer.data = &fake;
+
+    /* tick 330 is in block 5 of level 1, which covers ticks 320 to 383 */
+    fake.now = 330 * TIMER_WHEEL_TEST_TICK_NS;
+    sel4utils_timer_wheel_t *wheel = sel4utils_timer_wheel_new(&timer, TIMER_WHEEL_TEST_TICK_NS);
+    test_assert(wheel != NULL);
+
+    int expired_far = 0;
+    int expired_near = 0;
+    sel4utils_timeout_t far, near;
+    sel4utils_timeout_init(&far, count_expiry, &expired_far);
+    sel4utils_timeout_init(&near, count_expiry, &expired_near);
+
+    /* a turn of level 1 later, so it goes in the slot of the current block */
+    int error = sel4utils_timer_wheel_add(wheel, &far, 4419 * TIMER_WHEEL_TEST_TICK_NS);
+    test_eq(error, 0);
+    test_eq(fake.timeout, (uint64_t)(4416 - 330) * TIMER_WHEEL_TEST_TICK_NS);
+
+    /* in the slot of the next block, which is cascaded first */
+    error = sel4utils_timer_wheel_add(wheel, &near, 404 * TIMER_WHEEL_TEST_TICK_NS);
+    test_eq(error, 0);
+    test_eq(fake.timeout, (uint64_t)(384 - 330) * TIMER_WHEEL_TEST_TICK_NS);
+
+    /* the cascade moves the near timeout down a level, and the timer is set for its expiry */
+    fake.now = 384 * TIMER_WHEEL_TEST_TICK_NS;
+    test_eq(sel4utils_timer_wheel_process(wheel), 0);
+    test_eq(fake.timeout, (uint64_t)(404 - 384) * TIMER_WHEEL_TEST_TICK_NS);
+
+    fake.now = 404 * TIMER_WHEEL_TEST_TICK_NS;
+    test_eq(sel4utils_timer_wheel_process(wheel), 1);
+    test_eq(expired_near, 1);
+    test_eq(expired_far, 0);
+    test_eq(fake.timeout, (uint64_t)(4416 - 404) * TIMER_WHEEL_TEST_TICK_NS);
+
+    sel4utils_timer_wheel_destroy(wheel);
+    return sel4test_get_result();
+}
+DEFINE_TEST(SEL4UTILS_TIMER_WHEEL_001, "Timer wheel programs the cascade of the next block before a wrapped slot",
+            test_timer_wheel_level1_current_block, true)
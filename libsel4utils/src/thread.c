@@ -21,6 +21,7 @@
 #include <sel4utils/mapping.h>
 #include <sel4utils/thread.h>
 #include <sel4utils/util.h>
+#include <sel4utils/vspace.h>
 #include <sel4utils/arch/util.h>
 #include <sel4utils/helpers.h>
 #include <utils/stack.h>
@@ -311,11 +312,8 @@ sel4utils_start_fault_handler(seL4_CPtr fault_endpoint, vka_t *vka, vspace_t *vs
                                   (void *) fault_endpoint, 1);
 }
 
-int
-sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *checkpoint, bool suspend)
+static int checkpoint_read_registers(sel4utils_thread_t *thread, sel4utils_checkpoint_t *checkpoint, bool suspend)
 {
-    assert(checkpoint != NULL);
-
     int error = seL4_TCB_ReadRegisters(thread->tcb.cptr, suspend, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word),
             &checkpoint->regs);
     if (error) {
@@ -339,6 +337,20 @@ sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *
     }
 #endif /* CONFIG_ARCH_X86_64 */
 
+    return 0;
+}
+
+int
+sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *checkpoint, bool suspend)
+{
+    assert(checkpoint != NULL);
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    int error = checkpoint_read_registers(thread, checkpoint, suspend);
+    if (error) {
+        return error;
+    }
+
     size_t stack_size = (uintptr_t) thread->stack_top - checkpoint->sp;
     checkpoint->stack = malloc(stack_size);
     if (checkpoint->stack == NULL) {
@@ -352,13 +364,257 @@ sel4utils_checkpoint_thread(sel4utils_thread_t *thread, sel4utils_checkpoint_t *
     return error;
 }
 
+/* Change the rights a page of a tracked region is mapped with */
+static int checkpoint_protect_page(sel4utils_checkpoint_t *checkpoint, sel4utils_checkpoint_region_t *region,
+                                   size_t page, seL4_CapRights_t rights)
+{
+    void *vaddr = (void *)(region->start + page * PAGE_SIZE_4K);
+    seL4_CPtr frame = vspace_get_cap(checkpoint->vspace, vaddr);
+    if (frame == seL4_CapNull) {
+        ZF_LOGE("No frame mapped at %p", vaddr);
+        return -1;
+    }
+
+    /* mapping a frame at the address it is already mapped at updates its rights. The attributes
+     * must match the ones the vspace mapped it with, or a device or DMA buffer becomes cached */
+    seL4_ARCH_VMAttributes attr = region->cacheable ? seL4_ARCH_Default_VMAttributes :
+                                  seL4_ARCH_Uncached_VMAttributes;
+    int error = seL4_ARCH_Page_Map(frame, vspace_get_root(checkpoint->vspace), (seL4_Word) vaddr, rights, attr);
+    if (error) {
+        ZF_LOGE("Failed to remap %p, seL4 error %d", vaddr, error);
+    }
+    return error;
+}
+
+/* Regions are tracked a 4K page at a time, so every page must be backed by its own 4K frame. The
+ * vspace records a large frame against each 4K page it covers, so a cap shared by two neighbouring
+ * pages (including the pages either side of the region) is a large frame. */
+static int checkpoint_region_check(sel4utils_checkpoint_t *checkpoint, uintptr_t start, size_t num_pages)
+{
+    seL4_CPtr prev = start >= PAGE_SIZE_4K ? vspace_get_cap(checkpoint->vspace, (void *)(start - PAGE_SIZE_4K)) :
+                     seL4_CapNull;
+    for (size_t i = 0; i <= num_pages; i++) {
+        void *vaddr = (void *)(start + i * PAGE_SIZE_4K);
+        seL4_CPtr frame = vspace_get_cap(checkpoint->vspace, vaddr);
+        if (i < num_pages && frame == seL4_CapNull) {
+            ZF_LOGE("No frame mapped at %p", vaddr);
+            return -1;
+        }
+        if (frame != seL4_CapNull && frame == prev) {
+            ZF_LOGE("Region at %p is backed by large pages, which checkpoints do not support", (void *) start);
+            return -1;
+        }
+        prev = frame;
+    }
+
+    return 0;
+}
+
+static int checkpoint_region_init(sel4utils_checkpoint_t *checkpoint, sel4utils_checkpoint_region_t *region,
+                                  uintptr_t start, size_t num_pages)
+{
+    int cacheable = sel4utils_get_cacheable(checkpoint->vspace, (void *) start);
+    if (cacheable < 0) {
+        ZF_LOGE("Region at %p is not reserved in the vspace", (void *) start);
+        return -1;
+    }
+    if (checkpoint_region_check(checkpoint, start, num_pages)) {
+        return -1;
+    }
+
+    region->start = start;
+    region->num_pages = num_pages;
+    region->cacheable = cacheable;
+    region->data = malloc(num_pages * PAGE_SIZE_4K);
+    region->dirty = calloc(DIV_ROUND_UP(num_pages, seL4_WordBits), sizeof(seL4_Word));
+    if (region->data == NULL || region->dirty == NULL) {
+        ZF_LOGE("Failed to allocate checkpoint of %zu pages", num_pages);
+        free(region->data);
+        free(region->dirty);
+        return -1;
+    }
+
+    memcpy(region->data, (void *) start, num_pages * PAGE_SIZE_4K);
+    for (size_t i = 0; i < num_pages; i++) {
+        if (checkpoint_protect_page(checkpoint, region, i, seL4_CanRead)) {
+            for (size_t j = 0; j < i; j++) {
+                checkpoint_protect_page(checkpoint, region, j, seL4_AllRights);
+            }
+            free(region->data);
+            free(region->dirty);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static inline bool checkpoint_page_dirty(sel4utils_checkpoint_region_t *region, size_t page)
+{
+    return region->dirty[page / seL4_WordBits] & BIT(page % seL4_WordBits);
+}
+
+/* Synchronise the dirty pages of a region with the checkpoint, copying from the checkpoint
+ * to the thread's memory if restore is true, and the other way otherwise. */
+static int checkpoint_region_sync(sel4utils_checkpoint_t *checkpoint, sel4utils_checkpoint_region_t *region,
+                                  bool restore)
+{
+    for (size_t i = 0; i < region->num_pages; i++) {
+        if (!checkpoint_page_dirty(region, i)) {
+            continue;
+        }
+        void *saved = region->data + i * PAGE_SIZE_4K;
+        void *live = (void *)(region->start + i * PAGE_SIZE_4K);
+        if (restore) {
+            memcpy(live, saved, PAGE_SIZE_4K);
+        } else {
+            memcpy(saved, live, PAGE_SIZE_4K);
+        }
+        int error = checkpoint_protect_page(checkpoint, region, i, seL4_CanRead);
+        if (error) {
+            return error;
+        }
+        region->dirty[i / seL4_WordBits] &= ~BIT(i % seL4_WordBits);
+    }
+
+    return 0;
+}
+
+int sel4utils_checkpoint_thread_incremental(sel4utils_thread_t *thread, vspace_t *vspace,
+                                            sel4utils_checkpoint_t *checkpoint, bool suspend)
+{
+    assert(checkpoint != NULL);
+    assert(vspace != NULL);
+
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    int error = checkpoint_read_registers(thread, checkpoint, suspend);
+    if (error) {
+        return error;
+    }
+
+    checkpoint->thread = thread;
+    checkpoint->vspace = vspace;
+
+    /* track the whole stack, so the checkpoint can be moved without knowing how deep it will get */
+    uintptr_t stack_bottom = (uintptr_t) thread->stack_top - thread->stack_size * PAGE_SIZE_4K;
+    error = sel4utils_checkpoint_add_region(checkpoint, (void *) stack_bottom, thread->stack_size * PAGE_SIZE_4K);
+    if (error) {
+        free(checkpoint->regions);
+        checkpoint->regions = NULL;
+        if (suspend) {
+            /* don't leave the thread stopped for a checkpoint that doesn't exist */
+            seL4_TCB_Resume(thread->tcb.cptr);
+        }
+    }
+    return error;
+}
+
+int sel4utils_checkpoint_add_region(sel4utils_checkpoint_t *checkpoint, void *vaddr, size_t size)
+{
+    assert(checkpoint != NULL);
+
+    if (checkpoint->vspace == NULL) {
+        ZF_LOGE("Regions can only be added to incremental checkpoints");
+        return -1;
+    }
+
+    if (!IS_ALIGNED((uintptr_t) vaddr, seL4_PageBits) || size == 0) {
+        ZF_LOGE("Invalid region %p of %zu bytes", vaddr, size);
+        return -1;
+    }
+
+    sel4utils_checkpoint_region_t *regions = realloc(checkpoint->regions,
+                                                     (checkpoint->num_regions + 1) * sizeof(*regions));
+    if (regions == NULL) {
+        ZF_LOGE("Failed to allocate checkpoint region");
+        return -1;
+    }
+    checkpoint->regions = regions;
+
+    int error = checkpoint_region_init(checkpoint, &regions[checkpoint->num_regions], (uintptr_t) vaddr,
+                                       BYTES_TO_4K_PAGES(size));
+    if (error) {
+        return error;
+    }
+    checkpoint->num_regions++;
+
+    return 0;
+}
+
+int sel4utils_checkpoint_update(sel4utils_checkpoint_t *checkpoint, bool suspend)
+{
+    assert(checkpoint != NULL);
+
+    if (checkpoint->vspace == NULL) {
+        ZF_LOGE("Only incremental checkpoints can be updated");
+        return -1;
+    }
+
+    int error = checkpoint_read_registers(checkpoint->thread, checkpoint, suspend);
+    if (error) {
+        return error;
+    }
+
+    for (size_t i = 0; i < checkpoint->num_regions; i++) {
+        error = checkpoint_region_sync(checkpoint, &checkpoint->regions[i], false);
+        if (error) {
+            if (suspend) {
+                seL4_TCB_Resume(checkpoint->thread->tcb.cptr);
+            }
+            return error;
+        }
+    }
+
+    return 0;
+}
+
+bool sel4utils_checkpoint_handle_fault(sel4utils_checkpoint_t *checkpoint, seL4_MessageInfo_t tag)
+{
+    assert(checkpoint != NULL);
+
+    seL4_Fault_t fault = seL4_getFault(tag);
+    if (seL4_Fault_get_seL4_FaultType(fault) != seL4_Fault_VMFault || sel4utils_is_read_fault()) {
+        return false;
+    }
+
+    uintptr_t addr = seL4_Fault_VMFault_get_Addr(fault);
+    for (size_t i = 0; i < checkpoint->num_regions; i++) {
+        sel4utils_checkpoint_region_t *region = &checkpoint->regions[i];
+        if (addr < region->start || addr >= region->start + region->num_pages * PAGE_SIZE_4K) {
+            continue;
+        }
+        size_t page = (addr - region->start) / PAGE_SIZE_4K;
+        if (checkpoint_page_dirty(region, page)) {
+            /* already writable, this is a genuine fault */
+            return false;
+        }
+        if (checkpoint_protect_page(checkpoint, region, page, seL4_AllRights)) {
+            return false;
+        }
+        region->dirty[page / seL4_WordBits] |= BIT(page % seL4_WordBits);
+        return true;
+    }
+
+    return false;
+}
+
 int
 sel4utils_checkpoint_restore(sel4utils_checkpoint_t *checkpoint, bool free_memory, bool resume)
 {
     assert(checkpoint != NULL);
 
-    size_t stack_size = (uintptr_t) checkpoint->thread->stack_top - checkpoint->sp;
-    memcpy((void *) checkpoint->sp, checkpoint->stack, stack_size);
+    if (checkpoint->vspace != NULL) {
+        for (size_t i = 0; i < checkpoint->num_regions; i++) {
+            int error = checkpoint_region_sync(checkpoint, &checkpoint->regions[i], true);
+            if (error) {
+                ZF_LOGE("Failed to restore checkpoint region %zu", i);
+                return error;
+            }
+        }
+    } else {
+        size_t stack_size = (uintptr_t) checkpoint->thread->stack_top - checkpoint->sp;
+        memcpy((void *) checkpoint->sp, checkpoint->stack, stack_size);
+    }
 
     int error = seL4_TCB_WriteRegisters(checkpoint->thread->tcb.cptr, resume, 0,
             sizeof(seL4_UserContext) / sizeof (seL4_Word),
@@ -378,7 +634,23 @@ sel4utils_checkpoint_restore(sel4utils_checkpoint_t *checkpoint, bool free_memor
 void
 sel4utils_free_checkpoint(sel4utils_checkpoint_t *checkpoint)
 {
+    for (size_t i = 0; i < checkpoint->num_regions; i++) {
+        sel4utils_checkpoint_region_t *region = &checkpoint->regions[i];
+        /* hand the pages back to the thread fully writable */
+        for (size_t j = 0; j < region->num_pages; j++) {
+            if (!checkpoint_page_dirty(region, j)) {
+                checkpoint_protect_page(checkpoint, region, j, seL4_AllRights);
+            }
+        }
+        free(region->data);
+        free(region->dirty);
+    }
+    free(checkpoint->regions);
+    checkpoint->regions = NULL;
+    checkpoint->num_regions = 0;
+
     free(checkpoint->stack);
+    checkpoint->stack = NULL;
 }
 
 int sel4utils_set_sched_affinity(sel4utils_thread_t *thread, sched_params_t params) {
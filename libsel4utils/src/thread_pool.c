@@ -0,0 +1,384 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <autoconf.h>
+#include <sel4utils/gen_config.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sel4/sel4.h>
+#include <vka/object.h>
+#include <sel4utils/thread.h>
+#include <sel4utils/thread_pool.h>
+#include <sel4utils/util.h>
+#include <utils/util.h>
+
+#define QUEUE_MASK (SEL4UTILS_THREAD_POOL_QUEUE_SIZE - 1)
+compile_time_assert(thread_pool_queue_size_pow2, (SEL4UTILS_THREAD_POOL_QUEUE_SIZE & QUEUE_MASK) == 0);
+
+/* Work-stealing deque (Chase and Lev). Only the owning worker pushes and pops at the
+ * bottom, any thread may steal from the top. */
+typedef struct task_deque {
+    long top ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    long bottom ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    sel4utils_task_t *tasks[SEL4UTILS_THREAD_POOL_QUEUE_SIZE];
+} task_deque_t;
+
+/* Queue for tasks submitted from outside the pool. There is a single producer
+ * and any worker may consume. */
+typedef struct task_queue {
+    long head ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    long tail ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    sel4utils_task_t *tasks[SEL4UTILS_THREAD_POOL_QUEUE_SIZE];
+} task_queue_t;
+
+typedef struct thread_pool_worker {
+    task_deque_t deque;
+    /* set while the worker is blocked, or about to block, on its notification */
+    int sleeping ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    size_t id;
+    vka_object_t ntfn;
+    sel4utils_thread_t thread;
+    sel4utils_thread_pool_t *pool;
+} thread_pool_worker_t;
+
+struct sel4utils_thread_pool {
+    task_queue_t shared;
+    /* number of tasks submitted but not yet completed */
+    long pending ALIGN(BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS));
+    /* set while a thread is blocked in sel4utils_thread_pool_wait */
+    int waiting;
+    vka_object_t done_ntfn;
+    size_t num_workers;
+    thread_pool_worker_t *workers;
+    vka_t *vka;
+    vspace_t *vspace;
+};
+
+/* the pool worker that the current thread is, if any */
+static __thread thread_pool_worker_t *current_worker;
+
+static bool deque_push(task_deque_t *deque, sel4utils_task_t *task)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= SEL4UTILS_THREAD_POOL_QUEUE_SIZE) {
+        return false;
+    }
+    __atomic_store_n(&deque->tasks[bottom & QUEUE_MASK], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static sel4utils_task_t *deque_pop(task_deque_t *deque)
+{
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+    if (top > bottom) {
+        /* empty */
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    sel4utils_task_t *task = __atomic_load_n(&deque->tasks[bottom & QUEUE_MASK], __ATOMIC_RELAXED);
+    if (top == bottom) {
+        /* last task, race any thieves for it */
+        if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED)) {
+            task = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+static sel4utils_task_t *deque_steal(task_deque_t *deque)
+{
+    long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    sel4utils_task_t *task = __atomic_load_n(&deque->tasks[top & QUEUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED)) {
+        /* lost the race to another thief or the owner */
+        return NULL;
+    }
+    return task;
+}
+
+static bool queue_push(task_queue_t *queue, sel4utils_task_t *task)
+{
+    long tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    if (tail - head >= SEL4UTILS_THREAD_POOL_QUEUE_SIZE) {
+        return false;
+    }
+    __atomic_store_n(&queue->tasks[tail & QUEUE_MASK], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static sel4utils_task_t *queue_pop(task_queue_t *queue)
+{
+    long head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    while (head < __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        sel4utils_task_t *task = __atomic_load_n(&queue->tasks[head & QUEUE_MASK], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&queue->head, &head, head + 1, false, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_ACQUIRE)) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void run_task(sel4utils_thread_pool_t *pool, sel4utils_task_t *task)
+{
+    task->fn(task->arg);
+    if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+        __atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST)) {
+        seL4_Signal(pool->done_ntfn.cptr);
+    }
+}
+
+static sel4utils_task_t *find_task(thread_pool_worker_t *worker)
+{
+    sel4utils_thread_pool_t *pool = worker->pool;
+
+    sel4utils_task_t *task = deque_pop(&worker->deque);
+    if (task != NULL) {
+        return task;
+    }
+
+    task = queue_pop(&pool->shared);
+    if (task != NULL) {
+        return task;
+    }
+
+    for (size_t i = 1; i < pool->num_workers; i++) {
+        thread_pool_worker_t *victim = &pool->workers[(worker->id + i) % pool->num_workers];
+        task = deque_steal(&victim->deque);
+        if (task != NULL) {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+static void wake_one(sel4utils_thread_pool_t *pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        thread_pool_worker_t *worker = &pool->workers[i];
+        int sleeping = 1;
+        if (__atomic_load_n(&worker->sleeping, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&worker->sleeping, &sleeping, 0, false, __ATOMIC_SEQ_CST,
+                                        __ATOMIC_RELAXED)) {
+            seL4_Signal(worker->ntfn.cptr);
+            return;
+        }
+    }
+}
+
+static void thread_pool_worker_entry(thread_pool_worker_t *worker, UNUSED void *arg1, UNUSED void *ipc_buf)
+{
+    current_worker = worker;
+
+    while (1) {
+        sel4utils_task_t *task = find_task(worker);
+        if (task != NULL) {
+            run_task(worker->pool, task);
+            continue;
+        }
+
+        /* advertise that we are going to sleep, then look again so that a task submitted
+         * before the submitter could see the flag is not missed */
+        __atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+        task = find_task(worker);
+        if (task != NULL) {
+            int sleeping = 1;
+            if (!__atomic_compare_exchange_n(&worker->sleeping, &sleeping, 0, false, __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED)) {
+                /* a submitter already cleared the flag and signalled us, consume the signal */
+                seL4_Wait(worker->ntfn.cptr, NULL);
+            }
+            run_task(worker->pool, task);
+            continue;
+        }
+
+        seL4_Wait(worker->ntfn.cptr, NULL);
+    }
+}
+
+void sel4utils_thread_pool_submit(sel4utils_thread_pool_t *pool, sel4utils_task_t *task)
+{
+    assert(pool != NULL);
+    assert(task != NULL && task->fn != NULL);
+
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL);
+
+    bool queued;
+    if (current_worker != NULL && current_worker->pool == pool) {
+        queued = deque_push(&current_worker->deque, task);
+    } else {
+        queued = queue_push(&pool->shared, task);
+    }
+
+    if (!queued) {
+        run_task(pool, task);
+        return;
+    }
+
+    wake_one(pool);
+}
+
+void sel4utils_thread_pool_wait(sel4utils_thread_pool_t *pool)
+{
+    assert(pool != NULL);
+
+    while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) != 0) {
+        __atomic_store_n(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) == 0) {
+            break;
+        }
+        /* a stale signal from a previous wait only causes another trip around the loop */
+        seL4_Wait(pool->done_ntfn.cptr, NULL);
+    }
+    __atomic_store_n(&pool->waiting, 0, __ATOMIC_RELAXED);
+}
+
+static int thread_pool_worker_init(sel4utils_thread_pool_t *pool, thread_pool_worker_t *worker,
+                                   simple_t *simple, sel4utils_thread_pool_config_t config)
+{
+    seL4_Word core = config.one_per_core ? worker->id % CONFIG_MAX_NUM_NODES : 0;
+
+    int error = vka_alloc_notification(pool->vka, &worker->ntfn);
+    if (error) {
+        ZF_LOGE("Failed to allocate notification for worker %zu", worker->id);
+        return -1;
+    }
+
+    sel4utils_thread_config_t thread_config = thread_config_new(simple);
+    thread_config = thread_config_priority(thread_config, config.priority);
+    if (config_set(CONFIG_KERNEL_MCS)) {
+        seL4_Time timeslice_us = config.timeslice_us;
+        if (timeslice_us == 0) {
+            timeslice_us = CONFIG_BOOT_THREAD_TIME_SLICE * US_IN_MS;
+        }
+        /* the sched control cap used to configure the sc determines the core */
+        thread_config.sched_params = sched_params_round_robin(thread_config.sched_params, simple, core,
+                                                              timeslice_us);
+    } else {
+        thread_config.sched_params = sched_params_core(thread_config.sched_params, core);
+    }
+
+    error = sel4utils_configure_thread_config(pool->vka, pool->vspace, pool->vspace, thread_config,
+                                              &worker->thread);
+    if (error) {
+        ZF_LOGE("Failed to configure worker %zu", worker->id);
+        vka_free_object(pool->vka, &worker->ntfn);
+        return -1;
+    }
+
+    if (config.one_per_core && !config_set(CONFIG_KERNEL_MCS) && CONFIG_MAX_NUM_NODES > 1) {
+        error = sel4utils_set_sched_affinity(&worker->thread, thread_config.sched_params);
+        if (error) {
+            ZF_LOGE("Failed to move worker %zu to core %"PRIuPTR, worker->id, core);
+            sel4utils_clean_up_thread(pool->vka, pool->vspace, &worker->thread);
+            vka_free_object(pool->vka, &worker->ntfn);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+sel4utils_thread_pool_t *sel4utils_thread_pool_new(vka_t *vka, vspace_t *vspace, simple_t *simple,
+                                                   sel4utils_thread_pool_config_t config)
+{
+    if (vka == NULL || vspace == NULL || simple == NULL || config.num_workers == 0) {
+        ZF_LOGE("Invalid arguments");
+        return NULL;
+    }
+
+    sel4utils_thread_pool_t *pool = NULL;
+    int error = posix_memalign((void **) &pool, BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS), sizeof(*pool));
+    if (error) {
+        ZF_LOGE("Failed to allocate thread pool");
+        return NULL;
+    }
+    memset(pool, 0, sizeof(*pool));
+
+    error = posix_memalign((void **) &pool->workers, BIT(CONFIG_L1_CACHE_LINE_SIZE_BITS),
+                           config.num_workers * sizeof(*pool->workers));
+    if (error) {
+        ZF_LOGE("Failed to allocate %zu workers", config.num_workers);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, config.num_workers * sizeof(*pool->workers));
+
+    pool->vka = vka;
+    pool->vspace = vspace;
+
+    error = vka_alloc_notification(vka, &pool->done_ntfn);
+    if (error) {
+        ZF_LOGE("Failed to allocate notification");
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+
+    /* all workers must exist before any of them starts looking for work to steal */
+    for (size_t i = 0; i < config.num_workers; i++) {
+        thread_pool_worker_t *worker = &pool->workers[i];
+        worker->id = i;
+        worker->pool = pool;
+        error = thread_pool_worker_init(pool, worker, simple, config);
+        if (error) {
+            sel4utils_thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->num_workers++;
+    }
+
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        error = sel4utils_start_thread(&pool->workers[i].thread,
+                                       (sel4utils_thread_entry_fn) thread_pool_worker_entry,
+                                       &pool->workers[i], NULL, 1);
+        if (error) {
+            ZF_LOGE("Failed to start worker %zu", i);
+            sel4utils_thread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void sel4utils_thread_pool_destroy(sel4utils_thread_pool_t *pool)
+{
+    assert(pool != NULL);
+
+    /* idle workers are blocked on their notifications, so can be deleted directly */
+    for (size_t i = 0; i < pool->num_workers; i++) {
+        thread_pool_worker_t *worker = &pool->workers[i];
+        sel4utils_clean_up_thread(pool->vka, pool->vspace, &worker->thread);
+        vka_free_object(pool->vka, &worker->ntfn);
+    }
+
+    vka_free_object(pool->vka, &pool->done_ntfn);
+    free(pool->workers);
+    free(pool);
+}
@@ -9,21 +9,46 @@
 #include <platsupport/ltimer.h>
 #include <sel4utils/util.h>
 #include <sel4utils/time_server/client.h>
+#include <sel4utils/time_server/clock_page.h>
 #include <utils/util.h>
 
 typedef struct {
     seL4_CPtr ep;
     seL4_Word label;
+    /* read the time from here instead of calling the server, if set */
+    sel4utils_clock_page_t *clock_page;
+    /* latest time returned. The clock page may run ahead of the server's timer, so a
+     * time from the server is not returned if it is earlier */
+    uint64_t last_ns;
 } client_ltimer_t;
 
+static uint64_t client_monotonic(client_ltimer_t *ltimer, uint64_t time)
+{
+    if (time < ltimer->last_ns) {
+        return ltimer->last_ns;
+    }
+    ltimer->last_ns = time;
+    return time;
+}
+
 static int client_get_time(void *data, uint64_t *time)
 {
     client_ltimer_t *ltimer = data;
+    uint64_t ns;
+    if (ltimer->clock_page && sel4utils_clock_page_read(ltimer->clock_page, &ns)) {
+        *time = client_monotonic(ltimer, ns);
+        return 0;
+    }
+
     seL4_MessageInfo_t info = seL4_MessageInfo_new(ltimer->label, 0, 0, 1);
     seL4_SetMR(0, GET_TIME);
     seL4_Call(ltimer->ep, info);
-    *time = sel4utils_64_get_mr(1);
-    return seL4_GetMR(0);
+    int error = seL4_GetMR(0);
+    if (error) {
+        return error;
+    }
+    *time = client_monotonic(ltimer, sel4utils_64_get_mr(1));
+    return 0;
 }
 
 static int client_set_timeout(void *data, uint64_t ns, timeout_type_t type)
@@ -54,3 +79,15 @@ int sel4utils_rpc_ltimer_init(ltimer_t *ltimer, ps_io_ops_t ops, seL4_CPtr ep, s
     /* success! */
     return 0;
 }
+
+int sel4utils_rpc_ltimer_set_clock_page(ltimer_t *ltimer, sel4utils_clock_page_t *clock_page)
+{
+    if (ltimer->get_time != client_get_time) {
+        ZF_LOGE("Not an rpc ltimer");
+        return -1;
+    }
+
+    client_ltimer_t *client_ltimer = ltimer->data;
+    client_ltimer->clock_page = clock_page;
+    return 0;
+}
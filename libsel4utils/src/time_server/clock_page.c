@@ -0,0 +1,71 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+#include <sel4utils/time_server/clock_page.h>
+#include <utils/util.h>
+
+void sel4utils_clock_page_init(sel4utils_clock_page_t *page)
+{
+    memset(page, 0, sizeof(*page));
+}
+
+/* Time the page gives at a cycle count, or 0 if it cannot give one */
+static uint64_t clock_page_extrapolate(sel4utils_clock_page_t *page, uint64_t cycles)
+{
+    if (!page->valid) {
+        return 0;
+    }
+    uint64_t delta = (ccnt_t)(cycles - page->base_cycles);
+    if (delta > page->max_cycles) {
+        return 0;
+    }
+    return page->base_ns + ((delta * page->mult) >> SEL4UTILS_CLOCK_PAGE_SHIFT);
+}
+
+void sel4utils_clock_page_update(sel4utils_clock_page_t *page, uint64_t now_ns)
+{
+    if (!SEL4UTILS_CLOCK_PAGE_SUPPORTED) {
+        return;
+    }
+
+    /* Take the cycle count once the page is marked as changing, so a reader that sees the
+     * old contents read its cycle count before this one */
+    uint32_t seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t cycles = sel4bench_get_cycle_count();
+
+    /* Clients may have read up to this, so never start the new interval below it */
+    uint64_t base_ns = MAX(now_ns, clock_page_extrapolate(page, cycles));
+
+    uint64_t mult = 0;
+    if (page->ref_cycles != 0 || page->ref_ns != 0) {
+        uint64_t delta_cycles = (ccnt_t)(cycles - page->ref_cycles);
+        uint64_t delta_ns = now_ns - page->ref_ns;
+        /* delta_ns << SHIFT must not overflow, the server updates far more often than this */
+        if (delta_cycles > 0 && delta_ns > 0 && delta_ns < (1ull << (64 - SEL4UTILS_CLOCK_PAGE_SHIFT))) {
+            /* Aim to meet the timer at the next update, assuming it comes after the same
+             * interval, but never run at less than half the measured rate */
+            uint64_t lead_ns = base_ns - now_ns;
+            uint64_t target_ns = lead_ns < delta_ns / 2 ? delta_ns - lead_ns : delta_ns / 2;
+            mult = (target_ns << SEL4UTILS_CLOCK_PAGE_SHIFT) / delta_cycles;
+        }
+    }
+    page->ref_ns = now_ns;
+    page->ref_cycles = cycles;
+
+    __atomic_store_n(&page->base_ns, base_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&page->base_cycles, cycles, __ATOMIC_RELAXED);
+    if (mult > 0) {
+        __atomic_store_n(&page->mult, mult, __ATOMIC_RELAXED);
+        /* largest delta for which delta * mult fits in 64 bits */
+        __atomic_store_n(&page->max_cycles, UINT64_MAX / mult, __ATOMIC_RELAXED);
+        __atomic_store_n(&page->valid, 1, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright 2017, Data61, CSIRO (ABN 41 687 119 230)
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sel4/sel4.h>
+#include <platsupport/ltimer.h>
+#include <sel4utils/util.h>
+#include <sel4utils/time_server/client.h>
+#include <sel4utils/time_server/timer_wheel.h>
+#include <utils/util.h>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SIZE BIT(WHEEL_BITS)
+#define WHEEL_MASK MASK(WHEEL_BITS)
+/* Timeouts further away than this are placed as far away as the top level reaches,
+ * and placed again when their slot comes around */
+#define WHEEL_MAX_DELTA (BIT(WHEEL_BITS * WHEEL_LEVELS) - 1)
+
+typedef struct timer_client {
+    sel4utils_timer_wheel_t *wheel;
+    seL4_CPtr ntfn;
+    /* absolute time of the next expiry, and the period for periodic timeouts */
+    uint64_t next_ns;
+    uint64_t period_ns;
+    sel4utils_timeout_t timeout;
+} timer_client_t;
+
+struct sel4utils_timer_wheel {
+    seL4_timer_t *timer;
+    uint64_t tick_ns;
+    /* next tick to process */
+    uint64_t current;
+    size_t num_pending;
+    /* tick the timer is programmed to fire at, UINT64_MAX if none */
+    uint64_t programmed;
+    /* set while expiring timeouts, so that callbacks adding timeouts do not reprogram the timer */
+    bool processing;
+    sel4utils_timeout_t *slots[WHEEL_LEVELS][WHEEL_SIZE];
+    /* clients indexed by badge, if serving clients */
+    timer_client_t *clients;
+    size_t max_clients;
+    /* clock page kept up to date by a periodic timeout, if set */
+    sel4utils_clock_page_t *clock_page;
+    uint64_t clock_page_period_ns;
+    uint64_t clock_page_next_ns;
+    sel4utils_timeout_t clock_page_timeout;
+};
+
+static void list_add(sel4utils_timeout_t **head, sel4utils_timeout_t *timeout)
+{
+    timeout->next = *head;
+    if (*head) {
+        (*head)->pprev = &timeout->next;
+    }
+    *head = timeout;
+    timeout->pprev = head;
+}
+
+static void list_del(sel4utils_timeout_t *timeout)
+{
+    *timeout->pprev = timeout->next;
+    if (timeout->next) {
+        timeout->next->pprev = timeout->pprev;
+    }
+    timeout->next = NULL;
+    timeout->pprev = NULL;
+}
+
+/* Place a timeout in the slot of the lowest level whose turn covers its expiry */
+static void wheel_insert(sel4utils_timer_wheel_t *wheel, sel4utils_timeout_t *timeout)
+{
+    uint64_t expires = MAX(timeout->expires, wheel->current);
+    uint64_t delta = expires - wheel->current;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        expires = wheel->current + delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= BIT(WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+
+    list_add(&wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK], timeout);
+}
+
+/* Move the timeouts of the current slot of a level down to the levels below */
+static void wheel_cascade(sel4utils_timer_wheel_t *wheel, int level)
+{
+    sel4utils_timeout_t **slot = &wheel->slots[level][(wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    sel4utils_timeout_t *list = *slot;
+    *slot = NULL;
+    if (list) {
+        list->pprev = &list;
+    }
+
+    while (list) {
+        sel4utils_timeout_t *timeout = list;
+        list_del(timeout);
+        wheel_insert(wheel, timeout);
+    }
+}
+
+/* First tick at or after the current one that has timeouts to expire or to cascade */
+static uint64_t wheel_next_event(sel4utils_timer_wheel_t *wheel)
+{
+    if (wheel->num_pending == 0) {
+        return UINT64_MAX;
+    }
+
+    uint64_t next = UINT64_MAX;
+    for (uint64_t k = 0; k < WHEEL_SIZE; k++) {
+        if (wheel->slots[0][(wheel->current + k) & WHEEL_MASK]) {
+            next = wheel->current + k;
+            break;
+        }
+    }
+
+    /* A slot of a higher level is cascaded at the start of the turn of the level below it covers.
+     * The slot of the current block was cascaded when the block started, so anything in it now
+     * is a whole turn later than the slots of the following blocks, and it is only looked at if
+     * they are all empty */
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        uint64_t current_block = wheel->current >> shift;
+        uint64_t tick = UINT64_MAX;
+        for (uint64_t k = 1; k < WHEEL_SIZE; k++) {
+            if (wheel->slots[level][(current_block + k) & WHEEL_MASK]) {
+                tick = (current_block + k) << shift;
+                break;
+            }
+        }
+        if (tick == UINT64_MAX && wheel->slots[level][current_block & WHEEL_MASK]) {
+            tick = (current_block + WHEEL_SIZE) << shift;
+        }
+        next = MIN(next, tick);
+    }
+
+    return next;
+}
+
+static int wheel_program(sel4utils_timer_wheel_t *wheel)
+{
+    if (wheel->processing) {
+        return 0;
+    }
+
+    uint64_t next = wheel_next_event(wheel);
+    if (next == UINT64_MAX || next >= wheel->programmed) {
+        return 0;
+    }
+
+    uint64_t now;
+    int error = ltimer_get_time(&wheel->timer->ltimer, &now);
+    if (error) {
+        ZF_LOGE("Failed to get time");
+        return error;
+    }
+
+    uint64_t deadline = next * wheel->tick_ns;
+    error = ltimer_set_timeout(&wheel->timer->ltimer, deadline > now ? deadline - now : 1, TIMEOUT_RELATIVE);
+    if (error) {
+        ZF_LOGE("Failed to set timeout");
+        return error;
+    }
+
+    wheel->programmed = next;
+    return 0;
+}
+
+sel4utils_timer_wheel_t *sel4utils_timer_wheel_new(seL4_timer_t *timer, uint64_t tick_ns)
+{
+    if (timer == NULL || tick_ns == 0) {
+        ZF_LOGE("Invalid arguments");
+        return NULL;
+    }
+
+    uint64_t now;
+    int error = ltimer_get_time(&timer->ltimer, &now);
+    if (error) {
+        ZF_LOGE("Failed to get time");
+        return NULL;
+    }
+
+    sel4utils_timer_wheel_t *wheel = calloc(1, sizeof(*wheel));
+    if (wheel == NULL) {
+        ZF_LOGE("Failed to allocate timer wheel");
+        return NULL;
+    }
+
+    wheel->timer = timer;
+    wheel->tick_ns = tick_ns;
+    wheel->current = now / tick_ns;
+    wheel->programmed = UINT64_MAX;
+
+    return wheel;
+}
+
+void sel4utils_timer_wheel_destroy(sel4utils_timer_wheel_t *wheel)
+{
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SIZE; slot++) {
+            while (wheel->slots[level][slot]) {
+                list_del(wheel->slots[level][slot]);
+            }
+        }
+    }
+    free(wheel->clients);
+    free(wheel);
+}
+
+void sel4utils_timeout_init(sel4utils_timeout_t *timeout, sel4utils_timeout_fn_t fn, void *data)
+{
+    *timeout = (sel4utils_timeout_t) {
+        .fn = fn,
+        .data = data,
+    };
+}
+
+int sel4utils_timer_wheel_add(sel4utils_timer_wheel_t *wheel, sel4utils_timeout_t *timeout, uint64_t ns)
+{
+    if (timeout->pprev) {
+        list_del(timeout);
+    } else {
+        wheel->num_pending++;
+    }
+
+    /* round up, a timeout never expires early */
+    timeout->expires = DIV_ROUND_UP(ns, wheel->tick_ns);
+    wheel_insert(wheel, timeout);
+
+    return wheel_program(wheel);
+}
+
+bool sel4utils_timer_wheel_cancel(sel4utils_timer_wheel_t *wheel, sel4utils_timeout_t *timeout)
+{
+    if (timeout->pprev == NULL) {
+        return false;
+    }
+
+    /* the timer stays programmed, an early IRQ just finds nothing to expire */
+    list_del(timeout);
+    wheel->num_pending--;
+    return true;
+}
+
+int sel4utils_timer_wheel_get_time(sel4utils_timer_wheel_t *wheel, uint64_t *ns)
+{
+    return ltimer_get_time(&wheel->timer->ltimer, ns);
+}
+
+int sel4utils_timer_wheel_process(sel4utils_timer_wheel_t *wheel)
+{
+    uint64_t now_ns;
+    if (ltimer_get_time(&wheel->timer->ltimer, &now_ns)) {
+        ZF_LOGE("Failed to get time");
+        return -1;
+    }
+    uint64_t now = now_ns / wheel->tick_ns;
+
+    int num_expired = 0;
+    wheel->processing = true;
+    wheel->programmed = UINT64_MAX;
+
+    while (wheel->current <= now) {
+        /* skip ticks that have nothing to do */
+        uint64_t next = wheel_next_event(wheel);
+        if (next > now) {
+            wheel->current = now + 1;
+            break;
+        }
+        wheel->current = next;
+
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->current & MASK(WHEEL_BITS * level)) {
+                break;
+            }
+            wheel_cascade(wheel, level);
+        }
+
+        sel4utils_timeout_t **slot = &wheel->slots[0][wheel->current & WHEEL_MASK];
+        sel4utils_timeout_t *expired = *slot;
+        *slot = NULL;
+        if (expired) {
+            expired->pprev = &expired;
+        }
+        /* timeouts added by the callbacks at or before this tick expire on the next one */
+        wheel->current++;
+
+        while (expired) {
+            sel4utils_timeout_t *timeout = expired;
+            list_del(timeout);
+            wheel->num_pending--;
+            timeout->fn(timeout, timeout->data);
+            num_expired++;
+        }
+    }
+
+    wheel->processing = false;
+    if (wheel_program(wheel)) {
+        return -1;
+    }
+
+    return num_expired;
+}
+
+int sel4utils_timer_wheel_handle_irq(sel4utils_timer_wheel_t *wheel, seL4_Word badge)
+{
+    sel4platsupport_handle_timer_irq(wheel->timer, badge);
+    return sel4utils_timer_wheel_process(wheel);
+}
+
+static void clock_page_timeout(sel4utils_timeout_t *timeout, void *data)
+{
+    sel4utils_timer_wheel_t *wheel = data;
+
+    uint64_t now = 0;
+    if (ltimer_get_time(&wheel->timer->ltimer, &now) == 0) {
+        sel4utils_clock_page_update(wheel->clock_page, now);
+    } else {
+        ZF_LOGE("Failed to get time");
+    }
+
+    /* stay on the original schedule, but do not try to catch up on missed updates */
+    wheel->clock_page_next_ns += wheel->clock_page_period_ns;
+    if (wheel->clock_page_next_ns <= now) {
+        wheel->clock_page_next_ns = now + wheel->clock_page_period_ns;
+    }
+    sel4utils_timer_wheel_add(wheel, timeout, wheel->clock_page_next_ns);
+}
+
+int sel4utils_timer_wheel_set_clock_page(sel4utils_timer_wheel_t *wheel, sel4utils_clock_page_t *page,
+                                         uint64_t period_ns)
+{
+    if (page == NULL || period_ns == 0 || wheel->clock_page != NULL) {
+        ZF_LOGE("Invalid arguments");
+        return -1;
+    }
+
+    uint64_t now;
+    int error = ltimer_get_time(&wheel->timer->ltimer, &now);
+    if (error) {
+        ZF_LOGE("Failed to get time");
+        return error;
+    }
+
+    sel4utils_clock_page_init(page);
+    sel4utils_clock_page_update(page, now);
+    wheel->clock_page = page;
+    wheel->clock_page_period_ns = period_ns;
+    wheel->clock_page_next_ns = now + period_ns;
+    sel4utils_timeout_init(&wheel->clock_page_timeout, clock_page_timeout, wheel);
+
+    return sel4utils_timer_wheel_add(wheel, &wheel->clock_page_timeout, wheel->clock_page_next_ns);
+}
+
+int sel4utils_timer_wheel_serve_clients(sel4utils_timer_wheel_t *wheel, size_t max_clients)
+{
+    if (wheel->clients) {
+        ZF_LOGE("Already serving clients");
+        return -1;
+    }
+
+    wheel->clients = calloc(max_clients, sizeof(timer_client_t));
+    if (wheel->clients == NULL) {
+        ZF_LOGE("Failed to allocate %zu clients", max_clients);
+        return -1;
+    }
+    wheel->max_clients = max_clients;
+
+    return 0;
+}
+
+static timer_client_t *get_client(sel4utils_timer_wheel_t *wheel, seL4_Word badge)
+{
+    if (badge >= wheel->max_clients || wheel->clients[badge].ntfn == seL4_CapNull) {
+        return NULL;
+    }
+    return &wheel->clients[badge];
+}
+
+static void client_timeout(sel4utils_timeout_t *timeout, void *data)
+{
+    timer_client_t *client = data;
+
+    seL4_Signal(client->ntfn);
+    if (client->period_ns) {
+        client->next_ns += client->period_ns;
+        /* If the server fell behind, drop the periods that were missed rather than
+         * signalling once per tick to catch up */
+        uint64_t now;
+        if (ltimer_get_time(&client->wheel->timer->ltimer, &now) == 0 && client->next_ns <= now) {
+            client->next_ns += ((now - client->next_ns) / client->period_ns + 1) * client->period_ns;
+        }
+        sel4utils_timer_wheel_add(client->wheel, timeout, client->next_ns);
+    }
+}
+
+int sel4utils_timer_wheel_register_client(sel4utils_timer_wheel_t *wheel, seL4_Word badge, seL4_CPtr ntfn)
+{
+    if (badge >= wheel->max_clients || ntfn == seL4_CapNull) {
+        ZF_LOGE("Invalid client badge %"PRIuPTR, (uintptr_t) badge);
+        return -1;
+    }
+
+    timer_client_t *client = &wheel->clients[badge];
+    if (client->ntfn != seL4_CapNull) {
+        ZF_LOGE("Client %"PRIuPTR" already registered", (uintptr_t) badge);
+        return -1;
+    }
+
+    client->wheel = wheel;
+    client->ntfn = ntfn;
+    client->period_ns = 0;
+    sel4utils_timeout_init(&client->timeout, client_timeout, client);
+
+    return 0;
+}
+
+void sel4utils_timer_wheel_unregister_client(sel4utils_timer_wheel_t *wheel, seL4_Word badge)
+{
+    timer_client_t *client = get_client(wheel, badge);
+    if (client) {
+        sel4utils_timer_wheel_cancel(wheel, &client->timeout);
+        client->ntfn = seL4_CapNull;
+    }
+}
+
+static int client_set_timeout(sel4utils_timer_wheel_t *wheel, timer_client_t *client, uint64_t ns,
+                              timeout_type_t type)
+{
+    uint64_t now;
+    int error = ltimer_get_time(&wheel->timer->ltimer, &now);
+    if (error) {
+        return error;
+    }
+
+    switch (type) {
+    case TIMEOUT_ABSOLUTE:
+        client->period_ns = 0;
+        client->next_ns = ns;
+        break;
+    case TIMEOUT_RELATIVE:
+        client->period_ns = 0;
+        client->next_ns = now + ns;
+        break;
+    case TIMEOUT_PERIODIC:
+        if (ns == 0) {
+            return -EINVAL;
+        }
+        client->period_ns = ns;
+        client->next_ns = now + ns;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    /* replaces any timeout the client already had */
+    return sel4utils_timer_wheel_add(wheel, &client->timeout, client->next_ns);
+}
+
+seL4_MessageInfo_t sel4utils_timer_wheel_handle_rpc(sel4utils_timer_wheel_t *wheel, seL4_Word badge,
+                                                    seL4_MessageInfo_t info)
+{
+    int error;
+
+    switch (seL4_GetMR(0)) {
+    case GET_TIME: {
+        uint64_t time = 0;
+        error = ltimer_get_time(&wheel->timer->ltimer, &time);
+        seL4_SetMR(0, error);
+        sel4utils_64_set_mr(1, time);
+        return seL4_MessageInfo_new(0, 0, 0, 1 + SEL4UTILS_64_WORDS);
+    }
+    case SET_TIMEOUT: {
+        timer_client_t *client = get_client(wheel, badge);
+        if (client == NULL || seL4_MessageInfo_get_length(info) < 2 + SEL4UTILS_64_WORDS) {
+            error = -EINVAL;
+        } else {
+            timeout_type_t type = seL4_GetMR(1);
+            uint64_t ns = sel4utils_64_get_mr(2);
+            error = client_set_timeout(wheel, client, ns, type);
+        }
+        break;
+    }
+    default:
+        ZF_LOGE("Unknown timer op %"PRIuPTR, (uintptr_t) seL4_GetMR(0));
+        error = -EINVAL;
+        break;
+    }
+
+    seL4_SetMR(0, error);
+    return seL4_MessageInfo_new(0, 0, 0, 1);
+}
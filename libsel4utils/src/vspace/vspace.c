@@ -879,6 +879,15 @@ int sel4utils_share_mem_at_vaddr(vspace_t *from, vspace_t *to, void *start, int
     return error;
 }
 
+int sel4utils_get_cacheable(vspace_t *vspace, void *vaddr)
+{
+    sel4utils_res_t *res = find_reserve(get_alloc_data(vspace), (uintptr_t) vaddr);
+    if (res == NULL) {
+        return -1;
+    }
+    return res->cacheable;
+}
+
 uintptr_t sel4utils_get_paddr(vspace_t *vspace, void *vaddr, seL4_Word type, seL4_Word size_bits)
 {
     vka_t *vka = get_alloc_data(vspace)->vka;